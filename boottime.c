@@ -0,0 +1,70 @@
+// Startup time
+// Measures how much the player prints between the start of
+// InitializeSong and the first sample, and how long that takes on the
+// ATmega, where every byte busy-waits on the serial port. Build it with
+// the same LOG_LEVEL and COMPILED_SONG as the firmware; "make boottime"
+// runs it at every level.
+//
+// Usage: boottime song
+
+#include <time.h>
+
+#include "hostplayer.c"
+
+// 8N1 is 10 bits for every byte
+#define SERIAL_BPS (38400)
+#define SERIAL_BITS_PER_BYTE (10)
+
+const char *const LEVEL_NAMES[] = { "none", "error", "info", "debug" };
+
+int gFirstSample = 0;
+
+void OutputByte(uint8_t value)
+{
+    gFirstSample = 1;
+}
+
+double Seconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 2)
+    {
+        fprintf(stderr, "Usage: boottime song\n");
+        return -1;
+    }
+
+    InitializeTables();
+    char *songdata = LoadFile(argv[1], NULL);
+    if (songdata == NULL)
+    {
+        return -1;
+    }
+
+    // Only the number of bytes matters, not the messages themselves
+    gLogFile = fopen("/dev/null", "w");
+
+    double start = Seconds();
+    if (!InitializeSong(songdata))
+    {
+        fprintf(stderr, "Couldn't initialize %s\n", argv[1]);
+        return -1;
+    }
+    while (!gFirstSample)
+    {
+        OutputAudioAndCalculateNextByte();
+    }
+    double elapsed = Seconds() - start;
+
+    double serialSeconds = (double)gLogBytes * SERIAL_BITS_PER_BYTE / SERIAL_BPS;
+    printf("%s song, LOG_LEVEL %d (%-5s): %5llu bytes of messages, %6.1f ms on the serial port at %u bps, %5.1f us on this host\n",
+           COMPILED_SONG ? "Compiled" : "Raw", LOG_LEVEL, LEVEL_NAMES[LOG_LEVEL], (unsigned long long)gLogBytes,
+           serialSeconds * 1000, SERIAL_BPS, elapsed * 1e6);
+
+    return 0;
+}
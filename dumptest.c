@@ -0,0 +1,164 @@
+// Renders logs of SID register writes (see siddump.c) through the
+// SIDish synthesizer. Given more than one log, each one is written
+// next to it as a .wav with the same name.
+//
+// Usage: dumptest [-o output.wav] [-c cycles per frame] [-t tail seconds] dump.txt...
+
+#include <unistd.h>
+#include <time.h>
+
+#include "hostplayer.c"
+#include "siddump.c"
+
+// Samples written to the output at a time
+#define OUTPUT_BLOCK_SIZE (4096)
+
+FILE *outputfp;
+uint8_t gOutputBlock[OUTPUT_BLOCK_SIZE];
+uint32_t gOutputLength = 0;
+unsigned int gTotalBytesWritten = 0;
+
+void OutputByte(uint8_t value)
+{
+    gOutputBlock[gOutputLength++] = value;
+    if (gOutputLength == OUTPUT_BLOCK_SIZE)
+    {
+        fwrite(gOutputBlock, 1, gOutputLength, outputfp);
+        gOutputLength = 0;
+    }
+    gTotalBytesWritten++;
+}
+
+// Renders the log that's been loaded to a .wav file.
+// Returns 1 on success.
+int RenderDump(const char *filename, int tailSeconds)
+{
+    outputfp = fopen(filename, "wb");
+    if (outputfp == NULL)
+    {
+        printf("Failed to open output file %s.\n", filename);
+        return 0;
+    }
+
+    // 1 byte per sample, mono
+    WriteWavHeader(outputfp, BITRATE, 1, 8, 0);
+    gTotalBytesWritten = 0;
+
+    StartSidDump();
+    while (!OutputAudioAndCalculateNextByte());
+
+    // Let the last notes ring out
+    for (uint32_t i = 0 ; i < (uint32_t)tailSeconds * BITRATE ; i++)
+    {
+        OutputAudioAndCalculateNextByte();
+    }
+
+    fwrite(gOutputBlock, 1, gOutputLength, outputfp);
+    gOutputLength = 0;
+    FinishWavFile(outputfp, gTotalBytesWritten);
+    fclose(outputfp);
+    return 1;
+}
+
+void Usage()
+{
+    printf("Usage: dumptest [-o output.wav] [-c cycles per frame] [-t tail seconds] dump.txt...\n");
+    printf("  -o  Output file for a single log (default tonetest.wav)\n");
+    printf("  -c  CPU cycles in each frame (default %u, a PAL C64)\n", SID_PAL_CYCLES_PER_FRAME);
+    printf("  -t  Seconds to keep rendering after the last frame (default 1)\n");
+    printf("With more than one log, each is written to a .wav next to it\n");
+}
+
+int main(int argc, char *argv[])
+{
+    const char *outputFilename = NULL;
+    uint32_t cyclesPerFrame = SID_PAL_CYCLES_PER_FRAME;
+    int tailSeconds = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "o:c:t:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'o':
+                outputFilename = optarg;
+                break;
+
+            case 'c':
+                cyclesPerFrame = atoi(optarg);
+                if (cyclesPerFrame == 0)
+                {
+                    Usage();
+                    return -1;
+                }
+                break;
+
+            case 't':
+                tailSeconds = atoi(optarg);
+                break;
+
+            default:
+                Usage();
+                return -1;
+        }
+    }
+
+    int numDumps = argc - optind;
+    if (numDumps < 1 || (numDumps > 1 && outputFilename != NULL))
+    {
+        Usage();
+        return -1;
+    }
+
+    InitializeTables();
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    uint64_t totalSamples = 0;
+    int failures = 0;
+
+    for (int i = optind ; i < argc ; i++)
+    {
+        char filename[1100];
+        if (outputFilename != NULL)
+        {
+            snprintf(filename, sizeof(filename), "%s", outputFilename);
+        }
+        else if (numDumps == 1)
+        {
+            snprintf(filename, sizeof(filename), "tonetest.wav");
+        }
+        else
+        {
+            // The log's name with its extension swapped for .wav
+            char base[1024];
+            snprintf(base, sizeof(base), "%s", argv[i]);
+            char *extension = strrchr(base, '.');
+            if (extension != NULL && strchr(extension, '/') == NULL)
+            {
+                *extension = 0;
+            }
+            snprintf(filename, sizeof(filename), "%s.wav", base);
+        }
+
+        if (!LoadSidDump(argv[i], cyclesPerFrame) || !RenderDump(filename, tailSeconds))
+        {
+            failures++;
+            continue;
+        }
+
+        printf("%s: %u writes in %u frames, %u samples to %s\n",
+            argv[i], gNumSidWrites, gNumSidFrames, gTotalBytesWritten, filename);
+        totalSamples += gTotalBytesWritten;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    if (numDumps > 1)
+    {
+        printf("Rendered %llu samples in %.2f seconds, %.0f times real time\n",
+            (unsigned long long)totalSamples, seconds, totalSamples / (double)BITRATE / seconds);
+    }
+
+    return failures == 0 ? 0 : -1;
+}
@@ -0,0 +1,108 @@
+// Filter benchmark
+// Times the filter on its own and as part of rendering a song, and
+// prints the cost per sample. Build the firmware with FILTER_BENCHMARK
+// set in sidish.h for the same numbers on the ATmega.
+//
+// Usage: filterbench [song.sng ...]
+//
+// Without songs, times Comic_Bakery.sng and testsongs/FilterTest.sng,
+// which sweeps the cutoff up high with little resonance.
+
+#include <time.h>
+
+#include "hostplayer.c"
+
+#define BENCHMARK_SAMPLES (16 * 1024 * 1024)
+
+uint32_t gSamples;
+
+void OutputByte(uint8_t value)
+{
+    gSamples++;
+}
+
+double Seconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Runs the filter over a sawtooth while the cutoff sweeps, with every
+// type and resonance set along the way
+double TimeFilter()
+{
+    int8_t checksum = 0;
+
+    memset(&gFilter, 0, sizeof(gFilter));
+    gFilter.routing = 1;
+
+    double start = Seconds();
+    for (uint32_t sample = 0 ; sample < BENCHMARK_SAMPLES ; sample++)
+    {
+        if ((sample % VBI_COUNT) == 0)
+        {
+            uint32_t tick = sample / VBI_COUNT;
+            gFilter.cutoff = tick;
+            gFilter.resonance = (tick >> 8) & 0x0F;
+            gFilter.type = (tick >> 4) & (FILTER_LOWPASS | FILTER_BANDPASS | FILTER_HIGHPASS);
+            UpdateFilterCoefficients();
+        }
+        checksum += FilterSample((int8_t)((sample & 0x3F) - 32));
+    }
+    double elapsed = Seconds() - start;
+
+    // Keeps the loop from being optimized away
+    if (checksum == 0x7F)
+    {
+        printf(" ");
+    }
+    return elapsed;
+}
+
+// Renders the song and returns the time taken
+double TimeSong(const char *songdata)
+{
+    InitializeSong(songdata);
+
+    gSamples = 0;
+    double start = Seconds();
+    while (!OutputAudioAndCalculateNextByte());
+    return Seconds() - start;
+}
+
+// Songs timed when none are given
+const char *DEFAULT_SONGS[] = { "Comic_Bakery.sng", "testsongs/FilterTest.sng" };
+
+int main(int argc, char *argv[])
+{
+    const char **songFilenames = DEFAULT_SONGS;
+    int numSongs = sizeof(DEFAULT_SONGS) / sizeof(DEFAULT_SONGS[0]);
+    if (argc > 1)
+    {
+        songFilenames = (const char **)&argv[1];
+        numSongs = argc - 1;
+    }
+
+    InitializeTables();
+    gPrintEnabled = 0;
+
+    double elapsed = TimeFilter();
+    printf("Filter alone: %.2f ns per sample\n", elapsed * 1e9 / BENCHMARK_SAMPLES);
+
+    for (int song = 0 ; song < numSongs ; song++)
+    {
+        char *songdata = LoadFile(songFilenames[song], NULL);
+        if (songdata == NULL)
+        {
+            return -1;
+        }
+
+        elapsed = TimeSong(songdata);
+        printf("%s: %.2f ns per sample for %u samples\n", songFilenames[song], elapsed * 1e9 / gSamples, gSamples);
+        printf("  %.0fx faster than realtime at %u Hz\n", gSamples / (elapsed * BITRATE), BITRATE);
+        free(songdata);
+    }
+
+    return 0;
+}
@@ -0,0 +1,605 @@
+// Streaming FLAC encoder for the host tools (see flacenc.h)
+// The format is described at https://xiph.org/flac/format.html
+
+#include <string.h>
+
+#include "flacenc.h"
+
+#define FLAC_MAX_FIXED_ORDER (4)
+#define FLAC_MAX_PARTITION_ORDER (8)
+#define FLAC_MAX_RICE_PARAMETER (14)
+
+// Channel assignments in the frame header. Independent channels are
+// the number of channels - 1.
+#define FLAC_LEFT_SIDE (8)
+#define FLAC_RIGHT_SIDE (9)
+#define FLAC_MID_SIDE (10)
+
+enum SubframeType
+{
+    SubframeConstant,
+    SubframeVerbatim,
+    SubframeFixed,
+};
+
+// How a channel of a block is going to be stored
+struct Subframe
+{
+    enum SubframeType type;
+    uint8_t order;
+    uint8_t partitionOrder;
+    uint8_t parameters[1 << FLAC_MAX_PARTITION_ORDER];
+    uint64_t bits;
+};
+
+// Writes big endian bit fields into a buffer
+struct BitWriter
+{
+    uint8_t *buffer;
+    uint32_t length;
+    uint64_t bits;
+    int numBits;
+};
+
+static uint8_t gCrc8Table[256];
+static uint16_t gCrc16Table[256];
+
+static void InitializeCrcTables()
+{
+    for (int i = 0 ; i < 256 ; i++)
+    {
+        uint8_t crc8 = i;
+        uint16_t crc16 = i << 8;
+        for (int bit = 0 ; bit < 8 ; bit++)
+        {
+            crc8 = (crc8 & 0x80) ? (uint8_t)((crc8 << 1) ^ 0x07) : (uint8_t)(crc8 << 1);
+            crc16 = (crc16 & 0x8000) ? (uint16_t)((crc16 << 1) ^ 0x8005) : (uint16_t)(crc16 << 1);
+        }
+        gCrc8Table[i] = crc8;
+        gCrc16Table[i] = crc16;
+    }
+}
+
+// Writes the low count bits of value, up to 32
+static inline void PutBits(struct BitWriter *writer, uint32_t value, int count)
+{
+    writer->bits = (writer->bits << count) | (value & (((uint64_t)1 << count) - 1));
+    writer->numBits += count;
+    while (writer->numBits >= 8)
+    {
+        writer->numBits -= 8;
+        writer->buffer[writer->length++] = (uint8_t)(writer->bits >> writer->numBits);
+    }
+}
+
+// Fills the rest of the byte with zeros
+static void PadToByte(struct BitWriter *writer)
+{
+    if (writer->numBits > 0)
+    {
+        PutBits(writer, 0, 8 - writer->numBits);
+    }
+}
+
+// The quotient in unary, as that many 0s and then a 1, then the
+// remainder in parameter bits
+static inline void PutRice(struct BitWriter *writer, uint32_t value, int parameter)
+{
+    uint32_t quotient = value >> parameter;
+    while (quotient >= 32)
+    {
+        PutBits(writer, 0, 32);
+        quotient -= 32;
+    }
+    PutBits(writer, 1, quotient + 1);
+    PutBits(writer, value, parameter);
+}
+
+// Frame numbers are coded the same way as characters in UTF-8, with
+// up to 31 bits
+static void PutFrameNumber(struct BitWriter *writer, uint32_t value)
+{
+    if (value < 0x80)
+    {
+        PutBits(writer, value, 8);
+        return;
+    }
+
+    int numBytes = 2;
+    while (numBytes < 6 && value >= (1u << (5 * numBytes + 1)))
+    {
+        numBytes++;
+    }
+
+    PutBits(writer, ((0xFF00 >> numBytes) & 0xFF) | (value >> (6 * (numBytes - 1))), 8);
+    for (int byte = numBytes - 2 ; byte >= 0 ; byte--)
+    {
+        PutBits(writer, 0x80 | ((value >> (6 * byte)) & 0x3F), 8);
+    }
+}
+
+static inline uint32_t ZigZag(int32_t value)
+{
+    return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+// What the fixed predictor of the given order leaves after predicting
+// sample i from the ones before it
+static inline int32_t FixedResidual(const int32_t *x, uint32_t i, uint8_t order)
+{
+    switch (order)
+    {
+        case 0:
+            return x[i];
+        case 1:
+            return x[i] - x[i - 1];
+        case 2:
+            return x[i] - 2 * x[i - 1] + x[i - 2];
+        case 3:
+            return x[i] - 3 * x[i - 1] + 3 * x[i - 2] - x[i - 3];
+        default:
+            return x[i] - 4 * x[i - 1] + 6 * x[i - 2] - 4 * x[i - 3] + x[i - 4];
+    }
+}
+
+// The Rice parameter that comes out smallest for values adding up to
+// sum, going by the average. Returns the estimated number of bits.
+static uint64_t ChooseRiceParameter(uint64_t sum, uint32_t count, uint8_t *parameter)
+{
+    uint64_t bestBits = UINT64_MAX;
+
+    for (uint8_t k = 0 ; k <= FLAC_MAX_RICE_PARAMETER ; k++)
+    {
+        uint64_t bits = (uint64_t)count * (k + 1) + (sum >> k);
+        if (bits < bestBits)
+        {
+            bestBits = bits;
+            *parameter = k;
+        }
+    }
+
+    return bestBits;
+}
+
+// Works out the smallest way to store a channel of n samples with bps
+// bits each. The zigzagged residual is left in residual for
+// WriteSubframe.
+static void PlanSubframe(const int32_t *x, uint32_t n, int bps, uint32_t *residual, struct Subframe *plan)
+{
+    // An 8 bit header, then the samples
+    uint32_t i;
+    for (i = 1 ; i < n && x[i] == x[0] ; i++);
+    if (i == n)
+    {
+        plan->type = SubframeConstant;
+        plan->bits = 8 + bps;
+        return;
+    }
+
+    plan->type = SubframeVerbatim;
+    plan->bits = 8 + (uint64_t)n * bps;
+    if (n <= FLAC_MAX_FIXED_ORDER)
+    {
+        return;
+    }
+
+    // The order whose residual adds up to the least, the same way the
+    // reference encoder picks it
+    uint64_t total[FLAC_MAX_FIXED_ORDER + 1] = { 0 };
+    for (i = FLAC_MAX_FIXED_ORDER ; i < n ; i++)
+    {
+        for (uint8_t order = 0 ; order <= FLAC_MAX_FIXED_ORDER ; order++)
+        {
+            int32_t value = FixedResidual(x, i, order);
+            total[order] += (value < 0) ? -(int64_t)value : value;
+        }
+    }
+    uint8_t order = 0;
+    for (uint8_t candidate = 1 ; candidate <= FLAC_MAX_FIXED_ORDER ; candidate++)
+    {
+        if (total[candidate] < total[order])
+        {
+            order = candidate;
+        }
+    }
+
+    for (i = order ; i < n ; i++)
+    {
+        residual[i] = ZigZag(FixedResidual(x, i, order));
+    }
+
+    // The residual is split into 2^partitionOrder partitions, each with
+    // its own Rice parameter. Every partition has to be the same size,
+    // and the first one loses the warm up samples.
+    uint8_t maxPartitionOrder = 0;
+    while (maxPartitionOrder < FLAC_MAX_PARTITION_ORDER &&
+           n % (2u << maxPartitionOrder) == 0 && (n >> (maxPartitionOrder + 1)) > order)
+    {
+        maxPartitionOrder++;
+    }
+
+    uint64_t sums[1 << FLAC_MAX_PARTITION_ORDER];
+    uint32_t partitionSize = n >> maxPartitionOrder;
+    for (uint32_t partition = 0 ; partition < (1u << maxPartitionOrder) ; partition++)
+    {
+        sums[partition] = 0;
+        for (i = (partition == 0) ? order : partition * partitionSize ; i < (partition + 1) * partitionSize ; i++)
+        {
+            sums[partition] += residual[i];
+        }
+    }
+
+    // Try each partition order from the smallest partitions up, adding
+    // pairs of partitions together for the next one
+    uint64_t bestBits = UINT64_MAX;
+    for (int partitionOrder = maxPartitionOrder ; partitionOrder >= 0 ; partitionOrder--)
+    {
+        uint32_t numPartitions = 1u << partitionOrder;
+        uint8_t parameters[1 << FLAC_MAX_PARTITION_ORDER];
+        uint64_t bits = 0;
+
+        for (uint32_t partition = 0 ; partition < numPartitions ; partition++)
+        {
+            uint32_t count = (n >> partitionOrder) - ((partition == 0) ? order : 0);
+            bits += 4 + ChooseRiceParameter(sums[partition], count, &parameters[partition]);
+        }
+
+        if (bits < bestBits)
+        {
+            bestBits = bits;
+            plan->partitionOrder = partitionOrder;
+            memcpy(plan->parameters, parameters, numPartitions);
+        }
+
+        for (uint32_t partition = 0 ; partition < numPartitions / 2 ; partition++)
+        {
+            sums[partition] = sums[2 * partition] + sums[2 * partition + 1];
+        }
+    }
+
+    // The exact size, since the estimate only went by the averages.
+    // The header, the warm up samples, the coding method and the
+    // partition order, then the partitions.
+    uint64_t bits = 8 + order * bps + 2 + 4;
+    uint32_t numPartitions = 1u << plan->partitionOrder;
+    partitionSize = n >> plan->partitionOrder;
+    for (uint32_t partition = 0 ; partition < numPartitions ; partition++)
+    {
+        uint8_t parameter = plan->parameters[partition];
+        uint32_t start = (partition == 0) ? order : partition * partitionSize;
+        bits += 4 + (uint64_t)((partition + 1) * partitionSize - start) * (parameter + 1);
+        for (i = start ; i < (partition + 1) * partitionSize ; i++)
+        {
+            bits += residual[i] >> parameter;
+        }
+    }
+
+    if (bits < plan->bits)
+    {
+        plan->type = SubframeFixed;
+        plan->order = order;
+        plan->bits = bits;
+    }
+}
+
+static void WriteSubframe(struct BitWriter *writer, const int32_t *x, uint32_t n, int bps,
+                          const uint32_t *residual, const struct Subframe *plan)
+{
+    switch (plan->type)
+    {
+        case SubframeConstant:
+            PutBits(writer, 0x00, 8);
+            PutBits(writer, x[0], bps);
+            break;
+
+        case SubframeVerbatim:
+            PutBits(writer, 0x02, 8);
+            for (uint32_t i = 0 ; i < n ; i++)
+            {
+                PutBits(writer, x[i], bps);
+            }
+            break;
+
+        case SubframeFixed:
+        {
+            PutBits(writer, (0x08 | plan->order) << 1, 8);
+            for (uint32_t i = 0 ; i < plan->order ; i++)
+            {
+                PutBits(writer, x[i], bps);
+            }
+
+            // Rice coding with 4 bit parameters
+            PutBits(writer, 0, 2);
+            PutBits(writer, plan->partitionOrder, 4);
+
+            uint32_t partitionSize = n >> plan->partitionOrder;
+            for (uint32_t partition = 0 ; partition < (1u << plan->partitionOrder) ; partition++)
+            {
+                uint8_t parameter = plan->parameters[partition];
+                PutBits(writer, parameter, 4);
+                for (uint32_t i = (partition == 0) ? plan->order : partition * partitionSize ;
+                     i < (partition + 1) * partitionSize ; i++)
+                {
+                    PutRice(writer, residual[i], parameter);
+                }
+            }
+            break;
+        }
+    }
+}
+
+// The block size code for the frame header, or 7 if the size has to
+// follow the header in 16 bits
+static uint8_t BlockSizeCode(uint32_t n)
+{
+    for (uint8_t code = 8 ; code < 16 ; code++)
+    {
+        if (n == (256u << (code - 8)))
+        {
+            return code;
+        }
+    }
+    return 7;
+}
+
+static void WriteOut(struct FlacEncoder *encoder, const void *data, size_t length)
+{
+    if (fwrite(data, 1, length, encoder->fp) != length)
+    {
+        encoder->failed = 1;
+    }
+    encoder->bytesWritten += length;
+}
+
+// Encodes and writes the block that's been collected
+static void EncodeBlock(struct FlacEncoder *encoder)
+{
+    uint32_t n = encoder->blockLength;
+    int bps = encoder->bitsPerSample;
+
+    // The channels in the order they're stored, and the bits per
+    // sample of each, which is one more for the difference
+    const int32_t *channels[FLAC_MAX_CHANNELS];
+    const uint32_t *residuals[FLAC_MAX_CHANNELS];
+    const struct Subframe *subframes[FLAC_MAX_CHANNELS];
+    int channelBits[FLAC_MAX_CHANNELS];
+    struct Subframe plans[4];
+    uint8_t assignment;
+
+    if (encoder->numChannels == 1)
+    {
+        PlanSubframe(encoder->samples[0], n, bps, encoder->residual[0], &plans[0]);
+        assignment = 0;
+        channels[0] = encoder->samples[0];
+        residuals[0] = encoder->residual[0];
+        subframes[0] = &plans[0];
+        channelBits[0] = bps;
+    }
+    else
+    {
+        const int32_t *left = encoder->samples[0];
+        const int32_t *right = encoder->samples[1];
+        for (uint32_t i = 0 ; i < n ; i++)
+        {
+            encoder->mid[i] = (left[i] + right[i]) >> 1;
+            encoder->side[i] = left[i] - right[i];
+        }
+
+        PlanSubframe(left, n, bps, encoder->residual[0], &plans[0]);
+        PlanSubframe(right, n, bps, encoder->residual[1], &plans[1]);
+        PlanSubframe(encoder->mid, n, bps, encoder->residual[2], &plans[2]);
+        PlanSubframe(encoder->side, n, bps + 1, encoder->residual[3], &plans[3]);
+
+        // Each pair that can be stored, in the order they're stored in
+        static const struct
+        {
+            uint8_t assignment;
+            uint8_t first;
+            uint8_t second;
+        } pairs[] =
+        {
+            { 1, 0, 1 },
+            { FLAC_LEFT_SIDE, 0, 3 },
+            { FLAC_RIGHT_SIDE, 3, 1 },
+            { FLAC_MID_SIDE, 2, 3 },
+        };
+
+        int best = 0;
+        for (int pair = 1 ; pair < 4 ; pair++)
+        {
+            if (plans[pairs[pair].first].bits + plans[pairs[pair].second].bits <
+                plans[pairs[best].first].bits + plans[pairs[best].second].bits)
+            {
+                best = pair;
+            }
+        }
+
+        const int32_t *candidates[4] = { left, right, encoder->mid, encoder->side };
+        uint8_t stored[2] = { pairs[best].first, pairs[best].second };
+        assignment = pairs[best].assignment;
+        for (int channel = 0 ; channel < 2 ; channel++)
+        {
+            channels[channel] = candidates[stored[channel]];
+            residuals[channel] = encoder->residual[stored[channel]];
+            subframes[channel] = &plans[stored[channel]];
+            channelBits[channel] = (stored[channel] == 3) ? bps + 1 : bps;
+        }
+    }
+
+    struct BitWriter writer = { encoder->frame, 0, 0, 0 };
+
+    // Sync code for a stream of fixed size blocks, then the block size,
+    // the sample rate from the header, the channels and the sample size
+    uint8_t blockSizeCode = BlockSizeCode(n);
+    PutBits(&writer, 0xFFF8, 16);
+    PutBits(&writer, blockSizeCode, 4);
+    PutBits(&writer, 0, 4);
+    PutBits(&writer, assignment, 4);
+    PutBits(&writer, (bps == 8) ? 1 : 4, 3);
+    PutBits(&writer, 0, 1);
+    PutFrameNumber(&writer, encoder->frameNumber);
+    if (blockSizeCode == 7)
+    {
+        PutBits(&writer, n - 1, 16);
+    }
+
+    uint8_t crc8 = 0;
+    for (uint32_t i = 0 ; i < writer.length ; i++)
+    {
+        crc8 = gCrc8Table[crc8 ^ writer.buffer[i]];
+    }
+    PutBits(&writer, crc8, 8);
+
+    for (int channel = 0 ; channel < encoder->numChannels ; channel++)
+    {
+        WriteSubframe(&writer, channels[channel], n, channelBits[channel], residuals[channel], subframes[channel]);
+    }
+    PadToByte(&writer);
+
+    uint16_t crc16 = 0;
+    for (uint32_t i = 0 ; i < writer.length ; i++)
+    {
+        crc16 = (crc16 << 8) ^ gCrc16Table[(crc16 >> 8) ^ writer.buffer[i]];
+    }
+    PutBits(&writer, crc16, 16);
+
+    WriteOut(encoder, writer.buffer, writer.length);
+
+    if (writer.length < encoder->minFrameSize)
+    {
+        encoder->minFrameSize = writer.length;
+    }
+    if (writer.length > encoder->maxFrameSize)
+    {
+        encoder->maxFrameSize = writer.length;
+    }
+    encoder->frameNumber++;
+    encoder->totalSamples += n;
+    encoder->blockLength = 0;
+}
+
+// The "fLaC" marker and the STREAMINFO block. The sizes and length are
+// 0 when they aren't known yet.
+static void WriteStreamInfo(struct FlacEncoder *encoder)
+{
+    uint8_t header[4 + 4 + 34];
+    struct BitWriter writer = { header, 0, 0, 0 };
+
+    // Only the last block can be shorter, unless it's the only one
+    uint32_t blockSize = FLAC_BLOCK_SIZE;
+    if (encoder->frameNumber == 1 && encoder->totalSamples >= 16)
+    {
+        blockSize = encoder->totalSamples;
+    }
+
+    PutBits(&writer, 0x664C6143, 32);
+    PutBits(&writer, 0x80, 8); // The last metadata block, and a STREAMINFO
+    PutBits(&writer, 34, 24);
+    PutBits(&writer, blockSize, 16);
+    PutBits(&writer, blockSize, 16);
+    PutBits(&writer, (encoder->frameNumber > 0) ? encoder->minFrameSize : 0, 24);
+    PutBits(&writer, encoder->maxFrameSize, 24);
+    PutBits(&writer, encoder->sampleRate, 20);
+    PutBits(&writer, encoder->numChannels - 1, 3);
+    PutBits(&writer, encoder->bitsPerSample - 1, 5);
+    PutBits(&writer, encoder->totalSamples >> 32, 4);
+    PutBits(&writer, (uint32_t)encoder->totalSamples, 32);
+    for (int i = 0 ; i < 4 ; i++)
+    {
+        PutBits(&writer, 0, 32); // MD5 not worked out
+    }
+
+    WriteOut(encoder, header, sizeof(header));
+}
+
+int FlacOpen(struct FlacEncoder *encoder, FILE *fp, uint32_t sampleRate, uint8_t numChannels, uint8_t bitsPerSample)
+{
+    static int crcTablesReady = 0;
+    if (!crcTablesReady)
+    {
+        InitializeCrcTables();
+        crcTablesReady = 1;
+    }
+
+    if (numChannels < 1 || numChannels > FLAC_MAX_CHANNELS || (bitsPerSample != 8 && bitsPerSample != 16))
+    {
+        return 0;
+    }
+
+    encoder->fp = fp;
+    encoder->sampleRate = sampleRate;
+    encoder->numChannels = numChannels;
+    encoder->bitsPerSample = bitsPerSample;
+    encoder->blockLength = 0;
+    encoder->frameNumber = 0;
+    encoder->totalSamples = 0;
+    encoder->bytesWritten = 0;
+    encoder->minFrameSize = UINT32_MAX;
+    encoder->maxFrameSize = 0;
+    encoder->failed = 0;
+
+    // Pipes can't seek, so the header stays as it is
+    encoder->headerPosition = ftell(fp);
+
+    WriteStreamInfo(encoder);
+    return !encoder->failed;
+}
+
+void FlacWrite8(struct FlacEncoder *encoder, const uint8_t *samples, uint32_t count)
+{
+    for (uint32_t i = 0 ; i < count ; i++)
+    {
+        for (uint8_t channel = 0 ; channel < encoder->numChannels ; channel++)
+        {
+            encoder->samples[channel][encoder->blockLength] = *samples++ - 128;
+        }
+
+        if (++encoder->blockLength == FLAC_BLOCK_SIZE)
+        {
+            EncodeBlock(encoder);
+        }
+    }
+}
+
+void FlacWrite16(struct FlacEncoder *encoder, const int16_t *samples, uint32_t count)
+{
+    for (uint32_t i = 0 ; i < count ; i++)
+    {
+        for (uint8_t channel = 0 ; channel < encoder->numChannels ; channel++)
+        {
+            encoder->samples[channel][encoder->blockLength] = *samples++;
+        }
+
+        if (++encoder->blockLength == FLAC_BLOCK_SIZE)
+        {
+            EncodeBlock(encoder);
+        }
+    }
+}
+
+int FlacClose(struct FlacEncoder *encoder)
+{
+    if (encoder->blockLength > 0)
+    {
+        EncodeBlock(encoder);
+    }
+
+    if (encoder->headerPosition >= 0)
+    {
+        long end = ftell(encoder->fp);
+        uint64_t bytesWritten = encoder->bytesWritten;
+        if (end < 0 || fseek(encoder->fp, encoder->headerPosition, SEEK_SET) != 0)
+        {
+            return 0;
+        }
+        WriteStreamInfo(encoder);
+        encoder->bytesWritten = bytesWritten;
+        fseek(encoder->fp, end, SEEK_SET);
+    }
+
+    if (fflush(encoder->fp) != 0)
+    {
+        encoder->failed = 1;
+    }
+    return !encoder->failed;
+}
@@ -0,0 +1,74 @@
+#ifndef __FLACENC_H
+#define __FLACENC_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+// Streaming FLAC encoder for the host tools
+//
+// Samples are added as they're rendered, and each block is encoded and
+// written as soon as it fills up. Every channel of a block is stored
+// whichever of these ways is smallest: as one repeated value, with one
+// of FLAC's fixed polynomial predictors and the residual Rice coded,
+// or as it is. Stereo also tries storing the difference between the
+// channels, which is mostly what's left of voices panned to the center.
+//
+// The header is written with the length unknown, which FLAC allows,
+// so the output can be a pipe. If the file can seek, FlacClose goes
+// back and fills in the length and frame sizes the way FinishWavFile
+// does. The MD5 signature of the audio is always left unset.
+
+#define FLAC_BLOCK_SIZE (4096)
+#define FLAC_MAX_CHANNELS (2)
+
+// Every subframe is at most the size of storing the samples as they
+// are, plus the extra bit of the difference channel
+#define FLAC_MAX_FRAME_SIZE (FLAC_BLOCK_SIZE * FLAC_MAX_CHANNELS * 17 / 8 + 64)
+
+struct FlacEncoder
+{
+    FILE *fp;
+    uint32_t sampleRate;
+    uint8_t numChannels;
+    uint8_t bitsPerSample;
+
+    // The block being filled, one channel after the other
+    int32_t samples[FLAC_MAX_CHANNELS][FLAC_BLOCK_SIZE];
+    uint32_t blockLength;
+
+    uint32_t frameNumber;
+    uint64_t totalSamples;
+    uint64_t bytesWritten;
+    uint32_t minFrameSize;
+    uint32_t maxFrameSize;
+
+    // Where the header is in the file, or -1 if the file can't seek
+    long headerPosition;
+
+    // Set if anything failed to write
+    int failed;
+
+    // Room to work out each way of storing each channel of a block:
+    // the channels themselves, and for stereo their average and
+    // difference
+    int32_t mid[FLAC_BLOCK_SIZE];
+    int32_t side[FLAC_BLOCK_SIZE];
+    uint32_t residual[4][FLAC_BLOCK_SIZE];
+    uint8_t frame[FLAC_MAX_FRAME_SIZE];
+};
+
+// Writes the header. The encoder is too big for the stack, so it's
+// best kept as a global. Only 8 and 16 bits per sample are supported.
+// Returns 0 if the format isn't supported or the header can't be written.
+int FlacOpen(struct FlacEncoder *encoder, FILE *fp, uint32_t sampleRate, uint8_t numChannels, uint8_t bitsPerSample);
+
+// Adds count samples for every channel, interleaved as they are in a
+// .wav file. 8 bit samples are unsigned, 16 bit ones signed.
+void FlacWrite8(struct FlacEncoder *encoder, const uint8_t *samples, uint32_t count);
+void FlacWrite16(struct FlacEncoder *encoder, const int16_t *samples, uint32_t count);
+
+// Writes what's left of the last block and fills in the header if it
+// can. Doesn't close the file. Returns 0 if anything failed to write.
+int FlacClose(struct FlacEncoder *encoder);
+
+#endif // __FLACENC_H
@@ -0,0 +1,126 @@
+// Frame recorder
+// Plays a subtune through the player and records what each tick
+// changes in the voices and the filter (see framereplay.c). Firmware
+// built with SONG_FORMAT = frames plays the recording instead of the
+// song, without running the player at all.
+//
+// Instead of a song, it can also record a log of SID register writes
+// (see siddump.c), so the firmware can play music from other players.
+//
+// The recording is played back before it's written, and has to come
+// out the same as the song or log sample for sample.
+//
+// Usage: framec [-u subtune] -o frames.bin song.sng | dump.txt
+
+#include <unistd.h>
+
+#include "hostplayer.c"
+#include "siddump.c"
+#include "framereplay.c"
+#include "framerecorder.c"
+
+// No song should run longer than this, 10 minutes
+#define MAX_TICKS (50 * 60 * 10)
+
+uint64_t gOutputHash;
+
+void OutputByte(uint8_t value)
+{
+    gOutputHash = HashBytes(&value, 1, gOutputHash);
+}
+
+void Usage()
+{
+    fprintf(stderr, "Usage: framec [-u subtune] -o frames.bin song.sng | dump.txt\n");
+    fprintf(stderr, "  -u  Subtune to record (default 0)\n");
+    fprintf(stderr, "  -o  Write the recording\n");
+    fprintf(stderr, "Anything that isn't a GoatTracker song is read as a log of SID register writes\n");
+}
+
+int main(int argc, char *argv[])
+{
+    const char *outputFilename = NULL;
+    int subtune = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "u:o:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'u':
+                subtune = atoi(optarg);
+                break;
+
+            case 'o':
+                outputFilename = optarg;
+                break;
+
+            default:
+                Usage();
+                return -1;
+        }
+    }
+
+    if (argc - optind != 1 || outputFilename == NULL)
+    {
+        Usage();
+        return -1;
+    }
+
+    const char *songFilename = argv[optind];
+    uint32_t songSize;
+    char *songdata = LoadFile(songFilename, &songSize);
+    if (songdata == NULL)
+    {
+        return -1;
+    }
+
+    InitializeTables();
+    gPrintEnabled = 0;
+    if (songSize < 4 || memcmp(songdata, "GTS5", 4) != 0)
+    {
+        if (!LoadSidDump(songFilename, SID_PAL_CYCLES_PER_FRAME))
+        {
+            return -1;
+        }
+        StartSidDump();
+    }
+    else if (!InitializeSong(songdata) || (subtune != 0 && !StartSubtune(subtune)))
+    {
+        fprintf(stderr, "Can't play subtune %d of %s\n", subtune, songFilename);
+        return -1;
+    }
+
+    gOutputHash = FNV_OFFSET_BASIS;
+    uint32_t size = RecordFrames(MAX_TICKS);
+    if (size == 0)
+    {
+        fprintf(stderr, "%s is too long to record\n", songFilename);
+        return -1;
+    }
+    uint64_t playerHash = gOutputHash;
+
+    gOutputHash = FNV_OFFSET_BASIS;
+    InitializeFrameReplay((const char *)gFrames);
+    while (!OutputAudioAndCalculateNextByte());
+    gPrintEnabled = 1;
+
+    if (gOutputHash != playerHash)
+    {
+        fprintf(stderr, "The recording doesn't play the same as the song\n");
+        return -1;
+    }
+
+    FILE *fp = fopen(outputFilename, "wb");
+    if (fp == NULL)
+    {
+        perror(outputFilename);
+        return -1;
+    }
+    fwrite(gFrames, 1, size, fp);
+    fclose(fp);
+
+    printf("Recorded %u ticks in %u bytes, %.1f bytes per tick\n",
+           gFrameTicks, size, (double)size / gFrameTicks);
+    return 0;
+}
@@ -0,0 +1,232 @@
+// Records what every tick of the song changes in the voices and the
+// filter, in the format framereplay.c plays. Include after it.
+// Shared by framec, which writes it out for the firmware, and the tools
+// that check it plays the same as the original.
+
+// The recording is built up in memory, then written all at once
+uint8_t gFrames[1 << 20];
+uint32_t gFramesSize;
+int gFramesTooBig;
+
+// Ticks recorded so far, and how many of the last ones changed nothing
+// and haven't been written yet
+uint32_t gFrameTicks;
+uint32_t gPendingSkips;
+
+// What plays the ticks being recorded, the player or another source
+int (*gRecordedTickFunction)(void);
+
+void PutFrameByte(uint8_t value)
+{
+    if (gFramesSize >= sizeof(gFrames))
+    {
+        gFramesTooBig = 1;
+        return;
+    }
+    gFrames[gFramesSize++] = value;
+}
+
+void PutFrameWord(uint16_t value)
+{
+    PutFrameByte(value & 0xFF);
+    PutFrameByte(value >> 8);
+}
+
+void FlushSkips()
+{
+    while (gPendingSkips > 0)
+    {
+        uint32_t run = (gPendingSkips > FRAME_MAX_SKIP) ? FRAME_MAX_SKIP : gPendingSkips;
+        PutFrameByte(FRAME_SKIP | (run - 1));
+        gPendingSkips -= run;
+    }
+}
+
+// Which fields of the voice the tick changed
+uint8_t ChangedVoiceFields(const struct Voice *before, const struct Voice *after)
+{
+    uint8_t fields = 0;
+
+    if (after->steps != before->steps)
+    {
+        fields |= VOICE_STEPS;
+    }
+    if (after->control != before->control)
+    {
+        fields |= VOICE_CONTROL;
+    }
+
+    int16_t pulseStep = after->pulseWidth - before->pulseWidth;
+    if (pulseStep >= -128 && pulseStep <= 127 && pulseStep != 0)
+    {
+        fields |= VOICE_PULSE_STEP;
+    }
+    else if (pulseStep != 0)
+    {
+        fields |= VOICE_PULSE_WIDTH;
+    }
+
+    if (after->attackDecay != before->attackDecay || after->sustainRelease != before->sustainRelease)
+    {
+        fields |= VOICE_ADSR;
+    }
+
+    if (after->envelopePhase != before->envelopePhase ||
+        after->fadeAmount != before->fadeAmount ||
+        after->phaseStepCountdown != before->phaseStepCountdown)
+    {
+        if (after->envelopePhase == Release && after->fadeAmount == before->fadeAmount &&
+            after->phaseStepCountdown == DecayReleaseCycles[after->sustainRelease & 0x0F])
+        {
+            fields |= VOICE_KEY_OFF;
+        }
+        else
+        {
+            fields |= VOICE_ENVELOPE;
+        }
+    }
+
+    // The player only ever moves the waveform back to its start
+    if (after->tableOffset != before->tableOffset)
+    {
+        fields |= VOICE_RESTART;
+    }
+    return fields;
+}
+
+// Writes the frame for a tick, given the voices and the filter from
+// just before it
+void RecordFrame(const struct Voice *before, const struct Filter *filterBefore)
+{
+    uint8_t fields[NUM_CHANNELS];
+    uint8_t frame = 0;
+
+    for (uint8_t channel = 0 ; channel < NUM_CHANNELS ; channel++)
+    {
+        fields[channel] = ChangedVoiceFields(&before[channel], &channels[channel]);
+        if (gFrameTicks == 0)
+        {
+            fields[channel] = VOICE_STEPS | VOICE_CONTROL | VOICE_PULSE_WIDTH | VOICE_ADSR | VOICE_ENVELOPE |
+                              (fields[channel] & VOICE_RESTART);
+        }
+
+        if (fields[channel] != 0)
+        {
+            frame |= FRAME_VOICE(channel);
+        }
+    }
+
+    if (gFrameTicks == 0 ||
+        gFilter.frequency != filterBefore->frequency || gFilter.damping != filterBefore->damping ||
+        gFilter.type != filterBefore->type || gFilter.routing != filterBefore->routing)
+    {
+        frame |= FRAME_FILTER;
+    }
+
+    if (frame == 0)
+    {
+        gPendingSkips++;
+        return;
+    }
+
+    FlushSkips();
+    PutFrameByte(frame);
+    for (uint8_t channel = 0 ; channel < NUM_CHANNELS ; channel++)
+    {
+        if (fields[channel] == 0)
+        {
+            continue;
+        }
+
+        const struct Voice *voice = &channels[channel];
+        PutFrameByte(fields[channel]);
+        if (fields[channel] & VOICE_STEPS)
+        {
+            PutFrameWord(voice->steps);
+        }
+        if (fields[channel] & VOICE_CONTROL)
+        {
+            PutFrameByte(voice->control);
+        }
+        if (fields[channel] & VOICE_PULSE_WIDTH)
+        {
+            PutFrameWord(voice->pulseWidth);
+        }
+        if (fields[channel] & VOICE_PULSE_STEP)
+        {
+            PutFrameByte(voice->pulseWidth - before[channel].pulseWidth);
+        }
+        if (fields[channel] & VOICE_ADSR)
+        {
+            PutFrameByte(voice->attackDecay);
+            PutFrameByte(voice->sustainRelease);
+        }
+        if (fields[channel] & VOICE_ENVELOPE)
+        {
+            PutFrameByte(voice->envelopePhase);
+            PutFrameByte(voice->fadeAmount);
+            PutFrameWord(voice->phaseStepCountdown);
+        }
+    }
+
+    if (frame & FRAME_FILTER)
+    {
+        PutFrameByte(gFilter.frequency);
+        PutFrameByte(gFilter.damping);
+        PutFrameByte(gFilter.type | gFilter.routing);
+    }
+}
+
+// Takes the place of the tick function while recording. The
+// synthesizer moves the envelopes on between ticks, so only what the
+// tick itself changes is recorded.
+int RecordTick()
+{
+    struct Voice before[NUM_CHANNELS];
+    memcpy(before, channels, sizeof(before));
+    struct Filter filterBefore = gFilter;
+
+    int finished = gRecordedTickFunction();
+    RecordFrame(before, &filterBefore);
+    gFrameTicks++;
+    return finished;
+}
+
+// Plays the subtune that's been started, or whatever else gTickFunction
+// has been set to play, until it ends, recording every tick into
+// gFrames. The samples go to OutputByte as usual.
+// Returns the size of the recording, or 0 if it's too big or the song
+// hasn't ended after maxTicks.
+uint32_t RecordFrames(uint32_t maxTicks)
+{
+    gFramesSize = FRAME_STREAM_HEADER_SIZE;
+    gFramesTooBig = 0;
+    gFrameTicks = 0;
+    gPendingSkips = 0;
+
+    int finished = 0;
+    gRecordedTickFunction = gTickFunction;
+    gTickFunction = RecordTick;
+    while (!finished && gFrameTicks < maxTicks)
+    {
+        finished = OutputAudioAndCalculateNextByte();
+    }
+    gTickFunction = gRecordedTickFunction;
+
+    FlushSkips();
+    PutFrameByte(FRAME_END);
+    if (gFramesTooBig || !finished)
+    {
+        return 0;
+    }
+
+    gFrames[0] = FRAME_STREAM_MAGIC & 0xFF;
+    gFrames[1] = (FRAME_STREAM_MAGIC >> 8) & 0xFF;
+    gFrames[2] = (FRAME_STREAM_MAGIC >> 16) & 0xFF;
+    gFrames[3] = FRAME_STREAM_MAGIC >> 24;
+    gFrames[4] = gFrameTicks & 0xFF;
+    gFrames[5] = (gFrameTicks >> 8) & 0xFF;
+    gFrames[6] = (gFrameTicks >> 16) & 0xFF;
+    gFrames[7] = gFrameTicks >> 24;
+    return gFramesSize;
+}
@@ -0,0 +1,178 @@
+// Plays a song from the synthesizer settings recorded by framec instead
+// of the pattern data. Include after goatplayer.c.
+//
+// framec runs the player on the host and records what every tick
+// changed in the voices and the filter. Replaying a tick only copies
+// those few bytes in, so it costs the ATmega next to nothing and
+// leaves the time between samples to the synthesizer. The audio is
+// the same as the player's, sample for sample.
+//
+// The recording starts with a header:
+//
+//   uint32_t magic       FRAME_STREAM_MAGIC
+//   uint32_t numTicks    Ticks in the recording, up to the end of the song
+//
+// followed by a frame for every tick. A frame starts with a byte that
+// says what follows:
+//
+//   0x00                 The end of the recording
+//   0x80 | n             n + 1 ticks that change nothing
+//   otherwise            FRAME_VOICE(channel) for each voice that
+//                        changed, and FRAME_FILTER if the filter did
+//
+// Each voice that changed has a byte of VOICE_* bits for the fields
+// that did, followed by their new values in the order of the bits.
+// Words are little endian. Most ticks only move the pulse width a
+// little, or key off a voice that's already released again, which the
+// wavetable does every tick until the gate is set, so both of those
+// have their own shorter forms. The filter is its frequency and
+// damping coefficients, then its type and routing in one byte.
+//
+// The first frame sets everything, so once the recording ends it can
+// start again from the top whatever the voices were doing.
+
+// "SDF1"
+#define FRAME_STREAM_MAGIC (0x31464453)
+#define FRAME_STREAM_HEADER_SIZE (8)
+
+#define FRAME_END (0x00)
+#define FRAME_SKIP (0x80)
+#define FRAME_MAX_SKIP (0x80)
+#define FRAME_VOICE(channel) (1 << (channel))
+#define FRAME_FILTER (1 << NUM_CHANNELS)
+
+#define VOICE_STEPS       (0x01) // 2 bytes
+#define VOICE_CONTROL     (0x02)
+#define VOICE_PULSE_WIDTH (0x04) // 2 bytes
+#define VOICE_PULSE_STEP  (0x08) // Signed byte added to the pulse width
+#define VOICE_ADSR        (0x10) // Attack/decay, then sustain/release
+#define VOICE_ENVELOPE    (0x20) // Phase, fade amount and 2 bytes of countdown
+#define VOICE_RESTART     (0x40) // Back to the start of the waveform, no data
+#define VOICE_KEY_OFF     (0x80) // Released the way KeyOff does it, no data
+
+// Routing only takes the low bits, below the filter types
+#define FRAME_FILTER_ROUTING_MASK ((1 << NUM_CHANNELS) - 1)
+
+const char *gFrameStart;
+const char *gFramePosition;
+
+// Ticks left in a run of ticks that change nothing
+uint8_t gFrameSkip;
+
+static inline uint8_t NextFrameByte()
+{
+    return pgm_read_byte(gFramePosition++);
+}
+
+static inline uint16_t NextFrameWord()
+{
+    uint16_t value = NextFrameByte();
+    return value | ((uint16_t)NextFrameByte() << 8);
+}
+
+// Applies the frame at gFramePosition
+void ReplayFrame()
+{
+    uint8_t frame = NextFrameByte();
+    if (frame & FRAME_SKIP)
+    {
+        gFrameSkip = frame & ~FRAME_SKIP;
+        return;
+    }
+
+    for (uint8_t channel = 0 ; channel < NUM_CHANNELS ; channel++)
+    {
+        if (!(frame & FRAME_VOICE(channel)))
+        {
+            continue;
+        }
+
+        struct Voice *voice = &channels[channel];
+        uint8_t fields = NextFrameByte();
+        if (fields & VOICE_STEPS)
+        {
+            voice->steps = NextFrameWord();
+        }
+        if (fields & VOICE_CONTROL)
+        {
+            voice->control = NextFrameByte();
+        }
+        if (fields & VOICE_PULSE_WIDTH)
+        {
+            voice->pulseWidth = NextFrameWord();
+        }
+        if (fields & VOICE_PULSE_STEP)
+        {
+            voice->pulseWidth += (int8_t)NextFrameByte();
+        }
+        if (fields & VOICE_ADSR)
+        {
+            voice->attackDecay = NextFrameByte();
+            voice->sustainRelease = NextFrameByte();
+        }
+        if (fields & VOICE_ENVELOPE)
+        {
+            voice->envelopePhase = NextFrameByte();
+            voice->fadeAmount = NextFrameByte();
+            voice->phaseStepCountdown = NextFrameWord();
+        }
+        if (fields & VOICE_RESTART)
+        {
+            voice->tableOffset = 0;
+        }
+        if (fields & VOICE_KEY_OFF)
+        {
+            voice->envelopePhase = Release;
+            voice->phaseStepCountdown = DecayReleaseCycles[voice->sustainRelease & 0x0F];
+        }
+    }
+
+    if (frame & FRAME_FILTER)
+    {
+        gFilter.frequency = NextFrameByte();
+        gFilter.damping = NextFrameByte();
+        uint8_t typeRouting = NextFrameByte();
+        gFilter.type = typeRouting & ~FRAME_FILTER_ROUTING_MASK;
+        gFilter.routing = typeRouting & FRAME_FILTER_ROUTING_MASK;
+    }
+}
+
+// Takes the place of GoatPlayerTick. Returns TRUE on the last tick
+// of the recording, which then starts again.
+int FrameReplayTick()
+{
+    if (gFrameSkip > 0)
+    {
+        gFrameSkip--;
+    }
+    else
+    {
+        ReplayFrame();
+    }
+
+    if (gFrameSkip == 0 && pgm_read_byte(gFramePosition) == FRAME_END)
+    {
+        gFramePosition = gFrameStart;
+        return 1;
+    }
+    return 0;
+}
+
+// Starts playing a recording. Returns 0 if it isn't one.
+int InitializeFrameReplay(const char *frames)
+{
+    if (pgm_read_dword(frames) != FRAME_STREAM_MAGIC)
+    {
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
+        print("Not a frame recording\n");
+#endif
+        return 0;
+    }
+
+    ResetSynthesizer();
+    gFrameStart = frames + FRAME_STREAM_HEADER_SIZE;
+    gFramePosition = gFrameStart;
+    gFrameSkip = 0;
+    gTickFunction = FrameReplayTick;
+    return 1;
+}
@@ -5,6 +5,8 @@
 
 #ifdef WIN32
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include "tables.h"
 #include "sidish.h"
 
@@ -20,17 +22,198 @@ uint32_t totalTicks = 0;
 #define VBI_COUNT (BITRATE / 50)
 #define DEFAULT_TEMPO (5)
 
+// Number of channels processed by both the player and the synthesizer.
+// 4 voices are actually available in the synthesizer, but GoatTracker
+// only supports 3 and I need more cycles, so only process 3 of them.
+#define NUM_CHANNELS (3)
+
 uint16_t vbiCount = VBI_COUNT;
 
-// Pointer to the start of each orderlist.
-// TODO: Deal with the subtunes in a better way
 #define MAX_SUBTUNES (20)
+uint8_t gNumSubtunes;
+
+// The subtune that's playing
+uint8_t gSubtune;
+
+// When the song is built into the firmware, songc generates the offsets
+// of the orderlists and patterns ahead of time (see songindex.h) so they
+// can stay in flash. Otherwise the pointer tables below are filled in
+// by InitializeSong.
+#ifndef SONG_INDEX_IN_PROGMEM
+#define SONG_INDEX_IN_PROGMEM (0)
+#endif
+
+// Host builds decode all the patterns once when the song is loaded
+// instead of working out every row each time it's played. There isn't
+// enough RAM for that on the ATmega, so it decodes each row as it's read.
+#ifndef PREDECODE_PATTERNS
+#ifdef __AVR_ARCH__
+#define PREDECODE_PATTERNS (0)
+#else
+#define PREDECODE_PATTERNS (1)
+#endif
+#endif
+
+// The firmware normally embeds the song as compiled by songc (see
+// struct CompiledSong), which is laid out so the player can use it
+// straight from flash without parsing it first.
+#ifndef COMPILED_SONG
+#define COMPILED_SONG (0)
+#endif
+
+// A compiled song can also be streamed from an SD card instead of
+// being built into the firmware (see songsource.c). Everything but the
+// patterns is loaded into RAM when the song starts, and the patterns
+// are read through a small cache that the main loop keeps filled
+// ahead of the player.
+#ifndef SONG_SOURCE_SD
+#define SONG_SOURCE_SD (0)
+#endif
+
+// A song that never changes can instead be played from the settings
+// framec recorded for the voices and the filter at every tick (see
+// framereplay.c), so the ATmega only runs the synthesizer
+#ifndef FRAME_REPLAY
+#define FRAME_REPLAY (0)
+#endif
+#if FRAME_REPLAY && SONG_SOURCE_SD
+#error FRAME_REPLAY plays the recording from flash, not the SD card
+#endif
+
+// Reading the song data. Patterns go through their own macros since
+// they're the only part that's streamed.
+#if SONG_SOURCE_SD
+#if !COMPILED_SONG
+#error SONG_SOURCE_SD needs a song compiled by songc (COMPILED_SONG)
+#endif
+#include "songsource.h"
+#define SONG_BYTE(address) (*(const uint8_t *)(address))
+#define SONG_WORD(address) (*(const uint16_t *)(address))
+#define SONG_DWORD(address) (*(const uint32_t *)(address))
+#define PATTERN_BYTE(address) SongSourceByte((address) - gSongData)
+#define PATTERN_COPY(buffer, address, size) SongSourceCopy(buffer, (address) - gSongData, size)
+#else
+#define SONG_BYTE(address) pgm_read_byte(address)
+#define SONG_WORD(address) pgm_read_word(address)
+#define SONG_DWORD(address) pgm_read_dword(address)
+#define PATTERN_BYTE(address) pgm_read_byte(address)
+#define PATTERN_COPY(buffer, address, size) memcpy_P(buffer, address, size)
+#endif
+
+// Host tools can record a timeline of every tick (see trace.h).
+// Unless TRACE is set, the calls aren't compiled in at all.
+#ifndef TRACE
+#define TRACE (0)
+#endif
+
+#if TRACE
+#include "trace.h"
+#define TRACE_EVENT(call) call
+#else
+#define TRACE_EVENT(call)
+#endif
+
+// What to do with the note in a pattern row
+enum RowAction
+{
+    RowNone,
+    RowKeyOn,
+    RowKeyOff,
+    RowPatternEnd,
+};
+
+// Pattern commands the player handles. Any other command is
+// decoded as CommandNone.
+enum PatternCommand
+{
+    CommandNone,
+    CommandSetGlobalTempo,
+    CommandSetChannelTempo,
+};
+
+// A pattern row with everything already worked out.
+// Packed into the same 4 bytes as a row in the .sng file.
+struct PatternRow
+{
+    uint8_t action : 2;  // enum RowAction
+    uint8_t command : 6; // enum PatternCommand
+    uint8_t note;        // Key to play, before transposing
+    uint8_t instrument;
+    uint8_t parameter;   // Command data, already adjusted for the command
+};
+
+// "SDS2"
+#define COMPILED_SONG_MAGIC (0x32534453)
+
+// In a compiled song, a run of empty rows (all 4 bytes 0) is stored as
+// this byte followed by the number of rows. No decoded row starts with
+// it, since that would take command 63.
+#define EMPTY_ROWS_MARKER (0xFC)
+
+// Header of a song compiled by songc.
+// All of the offsets are from the start of the header, and each table
+// starts on an even offset.
+struct CompiledSong
+{
+    uint32_t magic;
+    uint8_t numSubtunes;
+    uint8_t numInstruments;
+    uint8_t numPatterns;
+    uint8_t wavetableSize;
+    uint8_t pulsetableSize;
+    uint8_t filtertableSize;
+    uint8_t speedtableSize;
+    uint8_t reserved;
+    uint16_t orderlistOffsets;   // uint16_t [numSubtunes][NUM_CHANNELS] orderlist offsets
+    uint16_t patternOffsets;     // uint16_t [numPatterns] offsets of each pattern's rows, with
+                                 // runs of empty rows shortened (see EMPTY_ROWS_MARKER)
+    uint16_t instruments;        // struct Instrument [numInstruments] without the names
+    uint16_t wavetable;          // Each table is the left column followed by the right
+    uint16_t pulsetable;
+    uint16_t filtertable;
+    uint16_t speedtable;
+};
+
+#if COMPILED_SONG
+// Rows aren't all the same size, so they're read one after another
+// (see NextPatternRow)
+typedef const char *PatternPosition;
+#elif PREDECODE_PATTERNS
+typedef const struct PatternRow *PatternPosition;
+#define PATTERN_ROW_SIZE (1)
+#else
+typedef const char *PatternPosition;
+#define PATTERN_ROW_SIZE (4)
+#endif
+
+#if PREDECODE_PATTERNS
+// Storage for all of the decoded rows
+struct PatternRow *gDecodedRows = NULL;
+#endif
+
+uint8_t gNumPatterns;
+
+#if COMPILED_SONG
+const uint16_t *gOrderlistOffsets;
+const uint16_t *gPatternOffsets;
+
+#define ORDERLIST(subtune, channel) (gSongData + SONG_WORD(&gOrderlistOffsets[(subtune) * NUM_CHANNELS + (channel)]))
+#define PATTERN(number) ((PatternPosition)(gSongData + SONG_WORD(&gPatternOffsets[number])))
+#elif SONG_INDEX_IN_PROGMEM
+#define ORDERLIST(subtune, channel) (song_start + pgm_read_word(&SONG_ORDERLIST_OFFSETS[subtune][channel]))
+#define PATTERN(number) (song_start + pgm_read_word(&SONG_PATTERN_OFFSETS[number]))
+#else
+// Pointer to the start of each orderlist.
 const char *orderlist[MAX_SUBTUNES][3];
 
 // Pointer to the start of each pattern.
-// TODO: Optimize memory usage by reducing this value.
-// This alone takes a lot of the available RAM on an ATmega328
-const char *pattern[256];
+// This alone takes a lot of the available RAM on an ATmega328,
+// which is why the firmware uses the generated offsets instead.
+PatternPosition pattern[256];
+
+#define ORDERLIST(subtune, channel) (orderlist[subtune][channel])
+#define PATTERN(number) (pattern[number])
+#endif
 
 // SID Registers
 // 16 bit FREQUENCY
@@ -62,7 +245,72 @@ enum EnvelopePhase
 const uint16_t AttackCycles[16] = { 1, 4, 8, 12, 19, 28, 34, 40, 50, 125, 250, 400, 500, 1500, 2500, 4000 };
 const uint16_t DecayReleaseCycles[16] = { 3, 12, 24, 36, 57, 84, 102, 120, 150, 375, 750, 1200, 1500, 4500, 7500, 12000 };
 
-uint16_t gNoise = 0x42;
+// Host builds keep what each voice added to the last sample so the
+// tools can write the voices out separately in the same pass.
+#ifndef VOICE_OUTPUT
+#ifdef __AVR_ARCH__
+#define VOICE_OUTPUT (0)
+#else
+#define VOICE_OUTPUT (1)
+#endif
+#endif
+
+#if VOICE_OUTPUT
+// The faded output of each voice for the sample in gNextOutputValue,
+// or 0 when the voice is off. These add up to the mix.
+int8_t gVoiceOutput[NUM_CHANNELS];
+#endif
+
+#define NOISE_SEED (0x42)
+uint16_t gNoise = NOISE_SEED;
+
+// Filter types, the same bits as the high nibble of a filtertable
+// "set filter parameters" step. More than one can be set at once.
+#define FILTER_LOWPASS  (0x10)
+#define FILTER_BANDPASS (0x20)
+#define FILTER_HIGHPASS (0x40)
+
+// Voices are scaled up this many bits going into the filter so it
+// keeps some precision below the 6 bits of the voices
+#define FILTER_INPUT_SHIFT (4)
+
+// Largest frequency coefficient. The filter becomes unstable as the
+// coefficient gets close to 1.0, so this is about 2.5 kHz at a 16 kHz
+// bitrate and any higher cutoff is treated as this.
+#define FILTER_MAX_FREQUENCY (240)
+
+// A state variable filter shared by all the voices, like the SID's.
+// The filtertable sets it up at tick rate and it runs on the voices
+// that are routed through it every sample.
+struct Filter
+{
+    // Position in the filtertable or 0xFF when it isn't running
+    uint8_t tablePosition;
+
+    // Ticks left in the current modulation step
+    uint8_t modulationCountdown;
+
+    // Settings from the filtertable
+    uint8_t cutoff;
+    uint8_t type;       // FILTER_LOWPASS, FILTER_BANDPASS and/or FILTER_HIGHPASS
+    uint8_t resonance;  // 0 to 15
+    uint8_t routing;    // Bit 0 set to filter voice 0, bit 1 for voice 1...
+
+    // Coefficients worked out from the settings
+    uint8_t frequency;  // 2 * sin(pi * cutoff / BITRATE) as 0.8 fixed point
+    uint8_t damping;    // 1 / Q as 1.7 fixed point
+
+    // Filter state, scaled up by FILTER_INPUT_SHIFT
+    int16_t low;
+    int16_t band;
+} gFilter;
+
+#if VOICE_OUTPUT
+// What the filter added to the last sample. Along with gVoiceOutput,
+// which is 0 for voices that go through the filter, it adds up to the
+// mix.
+int8_t gFilterOutput;
+#endif
 
 struct Voice
 {
@@ -107,14 +355,16 @@ struct Instrument
     uint8_t vibratoDelay;    // +6      byte    Vibrato delay
     uint8_t gateoffTime;     // +7      byte    Gateoff timer
     uint8_t hardRestart;     // +8      byte    Hard restart/1st frame waveform
+#if !COMPILED_SONG
     char    name[16];        // +9      16      Instrument name
+#endif
 } const *gInstruments;
 
 #if TEST_MODE
 const struct Instrument FakeInstruments[] PROGMEM =
 {
-    {0x00, 0xF0, 0, 0, 0, 0, 0, 0, 0, "TestInstrument"},
-    {0x56, 0x78, 0, 0, 0, 0, 0, 0, 0, "TI2"},
+    {0x00, 0xF0, 0, 0, 0, 0, 0, 0, 0},
+    {0x56, 0x78, 0, 0, 0, 0, 0, 0, 0},
 };
     
 void EnableFakeInstruments()
@@ -123,6 +373,8 @@ void EnableFakeInstruments()
 }
 #endif
 
+uint8_t gNumInstruments;
+
 uint8_t *gWavetable, *gPulsetable, *gFiltertable, *gSpeedtable;
 uint8_t gWavetableSize, gPulsetableSize, gFiltertableSize, gSpeedtableSize;
 
@@ -138,8 +390,13 @@ struct Track
     uint8_t currentNote;
     uint8_t originalNote;
     
-    // Pointer to the current position in the song data
-    const char *songPosition;
+    // Pointer to the current position in the pattern data
+    PatternPosition songPosition;
+
+#if COMPILED_SONG
+    // How far into a run of empty rows the position is
+    uint8_t emptyRow;
+#endif
     
     // The number of times remaining to repeat the current pattern before
     // moving to the next one
@@ -167,30 +424,266 @@ struct Track
     
     // Countdown until the next step in the pattern data
     uint8_t trackStepCountdown;
-} gTrackData[3];
+} gTrackData[NUM_CHANNELS];
         
 // Start of the song data -- only needed for testing 
 // by printing the offsets
 const char *gSongData;
 
+// Works out what a row from the song data does
+void DecodePatternRow(const char *data, struct PatternRow *row)
+{
+    uint8_t note = pgm_read_byte(data);
+    uint8_t command = pgm_read_byte(data + 2);
+    uint8_t parameter = pgm_read_byte(data + 3);
+
+    row->instrument = pgm_read_byte(data + 1);
+    row->note = 0;
+
+    if (note >= 0x60 && note <= 0xBC)
+    {
+        // In testing, I have to subtract 0x68 to get the key I expect
+        row->action = RowKeyOn;
+        row->note = note - 0x68;
+    }
+    else if (note == 0xBE)
+    {
+        row->action = RowKeyOff;
+    }
+    else if (note == 0xFF)
+    {
+        row->action = RowPatternEnd;
+    }
+    else
+    {
+        row->action = RowNone;
+    }
+
+    row->command = CommandNone;
+    row->parameter = parameter;
+    
+    switch (command)
+    {
+        case 0x0F: // Set tempo
+            if (parameter >= 0x80)
+            {
+                // Set the tempo for just this channel
+                row->command = CommandSetChannelTempo;
+                row->parameter = parameter - 0x80;
+            }
+            else
+            {
+                row->command = CommandSetGlobalTempo;
+            }
+            break;
+    }
+}
+
+// Gets the row at the given position in the pattern data.
+// buffer is only used if the row needs to be decoded.
+static inline const struct PatternRow *ReadPatternRow(PatternPosition position, struct PatternRow *buffer)
+{
+#if COMPILED_SONG
+    if (PATTERN_BYTE(position) == EMPTY_ROWS_MARKER)
+    {
+        memset(buffer, 0, sizeof(struct PatternRow));
+        return buffer;
+    }
+    PATTERN_COPY(buffer, position, sizeof(struct PatternRow));
+    return buffer;
+#elif PREDECODE_PATTERNS
+    return position;
+#else
+    DecodePatternRow(position, buffer);
+    return buffer;
+#endif
+}
+
+// Moves a track on to the next row of its pattern. In a compiled song
+// that's at most two more bytes read from flash per row. Since a run of
+// empty rows is never the last thing in a pattern, emptyRow is always 0
+// again by the time the track moves to another pattern.
+static inline void NextPatternRow(struct Track *track)
+{
+#if COMPILED_SONG
+    if (PATTERN_BYTE(track->songPosition) == EMPTY_ROWS_MARKER)
+    {
+        track->emptyRow++;
+        if (track->emptyRow < PATTERN_BYTE(track->songPosition + 1))
+        {
+            return;
+        }
+        track->emptyRow = 0;
+        track->songPosition += 2;
+        return;
+    }
+    track->songPosition += sizeof(struct PatternRow);
+#else
+    track->songPosition += PATTERN_ROW_SIZE;
+#endif
+}
+
+// Silences the voices and the filter and starts the next tick a whole
+// tick from now
+void ResetSynthesizer()
+{
+    memset(channels, 0, sizeof(channels));
+    memset(&gFilter, 0, sizeof(gFilter));
+    gFilter.tablePosition = 0xFF;
+    gNoise = NOISE_SEED;
+    vbiCount = VBI_COUNT;
+    gNextOutputValue = 0;
+}
+
+// Puts all the channels at the start of a subtune, silencing
+// anything that was playing. The song has to be initialized already.
+// Returns 0 if the song doesn't have that subtune.
+int StartSubtune(uint8_t subtune)
+{
+    if (subtune >= gNumSubtunes)
+    {
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
+        print("No subtune ");
+        print8int(subtune);
+        print("\n");
+#endif
+        return 0;
+    }
+
+    gSubtune = subtune;
+
+    // Start from the same state every time so a subtune always sounds
+    // the same no matter what played before it
+    ResetSynthesizer();
+    memset(gTrackData, 0, sizeof(gTrackData));
+
+    for (uint8_t channel = 0 ; channel < NUM_CHANNELS ; channel++)
+    {
+        // Start each channel at the first pattern in the order list
+        gTrackData[channel].orderlistPosition = 0;
+        gTrackData[channel].instrumentNumber = -1;
+        gTrackData[channel].wavetablePosition = 0xFF;
+        gTrackData[channel].semitoneOffset = 0;
+        gTrackData[channel].tempo = DEFAULT_TEMPO;
+        gTrackData[channel].trackStepCountdown = DEFAULT_TEMPO;
+        
+        uint8_t patternNumber;
+        do
+        {
+            // Get the pattern number from the current position
+            patternNumber = SONG_BYTE(ORDERLIST(gSubtune, channel) + gTrackData[channel].orderlistPosition);
+            if (patternNumber >= 0xD0 && patternNumber <= 0xDF)
+            {
+                gTrackData[channel].orderlistPosition++;
+                uint8_t repeatCount = patternNumber & 0x0F;
+                if (repeatCount == 0)
+                {
+                    repeatCount = 16;
+                }
+                gTrackData[channel].patternRepeatCountdown = repeatCount;
+            }
+            else if (patternNumber >= 0xE0 && patternNumber <= 0xFE)
+            {
+                // Handle transpose codes
+                gTrackData[channel].orderlistPosition++;
+                
+                // Convert 0xE0 (224) through 0xFE (254) to -15 through 15
+                gTrackData[channel].semitoneOffset = patternNumber - 0xF0;
+
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+                print("Transpose channel ");
+                print8int(channel);
+                print(" ");
+                print8int(gTrackData[channel].semitoneOffset);
+                print("\n");
+#endif
+            }
+        } while (patternNumber >= 0xD0);
+        
+        // Start each channel at the first song position for each pattern
+        gTrackData[channel].songPosition = PATTERN(patternNumber);
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+        print("Channel ");
+        print8int(channel);
+        print(" Initial Pattern: ");
+        print8int(patternNumber);
+        print("\n");
+#endif
+    }
+
+    return 1;
+}
+
+#if COMPILED_SONG
+int InitializeSong(const char *songdata)
+{
+    const struct CompiledSong *song = (const struct CompiledSong *)songdata;
+    gSongData = songdata;
+
+#if LOG_LEVEL >= LOG_LEVEL_INFO
+    print("\n\n\n******** Initializing *******\n\n");
+#endif
+
+    if (SONG_DWORD(&song->magic) != COMPILED_SONG_MAGIC)
+    {
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
+        print("Song wasn't compiled by songc\n");
+#endif
+        return 0;
+    }
+
+    gNumSubtunes = SONG_BYTE(&song->numSubtunes);
+    gNumInstruments = SONG_BYTE(&song->numInstruments);
+    gNumPatterns = SONG_BYTE(&song->numPatterns);
+    gWavetableSize = SONG_BYTE(&song->wavetableSize);
+    gPulsetableSize = SONG_BYTE(&song->pulsetableSize);
+    gFiltertableSize = SONG_BYTE(&song->filtertableSize);
+    gSpeedtableSize = SONG_BYTE(&song->speedtableSize);
+
+    gOrderlistOffsets = (const uint16_t *)(songdata + SONG_WORD(&song->orderlistOffsets));
+    gPatternOffsets = (const uint16_t *)(songdata + SONG_WORD(&song->patternOffsets));
+    gInstruments = (const struct Instrument *)(songdata + SONG_WORD(&song->instruments));
+    gWavetable = (uint8_t *)(songdata + SONG_WORD(&song->wavetable));
+    gPulsetable = (uint8_t *)(songdata + SONG_WORD(&song->pulsetable));
+    gFiltertable = (uint8_t *)(songdata + SONG_WORD(&song->filtertable));
+    gSpeedtable = (uint8_t *)(songdata + SONG_WORD(&song->speedtable));
+
+#if LOG_LEVEL >= LOG_LEVEL_INFO
+    print("Compiled song: ");
+    print8int(gNumSubtunes);
+    print(" subtunes, ");
+    print8int(gNumInstruments);
+    print(" instruments, ");
+    print8int(gNumPatterns);
+    print(" patterns\n");
+#endif
+
+    return StartSubtune(0);
+}
+#else
 int InitializeSong(const char *songdata)
 {
     const char *data = songdata;
     gSongData = songdata;
     
+#if LOG_LEVEL >= LOG_LEVEL_INFO
     print("\n\n\n******** Initializing *******\n\n");
+#endif
     
     uint32_t header = pgm_read_dword(data);
     if (header != 0x35535447)
     {
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
         print("Header is not from GoatTracker\n");
+#endif
         return 0;
     }
     data += 4;
     
-    print("Found GoatTracker header\n");
-
     int i;
+
+#if LOG_LEVEL >= LOG_LEVEL_INFO
+    print("Found GoatTracker header\n");
     
     char name[32];
     for (i = 0 ; i < 32 ; i++)
@@ -216,61 +709,68 @@ int InitializeSong(const char *songdata)
     print("Copyright: ");
     print(name);
     print("\n");
+#else
+    // Skip the song name, author and copyright
+    data += 3 * 32;
+#endif
 
     uint8_t numSubtunes = pgm_read_byte(data++);
+#if LOG_LEVEL >= LOG_LEVEL_INFO
     print("# subtunes: ");
     print8int(numSubtunes);
+    print("\n");
+#endif
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
     if (numSubtunes > MAX_SUBTUNES)
     {
-        print(" ****** ERROR: > MAX_SUBTUNES ******");
+        print("****** ERROR: > MAX_SUBTUNES ******\n");
     }
-    print("\n");
+#endif
 
-    for(int subtune = 0 ; subtune < numSubtunes ; subtune++)
+    gNumSubtunes = numSubtunes;
+    if (gNumSubtunes > MAX_SUBTUNES)
     {
-        // TODO: Handle multiple subtunes
-        uint8_t size = pgm_read_byte(data++);
-        orderlist[subtune][0] = data;
-        data += size + 1;
-
-        print("Subtune ");
-        print8int(i);
-        print(" Orderlist 1 Size ");
-        print8int(size);
-        print("\n");
-
-        size = pgm_read_byte(data++);
-        orderlist[subtune][1] = data;
-        data += size + 1;
-
-        print("Subtune ");
-        print8int(i);
-        print(" Orderlist 2 Size ");
-        print8int(size);
-        print("\n");
+        gNumSubtunes = MAX_SUBTUNES;
+    }
 
-        size = pgm_read_byte(data++);
-        orderlist[subtune][2] = data;
-        data += size + 1;
-        
-        print("Subtune ");
-        print8int(i);
-        print(" Orderlist 3 Size ");
-        print8int(size);
-        print("\n");
+    for(int subtune = 0 ; subtune < numSubtunes ; subtune++)
+    {
+        for (uint8_t channel = 0 ; channel < NUM_CHANNELS ; channel++)
+        {
+            uint8_t size = pgm_read_byte(data++);
+#if !SONG_INDEX_IN_PROGMEM
+            if (subtune < MAX_SUBTUNES)
+            {
+                orderlist[subtune][channel] = data;
+            }
+#endif
+            data += size + 1;
+
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+            print("Subtune ");
+            print8int(subtune);
+            print(" Orderlist ");
+            print8int(channel + 1);
+            print(" Size ");
+            print8int(size);
+            print("\n");
+#endif
+        }
     }
 
-    uint8_t numInstruments = pgm_read_byte(data++);
+    gNumInstruments = pgm_read_byte(data++);
+#if LOG_LEVEL >= LOG_LEVEL_INFO
     print("Number of instruments: ");
-    print8int(numInstruments);
+    print8int(gNumInstruments);
     print("\n");
+#endif
 
     gInstruments = (struct Instrument *)data;
+    data += gNumInstruments * 25;
 
-    for (i = 0 ; i < numInstruments ; i++)
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+    for (i = 0 ; i < gNumInstruments ; i++)
     {
-        data += 25;
-        
         uint8_t ad = pgm_read_byte(&gInstruments[i].attackDecay);
         uint8_t sr = pgm_read_byte(&gInstruments[i].sustainRelease);
         uint8_t waveOffset = pgm_read_byte(&gInstruments[i].waveOffset);
@@ -290,12 +790,16 @@ int InitializeSong(const char *songdata)
         print8int(waveOffset);
         print("\n");
     }
+#endif
     
     gWavetableSize = pgm_read_byte(data++);
+#if LOG_LEVEL >= LOG_LEVEL_INFO
     print("Wavetable Size: ");
     print8int(gWavetableSize);
     print("\n");
+#endif
     gWavetable = (uint8_t *)data;
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
     for (i = 0 ; i < gWavetableSize ; i++)
     {
         print("0x");
@@ -308,39 +812,90 @@ int InitializeSong(const char *songdata)
         print8hex(value);
         print("\n");        
     }
+#endif
     data += gWavetableSize * 2;
 
     gPulsetableSize = pgm_read_byte(data++);
+#if LOG_LEVEL >= LOG_LEVEL_INFO
     print("Pulsetable Size: ");
     print8int(gPulsetableSize);
     print("\n");
+#endif
     gPulsetable = (uint8_t *)data;
     data += gPulsetableSize * 2;
 
     gFiltertableSize = pgm_read_byte(data++);
+#if LOG_LEVEL >= LOG_LEVEL_INFO
     print("Filtertable Size: ");
     print8int(gFiltertableSize);
     print("\n");
+#endif
     gFiltertable = (uint8_t *)data;
     data += gFiltertableSize * 2;
 
     gSpeedtableSize = pgm_read_byte(data++);
+#if LOG_LEVEL >= LOG_LEVEL_INFO
     print("Speedtable Size: ");
     print8int(gSpeedtableSize);
     print("\n");
+#endif
     gSpeedtable = (uint8_t *)data;
     data += gSpeedtableSize * 2;
 
-    uint8_t numPatterns = pgm_read_byte(data++);
+    gNumPatterns = pgm_read_byte(data++);
+#if LOG_LEVEL >= LOG_LEVEL_INFO
     print("Number Patterns: ");
-    print8int(numPatterns);
+    print8int(gNumPatterns);
     print("\n");
+#endif
+
+#if SONG_INDEX_IN_PROGMEM
+    if (gNumPatterns != SONG_NUM_PATTERNS || gNumSubtunes != SONG_NUM_SUBTUNES)
+    {
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
+        print("Song index doesn't match the song data\n");
+#endif
+        return 0;
+    }
+#endif
 
-    for(i = 0 ; i < numPatterns ; i++)
+#if PREDECODE_PATTERNS
+    // Count the rows in all the patterns so they can be decoded
+    // into a single block
+    const char *patternData = data;
+    uint32_t totalRows = 0;
+    for(i = 0 ; i < gNumPatterns ; i++)
+    {
+        uint8_t length = pgm_read_byte(patternData);
+        totalRows += length;
+        patternData += 1 + 4*length;
+    }
+
+    struct PatternRow *rows = realloc(gDecodedRows, totalRows * sizeof(struct PatternRow));
+    if (rows == NULL)
+    {
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
+        print("Not enough memory to decode the patterns\n");
+#endif
+        return 0;
+    }
+    gDecodedRows = rows;
+#endif
+
+    for(i = 0 ; i < gNumPatterns ; i++)
     {
         uint8_t length = pgm_read_byte(data++);
+#if PREDECODE_PATTERNS
+        pattern[i] = rows;
+        for (uint8_t row = 0 ; row < length ; row++)
+        {
+            DecodePatternRow(data + 4*row, rows++);
+        }
+#elif !SONG_INDEX_IN_PROGMEM
         pattern[i] = data;
+#endif
         
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
         print("Pattern ");
         print8int(i);
         print(": Rows ");
@@ -350,66 +905,19 @@ int InitializeSong(const char *songdata)
         printf("0x%X", data - gSongData);
 #endif
         print("\n");
+#endif
 
         data += 4*length;
     }
 
-    // Initializa the song to get ready to play
-    for (uint8_t channel = 0 ; channel < 3 ; channel++)
-    {
-        // Start each channel at the first pattern in the order list
-        gTrackData[channel].orderlistPosition = 0;
-        gTrackData[channel].instrumentNumber = -1;
-        gTrackData[channel].wavetablePosition = 0xFF;
-        gTrackData[channel].semitoneOffset = 0;
-        gTrackData[channel].tempo = DEFAULT_TEMPO;
-        gTrackData[channel].trackStepCountdown = DEFAULT_TEMPO;
-        
-        uint8_t patternNumber;
-        do
-        {
-            // Get the pattern number from the current position
-            patternNumber = pgm_read_byte(orderlist[0][channel] + gTrackData[channel].orderlistPosition);
-            if (patternNumber >= 0xD0 && patternNumber <= 0xDF)
-            {
-                gTrackData[channel].orderlistPosition++;
-                uint8_t repeatCount = patternNumber & 0x0F;
-                if (repeatCount == 0)
-                {
-                    repeatCount = 16;
-                }
-                gTrackData[channel].patternRepeatCountdown = repeatCount;
-            }
-            else if (patternNumber >= 0xE0 && patternNumber <= 0xFE)
-            {
-                // Handle transpose codes
-                gTrackData[channel].orderlistPosition++;
-                
-                // Convert 0xE0 (224) through 0xFE (254) to -15 through 15
-                gTrackData[channel].semitoneOffset = patternNumber - 0xF0;
-
-                print("Transpose channel ");
-                print8int(channel);
-                print(" ");
-                print8int(gTrackData[channel].semitoneOffset);
-                print("\n");
-            }
-        } while (patternNumber >= 0xD0);
-        
-        // Start each channel at the first song position for each pattern
-        gTrackData[channel].songPosition = pattern[patternNumber];
-        print("Channel ");
-        print8int(channel);
-        print(" Initial Pattern: ");
-        print8int(patternNumber);
-        print("\n");
-    }
-
-	return 1;
+    return StartSubtune(0);
 }
+#endif
 
 void KeyOn(uint8_t channel, uint8_t key, uint8_t instrument)
 {
+    TRACE_EVENT(TraceKeyOn(channel, key, instrument));
+
     instrument--;
     
 #if 0
@@ -421,8 +929,8 @@ void KeyOn(uint8_t channel, uint8_t key, uint8_t instrument)
     print8int(key);
 #endif
 
-    channels[channel].attackDecay = pgm_read_byte(&gInstruments[instrument].attackDecay);
-    channels[channel].sustainRelease = pgm_read_byte(&gInstruments[instrument].sustainRelease);
+    channels[channel].attackDecay = SONG_BYTE(&gInstruments[instrument].attackDecay);
+    channels[channel].sustainRelease = SONG_BYTE(&gInstruments[instrument].sustainRelease);
     channels[channel].fadeAmount = 32;
     channels[channel].phaseStepCountdown = AttackCycles[(channels[channel].attackDecay & 0xF0) >> 4];
     channels[channel].envelopePhase = Off;
@@ -430,8 +938,8 @@ void KeyOn(uint8_t channel, uint8_t key, uint8_t instrument)
     gTrackData[channel].instrumentNumber = instrument;
     gTrackData[channel].originalNote = key;
     
-    gTrackData[channel].wavetablePosition = pgm_read_byte(&gInstruments[instrument].waveOffset);
-    gTrackData[channel].pulsetablePosition = pgm_read_byte(&gInstruments[instrument].pulseOffset);
+    gTrackData[channel].wavetablePosition = SONG_BYTE(&gInstruments[instrument].waveOffset);
+    gTrackData[channel].pulsetablePosition = SONG_BYTE(&gInstruments[instrument].pulseOffset);
     
     // Positions are stored as 1 based, but the table data itself is stored 0 based
     gTrackData[channel].wavetablePosition--;
@@ -449,7 +957,16 @@ void KeyOn(uint8_t channel, uint8_t key, uint8_t instrument)
     print("\n");
 #endif
 
-    gTrackData[channel].speedtablePosition = pgm_read_byte(&gInstruments[instrument].speedOffset);
+    gTrackData[channel].speedtablePosition = SONG_BYTE(&gInstruments[instrument].speedOffset);
+
+    // There's only one filter, so an instrument with a filtertable
+    // takes it over from whatever was using it before
+    uint8_t filterOffset = SONG_BYTE(&gInstruments[instrument].filterOffset);
+    if (filterOffset != 0)
+    {
+        gFilter.tablePosition = filterOffset - 1;
+        gFilter.modulationCountdown = 0;
+    }
 
     // Reset the table positions (may not want to do this in the future depending on 
     // what the song specifies
@@ -462,589 +979,869 @@ void KeyOn(uint8_t channel, uint8_t key, uint8_t instrument)
 void KeyOff(uint8_t channel)
 {
     //printf("KeyOff(%u)\n", channel);
+    TRACE_EVENT(TraceKeyOff(channel));
     channels[channel].envelopePhase = Release;
     channels[channel].phaseStepCountdown = DecayReleaseCycles[channels[channel].sustainRelease & 0x0F];
 }
 
-// Returns TRUE when the song is finished
-int GoatPlayerTick()
+// Process one step of the wavetable for the given channel
+void WavetableStep(uint8_t channel)
 {
-    int songFinished = 0;
+    if (gTrackData[channel].wavetablePosition == 0xFF)
+    {
+        return;
+    }
     
-    // Handle the wavetable
-    for(uint8_t channel = 0 ; channel < 3 ; channel++)
+    if (gTrackData[channel].instrumentNumber < 0)
     {
-        if (gTrackData[channel].wavetablePosition == 0xFF)
-        {
-            continue;
-        }
-        
-        if (gTrackData[channel].instrumentNumber < 0)
-        {
-            continue;
-        }
-        
-        if (gTrackData[channel].wavetableDelay > 0)
-        {
-            gTrackData[channel].wavetableDelay--;
-            continue;
-        }
-        
+        return;
+    }
+    
+    if (gTrackData[channel].wavetableDelay > 0)
+    {
+        gTrackData[channel].wavetableDelay--;
+        return;
+    }
+    
 #if 0
-        print("Channel: ");
-        print8int(channel);
-        print(" Instrument: ");
-        print8int(gTrackData[channel].instrumentNumber);
-        print(" Wave Pos 0x");
-        print8hex(gTrackData[channel].wavetablePosition);
+    print("Channel: ");
+    print8int(channel);
+    print(" Instrument: ");
+    print8int(gTrackData[channel].instrumentNumber);
+    print(" Wave Pos 0x");
+    print8hex(gTrackData[channel].wavetablePosition);
 #endif
 
-        uint8_t leftSide = pgm_read_byte(&gWavetable[gTrackData[channel].wavetablePosition]);
-        uint8_t rightSide = pgm_read_byte(&gWavetable[gTrackData[channel].wavetablePosition + gWavetableSize]);
+    uint8_t position = gTrackData[channel].wavetablePosition;
+    uint8_t leftSide = 0;
+    uint8_t rightSide = 0;
+
+    // Positions past the end of the table read as empty entries, the
+    // same as the unused part of a table in GoatTracker
+    if (position < gWavetableSize)
+    {
+        leftSide = SONG_BYTE(&gWavetable[position]);
+        rightSide = SONG_BYTE(&gWavetable[position + gWavetableSize]);
+    }
+    TRACE_EVENT(TraceTableStep("Wavetable", channel, position, leftSide, rightSide));
 
 #if 0
-        print(" 0x");
-        print8hex(leftSide);
-        print(" ");
-        print8hex(rightSide);
-        print("\n");
+    print(" 0x");
+    print8hex(leftSide);
+    print(" ");
+    print8hex(rightSide);
+    print("\n");
 #endif
+    
+    if (leftSide >= 0x01 && leftSide <= 0x0F)
+    {
+        // Handle delay
+        gTrackData[channel].wavetableDelay = leftSide;
+    }
+    else if (leftSide == 0 || (leftSide >= 0x10 && leftSide <= 0xDF))
+    {
+        // Handle waveform value
         
-        if (leftSide >= 0x01 && leftSide <= 0x0F)
+        if (leftSide == 0)
         {
-            // Handle delay
-            gTrackData[channel].wavetableDelay = leftSide;
+            // If the left side is 0, process the right side
+            // according to the previous left side
+            leftSide = channels[channel].control; 
         }
-        else if (leftSide == 0 || (leftSide >= 0x10 && leftSide <= 0xDF))
+        else
         {
-            // Handle waveform value
-            
-            if (leftSide == 0)
+            channels[channel].control = leftSide;
+        }
+        
+        // TODO: Find a way to combine waveforms.
+        //       Or actually, do I really want to support this?
+        if (leftSide & (CONTROL_SAWTOOTH | CONTROL_TRIANGLE))
+        {
+            if (rightSide <= 0x5F)
             {
-                // If the left side is 0, process the right side
-                // according to the previous left side
-                leftSide = channels[channel].control; 
+                // Relative notes
+                gTrackData[channel].currentNote = gTrackData[channel].originalNote + rightSide;
             }
-            else
+            else if (rightSide <= 0x7F)
             {
-                channels[channel].control = leftSide;
+                // Negative relative notes
+                // TODO: Verify this algorithm is correct
+                gTrackData[channel].currentNote = gTrackData[channel].originalNote - (rightSide - 0x60);
             }
-            
-            // TODO: Find a way to combine waveforms.
-            //       Or actually, do I really want to support this?
-            if (leftSide & (CONTROL_SAWTOOTH | CONTROL_TRIANGLE))
+            else if (rightSide == 0x80)
             {
-                if (rightSide <= 0x5F)
-                {
-                    // Relative notes
-                    gTrackData[channel].currentNote = gTrackData[channel].originalNote + rightSide;
-                }
-                else if (rightSide <= 0x7F)
-                {
-                    // Negative relative notes
-                    // TODO: Verify this algorithm is correct
-                    gTrackData[channel].currentNote = gTrackData[channel].originalNote - (rightSide - 0x60);
-                }
-                else if (rightSide == 0x80)
-                {
-                    // Note unchanged
-                    gTrackData[channel].currentNote = gTrackData[channel].originalNote;
-                }
-                else if (rightSide <= 0xDF)
-                {
-                    // Absolute notes
-                    gTrackData[channel].currentNote = rightSide - 0x81;
-                }
-
-                //printf("Setting steps for SAWTRI, note %d\n", gTrackData[channel].currentNote);
-                
-                channels[channel].steps = pgm_read_word(&SAWTOOTH_TABLE[gTrackData[channel].currentNote]);
-                channels[channel].tableOffset = 0;
+                // Note unchanged
+                gTrackData[channel].currentNote = gTrackData[channel].originalNote;
             }
-            
-            if (leftSide & CONTROL_PULSE)
+            else if (rightSide <= 0xDF)
             {
-                if (rightSide <= 0x5F)
-                {
-                    gTrackData[channel].currentNote = gTrackData[channel].originalNote + rightSide;
-                }
-                else if (rightSide <= 0x7F)
-                {
-                    // TODO: Verify this algorithm is correct
-                    gTrackData[channel].currentNote = gTrackData[channel].originalNote - (rightSide - 0x60);
-                }
-                else if (rightSide == 0x80)
-                {
-                    gTrackData[channel].currentNote = gTrackData[channel].originalNote;
-                }
-                else if (rightSide <= 0xDF)
-                {
-                    gTrackData[channel].currentNote = rightSide - 0x81;
-                }
-                
-                //printf("Setting steps for PULSE, note %d\n", gTrackData[channel].currentNote);
-                
-                // Use the same table. We'll multiply the pulsetable value by 4 to scale
-                // it from 16.00 to 64.00
-                channels[channel].steps = pgm_read_word(&SAWTOOTH_TABLE[gTrackData[channel].currentNote]);
-                channels[channel].tableOffset = 0;
+                // Absolute notes
+                gTrackData[channel].currentNote = rightSide - 0x81;
             }
 
-            // TODO: Move all the handline of what happens with the
-            //       GATE to be in the SIDish part, not the player part
-            if (leftSide & CONTROL_GATE)
+            //printf("Setting steps for SAWTRI, note %d\n", gTrackData[channel].currentNote);
+            
+            channels[channel].steps = pgm_read_word(&SAWTOOTH_TABLE[gTrackData[channel].currentNote]);
+            channels[channel].tableOffset = 0;
+        }
+        
+        if (leftSide & CONTROL_PULSE)
+        {
+            if (rightSide <= 0x5F)
             {
-                if (channels[channel].envelopePhase == Off)
-                {
-                    channels[channel].envelopePhase = Attack;
-                }
+                gTrackData[channel].currentNote = gTrackData[channel].originalNote + rightSide;
             }
-            else
+            else if (rightSide <= 0x7F)
             {
-                if (channels[channel].envelopePhase != Off)
-                {
-                    KeyOff(channel);
-                }    
+                // TODO: Verify this algorithm is correct
+                gTrackData[channel].currentNote = gTrackData[channel].originalNote - (rightSide - 0x60);
             }
-        }
-        else if (leftSide == 0xFF)
-        {
-            if (rightSide == 0)
+            else if (rightSide == 0x80)
             {
-                //printf("Wavetable end\n");
-                gTrackData[channel].wavetablePosition = 0xFF;
+                gTrackData[channel].currentNote = gTrackData[channel].originalNote;
             }
-            else
+            else if (rightSide <= 0xDF)
             {
-                // rightSide is 1 based while the data is 0 based, so subtract 1
-                gTrackData[channel].wavetablePosition = rightSide - 1;
-                //print("Wavetable jump to 0x");
-                //print8hex(rightSide);
-                //print("\n");
+                gTrackData[channel].currentNote = rightSide - 0x81;
             }
             
-            continue;
+            //printf("Setting steps for PULSE, note %d\n", gTrackData[channel].currentNote);
+            
+            // Use the same table. We'll multiply the pulsetable value by 4 to scale
+            // it from 16.00 to 64.00
+            channels[channel].steps = pgm_read_word(&SAWTOOTH_TABLE[gTrackData[channel].currentNote]);
+            channels[channel].tableOffset = 0;
         }
-        
-        gTrackData[channel].wavetablePosition++;
-    }
-    
-    // Handle the pulsetable
-    for(uint8_t channel = 0 ; channel < 3 ; channel++)
-    {
-        if (gTrackData[channel].pulsetablePosition == 0xFF)
+
+        // TODO: Move all the handline of what happens with the
+        //       GATE to be in the SIDish part, not the player part
+        if (leftSide & CONTROL_GATE)
         {
-            continue;
+            if (channels[channel].envelopePhase == Off)
+            {
+                channels[channel].envelopePhase = Attack;
+            }
         }
-        
-        if (gTrackData[channel].instrumentNumber < 0)
+        else
         {
-            continue;
+            if (channels[channel].envelopePhase != Off)
+            {
+                KeyOff(channel);
+            }    
         }
-        
-        if (gTrackData[channel].pulseRepeatCountdown > 0)
+    }
+    else if (leftSide == 0xFF)
+    {
+        if (rightSide == 0)
         {
-            channels[channel].pulseWidth += gTrackData[channel].pulseChange; 
-            gTrackData[channel].pulseRepeatCountdown--;
-            //printf("Channel %u changing pulse by %d to %u\n", channel, gTrackData[channel].pulseChange, channels[channel].pulseWidth);
-            continue;
+            //printf("Wavetable end\n");
+            gTrackData[channel].wavetablePosition = 0xFF;
+        }
+        else
+        {
+            // rightSide is 1 based while the data is 0 based, so subtract 1
+            gTrackData[channel].wavetablePosition = rightSide - 1;
+            //print("Wavetable jump to 0x");
+            //print8hex(rightSide);
+            //print("\n");
         }
         
+        return;
+    }
+    
+    gTrackData[channel].wavetablePosition++;
+}
+
+// Process one step of the pulsetable for the given channel
+void PulsetableStep(uint8_t channel)
+{
+    if (gTrackData[channel].pulsetablePosition == 0xFF)
+    {
+        return;
+    }
+    
+    if (gTrackData[channel].instrumentNumber < 0)
+    {
+        return;
+    }
+    
+    if (gTrackData[channel].pulseRepeatCountdown > 0)
+    {
+        channels[channel].pulseWidth += gTrackData[channel].pulseChange; 
+        gTrackData[channel].pulseRepeatCountdown--;
+        //printf("Channel %u changing pulse by %d to %u\n", channel, gTrackData[channel].pulseChange, channels[channel].pulseWidth);
+        return;
+    }
+    
 #if 0
-        print("Channel: ");
-        print8int(channel);
-        print(" Instrument: ");
-        print8int(gTrackData[channel].instrumentNumber);
-        print(" Pulse Pos 0x");
-        print8hex(gTrackData[channel].pulsetablePosition);
+    print("Channel: ");
+    print8int(channel);
+    print(" Instrument: ");
+    print8int(gTrackData[channel].instrumentNumber);
+    print(" Pulse Pos 0x");
+    print8hex(gTrackData[channel].pulsetablePosition);
 #endif
 
-        uint8_t leftSide = pgm_read_byte(&gPulsetable[gTrackData[channel].pulsetablePosition]);
-        uint8_t rightSide = pgm_read_byte(&gPulsetable[gTrackData[channel].pulsetablePosition + gPulsetableSize]);
+    uint8_t position = gTrackData[channel].pulsetablePosition;
+    uint8_t leftSide = 0;
+    uint8_t rightSide = 0;
+
+    // Positions past the end of the table read as empty entries, the
+    // same as the unused part of a table in GoatTracker
+    if (position < gPulsetableSize)
+    {
+        leftSide = SONG_BYTE(&gPulsetable[position]);
+        rightSide = SONG_BYTE(&gPulsetable[position + gPulsetableSize]);
+    }
+    TRACE_EVENT(TraceTableStep("Pulsetable", channel, position, leftSide, rightSide));
 
 #if 0
-        print(" 0x");
-        print8hex(leftSide);
-        print(" ");
-        print8hex(rightSide);
-        print("\n");
-#endif
-        
-        if (leftSide == 0xFF)
-        {
-            if (rightSide == 0)
-            {
-                //print("Pulsetable end\n");
-                gTrackData[channel].pulsetablePosition = 0xFF;
-            }
-            else
-            {
-                gTrackData[channel].pulsetablePosition = rightSide;
-#if 0
-                print("Pulsetable jump to 0x");
-                print8hex(rightSide);
-                print("\n");
+    print(" 0x");
+    print8hex(leftSide);
+    print(" ");
+    print8hex(rightSide);
+    print("\n");
 #endif
-            }
-            
-            continue;
-            
-        }
-        else if (leftSide < 0x80)
+    
+    if (leftSide == 0xFF)
+    {
+        if (rightSide == 0)
         {
-            // Set pulse change parameters
-            //printf("Pulse change: 0x%02X %d\n", leftSide, (int8_t)rightSide);
-            
-            gTrackData[channel].pulseRepeatCountdown = leftSide;
-            gTrackData[channel].pulseChange = (int8_t) rightSide;
+            //print("Pulsetable end\n");
+            gTrackData[channel].pulsetablePosition = 0xFF;
         }
         else
         {
-            // Directly set the pulse width
-            channels[channel].pulseWidth = ((leftSide & 0x0F) << 8) | rightSide;
+            gTrackData[channel].pulsetablePosition = rightSide;
 #if 0
-            print("Set pulsewidth to 0x");
-            print8hex(leftSide & 0x0F);
+            print("Pulsetable jump to 0x");
             print8hex(rightSide);
             print("\n");
 #endif
         }
         
-        gTrackData[channel].pulsetablePosition++;
+        return;
+    }
+    else if (leftSide < 0x80)
+    {
+        // Set pulse change parameters
+        //printf("Pulse change: 0x%02X %d\n", leftSide, (int8_t)rightSide);
+        
+        gTrackData[channel].pulseRepeatCountdown = leftSide;
+        gTrackData[channel].pulseChange = (int8_t) rightSide;
+    }
+    else
+    {
+        // Directly set the pulse width
+        channels[channel].pulseWidth = ((leftSide & 0x0F) << 8) | rightSide;
+#if 0
+        print("Set pulsewidth to 0x");
+        print8hex(leftSide & 0x0F);
+        print8hex(rightSide);
+        print("\n");
+#endif
     }
     
-    // Handle the pattern data
-    for(uint8_t channel = 0; channel < 3 ; channel++)
+    gTrackData[channel].pulsetablePosition++;
+}
+
+// Works out the filter coefficients from the filtertable settings
+void UpdateFilterCoefficients()
+{
+    gFilter.frequency = pgm_read_byte(&FILTER_CUTOFF_TABLE[gFilter.cutoff]);
+
+    // From about 1.41 (no resonance) down to 0.24
+    gFilter.damping = 181 - 10 * gFilter.resonance;
+}
+
+// Reads an entry from the filtertable.
+// Positions past the end of the table read as empty entries, the
+// same as the unused part of a table in GoatTracker.
+static inline void ReadFiltertable(uint8_t position, uint8_t *leftSide, uint8_t *rightSide)
+{
+    *leftSide = 0;
+    *rightSide = 0;
+    if (position < gFiltertableSize)
+    {
+        *leftSide = SONG_BYTE(&gFiltertable[position]);
+        *rightSide = SONG_BYTE(&gFiltertable[position + gFiltertableSize]);
+    }
+}
+
+// Process one step of the filtertable. Unlike the other tables,
+// there's only one for all the channels.
+void FiltertableStep()
+{
+    uint8_t leftSide, rightSide;
+
+    if (gFilter.tablePosition == 0xFF)
     {
-        uint8_t note;
-        uint8_t command;
-        uint16_t data;
-        uint8_t instrument;
+        return;
+    }
+
+    ReadFiltertable(gFilter.tablePosition, &leftSide, &rightSide);
+    TRACE_EVENT(TraceTableStep("Filtertable", TRACE_NO_CHANNEL, gFilter.tablePosition, leftSide, rightSide));
 
-        gTrackData[channel].trackStepCountdown--;
-        if (gTrackData[channel].trackStepCountdown > 0)
+    if (leftSide == 0xFF)
+    {
+        // Jump, which takes effect right away. rightSide is 1 based and
+        // 0 stops the table, which conveniently becomes 0xFF.
+        gFilter.tablePosition = rightSide - 1;
+        if (gFilter.tablePosition == 0xFF)
         {
-            continue;
+            return;
         }
-        
-        gTrackData[channel].trackStepCountdown = gTrackData[channel].tempo;
+        ReadFiltertable(gFilter.tablePosition, &leftSide, &rightSide);
+    }
 
-        do
+    if (gFilter.modulationCountdown == 0)
+    {
+        if (leftSide == 0x00)
         {
-            note = pgm_read_byte(gTrackData[channel].songPosition);
-            instrument = pgm_read_byte(gTrackData[channel].songPosition + 1);
-            command = pgm_read_byte(gTrackData[channel].songPosition + 2);
-            data = pgm_read_byte(gTrackData[channel].songPosition + 3);
-#if 0
-            printf("Channel %u (0x%X): %02X %02X %X %02X\n", channel,
-                gTrackData[channel].songPosition - gSongData, note, instrument, command, data);
-#endif
-       
-            switch (command)
+            // Set cutoff
+            gFilter.cutoff = rightSide;
+            gFilter.tablePosition++;
+        }
+        else if (leftSide >= 0x80)
+        {
+            // Set filter parameters
+            gFilter.type = leftSide & (FILTER_LOWPASS | FILTER_BANDPASS | FILTER_HIGHPASS);
+            gFilter.resonance = rightSide >> 4;
+            // The 4th voice bit is ignored like the 4th voice itself
+            gFilter.routing = rightSide & ((1 << NUM_CHANNELS) - 1);
+            gFilter.tablePosition++;
+
+            // Usually followed by the cutoff, which is set at the same time
+            ReadFiltertable(gFilter.tablePosition, &leftSide, &rightSide);
+            if (leftSide == 0x00)
             {
-                case 0x0F: // Set tempo
-                    if (data >= 0x80)
-                    {
-                        print("Set tempo, channel ");
-                        print8int(channel);
-                        print(": 0x");
-                        print8hex(data - 0x80);
-                        print("\n");
-
-                        // Set the tempo for just this channel
-                        gTrackData[channel].tempo = data - 0x80;
-                    }
-                    else
-                    {
-                        print("Set global tempo: ");
-                        print8hex((uint8_t)data);
-                        print("\n");
-                        for (int i = 0 ; i < 3 ; i++)
-                        {
-                            gTrackData[i].tempo = (uint8_t)data;
-                        }
-                    }
-                    break;
+                gFilter.cutoff = rightSide;
+                gFilter.tablePosition++;
             }
+        }
+        else
+        {
+            // Start a modulation step
+            gFilter.modulationCountdown = leftSide;
+        }
+    }
+
+    if (gFilter.modulationCountdown > 0)
+    {
+        gFilter.cutoff += rightSide;
+        gFilter.modulationCountdown--;
+        if (gFilter.modulationCountdown == 0)
+        {
+            gFilter.tablePosition++;
+        }
+    }
+
+    UpdateFilterCoefficients();
+}
+
+// Process the pattern data for the given channel
+// Returns TRUE when the song is finished
+int PatternStep(uint8_t channel)
+{
+    int songFinished = 0;
+    const struct PatternRow *row;
+    struct PatternRow rowBuffer;
+
+    gTrackData[channel].trackStepCountdown--;
+    if (gTrackData[channel].trackStepCountdown > 0)
+    {
+        return 0;
+    }
+    
+#if SONG_SOURCE_SD
+    // Rather than wait for the card in the middle of a sample, the row
+    // is read on the next tick if the cache hasn't caught up yet
+    if (!SongSourceRowReady(channel))
+    {
+        gTrackData[channel].trackStepCountdown = 1;
+        return 0;
+    }
+#endif
+
+    gTrackData[channel].trackStepCountdown = gTrackData[channel].tempo;
+    TRACE_EVENT(TraceRowBegin(channel));
+
+    do
+    {
+        row = ReadPatternRow(gTrackData[channel].songPosition, &rowBuffer);
+#if 0
+        printf("Channel %u: %u %02X %02X %u %02X\n", channel,
+            row->action, row->note, row->instrument, row->command, row->parameter);
+#endif
+   
+        switch (row->command)
+        {
+            case CommandSetChannelTempo:
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+                print("Set tempo, channel ");
+                print8int(channel);
+                print(": 0x");
+                print8hex(row->parameter);
+                print("\n");
+#endif
+
+                // Set the tempo for just this channel
+                gTrackData[channel].tempo = row->parameter;
+                break;
+
+            case CommandSetGlobalTempo:
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+                print("Set global tempo: ");
+                print8hex(row->parameter);
+                print("\n");
+#endif
+                for (int i = 0 ; i < NUM_CHANNELS ; i++)
+                {
+                    gTrackData[i].tempo = row->parameter;
+                }
+                break;
+        }
+        
+        if (row->action == RowKeyOn)
+        {
+            // Transpose for the current orderlist setting
+            uint8_t note = row->note + gTrackData[channel].semitoneOffset;
             
-            if (note >= 0x60 && note <= 0xBC)
-            {
-                // In testing, I have to subtract 0x68 to get the key I expect
-                note -= 0x68;
-                
-                // Transpose for the current orderlist setting
-                note += gTrackData[channel].semitoneOffset;
-                
-                KeyOn(channel, note, instrument);
+            KeyOn(channel, note, row->instrument);
 
-                // printf("NOTE ON -- Channel %u Note: %u Instrument: %u\n", channel, note, instrument);
-            }
-            else if (note == 0xBE)
+            // printf("NOTE ON -- Channel %u Note: %u Instrument: %u\n", channel, note, row->instrument);
+        }
+        else if (row->action == RowKeyOff)
+        {
+            KeyOff(channel);
+        }
+        else if (row->action == RowPatternEnd)
+        {
+            if (gTrackData[channel].patternRepeatCountdown > 0)
             {
-                KeyOff(channel);
+                gTrackData[channel].patternRepeatCountdown -= 1;
+                uint8_t patternNumber = SONG_BYTE(ORDERLIST(gSubtune, channel) + gTrackData[channel].orderlistPosition);
+                gTrackData[channel].songPosition = PATTERN(patternNumber);
+                continue;
             }
-            else if (note == 0xFF)
+            
+            gTrackData[channel].orderlistPosition++;
+            
+            uint8_t patternNumber;
+            do
             {
-                if (gTrackData[channel].patternRepeatCountdown > 0)
+                // Get the pattern number from the current position
+                patternNumber = SONG_BYTE(ORDERLIST(gSubtune, channel) + gTrackData[channel].orderlistPosition);
+
+                if (patternNumber >= 0xD0 && patternNumber <= 0xDF)
+                {
+                    gTrackData[channel].orderlistPosition++;
+                    uint8_t repeatCount = patternNumber & 0x0F;
+                    if (repeatCount == 0)
+                    {
+                        repeatCount = 16;
+                    }
+                    gTrackData[channel].patternRepeatCountdown = repeatCount;
+                }
+                else if (patternNumber >= 0xE0 && patternNumber <= 0xFE)
                 {
-                    gTrackData[channel].patternRepeatCountdown -= 1;
-                    uint8_t patternNumber = pgm_read_byte(orderlist[0][channel] + gTrackData[channel].orderlistPosition);
-                    gTrackData[channel].songPosition = pattern[patternNumber];
-                    continue;
+                    // Handle transpose codes!
+                    gTrackData[channel].orderlistPosition++;
+                               
+                    // Convert 0xE0 (224) through 0xFE (254) to -15 through 15
+                    gTrackData[channel].semitoneOffset = patternNumber - 0xF0;
+
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+                    print("Transpose channel ");
+                    print8int(channel);
+                    print(" ");
+                    print8int(gTrackData[channel].semitoneOffset);
+                    print("\n");
+#endif
                 }
-                
-                gTrackData[channel].orderlistPosition++;
-                
-                uint8_t patternNumber;
-                do
+                else if (patternNumber == 0xFF)
                 {
-                    // Get the pattern number from the current position
-                    patternNumber = pgm_read_byte(orderlist[0][channel] + gTrackData[channel].orderlistPosition);
+                    gTrackData[channel].orderlistPosition++;
+                    patternNumber = SONG_BYTE(ORDERLIST(gSubtune, channel) + gTrackData[channel].orderlistPosition);
+
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+                    print("END ");
+                    print8int(channel);
+                    print(" Next ");
+                    print8int(patternNumber);
+                    print("\n");
+#endif
 
-                    if (patternNumber >= 0xD0 && patternNumber <= 0xDF)
-                    {
-                        gTrackData[channel].orderlistPosition++;
-                        uint8_t repeatCount = patternNumber & 0x0F;
-                        if (repeatCount == 0)
-                        {
-                            repeatCount = 16;
-                        }
-                        gTrackData[channel].patternRepeatCountdown = repeatCount;
-                    }
-                    else if (patternNumber >= 0xE0 && patternNumber <= 0xFE)
-                    {
-                        // Handle transpose codes!
-                        gTrackData[channel].orderlistPosition++;
-                                   
-                        // Convert 0xE0 (224) through 0xFE (254) to -15 through 15
-                        gTrackData[channel].semitoneOffset = patternNumber - 0xF0;
-
-                        print("Transpose channel ");
-                        print8int(channel);
-                        print(" ");
-                        print8int(gTrackData[channel].semitoneOffset);
-                        print("\n");
-                    }
-                    else if (patternNumber == 0xFF)
-                    {
-                        gTrackData[channel].orderlistPosition++;
-                        patternNumber = pgm_read_byte(orderlist[0][channel] + gTrackData[channel].orderlistPosition);
+                    gTrackData[channel].orderlistPosition = patternNumber;
 
-                        print("END ");
-                        print8int(channel);
-                        print(" Next ");
-                        print8int(patternNumber);
-                        print("\n");
+                    songFinished = 1;
+                }
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+                else
+                {
+                    print("Next ");
+                    print8int(channel);
+                    print(": ");
+                    print8int(patternNumber);
+                    print("\n");
+                }
+#endif
+                
+                gTrackData[channel].songPosition = PATTERN(patternNumber);
+            } while (patternNumber >= 0xD0);
+        }
+    } while (row->action == RowPatternEnd);
 
-                        gTrackData[channel].orderlistPosition = patternNumber;
+    // TODO: Handle all the rest of the interesting parts
+    NextPatternRow(&gTrackData[channel]);
 
-                        songFinished = 1;
-                    }
-                    else
-                    {
-                        print("Next ");
-                        print8int(channel);
-                        print(": ");
-                        print8int(patternNumber);
-                        print("\n");
-                    }
-                    
-                    gTrackData[channel].songPosition = pattern[patternNumber];
-                } while (patternNumber >= 0xD0);
-            }
-        } while (note == 0xFF);
+    TRACE_EVENT(TraceRowEnd(channel, row->action, row->note, row->instrument, row->command));
 
-        // TODO: Handle all the rest of the interesting parts
-        //printf("Channel %u song position: 0x%p + 4 = ", channel, gTrackData[channel].songPosition);
-        gTrackData[channel].songPosition += 4;
-        //printf("0x%p\n", gTrackData[channel].songPosition);
+    return songFinished;
+}
+
+// Process the instrument tables (but not the pattern data)
+// for every channel. Used directly when something other than
+// the pattern data (such as a MIDI file) is triggering the notes.
+int TableTick()
+{
+    for(uint8_t channel = 0 ; channel < NUM_CHANNELS ; channel++)
+    {
+        WavetableStep(channel);
+    }
+    
+    for(uint8_t channel = 0 ; channel < NUM_CHANNELS ; channel++)
+    {
+        PulsetableStep(channel);
     }
 
-    return songFinished;
+    FiltertableStep();
+
+    return 0;
 }
 
-int OutputAudioAndCalculateNextByte(void)
+// Returns TRUE when the song is finished, with a bit set for each
+// channel that reached the end of its orderlist, so that a host tool
+// counting loops can follow one channel
+int GoatPlayerTick()
 {
-    OutputByte(gNextOutputValue);
+    int songFinished = 0;
 
-    int8_t outputValue = 0;
-    int8_t wrap = 0;
+    TRACE_EVENT(TraceTickBegin());
     
-    // 4 channels are actually supported, but since GoatTracker
-    // only supports 3 and I need more cycles, only process 3
-    // of them.
+    TableTick();
+
+    for(uint8_t channel = 0; channel < NUM_CHANNELS ; channel++)
+    {
+        if (PatternStep(channel))
+        {
+            songFinished |= 1 << channel;
+        }
+    }
+
+    TRACE_EVENT(TraceTickEnd());
+
+    return songFinished;
+}
+
+// Called for every tick of the player. Defaults to playing the
+// song pattern data, but can be switched to drive the synthesizer
+// from another source.
+int (*gTickFunction)(void) = GoatPlayerTick;
+
+// Multiplies by a 0.8 fixed point coefficient.
+// Split up into the 8x8 multiplies the ATmega has in hardware
+// instead of a 16x16 one. The low byte's product needs all 16 bits,
+// so it's kept unsigned for the ATmega's 16 bit int.
+static inline int16_t MultiplyCoefficient(int16_t value, uint8_t coefficient)
+{
+    return (int8_t)(value >> 8) * coefficient + (((uint16_t)(uint8_t)value * coefficient) >> 8);
+}
+
+// Runs the filter for one sample of the voices routed through it.
+// Returns what the filter adds to the output.
+static inline int8_t FilterSample(int8_t input)
+{
+    int16_t scaledInput = (int16_t)input << FILTER_INPUT_SHIFT;
+
+    gFilter.low += MultiplyCoefficient(gFilter.band, gFilter.frequency);
+    int16_t high = scaledInput - gFilter.low - 2 * MultiplyCoefficient(gFilter.band, gFilter.damping);
+    gFilter.band += MultiplyCoefficient(high, gFilter.frequency);
+
+    int16_t output = 0;
+    if (gFilter.type & FILTER_LOWPASS)
+    {
+        output += gFilter.low >> FILTER_INPUT_SHIFT;
+    }
+    if (gFilter.type & FILTER_BANDPASS)
+    {
+        output += gFilter.band >> FILTER_INPUT_SHIFT;
+    }
+    if (gFilter.type & FILTER_HIGHPASS)
+    {
+        output += high >> FILTER_INPUT_SHIFT;
+    }
+
+    if (output > 127)
+    {
+        output = 127;
+    }
+    else if (output < -128)
+    {
+        output = -128;
+    }
+    return (int8_t)output;
+}
+
+// Brings the voice's position back to the start of the waveform once
+// it runs off the end. Returns the position in the waveform and sets
+// wrap if it had to be brought back.
+static inline uint16_t WrapTableOffset(struct Voice *voice, int8_t *wrap)
+{
+    uint16_t offset = voice->tableOffset >> 8;
+    //printf("Offset: 0x%04X ", offset);
     
-    for (uint8_t channel = 0 ; channel < 3 ; channel++)
+    if (offset >= 64)
     {
-        uint16_t bit = ((gNoise >> 0) ^ (gNoise >> 2) ^ (gNoise >> 3) ^ (gNoise >> 5)) & 1;
-        gNoise = (gNoise >> 1) | (bit << 15);
+        offset -= 64;
+        voice->tableOffset &= 0xFF;
+        voice->tableOffset |= offset << 8;
+        *wrap = 1;
+    }
 
-        // printf("Noise: 0x%02X ", gNoise);
-        
-        if (channels[channel].envelopePhase != Off)
+    return offset;
+}
+
+// The voice's waveform at the given position, faded by its envelope
+static inline int8_t VoiceWaveform(struct Voice *voice, uint16_t offset, int8_t wrap)
+{
+    int8_t waveformValue;
+    
+    if (voice->control & CONTROL_SAWTOOTH)
+    {
+        waveformValue = offset - 32;
+        //printf(" SAWTOOTH: %d\n", waveformValue);
+    }
+    else if (voice->control & CONTROL_TRIANGLE)
+    {
+        waveformValue = offset * 2;
+        if (waveformValue >= 64)
         {
-            uint16_t offset = channels[channel].tableOffset >> 8;
-            //printf("Offset: 0x%04X ", offset);
-            
-            if (offset >= 64)
-            {
-                offset -= 64;
-                channels[channel].tableOffset &= 0xFF;
-                channels[channel].tableOffset |= offset << 8;
-                wrap = 1;
-            }
+            waveformValue = 128 - waveformValue;
+        }
+        waveformValue -= 32;
+        //printf(" TRIANGLE: %d\n", waveformValue);
+    }
+    else if (voice->control & CONTROL_PULSE)
+    {
+        if (wrap)
+        {
+            waveformValue = 31;
+        }
+        else if (voice->tableOffset >= voice->pulseWidth)
+        {
+            waveformValue = -32;
+        }
+        else
+        {
+            waveformValue = 31;
+        }
+        //printf(" PULSE: offset: %u pulseWidth: %u %d\n", voice->tableOffset, voice->pulseWidth, waveformValue);
+    }
+    else if (voice->control & CONTROL_NOISE)
+    {
+        waveformValue = (gNoise & 0x3F) - 32;
+        //printf(" NOISE: %d\n", waveformValue);
+    }
+    else
+    {
+        waveformValue = 0;
+    }
+    
+    int16_t shortWaveformValue = (int16_t)waveformValue;
+    int8_t fadedValue = (int8_t) (shortWaveformValue * (32 - voice->fadeAmount) / 32);
+    //printf("waveform: %3d short: %3d fadeAmount: %2u phase: %d faded: %3d\n",
+    //        waveformValue, shortWaveformValue, voice->fadeAmount, voice->envelopePhase, fadedValue);
 
-            int8_t waveformValue;
-            
-            if (channels[channel].control & CONTROL_SAWTOOTH)
-            {
-                waveformValue = offset - 32;
-                //printf(" SAWTOOTH (%u): %d\n", channel, waveformValue);
-            }
-            else if (channels[channel].control & CONTROL_TRIANGLE)
+    return fadedValue;
+}
+
+// Counts down to the next step of the voice's envelope and takes it
+static inline void StepEnvelope(struct Voice *voice)
+{
+    voice->phaseStepCountdown--;
+    if (voice->phaseStepCountdown == 0)
+    {
+        // TODO: Parse out and save the A D S R values ahead of time and store
+        // in the struct so we don't have to do it a lot here?
+        switch (voice->envelopePhase)
+        {
+        case Attack:
+            if (voice->fadeAmount <= 0)
             {
-                waveformValue = offset * 2;
-                if (waveformValue >= 64)
+                //printf("Done attacking. SR = 0x%02X\n", voice->sustainRelease);
+                uint8_t sustainLevel = (voice->sustainRelease & 0xF0) >> 4;
+                //printf("SustainLevel = %u\n", sustainLevel);
+                uint8_t sustainFadeValue = 0x0F - sustainLevel;
+                sustainFadeValue <<= 1;
+                
+                //printf("FadeValue = %u\n", sustainFadeValue);
+                if (sustainFadeValue > 0)
                 {
-                    waveformValue = 128 - waveformValue;
+                    //printf("Switching to decay\n");
+                    // TODO: Figure out exactly how the decay works. Is it "X ms" to decay from the
+                    //       maximum to the sustain value or is it "X ms" total if we were decaying
+                    //       to the minimum?
+                    voice->envelopePhase = Decay;
+                    voice->phaseStepCountdown = DecayReleaseCycles[voice->attackDecay & 0x0F];
                 }
-                waveformValue -= 32;
-                //printf(" TRIANGLE (%u): %d\n", channel, waveformValue);
-            }
-            else if (channels[channel].control & CONTROL_PULSE)
-            {
-                if (wrap)
+                else
                 {
-                    waveformValue = 31;
+                    //printf("Switching to Sustain.\n");
+                    voice->envelopePhase = Sustain;
                 }
-                else if (channels[channel].tableOffset >= channels[channel].pulseWidth)
+            }
+            else
+            {
+                voice->fadeAmount--;
+                voice->phaseStepCountdown = AttackCycles[(voice->attackDecay & 0xF0) >> 4];
+            }
+            break;
+
+        case Decay:
+            {
+                uint8_t sustainFadeValue = 0x0F - ((voice->sustainRelease & 0xF0) >> 4);
+                sustainFadeValue <<= 1;
+#if 0
+                print("SR: ");
+                print8hex(voice->sustainRelease);
+                print(" sFV: ");
+                print8hex(sustainFadeValue);
+                print("\n");
+#endif
+                
+                // Decaying from the maximum value to the sustain level
+            
+                if (voice->fadeAmount >= sustainFadeValue)
                 {
-                    waveformValue = -32;
+                    voice->envelopePhase = Sustain;
+                    // TODO: Really should just disable the phaseCountdown here, but it doesn't entirely
+                    //       matter since it just wraps around only calling Sustain every 65536 loops.
                 }
                 else
                 {
-                    waveformValue = 31;
+                    voice->fadeAmount++;
+                    voice->phaseStepCountdown = DecayReleaseCycles[voice->attackDecay & 0x0F];
                 }
-                //printf(" PULSE (%u): offset: %u pulseWidth: %u %d\n", channel, channels[channel].tableOffset, channels[channel].pulseWidth, waveformValue);
             }
-            else if (channels[channel].control & CONTROL_NOISE)
+            break;
+
+        case Sustain:
+            // Do nothing. Just sustain
+            break;
+
+        case Release:
+            // Fade from the sustain level to 0 (fadeAmount of 32)
+            voice->fadeAmount++;
+            if (voice->fadeAmount >= 32)
             {
-                waveformValue = (gNoise & 0x3F) - 32;
-                //printf(" NOISE (%u): %d\n", channel, waveformValue);
+                voice->envelopePhase = Off;
             }
             else
             {
-                waveformValue = 0;
+                voice->phaseStepCountdown = DecayReleaseCycles[voice->sustainRelease & 0x0F];
             }
-            
-            int16_t shortWaveformValue = (int16_t)waveformValue;
-            int8_t fadedValue = (int8_t) (shortWaveformValue * (32 - channels[channel].fadeAmount) / 32);
-            //printf("waveform: %3d short: %3d fadeAmount: %2u phase: %d faded: %3d\n",
-            //        waveformValue, shortWaveformValue, channels[channel].fadeAmount, channels[channel].envelopePhase, fadedValue);
-            
-            //printf(" Faded: %d\n", fadedValue);
-            outputValue += fadedValue;
-            
-            channels[channel].phaseStepCountdown--;
-            if (channels[channel].phaseStepCountdown == 0)
-            {
-                // TODO: Parse out and save the A D S R values ahead of time and store
-                // in the struct so we don't have to do it a lot here?
-                switch (channels[channel].envelopePhase)
-                {
-                case Attack:
-                    if (channels[channel].fadeAmount <= 0)
-                    {
-                        //printf("Done attacking. SR = 0x%02X\n", channels[channel].sustainRelease);
-                        uint8_t sustainLevel = (channels[channel].sustainRelease & 0xF0) >> 4;
-                        //printf("SustainLevel = %u\n", sustainLevel);
-                        uint8_t sustainFadeValue = 0x0F - sustainLevel;
-                        sustainFadeValue <<= 1;
-                        
-                        //printf("FadeValue = %u\n", sustainFadeValue);
-                        if (sustainFadeValue > 0)
-                        {
-                            //printf("Switching to decay\n");
-                            // TODO: Figure out exactly how the decay works. Is it "X ms" to decay from the
-                            //       maximum to the sustain value or is it "X ms" total if we were decaying
-                            //       to the minimum?
-                            channels[channel].envelopePhase = Decay;
-                            channels[channel].phaseStepCountdown = DecayReleaseCycles[channels[channel].attackDecay & 0x0F];
-                        }
-                        else
-                        {
-                            //printf("Switching to Sustain.\n");
-                            channels[channel].envelopePhase = Sustain;
-                        }
-                    }
-                    else
-                    {
-                        channels[channel].fadeAmount--;
-                        channels[channel].phaseStepCountdown = AttackCycles[(channels[channel].attackDecay & 0xF0) >> 4];
-                    }
-                    break;
+            break;
 
-                case Decay:
-                    {
-                        uint8_t sustainFadeValue = 0x0F - ((channels[channel].sustainRelease & 0xF0) >> 4);
-                        sustainFadeValue <<= 1;
-#if 0
-                        print("SR: ");
-                        print8hex(channels[channel].sustainRelease);
-                        print(" sFV: ");
-                        print8hex(sustainFadeValue);
-                        print("\n");
-#endif
-                        
-                        // Decaying from the maximum value to the sustain level
-                    
-                        if (channels[channel].fadeAmount >= sustainFadeValue)
-                        {
-                            channels[channel].envelopePhase = Sustain;
-                            // TODO: Really should just disable the phaseCountdown here, but it doesn't entirely
-                            //       matter since it just wraps around only calling Sustain every 65536 loops.
-                        }
-                        else
-                        {
-                            channels[channel].fadeAmount++;
-                            channels[channel].phaseStepCountdown = DecayReleaseCycles[channels[channel].attackDecay & 0x0F];
-                        }
-                    }
-                    break;
+        case Off:
+            // Doesn't need to be here except to avoid the compiler warning
+            break;
+        }
+    }
+}
 
-                case Sustain:
-                    // Do nothing. Just sustain
-                    break;
+int OutputAudioAndCalculateNextByte(void)
+{
+    OutputByte(gNextOutputValue);
+    TRACE_EVENT(TraceSampleBegin());
 
-                case Release:
-                    // Fade from the sustain level to 0 (fadeAmount of 32)
-                    channels[channel].fadeAmount++;
-                    if (channels[channel].fadeAmount >= 32)
-                    {
-                        channels[channel].envelopePhase = Off;
-                    }
-                    else
-                    {
-                        channels[channel].phaseStepCountdown = DecayReleaseCycles[channels[channel].sustainRelease & 0x0F];
-                    }
-                    break;
+    int8_t outputValue = 0;
+    int8_t filterInput = 0;
+    int8_t wrap = 0;
+    
+    for (uint8_t channel = 0 ; channel < NUM_CHANNELS ; channel++)
+    {
+        uint16_t bit = ((gNoise >> 0) ^ (gNoise >> 2) ^ (gNoise >> 3) ^ (gNoise >> 5)) & 1;
+        gNoise = (gNoise >> 1) | (bit << 15);
 
-                case Off:
-                    // Doesn't need to be here except to avoid the compiler warning
-                    break;
-                }
+        // printf("Noise: 0x%02X ", gNoise);
+        
+        if (channels[channel].envelopePhase != Off)
+        {
+            struct Voice *voice = &channels[channel];
+            uint16_t offset = WrapTableOffset(voice, &wrap);
+            int8_t fadedValue = VoiceWaveform(voice, offset, wrap);
+            
+            //printf(" Faded: %d\n", fadedValue);
+            if (gFilter.routing & (1 << channel))
+            {
+                filterInput += fadedValue;
+#if VOICE_OUTPUT
+                gVoiceOutput[channel] = 0;
+#endif
             }
+            else
+            {
+                outputValue += fadedValue;
+#if VOICE_OUTPUT
+                gVoiceOutput[channel] = fadedValue;
+#endif
+            }
+            
+            StepEnvelope(voice);
 
-            //printf("Channel %u Offset: 0x%04X + Steps: 0x%04X = ", channel, channels[channel].tableOffset, channels[channel].steps);
-            channels[channel].tableOffset += channels[channel].steps;
-            //printf("0x%04X ", channels[channel].tableOffset);
+            //printf("Channel %u Offset: 0x%04X + Steps: 0x%04X = ", channel, voice->tableOffset, voice->steps);
+            voice->tableOffset += voice->steps;
+            //printf("0x%04X ", voice->tableOffset);
         }
+#if VOICE_OUTPUT
+        else
+        {
+            gVoiceOutput[channel] = 0;
+        }
+#endif
     }  
+
+    // Nothing is spent on the filter unless a voice is going through it
+    if (gFilter.routing != 0)
+    {
+        int8_t filterOutput = FilterSample(filterInput);
+        int16_t mixed = (int16_t)outputValue + filterOutput;
+        if (mixed > 127)
+        {
+            mixed = 127;
+        }
+        else if (mixed < -128)
+        {
+            mixed = -128;
+        }
+        outputValue = (int8_t)mixed;
+#if VOICE_OUTPUT
+        gFilterOutput = filterOutput;
+#endif
+    }
+#if VOICE_OUTPUT
+    else
+    {
+        gFilterOutput = 0;
+    }
+#endif
     
     // Scale -128 to 128 values to 0 to 255
     //printf("Output: %d\n", outputValue);
     gNextOutputValue = (uint8_t)((int16_t)outputValue + 128);
     //printf("Next output 0x%02X\n", gNextOutputValue);
+    TRACE_EVENT(TraceSampleEnd());
     
 #if !TEST_MODE
     vbiCount--;
@@ -1060,7 +1857,7 @@ int OutputAudioAndCalculateNextByte(void)
 #ifdef __AVR_ARCH__
         sei();
 #endif
-        return GoatPlayerTick();
+        return gTickFunction();
     }
 #endif
 
@@ -1,80 +1,291 @@
-#include <stdio.h>
-#include <stdint.h>
-#include <stdlib.h>
-#include <sys/stat.h>
-#include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
 
-#include "sidish.h"
+// Built with the trace calls so -t can record a timeline
+#define TRACE (1)
 
-// This table holds the number of steps through the
-// SINE_TABLE for each cycle of the BITRATE.
-// This is essentially a fixed point floating point table.
-// The high 16 bits are used as the lookup into the SINE_TABLE
-// and the low 16 bits are the error in units of 1/65536ths.
-uint32_t FREQUENCY_TABLE[NUM_PIANO_KEYS];
-uint16_t SAWTOOTH_TABLE[NUM_PIANO_KEYS];
+#include "hostplayer.c"
+#include "segmentrender.c"
+#include "rerender.c"
+#include "notecache.c"
+#include "mixer.h"
+#include "flacenc.h"
 
-
-#define pgm_read_byte(x) *(uint8_t*)(x)
-#define pgm_read_word(x) *(uint16_t*)(x)
-#define pgm_read_dword(x) *(uint32_t*)(x)
-
-#include "goatplayer.c"
+// Longest song -j can render. Only the part that's used is ever
+// given any memory.
+#define MAX_SEGMENTED_SAMPLES (BITRATE * 60 * 60 * 4)
 
 FILE *outputfp;
 unsigned int gTotalBytesWritten = 0;
 
-void print(char *message)
+// How the samples are written. FLAC is used when the output filename
+// ends in .flac, and the stems get their own encoders. Raw is the
+// samples with no header at all, for piping into another program.
+enum OutputFormat
 {
-    printf("%s", message);
-}
-
-void print8int(int8_t value)
+    OUTPUT_WAV,
+    OUTPUT_FLAC,
+    OUTPUT_RAW
+};
+enum OutputFormat gOutputFormat = OUTPUT_WAV;
+struct FlacEncoder gFlac;
+
+// The output goes through a buffer this big, so a pipe is written to
+// in large blocks rather than a byte at a time
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+
+// Output filename for standard output, and the prefix for any other
+// file descriptor, like "pipe:3"
+#define STANDARD_OUTPUT_NAME "-"
+#define PIPE_OUTPUT_PREFIX "pipe:"
+
+// The descriptor the output filename names, or -1 if it's a file
+int gOutputDescriptor = -1;
+
+// The render stops after this many samples, or after the song has
+// looped gLoopLimit times. 0 for no limit.
+uint64_t gSampleLimit = 0;
+uint32_t gLoopLimit = 1;
+
+// Set to take the notes and patterns that are played over and over
+// from the note cache instead of synthesizing them every time
+int gUseNoteCache = 0;
+
+// The filter is treated as one more voice by the stems and the mixer,
+// since the voices that go through it are silent on their own
+#define NUM_STEMS (NUM_CHANNELS + 1)
+
+// Set to also write each voice to its own file
+int gWriteStems = 0;
+FILE *gStemFiles[NUM_STEMS];
+struct FlacEncoder gStemFlac[NUM_STEMS];
+
+// What each voice and the filter added to the last sample
+static inline int8_t StemOutput(int stem)
 {
-    printf("%d", value);
+    return (stem < NUM_CHANNELS) ? gVoiceOutput[stem] : gFilterOutput;
 }
 
-void print8hex(uint8_t value)
+// Set to write 16 bit stereo through the mixer instead of the player's
+// own 8 bit mono mix
+int gStereo = 0;
+struct Mixer gMixer;
+int8_t gMixerInput[NUM_STEMS][MIXER_BLOCK_SIZE];
+int gMixerInputLength = 0;
+
+void FlushMixer()
 {
-    printf("%02X", value);
+    int16_t stereo[2 * MIXER_BLOCK_SIZE];
+
+    MixBlock(&gMixer, gMixerInput, gMixerInputLength, stereo);
+    if (gOutputFormat == OUTPUT_FLAC)
+    {
+        FlacWrite16(&gFlac, stereo, gMixerInputLength);
+    }
+    else
+    {
+        fwrite(stereo, sizeof(int16_t), 2 * gMixerInputLength, outputfp);
+    }
+    gMixerInputLength = 0;
 }
 
 void OutputByte(uint8_t value)
 {
-    fwrite(&value, 1, 1, outputfp);
+    if (gSegmentOutput != NULL)
+    {
+        SegmentByte(value);
+        return;
+    }
+    else if (gRerender.active)
+    {
+        RerenderByte(value);
+        return;
+    }
+
+    if (gStereo)
+    {
+        for (int stem = 0 ; stem < NUM_STEMS ; stem++)
+        {
+            gMixerInput[stem][gMixerInputLength] = StemOutput(stem);
+        }
+
+        if (++gMixerInputLength == MIXER_BLOCK_SIZE)
+        {
+            FlushMixer();
+        }
+    }
+    else if (gOutputFormat == OUTPUT_FLAC)
+    {
+        FlacWrite8(&gFlac, &value, 1);
+    }
+    else
+    {
+        // Only this thread writes the output files, so they're written
+        // without taking the lock the log thread's there makes stdio
+        // take for every byte
+        putc_unlocked(value, outputfp);
+    }
     gTotalBytesWritten++;
+
+    if (gWriteStems)
+    {
+        // gVoiceOutput still holds the voices for the sample being
+        // output here. Centered the same way as the mix so that the
+        // stems add up to it.
+        for (int stem = 0 ; stem < NUM_STEMS ; stem++)
+        {
+            uint8_t sample = (uint8_t)(StemOutput(stem) + 128);
+            if (gOutputFormat == OUTPUT_FLAC)
+            {
+                FlacWrite8(&gStemFlac[stem], &sample, 1);
+            }
+            else
+            {
+                putc_unlocked(sample, gStemFiles[stem]);
+            }
+        }
+    }
 }
 
-void InitializeTables()
+// Reads a format given with -f. Returns 0 if it isn't one.
+int ParseOutputFormat(const char *name, enum OutputFormat *format)
 {
-    int x;
+    if (strcmp(name, "wav") == 0)
+    {
+        *format = OUTPUT_WAV;
+    }
+    else if (strcmp(name, "flac") == 0)
+    {
+        *format = OUTPUT_FLAC;
+    }
+    else if (strcmp(name, "raw") == 0)
+    {
+        *format = OUTPUT_RAW;
+    }
+    else
+    {
+        return 0;
+    }
+    return 1;
+}
+
+// The format to write when none is given, from the filename's extension
+enum OutputFormat DefaultOutputFormat(const char *filename)
+{
+    const char *extension = strrchr(filename, '.');
+    if (extension != NULL && strcmp(extension, ".flac") == 0)
+    {
+        return OUTPUT_FLAC;
+    }
+    else if (extension != NULL && strcmp(extension, ".raw") == 0)
+    {
+        return OUTPUT_RAW;
+    }
+    return OUTPUT_WAV;
+}
+
+// The extension of the files written, for the ones named after the
+// output file
+const char *OutputExtension()
+{
+    switch (gOutputFormat)
+    {
+        case OUTPUT_FLAC:
+            return ".flac";
+        case OUTPUT_RAW:
+            return ".raw";
+        default:
+            return ".wav";
+    }
+}
+
+// Removes .wav, .flac or .raw from the end of a filename
+void StripExtension(char *filename)
+{
+    char *extension = strrchr(filename, '.');
+    if (extension != NULL && (strcmp(extension, ".wav") == 0 || strcmp(extension, ".flac") == 0 ||
+                              strcmp(extension, ".raw") == 0))
+    {
+        *extension = 0;
+    }
+}
+
+// Returns the file descriptor an output filename of "-" or "pipe:N"
+// names, or -1 for an ordinary file
+int OutputDescriptor(const char *filename)
+{
+    if (strcmp(filename, STANDARD_OUTPUT_NAME) == 0)
+    {
+        return STDOUT_FILENO;
+    }
+    else if (strncmp(filename, PIPE_OUTPUT_PREFIX, strlen(PIPE_OUTPUT_PREFIX)) == 0)
+    {
+        char *end;
+        long fd = strtol(filename + strlen(PIPE_OUTPUT_PREFIX), &end, 10);
+        if (*end == 0 && end != filename + strlen(PIPE_OUTPUT_PREFIX) && fd >= 0 && fd <= INT16_MAX)
+        {
+            return (int)fd;
+        }
+    }
+    return -1;
+}
+
+// Opens the output file, or the descriptor it names, with a large buffer
+FILE *OpenOutputFile(const char *filename)
+{
+    FILE *fp;
+
+    if (gOutputDescriptor >= 0)
+    {
+        fp = fdopen(gOutputDescriptor, "wb");
+    }
+    else
+    {
+        fp = fopen(filename, "wb");
+    }
 
-    // Sawtooth waveform:
-    // ------------------
-    // Repeats every BITRATE / FREQUENCY
-    // At the start of each cycle, we start at 0 and count up to 63,
-    // which is 64 steps.
-    // So, each BITRATE interrupt, step by 64 / BITRATE / FREQUENCY
-    // Use a 16 bit format with the format:
-    // value | 1/256ths value
-    // Then subtract 32 from the most significant byte before using it
-    
-    for (x = 0 ; x < NUM_PIANO_KEYS ; x++)
-    {
-        double frequency = pow(2, (x-49.0)/12.0) * 440.0;
-
-        // Calculate the steps for the sine wave table
-        double steps = (frequency / (double)BITRATE * (double)TABLE_SIZE);
-        uint16_t frequencySteps = (uint16_t) steps;
-        uint16_t error = (uint16_t)floor(steps * 65536 - frequencySteps * 65536);
-        FREQUENCY_TABLE[x] = ((uint16_t)frequencySteps << 16) | ((uint16_t)error & 0xFFFF);
-
-        // Calculate the steps for the sawtooth table
-        steps = frequency * 64.0 / (double)BITRATE;
-        frequencySteps = (uint16_t)steps;
-        error = (uint16_t)floor(steps * 256 - frequencySteps * 256);
-        SAWTOOTH_TABLE[x] = (frequencySteps << 8) | (error & 0xFF);
+    if (fp != NULL)
+    {
+        setvbuf(fp, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
     }
+    return fp;
+}
+
+// Writes the header for 8 or 16 bit samples at BITRATE in the output format
+int StartOutputFile(FILE *fp, struct FlacEncoder *encoder, uint16_t numChannels, uint16_t bitsPerSample)
+{
+    if (gOutputFormat == OUTPUT_FLAC)
+    {
+        return FlacOpen(encoder, fp, BITRATE, numChannels, bitsPerSample);
+    }
+    else if (gOutputFormat == OUTPUT_WAV)
+    {
+        // A pipe can't go back to fill in the length, so it's written
+        // as unknown, which most programs reading a stream accept
+        WriteWavHeader(fp, BITRATE, numChannels, bitsPerSample, (ftell(fp) < 0) ? WAV_UNKNOWN_LENGTH : 0);
+    }
+    return 1;
+}
+
+// Fills in the header once all of the samples have been written, if
+// the file can seek
+void FinishOutputFile(FILE *fp, struct FlacEncoder *encoder, uint32_t dataLength)
+{
+    if (gOutputFormat == OUTPUT_FLAC)
+    {
+        FlacClose(encoder);
+    }
+    else if (gOutputFormat == OUTPUT_WAV && ftell(fp) >= 0)
+    {
+        FinishWavFile(fp, dataLength);
+    }
+}
+
+void PrintTables()
+{
+    int x;
 
     printf("const uint32_t FREQUENCY_TABLE[] PROGMEM = {");
     for(x = 0 ; x < NUM_PIANO_KEYS ; x++)
@@ -89,101 +300,513 @@ void InitializeTables()
         printf("0x%04X,", SAWTOOTH_TABLE[x]);
     }
     printf("};\n");
+
+    printf("const uint8_t FILTER_CUTOFF_TABLE[] PROGMEM = {");
+    for(x = 0 ; x < 256 ; x++)
+    {
+        printf("0x%02X,", FILTER_CUTOFF_TABLE[x]);
+    }
+    printf("};\n");
 }
 
-int main(void)
+// Renders the subtune that's been started to a .wav or .flac file.
+// Returns 1 on success.
+int RenderToFile(const char *filename)
 {
-    InitializeTables();
-    
-    FILE *fp;
-    fp = fopen(SONG, "rb");
-    if (fp == NULL)
+    outputfp = OpenOutputFile(filename);
+    if (outputfp == NULL)
     {
-        printf("Failed to open the song data.\n");
-        return -1;
+        printf("Failed to open output file %s.\n", filename);
+        return 0;
     }
 
-    struct stat songstat;
-    int error = fstat(fileno(fp), &songstat);
-    if (error != 0)
+    if (gStereo)
     {
-        printf("Failed to stat the song data.\n");
-        return -1;
+        StartOutputFile(outputfp, &gFlac, 2, 16);
+    }
+    else
+    {
+        // 1 byte per sample, mono
+        StartOutputFile(outputfp, &gFlac, 1, 8);
     }
 
-    char *songdata = malloc(songstat.st_size);
-    if (songdata == NULL)
+    if (gWriteStems)
     {
-        printf("Failed to malloc for song data.\n");
-        return -1;
+        // The voices go next to the mix, as <output>_voice<n>.wav,
+        // and the filter as <output>_filter.wav (or .flac)
+        char base[1024];
+        snprintf(base, sizeof(base), "%s", filename);
+        StripExtension(base);
+
+        for (int stem = 0 ; stem < NUM_STEMS ; stem++)
+        {
+            char stemFilename[1100];
+            if (stem < NUM_CHANNELS)
+            {
+                snprintf(stemFilename, sizeof(stemFilename), "%s_voice%d%s", base, stem, OutputExtension());
+            }
+            else
+            {
+                snprintf(stemFilename, sizeof(stemFilename), "%s_filter%s", base, OutputExtension());
+            }
+
+            gStemFiles[stem] = fopen(stemFilename, "wb");
+            if (gStemFiles[stem] == NULL)
+            {
+                printf("Failed to open output file %s.\n", stemFilename);
+                return 0;
+            }
+            StartOutputFile(gStemFiles[stem], &gStemFlac[stem], 1, 8);
+        }
     }
 
-    size_t bytesRead = fread(songdata, 1, songstat.st_size, fp);
-    if (bytesRead != songstat.st_size)
+    // Now calculate and write all the rest of the data, until the song
+    // has looped enough times or the limit is reached. The channels
+    // reach the end of their orderlists at different times, so the
+    // loops are counted by the first one to get there.
+    gTotalBytesWritten = 0;
+    uint64_t samples = 0;
+    uint32_t loops = 0;
+    int loopChannel = 0;
+    if (gUseNoteCache)
     {
-        printf("Failed to read song data. Got %zu of %u bytes.\n", bytesRead, (uint32_t)songstat.st_size);
-        return -1;
+        StartNoteCache();
+    }
+    while (gSampleLimit == 0 || samples < gSampleLimit)
+    {
+        samples++;
+        int finished = gUseNoteCache ? OutputAudioFromNoteCache() : OutputAudioAndCalculateNextByte();
+        if (loopChannel == 0)
+        {
+            loopChannel = finished & -finished;
+        }
+
+        if ((finished & loopChannel) && ++loops == gLoopLimit)
+        {
+            break;
+        }
+    }
+
+    if (gStereo)
+    {
+        FlushMixer();
+        FinishOutputFile(outputfp, &gFlac, gTotalBytesWritten * 2 * sizeof(int16_t));
+    }
+    else
+    {
+        FinishOutputFile(outputfp, &gFlac, gTotalBytesWritten);
+    }
+    fclose(outputfp);
+
+    if (gOutputFormat == OUTPUT_FLAC)
+    {
+        uint64_t wavBytes = 44 + (uint64_t)gTotalBytesWritten * (gStereo ? 4 : 1);
+        printf("Wrote %llu bytes to %s, %.1f times smaller than the .wav\n",
+               (unsigned long long)gFlac.bytesWritten, filename, (double)wavBytes / gFlac.bytesWritten);
+    }
+
+    if (gWriteStems)
+    {
+        for (int stem = 0 ; stem < NUM_STEMS ; stem++)
+        {
+            FinishOutputFile(gStemFiles[stem], &gStemFlac[stem], gTotalBytesWritten);
+            fclose(gStemFiles[stem]);
+        }
     }
 
-    fclose(fp);
-    
-    InitializeSong(songdata);
+    if (gUseNoteCache)
+    {
+        PrintNoteCacheStatistics();
+    }
+    return 1;
+}
 
-    outputfp = fopen("tonetest.wav", "w");
+// Renders the subtune that's been started to a .wav or .flac file the way
+// RenderToFile does, but split into segments that are rendered on up
+// to the given number of cores at once (see segmentrender.c).
+// Returns 1 on success.
+int RenderToFileInSegments(const char *filename, int workers)
+{
+    uint8_t *samples = mmap(NULL, MAX_SEGMENTED_SAMPLES, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (samples == MAP_FAILED)
+    {
+        perror("mmap");
+        return 0;
+    }
+
+    outputfp = OpenOutputFile(filename);
     if (outputfp == NULL)
     {
-        printf("Failed to open output file.\n");
-        return -1;
+        printf("Failed to open output file %s.\n", filename);
+        munmap(samples, MAX_SEGMENTED_SAMPLES);
+        return 0;
+    }
+
+    int64_t count = RenderSegments(samples, MAX_SEGMENTED_SAMPLES, workers);
+    if (count < 0)
+    {
+        printf("A segment failed to render.\n");
+    }
+    else
+    {
+        StartOutputFile(outputfp, &gFlac, 1, 8);
+        if (gOutputFormat == OUTPUT_FLAC)
+        {
+            FlacWrite8(&gFlac, samples, count);
+        }
+        else
+        {
+            fwrite(samples, 1, count, outputfp);
+        }
+        FinishOutputFile(outputfp, &gFlac, count);
+        gTotalBytesWritten = count;
+    }
+
+    fclose(outputfp);
+    munmap(samples, MAX_SEGMENTED_SAMPLES);
+    return count >= 0;
+}
+
+// Renders every subtune at the same time, each in its own process.
+// The song is only parsed once, before forking, so all the processes
+// share the song data and only have their own copy of the player state.
+int RenderAllSubtunes(const char *outputFilename)
+{
+    char base[1024];
+    snprintf(base, sizeof(base), "%s", outputFilename);
+    StripExtension(base);
+
+    // The messages from all the renders would be mixed together
+    gPrintEnabled = 0;
+    fflush(stdout);
+
+    pid_t children[256];
+    for (int subtune = 0 ; subtune < gNumSubtunes ; subtune++)
+    {
+        children[subtune] = fork();
+        if (children[subtune] == 0)
+        {
+            char filename[1100];
+            snprintf(filename, sizeof(filename), "%s_%d%s", base, subtune, OutputExtension());
+
+            if (!StartSubtune(subtune) || !RenderToFile(filename))
+            {
+                _exit(1);
+            }
+
+            printf("Subtune %d: %u samples to %s\n", subtune, gTotalBytesWritten, filename);
+            fflush(stdout);
+            _exit(0);
+        }
+        else if (children[subtune] < 0)
+        {
+            perror("fork");
+        }
+    }
+
+    int failures = 0;
+    for (int subtune = 0 ; subtune < gNumSubtunes ; subtune++)
+    {
+        int status;
+        if (children[subtune] < 0 || waitpid(children[subtune], &status, 0) != children[subtune] ||
+            !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        {
+            printf("Subtune %d failed\n", subtune);
+            failures++;
+        }
+    }
+
+    return failures == 0;
+}
+
+// Reads a comma separated list of numbers, one for each voice and then
+// the filter, like "-0.5,0.5,0". Returns 0 if there are too many or
+// they aren't numbers.
+int ParseVoiceList(const char *list, void (*set)(struct Mixer *, uint8_t, float))
+{
+    uint8_t voice = 0;
+
+    while (*list != 0)
+    {
+        char *end;
+        float value = strtof(list, &end);
+        if (end == list || (*end != ',' && *end != 0) || voice >= NUM_STEMS)
+        {
+            return 0;
+        }
+
+        set(&gMixer, voice++, value);
+        list = (*end == ',') ? end + 1 : end;
     }
+    return 1;
+}
 
-    // Write the .wave file header
-    fwrite("RIFF", 4, 1, outputfp);
+void Usage()
+{
+    printf("Usage: goattest [-u subtune | -a] [-S] [-s [-P pans] [-G gains]] [-t trace.json] [-j cores | -c checkpoints | -k MB]\n");
+    printf("                [-l seconds] [-n loops] [-f wav|flac|raw] [-o output.wav] [song.sng]\n");
+    printf("  -u  Subtune to render (default 0)\n");
+    printf("  -a  Render every subtune in parallel, to output_0.wav, output_1.wav...\n");
+    printf("  -S  Also write each voice on its own, to output_voice0.wav, output_voice1.wav...\n");
+    printf("      and the filter to output_filter.wav\n");
+    printf("  -s  Write 16 bit stereo\n");
+    printf("  -P  Pan of each voice for -s, from -1 (left) to 1 (right), like -P -0.5,0.5,0\n");
+    printf("  -G  Gain of each voice for -s, like -G 1,1,0.5\n");
+    printf("      The filter goes after the voices in both lists\n");
+    printf("  -t  Write a timeline of every tick as Chrome trace JSON, for Perfetto\n");
+    printf("  -j  Render the subtune in segments on this many cores at once (mono mix only)\n");
+    printf("  -c  Save the player state at every tick to this file, and use it next time to only\n");
+    printf("      re-render the parts of output.wav that the changes to the song affect (mono mix only)\n");
+    printf("  -k  Synthesize each note and pattern that's played the same way again and again only once,\n");
+    printf("      keeping up to this many MB of them (%d is a good size), and print how often it helped\n",
+           NOTE_CACHE_DEFAULT_BUDGET / (1024 * 1024));
+    printf("  -l  Stop after this many seconds\n");
+    printf("  -n  Stop after the song has played this many times (default 1, 0 to play forever)\n");
+    printf("  -f  Output format. By default it's FLAC if the output file ends in .flac, raw samples\n");
+    printf("      with no header if it ends in .raw, and .wav otherwise, for the stems and subtunes too\n");
+    printf("  -o  Output file (default tonetest.wav). - writes to standard output, and pipe:N to file\n");
+    printf("      descriptor N, with the messages going to standard error\n");
+    printf("Without a song, renders %s\n", SONG);
+}
 
-    // Total size of the rest of the file (4 unsigned bytes to be filled in later)
-    unsigned int value = 0;
-    fwrite(&value, 4, 1, outputfp);
+int main(int argc, char *argv[])
+{
+    const char *outputFilename = "tonetest.wav";
+    const char *songFilename = SONG;
+    int subtune = 0;
+    int allSubtunes = 0;
+    const char *traceFilename = NULL;
+    int workers = 0;
+    const char *checkpointFilename = NULL;
+    const char *formatName = NULL;
+    int opt;
+
+    InitializeMixer(&gMixer, NUM_STEMS);
+
+    while ((opt = getopt(argc, argv, "u:aSsP:G:t:j:c:k:l:n:f:o:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'u':
+                subtune = atoi(optarg);
+                break;
+
+            case 'a':
+                allSubtunes = 1;
+                break;
+
+            case 'S':
+                gWriteStems = 1;
+                break;
+
+            case 's':
+                gStereo = 1;
+                break;
+
+            case 'P':
+                if (!ParseVoiceList(optarg, SetVoicePan))
+                {
+                    Usage();
+                    return -1;
+                }
+                break;
+
+            case 'G':
+                if (!ParseVoiceList(optarg, SetVoiceGain))
+                {
+                    Usage();
+                    return -1;
+                }
+                break;
+
+            case 't':
+                traceFilename = optarg;
+                break;
+
+            case 'j':
+                workers = atoi(optarg);
+                if (workers < 1)
+                {
+                    Usage();
+                    return -1;
+                }
+                break;
+
+            case 'c':
+                checkpointFilename = optarg;
+                break;
+
+            case 'k':
+            {
+                double megabytes = atof(optarg);
+                if (megabytes <= 0)
+                {
+                    Usage();
+                    return -1;
+                }
+                gNoteCacheBudget = (uint64_t)(megabytes * 1024 * 1024);
+                gUseNoteCache = 1;
+                break;
+            }
+
+            case 'l':
+            {
+                double seconds = atof(optarg);
+                if (seconds <= 0)
+                {
+                    Usage();
+                    return -1;
+                }
+                gSampleLimit = (uint64_t)(seconds * BITRATE + 0.5);
+                break;
+            }
+
+            case 'n':
+                gLoopLimit = atoi(optarg);
+                break;
+
+            case 'f':
+                formatName = optarg;
+                break;
+
+            case 'o':
+                outputFilename = optarg;
+                break;
+
+            default:
+                Usage();
+                return -1;
+        }
+    }
 
-    fwrite("WAVE", 4, 1, outputfp);
+    if (argc - optind > 1)
+    {
+        Usage();
+        return -1;
+    }
+    else if (argc - optind == 1)
+    {
+        songFilename = argv[optind];
+    }
 
-    fwrite("fmt ", 4, 1, outputfp);
-    
-    // Chunk size (4 bytes)
-    value = 16;
-    fwrite(&value, 4, 1, outputfp);
+    gOutputFormat = DefaultOutputFormat(outputFilename);
+    if (formatName != NULL && !ParseOutputFormat(formatName, &gOutputFormat))
+    {
+        Usage();
+        return -1;
+    }
 
-    // Format code (2 bytes)
-    value = 1;   //  WAVE_FORMAT_PCM
-    fwrite(&value, 2, 1, outputfp);
+    gOutputDescriptor = OutputDescriptor(outputFilename);
+    if (gOutputDescriptor >= 0)
+    {
+        // The other files are named after the output file
+        if (allSubtunes || gWriteStems || checkpointFilename != NULL)
+        {
+            printf("-a, -S and -c need an output file.\n");
+            return -1;
+        }
+
+        // Everything that would be printed goes to standard error
+        // instead, so only the audio goes down the pipe
+        if (gOutputDescriptor == STDOUT_FILENO)
+        {
+            gOutputDescriptor = dup(STDOUT_FILENO);
+            dup2(STDERR_FILENO, STDOUT_FILENO);
+        }
+        else if (fcntl(gOutputDescriptor, F_GETFD) < 0)
+        {
+            perror(outputFilename);
+            return -1;
+        }
+    }
 
-    //Number of interleaved channels (2 bytes)
-    uint16_t shortvalue = 1; // # WAVE_FORMAT_PCM
-    fwrite(&shortvalue, 2, 1, outputfp);
+    if ((gSampleLimit != 0 || gLoopLimit != 1) && (workers != 0 || checkpointFilename != NULL))
+    {
+        printf("-j and -c always render the song once.\n");
+        return -1;
+    }
 
-    //Sample rate (4 bytes)
-    value = BITRATE;
-    fwrite(&value, 4, 1, outputfp);
+    if (gUseNoteCache && (workers != 0 || checkpointFilename != NULL))
+    {
+        printf("-k can't be used with -j or -c, which have their own ways to save time.\n");
+        return -1;
+    }
 
-    // Data rate (average bytes per second) (4 bytes)
-    // Same as bitrate since we have 1 byte per sample
-    value = BITRATE;
-    fwrite(&value, 4, 1, outputfp);
+    InitializeTables();
+    PrintTables();
 
-    // Data block size (2 bytes)
-    shortvalue = 1;
-    fwrite(&shortvalue, 2, 1, outputfp);
+    uint32_t songSize;
+    char *songdata = LoadFile(songFilename, &songSize);
+    if (songdata == NULL)
+    {
+        printf("Failed to load the song data.\n");
+        return -1;
+    }
 
-    // Bits per sample (2 bytes)
-    shortvalue = 8;
-    fwrite(&shortvalue, 2, 1, outputfp);
+    if (!InitializeSong(songdata))
+    {
+        return -1;
+    }
 
-    fwrite("data", 4, 1, outputfp);
+    if (allSubtunes)
+    {
+        if (traceFilename != NULL)
+        {
+            printf("Only one subtune can be traced at a time.\n");
+            return -1;
+        }
+        if (checkpointFilename != NULL)
+        {
+            printf("-c keeps the checkpoints of one subtune, so it can't be used with -a.\n");
+            return -1;
+        }
+        if (workers != 0)
+        {
+            printf("-a already renders each subtune in its own process, so it can't be used with -j.\n");
+            return -1;
+        }
+        return RenderAllSubtunes(outputFilename) ? 0 : -1;
+    }
 
-    // Now calculate and write all the rest of the data
-    while (!OutputAudioAndCalculateNextByte());
+    if (subtune != 0 && !StartSubtune(subtune))
+    {
+        return -1;
+    }
 
-    // Go back and fill in the final length
-    fseek(outputfp, 4, SEEK_SET);
-    gTotalBytesWritten += 24; // 24 is the length of the header
-    fwrite(&gTotalBytesWritten, sizeof(gTotalBytesWritten), 1, outputfp);
-    fclose(outputfp);
+    if (workers != 0 || checkpointFilename != NULL)
+    {
+        // Each segment would need its own stems, mixer and trace, and
+        // so would the checkpoints
+        if (gStereo || gWriteStems || traceFilename != NULL || (workers != 0 && checkpointFilename != NULL))
+        {
+            printf("-j and -c only write the mono mix, and can't be used together.\n");
+            return -1;
+        }
+
+        if (checkpointFilename != NULL)
+        {
+            // Only the changed parts of the .wav are written again
+            if (gOutputFormat != OUTPUT_WAV)
+            {
+                printf("-c only writes .wav files.\n");
+                return -1;
+            }
+            return RenderWithCheckpoints(songdata, songSize, subtune, outputFilename, checkpointFilename) ? 0 : -1;
+        }
+        return RenderToFileInSegments(outputFilename, workers) ? 0 : -1;
+    }
+
+    if (traceFilename != NULL && !TraceOpen(traceFilename, songFilename))
+    {
+        return -1;
+    }
+
+    // The player's messages are written from another thread while it
+    // renders, so a slow terminal doesn't hold up the render
+    StartAsyncLog();
+    int result = RenderToFile(outputFilename) ? 0 : -1;
+    StopAsyncLog();
+    TraceClose();
+    return result;
 }
@@ -0,0 +1,698 @@
+// Golden output harness
+// Renders every test song through the reference player and through
+// each of the other ways the tools can render a song, then compares
+// them sample by sample. The reference output is also checked against
+// the hashes stored in testsongs/golden.txt so that accidental changes
+// to the synthesizer or player show up.
+//
+// Paths that are allowed to change the output declare the largest
+// difference from the reference they may have in any one sample.
+// Exact paths must match sample for sample, and the first difference
+// is reported along with the state of every voice and track at that
+// point in both renders.
+//
+// Each render runs in a forked child so that it starts from the same
+// freshly loaded player state as the other tools.
+//
+// Usage: goldentest [-u] [-g golden file] [-p path] [song.sng ...]
+
+#include <unistd.h>
+#include <glob.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "hostplayer.c"
+#include "songcompiler.c"
+#include "segmentrender.c"
+#include "framereplay.c"
+#include "framerecorder.c"
+#include "notecache.c"
+
+#define DEFAULT_GOLDEN_FILE "testsongs/golden.txt"
+
+// No song should run longer than this
+#define MAX_SAMPLES (BITRATE * 60 * 10)
+
+// How often the resume path saves and restores the player
+#define RESUME_INTERVAL (12345)
+
+// How many segments the segments path renders at once
+#define SEGMENT_WORKERS (4)
+
+// Small enough that the notecache path throws notes out and records
+// them again
+#define NOTE_CACHE_TEST_BUDGET (128 * 1024)
+
+// Where the child writes the rendered samples
+uint8_t *gOutput;
+uint32_t gOutputCount;
+uint32_t gOutputLimit;
+
+void OutputByte(uint8_t value)
+{
+    if (gSegmentOutput != NULL)
+    {
+        SegmentByte(value);
+    }
+    else if (gOutputCount < gOutputLimit)
+    {
+        gOutput[gOutputCount++] = value;
+    }
+}
+
+// Renders until the song ends or the limit is reached
+void RenderSamples()
+{
+    while (gOutputCount < gOutputLimit)
+    {
+        if (OutputAudioAndCalculateNextByte())
+        {
+            break;
+        }
+    }
+}
+
+// The normal player, one sample at a time
+int RenderReference(const char *songdata)
+{
+    if (!InitializeSong(songdata))
+    {
+        return 0;
+    }
+
+    RenderSamples();
+    return 1;
+}
+
+// Plays the song the way the firmware does after songc has compiled it.
+// The host keeps its instruments with the names, so they're copied out
+// of the compiled song.
+int LoadCompiledSong(const uint8_t *compiled)
+{
+    const struct CompiledSong *song = (const struct CompiledSong *)compiled;
+    if (song->magic != COMPILED_SONG_MAGIC)
+    {
+        return 0;
+    }
+
+    gNumSubtunes = song->numSubtunes;
+    gNumInstruments = song->numInstruments;
+    gNumPatterns = song->numPatterns;
+    gWavetableSize = song->wavetableSize;
+    gPulsetableSize = song->pulsetableSize;
+    gFiltertableSize = song->filtertableSize;
+    gSpeedtableSize = song->speedtableSize;
+
+    const uint16_t *orderlistOffsets = (const uint16_t *)(compiled + song->orderlistOffsets);
+    for (int subtune = 0 ; subtune < gNumSubtunes && subtune < MAX_SUBTUNES ; subtune++)
+    {
+        for (int channel = 0 ; channel < NUM_CHANNELS ; channel++)
+        {
+            orderlist[subtune][channel] = (const char *)compiled + orderlistOffsets[subtune * NUM_CHANNELS + channel];
+        }
+    }
+
+    // This player reads whole rows, so the runs of empty rows are
+    // filled back in, up to the end of each pattern
+    const uint16_t *patternOffsets = (const uint16_t *)(compiled + song->patternOffsets);
+    for (int i = 0 ; i < gNumPatterns ; i++)
+    {
+        const uint8_t *data = compiled + patternOffsets[i];
+        struct PatternRow *rows = calloc(256, sizeof(struct PatternRow));
+        int row = 0;
+        do
+        {
+            if (data[0] == EMPTY_ROWS_MARKER)
+            {
+                row += data[1];
+                data += 2;
+            }
+            else
+            {
+                memcpy(&rows[row++], data, sizeof(struct PatternRow));
+                data += sizeof(struct PatternRow);
+            }
+        } while (row < 256 && (row == 0 || rows[row - 1].action != RowPatternEnd));
+        pattern[i] = rows;
+    }
+
+    struct Instrument *instruments = calloc(gNumInstruments, sizeof(struct Instrument));
+    for (int i = 0 ; i < gNumInstruments ; i++)
+    {
+        memcpy(&instruments[i], compiled + song->instruments + i * offsetof(struct Instrument, name),
+            offsetof(struct Instrument, name));
+    }
+    gInstruments = instruments;
+
+    gWavetable = (uint8_t *)compiled + song->wavetable;
+    gPulsetable = (uint8_t *)compiled + song->pulsetable;
+    gFiltertable = (uint8_t *)compiled + song->filtertable;
+    gSpeedtable = (uint8_t *)compiled + song->speedtable;
+
+    return StartSubtune(0);
+}
+
+int RenderCompiled(const char *songdata)
+{
+    if (!InitializeSong(songdata) || CompileSong() == 0)
+    {
+        return 0;
+    }
+
+    if (!LoadCompiledSong(gCompiled))
+    {
+        return 0;
+    }
+
+    RenderSamples();
+    return 1;
+}
+
+// Saves the player state every so often, scribbles over the player
+// and restores it, the way the render cache resumes from a chunk
+int RenderResume(const char *songdata)
+{
+    if (!InitializeSong(songdata))
+    {
+        return 0;
+    }
+
+    uint32_t limit = gOutputLimit;
+    while (gOutputCount < limit)
+    {
+        gOutputLimit = gOutputCount + RESUME_INTERVAL;
+        if (gOutputLimit > limit)
+        {
+            gOutputLimit = limit;
+        }
+
+        uint32_t start = gOutputCount;
+        RenderSamples();
+        if (gOutputCount < gOutputLimit)
+        {
+            // The song ended
+            break;
+        }
+
+        struct PlayerState state;
+        SavePlayerState(&state);
+        memset(channels, 0x55, sizeof(channels));
+        memset(gTrackData, 0x55, sizeof(gTrackData));
+        memset(&gFilter, 0x55, sizeof(gFilter));
+        gNoise = 0;
+        vbiCount = 0;
+        gNextOutputValue = 0;
+        RestorePlayerState(&state);
+
+        if (gOutputCount == start)
+        {
+            break;
+        }
+    }
+
+    gOutputLimit = limit;
+    return 1;
+}
+
+// Renders the song in segments on several cores and joins them up
+int RenderInSegments(const char *songdata)
+{
+    if (!InitializeSong(songdata))
+    {
+        return 0;
+    }
+
+    int64_t samples = RenderSegments(gOutput, gOutputLimit, SEGMENT_WORKERS);
+    if (samples < 0)
+    {
+        return 0;
+    }
+
+    gOutputCount = samples;
+    return 1;
+}
+
+// Records what every tick changes the way framec does, then plays the
+// song again from the recording alone
+int RenderFrames(const char *songdata)
+{
+    if (!InitializeSong(songdata))
+    {
+        return 0;
+    }
+
+    // Nothing is kept from the recording pass
+    uint32_t limit = gOutputLimit;
+    gOutputLimit = 0;
+    uint32_t size = RecordFrames(limit / VBI_COUNT + 1);
+    gOutputLimit = limit;
+    if (size == 0 || !InitializeFrameReplay((const char *)gFrames))
+    {
+        return 0;
+    }
+
+    RenderSamples();
+    return 1;
+}
+
+// Takes every note it can from the note cache
+int RenderNoteCache(const char *songdata)
+{
+    if (!InitializeSong(songdata))
+    {
+        return 0;
+    }
+
+    gNoteCacheBudget = NOTE_CACHE_TEST_BUDGET;
+    StartNoteCache();
+    while (gOutputCount < gOutputLimit)
+    {
+        if (OutputAudioFromNoteCache())
+        {
+            break;
+        }
+    }
+    return 1;
+}
+
+struct RenderPath
+{
+    const char *name;
+    int (*render)(const char *songdata);
+
+    // Largest difference from the reference allowed in any sample.
+    // 0 means the output has to be identical.
+    uint8_t maxError;
+};
+
+// The first path is the reference the others are compared against
+const struct RenderPath gPaths[] =
+{
+    { "reference", RenderReference, 0 },
+    { "compiled", RenderCompiled, 0 },
+    { "resume", RenderResume, 0 },
+    { "segments", RenderInSegments, 0 },
+    { "frames", RenderFrames, 0 },
+    { "notecache", RenderNoteCache, 0 },
+};
+
+#define NUM_PATHS (sizeof(gPaths) / sizeof(gPaths[0]))
+
+void DumpPlayerState()
+{
+    printf("      vbiCount %u  noise 0x%04X  next output 0x%02X\n",
+        vbiCount, gNoise, gNextOutputValue);
+
+    for (int channel = 0 ; channel < NUM_CHANNELS ; channel++)
+    {
+        struct Voice *voice = &channels[channel];
+        printf("      Voice %d: steps 0x%04X offset 0x%04X ADSR 0x%02X%02X phase %d countdown %u fade %u control 0x%02X pulse 0x%03X\n",
+            channel, voice->steps, voice->tableOffset, voice->attackDecay, voice->sustainRelease,
+            voice->envelopePhase, voice->phaseStepCountdown, voice->fadeAmount, voice->control, voice->pulseWidth);
+    }
+
+    for (int channel = 0 ; channel < NUM_CHANNELS ; channel++)
+    {
+        struct Track *track = &gTrackData[channel];
+        uint8_t patternNumber, row;
+        FindTrackRow(track, &patternNumber, &row);
+        printf("      Track %d: orderlist %u pattern %u row %u repeat %u transpose %d tempo %u countdown %u\n",
+            channel, track->orderlistPosition, patternNumber, row, track->patternRepeatCountdown,
+            track->semitoneOffset, track->tempo, track->trackStepCountdown);
+        printf("               instrument %d note %u wave %u delay %u pulse %u repeat %u change %d\n",
+            track->instrumentNumber, track->currentNote, track->wavetablePosition, track->wavetableDelay,
+            track->pulsetablePosition, track->pulseRepeatCountdown, track->pulseChange);
+    }
+
+    printf("      Filter: position %u countdown %u cutoff 0x%02X type 0x%02X resonance %u routing 0x%X low %d band %d\n",
+        gFilter.tablePosition, gFilter.modulationCountdown, gFilter.cutoff, gFilter.type,
+        gFilter.resonance, gFilter.routing, gFilter.low, gFilter.band);
+}
+
+// Renders the song with one of the paths in a child process.
+// With dumpState set, the child prints the player state once it's
+// done. Returns the number of samples or -1 if the render failed.
+int64_t RenderInChild(const struct RenderPath *path, const char *songdata, uint8_t *output, uint32_t limit, int dumpState)
+{
+    // The sample count comes back at the end of the output buffer
+    uint32_t *count = (uint32_t *)(output + MAX_SAMPLES);
+    *count = 0;
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        gOutput = output;
+        gOutputCount = 0;
+        gOutputLimit = limit;
+
+        if (!path->render(songdata))
+        {
+            _exit(1);
+        }
+
+        *count = gOutputCount;
+        if (dumpState)
+        {
+            DumpPlayerState();
+        }
+        fflush(stdout);
+        _exit(0);
+    }
+    else if (pid < 0)
+    {
+        perror("fork");
+        return -1;
+    }
+
+    int status;
+    if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        return -1;
+    }
+
+    return *count;
+}
+
+struct GoldenEntry
+{
+    char song[256];
+    uint32_t samples;
+    uint64_t hash;
+};
+
+struct GoldenEntry gGolden[256];
+int gNumGolden;
+int gGoldenVersion;
+
+void LoadGolden(const char *filename)
+{
+    FILE *fp = fopen(filename, "r");
+    if (fp == NULL)
+    {
+        return;
+    }
+
+    char line[512];
+    while (fgets(line, sizeof(line), fp) != NULL && gNumGolden < 256)
+    {
+        struct GoldenEntry *entry = &gGolden[gNumGolden];
+        unsigned long long hash;
+
+        if (line[0] == '#')
+        {
+            continue;
+        }
+        else if (sscanf(line, "version %d", &gGoldenVersion) == 1)
+        {
+            continue;
+        }
+        else if (sscanf(line, "%255s %u %llx", entry->song, &entry->samples, &hash) == 3)
+        {
+            entry->hash = hash;
+            gNumGolden++;
+        }
+    }
+
+    fclose(fp);
+}
+
+int SaveGolden(const char *filename)
+{
+    FILE *fp = fopen(filename, "w");
+    if (fp == NULL)
+    {
+        perror(filename);
+        return 0;
+    }
+
+    fprintf(fp, "# Output of the reference player for each test song: samples and FNV-1a hash.\n");
+    fprintf(fp, "# Checked by goldentest. When a change is meant to alter the output, bump\n");
+    fprintf(fp, "# SIDISH_VERSION and regenerate this file with ./goldentest -u\n");
+    fprintf(fp, "version %d\n", SIDISH_VERSION);
+    for (int i = 0 ; i < gNumGolden ; i++)
+    {
+        fprintf(fp, "%s %u %016llx\n", gGolden[i].song, gGolden[i].samples, (unsigned long long)gGolden[i].hash);
+    }
+
+    fclose(fp);
+    return 1;
+}
+
+struct GoldenEntry *FindGolden(const char *song)
+{
+    for (int i = 0 ; i < gNumGolden ; i++)
+    {
+        if (strcmp(gGolden[i].song, song) == 0)
+        {
+            return &gGolden[i];
+        }
+    }
+    return NULL;
+}
+
+// Compares a path's output against the reference.
+// Returns 1 if it's within the path's error bound.
+int ComparePath(const struct RenderPath *path, const char *songdata,
+    const uint8_t *reference, uint32_t referenceSamples,
+    uint8_t *output, uint32_t samples)
+{
+    uint32_t length = samples < referenceSamples ? samples : referenceSamples;
+    uint32_t firstDifference = UINT32_MAX;
+    uint32_t largestError = 0;
+    double squaredError = 0;
+
+    for (uint32_t i = 0 ; i < length ; i++)
+    {
+        int error = abs((int)output[i] - (int)reference[i]);
+        if (error != 0 && firstDifference == UINT32_MAX)
+        {
+            firstDifference = i;
+        }
+        if (error > largestError)
+        {
+            largestError = error;
+        }
+        squaredError += error * error;
+    }
+
+    if (samples != referenceSamples)
+    {
+        printf("  %-10s FAIL  %u samples instead of %u\n", path->name, samples, referenceSamples);
+        if (firstDifference == UINT32_MAX)
+        {
+            return 0;
+        }
+    }
+    else if (largestError <= path->maxError)
+    {
+        if (path->maxError == 0)
+        {
+            printf("  %-10s OK    identical\n", path->name);
+        }
+        else
+        {
+            printf("  %-10s OK    largest error %u (allowed %u), RMS error %.3f\n", path->name,
+                largestError, path->maxError, length ? sqrt(squaredError / length) : 0.0);
+        }
+        return 1;
+    }
+    else
+    {
+        printf("  %-10s FAIL  largest error %u (allowed %u), RMS error %.3f\n", path->name,
+            largestError, path->maxError, length ? sqrt(squaredError / length) : 0.0);
+    }
+
+    printf("    First difference at sample %u (%.3f s, tick %u): reference 0x%02X, %s 0x%02X\n",
+        firstDifference, (double)firstDifference / BITRATE, firstDifference / VBI_COUNT,
+        reference[firstDifference], path->name, output[firstDifference]);
+
+    // Render both again up to that sample to show what the player
+    // looked like when they went apart
+    printf("    Reference state:\n");
+    RenderInChild(&gPaths[0], songdata, output, firstDifference + 1, 1);
+    printf("    %s state:\n", path->name);
+    RenderInChild(path, songdata, output, firstDifference + 1, 1);
+
+    return 0;
+}
+
+void Usage()
+{
+    printf("Usage: goldentest [-u] [-g golden file] [-p path] [song.sng ...]\n");
+    printf("  -u  Update the golden hashes from the reference output\n");
+    printf("  -g  Golden hash file (default %s)\n", DEFAULT_GOLDEN_FILE);
+    printf("  -p  Only check this path against the reference (can be repeated)\n");
+    printf("Paths:");
+    for (int i = 0 ; i < NUM_PATHS ; i++)
+    {
+        printf(" %s", gPaths[i].name);
+    }
+    printf("\nWithout songs, checks Comic_Bakery.sng and testsongs/*.sng\n");
+}
+
+int main(int argc, char *argv[])
+{
+    const char *goldenFilename = DEFAULT_GOLDEN_FILE;
+    int update = 0;
+    int selected[NUM_PATHS] = { 0 };
+    int anySelected = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "ug:p:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'u':
+                update = 1;
+                break;
+
+            case 'g':
+                goldenFilename = optarg;
+                break;
+
+            case 'p':
+            {
+                int i;
+                for (i = 0 ; i < NUM_PATHS ; i++)
+                {
+                    if (strcmp(optarg, gPaths[i].name) == 0)
+                    {
+                        selected[i] = 1;
+                        anySelected = 1;
+                        break;
+                    }
+                }
+                if (i == NUM_PATHS)
+                {
+                    printf("Unknown path %s\n", optarg);
+                    Usage();
+                    return -1;
+                }
+                break;
+            }
+
+            default:
+                Usage();
+                return -1;
+        }
+    }
+
+    glob_t songs;
+    memset(&songs, 0, sizeof(songs));
+    if (optind < argc)
+    {
+        for (int i = optind ; i < argc ; i++)
+        {
+            glob(argv[i], GLOB_NOCHECK | (i > optind ? GLOB_APPEND : 0), NULL, &songs);
+        }
+    }
+    else
+    {
+        glob("Comic_Bakery.sng", 0, NULL, &songs);
+        glob("testsongs/*.sng", GLOB_APPEND, NULL, &songs);
+    }
+
+    LoadGolden(goldenFilename);
+    if (!update && gNumGolden > 0 && gGoldenVersion != SIDISH_VERSION)
+    {
+        printf("Golden hashes are from SIDISH_VERSION %d, this is version %d.\n", gGoldenVersion, SIDISH_VERSION);
+        printf("Run ./goldentest -u if the output is meant to have changed.\n");
+    }
+
+    gPrintEnabled = 0;
+    InitializeTables();
+
+    // Shared with the children, with room for the sample count at the end
+    size_t bufferSize = MAX_SAMPLES + sizeof(uint32_t);
+    uint8_t *reference = mmap(NULL, bufferSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    uint8_t *output = mmap(NULL, bufferSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (reference == MAP_FAILED || output == MAP_FAILED)
+    {
+        perror("mmap");
+        return -1;
+    }
+
+    int failures = 0;
+    for (size_t s = 0 ; s < songs.gl_pathc ; s++)
+    {
+        const char *song = songs.gl_pathv[s];
+        char *songdata = LoadFile(song, NULL);
+        if (songdata == NULL)
+        {
+            failures++;
+            continue;
+        }
+
+        printf("%s\n", song);
+
+        int64_t referenceSamples = RenderInChild(&gPaths[0], songdata, reference, MAX_SAMPLES, 0);
+        if (referenceSamples < 0)
+        {
+            printf("  %-10s FAIL  couldn't render\n", gPaths[0].name);
+            failures++;
+            free(songdata);
+            continue;
+        }
+
+        uint64_t hash = HashBytes(reference, referenceSamples, FNV_OFFSET_BASIS);
+        struct GoldenEntry *golden = FindGolden(song);
+        if (update)
+        {
+            if (golden == NULL && gNumGolden < 256)
+            {
+                golden = &gGolden[gNumGolden++];
+                snprintf(golden->song, sizeof(golden->song), "%s", song);
+            }
+            if (golden != NULL)
+            {
+                golden->samples = referenceSamples;
+                golden->hash = hash;
+            }
+            printf("  %-10s %u samples, hash %016llx\n", "golden", (uint32_t)referenceSamples, (unsigned long long)hash);
+        }
+        else if (golden == NULL)
+        {
+            printf("  %-10s none  run ./goldentest -u to add it\n", "golden");
+        }
+        else if (golden->samples != referenceSamples || golden->hash != hash)
+        {
+            printf("  %-10s FAIL  %u samples, hash %016llx, expected %u samples, hash %016llx\n", "golden",
+                (uint32_t)referenceSamples, (unsigned long long)hash, golden->samples, (unsigned long long)golden->hash);
+            failures++;
+        }
+        else
+        {
+            printf("  %-10s OK    hash %016llx\n", "golden", (unsigned long long)hash);
+        }
+
+        for (int i = 1 ; i < NUM_PATHS ; i++)
+        {
+            if (anySelected && !selected[i])
+            {
+                continue;
+            }
+
+            int64_t samples = RenderInChild(&gPaths[i], songdata, output, MAX_SAMPLES, 0);
+            if (samples < 0)
+            {
+                printf("  %-10s FAIL  couldn't render\n", gPaths[i].name);
+                failures++;
+            }
+            else if (!ComparePath(&gPaths[i], songdata, reference, referenceSamples, output, samples))
+            {
+                failures++;
+            }
+        }
+
+        free(songdata);
+    }
+
+    if (update && !SaveGolden(goldenFilename))
+    {
+        return -1;
+    }
+
+    printf("%d failure%s\n", failures, failures == 1 ? "" : "s");
+    return failures ? 1 : 0;
+}
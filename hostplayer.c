@@ -0,0 +1,572 @@
+// Support routines shared by the tools that run the player on the
+// host system instead of an ATmega.
+// Like goatplayer.c, this gets included directly into each tool so
+// the player can still be built as a single unit.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "sidish.h"
+
+// This table holds the number of steps through the
+// SINE_TABLE for each cycle of the BITRATE.
+// This is essentially a fixed point floating point table.
+// The high 16 bits are used as the lookup into the SINE_TABLE
+// and the low 16 bits are the error in units of 1/65536ths.
+uint32_t FREQUENCY_TABLE[NUM_PIANO_KEYS];
+uint16_t SAWTOOTH_TABLE[NUM_PIANO_KEYS];
+
+// Filter frequency coefficient for each filtertable cutoff value
+uint8_t FILTER_CUTOFF_TABLE[256];
+
+// Voice steps for a SID frequency register, split so that the steps
+// are SID_FREQUENCY_HIGH_TABLE[high byte] + SID_FREQUENCY_LOW_TABLE[low byte]
+uint16_t SID_FREQUENCY_HIGH_TABLE[256];
+uint8_t SID_FREQUENCY_LOW_TABLE[256];
+
+// Clock of a PAL C64's SID. Its oscillators add the frequency register
+// to a 24 bit accumulator every cycle.
+#define SID_CLOCK (985248.0)
+
+
+#define pgm_read_byte(x) *(uint8_t*)(x)
+#define pgm_read_word(x) *(uint16_t*)(x)
+#define pgm_read_dword(x) *(uint32_t*)(x)
+#define memcpy_P memcpy
+
+#include "goatplayer.c"
+
+// Clear to silence the messages from the player
+int gPrintEnabled = 1;
+
+// Where the messages from the player go, and how many bytes of them
+// have been written
+FILE *gLogFile;
+uint64_t gLogBytes = 0;
+
+// Messages can be handed to a background thread to write out instead,
+// so the player doesn't wait on a slow terminal or pipe in the middle
+// of a render (see StartAsyncLog).
+#define ASYNC_LOG_SIZE (64 * 1024)
+
+struct AsyncLog
+{
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    int running;
+    int stopping;
+
+    // Ring buffer of messages. head and tail count every byte ever
+    // added and written, so head - tail is how much is waiting.
+    char buffer[ASYNC_LOG_SIZE];
+    uint64_t head;
+    uint64_t tail;
+} gAsyncLog = { .lock = PTHREAD_MUTEX_INITIALIZER, .changed = PTHREAD_COND_INITIALIZER };
+
+static void *AsyncLogThread(void *unused)
+{
+    pthread_mutex_lock(&gAsyncLog.lock);
+    while (1)
+    {
+        while (gAsyncLog.head == gAsyncLog.tail && !gAsyncLog.stopping)
+        {
+            pthread_cond_wait(&gAsyncLog.changed, &gAsyncLog.lock);
+        }
+        if (gAsyncLog.head == gAsyncLog.tail)
+        {
+            break;
+        }
+
+        // Write up to the end of the buffer without holding the lock,
+        // so the player can keep adding messages
+        size_t start = gAsyncLog.tail % ASYNC_LOG_SIZE;
+        size_t length = gAsyncLog.head - gAsyncLog.tail;
+        if (length > ASYNC_LOG_SIZE - start)
+        {
+            length = ASYNC_LOG_SIZE - start;
+        }
+        pthread_mutex_unlock(&gAsyncLog.lock);
+
+        fwrite(gAsyncLog.buffer + start, 1, length, gLogFile);
+
+        pthread_mutex_lock(&gAsyncLog.lock);
+        gAsyncLog.tail += length;
+        pthread_cond_signal(&gAsyncLog.changed);
+    }
+    pthread_mutex_unlock(&gAsyncLog.lock);
+
+    fflush(gLogFile);
+    return NULL;
+}
+
+// Starts writing the messages from a background thread.
+// Returns 0 if the thread can't be started, in which case they're
+// still written directly.
+int StartAsyncLog()
+{
+    if (gLogFile == NULL)
+    {
+        gLogFile = stdout;
+    }
+
+    gAsyncLog.head = 0;
+    gAsyncLog.tail = 0;
+    gAsyncLog.stopping = 0;
+    if (pthread_create(&gAsyncLog.thread, NULL, AsyncLogThread, NULL) != 0)
+    {
+        return 0;
+    }
+    gAsyncLog.running = 1;
+    return 1;
+}
+
+// Waits for every message to be written and stops the thread.
+// Has to be called before forking, since the thread isn't copied.
+void StopAsyncLog()
+{
+    if (!gAsyncLog.running)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&gAsyncLog.lock);
+    gAsyncLog.stopping = 1;
+    pthread_cond_signal(&gAsyncLog.changed);
+    pthread_mutex_unlock(&gAsyncLog.lock);
+
+    pthread_join(gAsyncLog.thread, NULL);
+    gAsyncLog.running = 0;
+}
+
+static void LogWrite(const char *text, size_t length)
+{
+    gLogBytes += length;
+    if (gLogFile == NULL)
+    {
+        gLogFile = stdout;
+    }
+
+    if (!gAsyncLog.running)
+    {
+        fwrite(text, 1, length, gLogFile);
+        return;
+    }
+
+    pthread_mutex_lock(&gAsyncLog.lock);
+    while (length > 0)
+    {
+        // Only waits if the writer has fallen a whole buffer behind
+        while (gAsyncLog.head - gAsyncLog.tail == ASYNC_LOG_SIZE)
+        {
+            pthread_cond_wait(&gAsyncLog.changed, &gAsyncLog.lock);
+        }
+
+        int wasEmpty = (gAsyncLog.head == gAsyncLog.tail);
+        while (length > 0 && gAsyncLog.head - gAsyncLog.tail < ASYNC_LOG_SIZE)
+        {
+            gAsyncLog.buffer[gAsyncLog.head++ % ASYNC_LOG_SIZE] = *text++;
+            length--;
+        }
+
+        if (wasEmpty)
+        {
+            pthread_cond_signal(&gAsyncLog.changed);
+        }
+    }
+    pthread_mutex_unlock(&gAsyncLog.lock);
+}
+
+void print(char *message)
+{
+    if (gPrintEnabled)
+    {
+        LogWrite(message, strlen(message));
+    }
+}
+
+void print8int(int8_t value)
+{
+    if (gPrintEnabled)
+    {
+        char text[8];
+        LogWrite(text, snprintf(text, sizeof(text), "%d", value));
+    }
+}
+
+void print8hex(uint8_t value)
+{
+    if (gPrintEnabled)
+    {
+        char text[8];
+        LogWrite(text, snprintf(text, sizeof(text), "%02X", value));
+    }
+}
+
+void printint(int value)
+{
+    if (gPrintEnabled)
+    {
+        char text[16];
+        LogWrite(text, snprintf(text, sizeof(text), "%d", value));
+    }
+}
+
+void InitializeTables()
+{
+    int x;
+
+    // Sawtooth waveform:
+    // ------------------
+    // Repeats every BITRATE / FREQUENCY
+    // At the start of each cycle, we start at 0 and count up to 63,
+    // which is 64 steps.
+    // So, each BITRATE interrupt, step by 64 / BITRATE / FREQUENCY
+    // Use a 16 bit format with the format:
+    // value | 1/256ths value
+    // Then subtract 32 from the most significant byte before using it
+
+    for (x = 0 ; x < NUM_PIANO_KEYS ; x++)
+    {
+        double frequency = pow(2, (x-49.0)/12.0) * 440.0;
+
+        // Calculate the steps for the sine wave table
+        double steps = (frequency / (double)BITRATE * (double)TABLE_SIZE);
+        uint16_t frequencySteps = (uint16_t) steps;
+        uint16_t error = (uint16_t)floor(steps * 65536 - frequencySteps * 65536);
+        FREQUENCY_TABLE[x] = ((uint16_t)frequencySteps << 16) | ((uint16_t)error & 0xFFFF);
+
+        // Calculate the steps for the sawtooth table
+        steps = frequency * 64.0 / (double)BITRATE;
+        frequencySteps = (uint16_t)steps;
+        error = (uint16_t)floor(steps * 256 - frequencySteps * 256);
+        SAWTOOTH_TABLE[x] = (frequencySteps << 8) | (error & 0xFF);
+    }
+
+    // Filter cutoff:
+    // --------------
+    // The cutoff in the filtertable is the top 8 bits of the SID's
+    // cutoff register. Loosely follows the curve of a 6581, which
+    // most songs were written for: 200 Hz at 0 and an octave higher
+    // every 0x20 after that.
+    // The filter uses 2 * sin(pi * cutoff / BITRATE) as a 0.8 fixed
+    // point value, which can't go past FILTER_MAX_FREQUENCY.
+    for (x = 0 ; x < 256 ; x++)
+    {
+        double cutoff = 200.0 * pow(2.0, x / 32.0);
+        double frequency = 2.0 * sin(M_PI * fmin(cutoff, BITRATE / 4.0) / BITRATE) * 256.0;
+        FILTER_CUTOFF_TABLE[x] = (uint8_t)fmin(frequency, FILTER_MAX_FREQUENCY);
+    }
+
+    // SID frequency registers:
+    // ------------------------
+    // A register value of f plays f * SID_CLOCK / 2^24 Hz, and a voice
+    // steps through its 64 positions (in 1/256ths) that many times a
+    // second. Both halves are rounded, so the sum is at most one step
+    // out from working it out in full.
+    double stepsPerUnit = SID_CLOCK / 16777216.0 * 64.0 * 256.0 / BITRATE;
+    for (x = 0 ; x < 256 ; x++)
+    {
+        SID_FREQUENCY_HIGH_TABLE[x] = (uint16_t)lround(x * 256 * stepsPerUnit);
+        SID_FREQUENCY_LOW_TABLE[x] = (uint8_t)lround(x * stepsPerUnit);
+    }
+}
+
+// 64 bit FNV-1a hash. Pass the result of a previous call as the
+// hash to continue hashing more data, or FNV_OFFSET_BASIS to start.
+#define FNV_OFFSET_BASIS (0xCBF29CE484222325ULL)
+
+uint64_t HashBytes(const void *data, size_t length, uint64_t hash)
+{
+    const uint8_t *bytes = (const uint8_t *)data;
+
+    while (length-- > 0)
+    {
+        hash ^= *bytes++;
+        hash *= 0x100000001B3ULL;
+    }
+
+    return hash;
+}
+
+// Everything needed to pick up rendering from the middle of a song.
+// Positions in the pattern data are kept as pattern and row numbers
+// instead of pointers so a state can be saved to a file and used by
+// another process playing the same song.
+struct PlayerState
+{
+    struct Voice voices[NUM_CHANNELS];
+    struct Track tracks[NUM_CHANNELS];
+    struct Filter filter;
+    uint8_t patternNumber[NUM_CHANNELS];
+    uint8_t patternRow[NUM_CHANNELS];
+    uint16_t noise;
+    uint16_t vbiCount;
+    uint8_t nextOutputValue;
+    uint8_t subtune;
+};
+
+// Finds which pattern a position in the pattern data is in
+uint8_t FindPattern(PatternPosition position)
+{
+    // Patterns are stored one after another, so find the last one
+    // that starts at or before the position
+    int low = 0;
+    int high = gNumPatterns - 1;
+    while (low < high)
+    {
+        int middle = (low + high + 1) / 2;
+        if (PATTERN(middle) <= position)
+        {
+            low = middle;
+        }
+        else
+        {
+            high = middle - 1;
+        }
+    }
+
+    return (uint8_t)low;
+}
+
+// Finds which pattern and row a track is at
+void FindTrackRow(const struct Track *track, uint8_t *patternNumber, uint8_t *row)
+{
+    *patternNumber = FindPattern(track->songPosition);
+
+#if COMPILED_SONG
+    // Rows aren't all the same size, so count them from the start
+    struct Track counter;
+    memset(&counter, 0, sizeof(counter));
+    counter.songPosition = PATTERN(*patternNumber);
+    for (*row = 0 ; counter.songPosition != track->songPosition || counter.emptyRow != track->emptyRow ; (*row)++)
+    {
+        NextPatternRow(&counter);
+    }
+#else
+    *row = (uint8_t)((track->songPosition - PATTERN(*patternNumber)) / PATTERN_ROW_SIZE);
+#endif
+}
+
+// Puts a track at a row of a pattern
+void SetTrackRow(struct Track *track, uint8_t patternNumber, uint8_t row)
+{
+    track->songPosition = PATTERN(patternNumber);
+#if COMPILED_SONG
+    track->emptyRow = 0;
+    while (row-- > 0)
+    {
+        NextPatternRow(track);
+    }
+#else
+    track->songPosition += PATTERN_ROW_SIZE * row;
+#endif
+}
+
+void SavePlayerState(struct PlayerState *state)
+{
+    memset(state, 0, sizeof(*state));
+    memcpy(state->voices, channels, sizeof(state->voices));
+    memcpy(state->tracks, gTrackData, sizeof(state->tracks));
+    state->filter = gFilter;
+
+    for (uint8_t channel = 0 ; channel < NUM_CHANNELS ; channel++)
+    {
+        FindTrackRow(&gTrackData[channel], &state->patternNumber[channel], &state->patternRow[channel]);
+        state->tracks[channel].songPosition = NULL;
+#if COMPILED_SONG
+        state->tracks[channel].emptyRow = 0;
+#endif
+    }
+
+    state->noise = gNoise;
+    state->vbiCount = vbiCount;
+    state->nextOutputValue = gNextOutputValue;
+    state->subtune = gSubtune;
+}
+
+void RestorePlayerState(const struct PlayerState *state)
+{
+    memcpy(channels, state->voices, sizeof(state->voices));
+    memcpy(gTrackData, state->tracks, sizeof(state->tracks));
+    gFilter = state->filter;
+
+    for (uint8_t channel = 0 ; channel < NUM_CHANNELS ; channel++)
+    {
+        SetTrackRow(&gTrackData[channel], state->patternNumber[channel], state->patternRow[channel]);
+    }
+
+    gNoise = state->noise;
+    vbiCount = state->vbiCount;
+    gNextOutputValue = state->nextOutputValue;
+    gSubtune = state->subtune;
+}
+
+// Reads an entire file into memory.
+// Returns NULL (after printing the reason) if it can't be read.
+// The caller is responsible for freeing the returned data.
+char *LoadFile(const char *filename, uint32_t *size)
+{
+    FILE *fp;
+    fp = fopen(filename, "rb");
+    if (fp == NULL)
+    {
+        printf("Failed to open %s.\n", filename);
+        return NULL;
+    }
+
+    struct stat filestat;
+    int error = fstat(fileno(fp), &filestat);
+    if (error != 0)
+    {
+        printf("Failed to stat %s.\n", filename);
+        fclose(fp);
+        return NULL;
+    }
+
+    char *data = malloc(filestat.st_size);
+    if (data == NULL)
+    {
+        printf("Failed to malloc for %s.\n", filename);
+        fclose(fp);
+        return NULL;
+    }
+
+    size_t bytesRead = fread(data, 1, filestat.st_size, fp);
+    fclose(fp);
+    if (bytesRead != filestat.st_size)
+    {
+        printf("Failed to read %s. Got %zu of %u bytes.\n", filename, bytesRead, (uint32_t)filestat.st_size);
+        free(data);
+        return NULL;
+    }
+
+    if (size != NULL)
+    {
+        *size = (uint32_t)filestat.st_size;
+    }
+
+    return data;
+}
+
+// Checks that everything InitializeSong reads is in the file, so a
+// song that's only partly written can't be read past its end.
+// Returns 0 if it isn't a complete GoatTracker song.
+int SongIsComplete(const uint8_t *data, uint32_t size)
+{
+    uint32_t position = 4 + 3 * 32;
+    if (size < position + 1 || memcmp(data, "GTS5", 4) != 0)
+    {
+        return 0;
+    }
+
+    uint8_t numSubtunes = data[position++];
+    for (int orderlist = 0 ; orderlist < numSubtunes * NUM_CHANNELS ; orderlist++)
+    {
+        if (position >= size)
+        {
+            return 0;
+        }
+        position += 1 + data[position] + 1;
+    }
+
+    if (position >= size)
+    {
+        return 0;
+    }
+    position += 1 + data[position] * 25;
+
+    // Wave, pulse, filter and speed tables
+    for (int table = 0 ; table < 4 ; table++)
+    {
+        if (position >= size)
+        {
+            return 0;
+        }
+        position += 1 + data[position] * 2;
+    }
+
+    if (position >= size)
+    {
+        return 0;
+    }
+    uint8_t numPatterns = data[position++];
+    for (int number = 0 ; number < numPatterns ; number++)
+    {
+        if (position >= size)
+        {
+            return 0;
+        }
+        position += 1 + data[position] * 4;
+    }
+
+    return position <= size;
+}
+
+// Length to put in a .wav header that will never be filled in,
+// such as when it's streamed over a socket
+#define WAV_UNKNOWN_LENGTH (0xFFFFFFFF)
+
+// Writes a .wav file header for PCM data. If the length isn't known
+// yet, pass 0 and fill it in with FinishWavFile later.
+void WriteWavHeader(FILE *fp, uint32_t sampleRate, uint16_t numChannels, uint16_t bitsPerSample, uint32_t dataLength)
+{
+    uint32_t value;
+    uint16_t shortvalue;
+    uint16_t blockSize = numChannels * bitsPerSample / 8;
+
+    fwrite("RIFF", 4, 1, fp);
+
+    // Total size of the rest of the file (4 unsigned bytes)
+    value = (dataLength == WAV_UNKNOWN_LENGTH) ? WAV_UNKNOWN_LENGTH : dataLength + 36;
+    fwrite(&value, 4, 1, fp);
+
+    fwrite("WAVE", 4, 1, fp);
+
+    fwrite("fmt ", 4, 1, fp);
+
+    // Chunk size (4 bytes)
+    value = 16;
+    fwrite(&value, 4, 1, fp);
+
+    // Format code (2 bytes)
+    shortvalue = 1;   //  WAVE_FORMAT_PCM
+    fwrite(&shortvalue, 2, 1, fp);
+
+    //Number of interleaved channels (2 bytes)
+    fwrite(&numChannels, 2, 1, fp);
+
+    //Sample rate (4 bytes)
+    fwrite(&sampleRate, 4, 1, fp);
+
+    // Data rate (average bytes per second) (4 bytes)
+    value = sampleRate * blockSize;
+    fwrite(&value, 4, 1, fp);
+
+    // Data block size (2 bytes)
+    fwrite(&blockSize, 2, 1, fp);
+
+    // Bits per sample (2 bytes)
+    fwrite(&bitsPerSample, 2, 1, fp);
+
+    fwrite("data", 4, 1, fp);
+
+    // Size of the data (4 bytes)
+    fwrite(&dataLength, 4, 1, fp);
+}
+
+// Go back and fill in the lengths in a header written by WriteWavHeader
+void FinishWavFile(FILE *fp, uint32_t dataLength)
+{
+    uint32_t value = dataLength + 36; // 36 is the length of the header after the RIFF size
+    fseek(fp, 4, SEEK_SET);
+    fwrite(&value, 4, 1, fp);
+
+    fseek(fp, 40, SEEK_SET);
+    fwrite(&dataLength, 4, 1, fp);
+}
@@ -0,0 +1,277 @@
+// Standard MIDI File reader
+// Replaces the conversion step that ReadMidi.py used to do. Rather
+// than converting everything to 50 Hz program steps ahead of time,
+// the events are streamed from the file with their exact sample
+// positions.
+
+#include <stdio.h>
+#include <string.h>
+
+#include "midifile.h"
+
+static uint32_t ReadBigEndian32(const uint8_t *data)
+{
+    return ((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) | ((uint32_t)data[2] << 8) | data[3];
+}
+
+static uint16_t ReadBigEndian16(const uint8_t *data)
+{
+    return (uint16_t)((data[0] << 8) | data[1]);
+}
+
+// Reads a variable length quantity from the track.
+// Returns 0 if the track ends in the middle of the value.
+static int ReadVariableLength(struct MidiTrack *track, uint32_t *value)
+{
+    uint32_t result = 0;
+
+    for (int i = 0 ; i < 4 ; i++)
+    {
+        if (track->position >= track->end)
+        {
+            return 0;
+        }
+
+        uint8_t byte = *track->position++;
+        result = (result << 7) | (byte & 0x7F);
+        if ((byte & 0x80) == 0)
+        {
+            *value = result;
+            return 1;
+        }
+    }
+
+    // More than 4 bytes isn't allowed
+    return 0;
+}
+
+// Reads the delta time in front of the next event and updates
+// the absolute tick of the track
+static void ReadNextDelta(struct MidiTrack *track)
+{
+    uint32_t delta;
+
+    if (track->position >= track->end || !ReadVariableLength(track, &delta))
+    {
+        track->finished = 1;
+        return;
+    }
+
+    track->nextTick += delta;
+}
+
+int OpenMidiFile(struct MidiFile *midi, const uint8_t *data, uint32_t size, uint32_t sampleRate)
+{
+    memset(midi, 0, sizeof(*midi));
+
+    if (size < 14 || ReadBigEndian32(data) != 0x4D546864) // "MThd"
+    {
+        printf("Not a MIDI file\n");
+        return 0;
+    }
+
+    uint32_t headerSize = ReadBigEndian32(data + 4);
+    if (headerSize < 6 || headerSize > size - 8)
+    {
+        printf("Invalid MIDI header size %u\n", headerSize);
+        return 0;
+    }
+
+    midi->format = ReadBigEndian16(data + 8);
+    uint16_t numTracks = ReadBigEndian16(data + 10);
+    uint16_t division = ReadBigEndian16(data + 12);
+
+    if (midi->format > 1)
+    {
+        printf("MIDI format %u is not supported\n", midi->format);
+        return 0;
+    }
+
+    if (division & 0x8000)
+    {
+        // SMPTE timing: the upper byte is the negative frames per second
+        // and the lower byte is the ticks per frame. Treat a second as
+        // a "quarter note" so the same conversion works. 29 means
+        // 29.97 drop frame, 30 frames every 1.001 seconds.
+        uint8_t framesPerSecond = (uint8_t)(-(int8_t)(division >> 8));
+        midi->tempo = 1000000;
+        if (framesPerSecond == 29)
+        {
+            framesPerSecond = 30;
+            midi->tempo = 1001000;
+        }
+        midi->ticksPerQuarter = framesPerSecond * (division & 0xFF);
+        midi->smpte = 1;
+    }
+    else
+    {
+        midi->ticksPerQuarter = division;
+        midi->tempo = MIDI_DEFAULT_TEMPO;
+    }
+
+    if (midi->ticksPerQuarter == 0)
+    {
+        printf("Invalid MIDI time division\n");
+        return 0;
+    }
+
+    midi->sampleRate = sampleRate;
+
+    // Locate each of the tracks
+    const uint8_t *chunk = data + 8 + headerSize;
+    const uint8_t *end = data + size;
+    while (midi->numTracks < numTracks && end - chunk >= 8)
+    {
+        uint32_t chunkSize = ReadBigEndian32(chunk + 4);
+        if (chunkSize > (uint32_t)(end - chunk - 8))
+        {
+            printf("MIDI track %u is truncated\n", midi->numTracks);
+            chunkSize = (uint32_t)(end - chunk - 8);
+        }
+
+        // Unknown chunk types are skipped
+        if (ReadBigEndian32(chunk) == 0x4D54726B) // "MTrk"
+        {
+            if (midi->numTracks == MAX_MIDI_TRACKS)
+            {
+                printf("Too many MIDI tracks. Only using the first %u\n", MAX_MIDI_TRACKS);
+                break;
+            }
+
+            struct MidiTrack *track = &midi->tracks[midi->numTracks++];
+            track->position = chunk + 8;
+            track->end = chunk + 8 + chunkSize;
+            ReadNextDelta(track);
+        }
+
+        chunk += 8 + chunkSize;
+    }
+
+    if (midi->numTracks == 0)
+    {
+        printf("No MIDI tracks found\n");
+        return 0;
+    }
+
+    return 1;
+}
+
+int NextMidiEvent(struct MidiFile *midi, struct MidiEvent *event)
+{
+    while (1)
+    {
+        // Find the track with the earliest pending event
+        struct MidiTrack *track = NULL;
+        for (int i = 0 ; i < midi->numTracks ; i++)
+        {
+            if (!midi->tracks[i].finished &&
+                (track == NULL || midi->tracks[i].nextTick < track->nextTick))
+            {
+                track = &midi->tracks[i];
+            }
+        }
+
+        if (track == NULL)
+        {
+            return 0;
+        }
+
+        // Advance the clock to the event. Tempo changes only happen
+        // at events, so this keeps the sample positions exact.
+        midi->elapsed += (uint64_t)(track->nextTick - midi->currentTick) * midi->tempo;
+        midi->currentTick = track->nextTick;
+
+        if (track->position >= track->end)
+        {
+            track->finished = 1;
+            continue;
+        }
+
+        uint8_t status = *track->position;
+        if (status & 0x80)
+        {
+            track->position++;
+        }
+        else
+        {
+            // Running status reuses the previous status byte
+            if (track->runningStatus == 0)
+            {
+                printf("MIDI data byte found without a status\n");
+                return -1;
+            }
+            status = track->runningStatus;
+        }
+
+        if (status == 0xFF)
+        {
+            // Meta event
+            if (track->position >= track->end)
+            {
+                return -1;
+            }
+
+            uint8_t type = *track->position++;
+            uint32_t length;
+            if (!ReadVariableLength(track, &length) || length > (uint32_t)(track->end - track->position))
+            {
+                return -1;
+            }
+
+            if (type == 0x51 && length == 3 && !midi->smpte)
+            {
+                // Set tempo
+                midi->tempo = ((uint32_t)track->position[0] << 16) | (track->position[1] << 8) | track->position[2];
+            }
+            else if (type == 0x2F)
+            {
+                // End of track
+                track->finished = 1;
+                continue;
+            }
+
+            track->position += length;
+            ReadNextDelta(track);
+            continue;
+        }
+        else if (status == 0xF0 || status == 0xF7)
+        {
+            // System exclusive data is skipped
+            uint32_t length;
+            if (!ReadVariableLength(track, &length) || length > (uint32_t)(track->end - track->position))
+            {
+                return -1;
+            }
+
+            track->position += length;
+            ReadNextDelta(track);
+            continue;
+        }
+        else if (status > 0xF0)
+        {
+            // System common and realtime messages aren't valid in a file
+            printf("Unexpected MIDI status 0x%02X\n", status);
+            return -1;
+        }
+
+        track->runningStatus = status;
+
+        // Program change and channel pressure only have 1 data byte
+        uint8_t dataLength = ((status & 0xF0) == 0xC0 || (status & 0xF0) == 0xD0) ? 1 : 2;
+        if (track->end - track->position < dataLength)
+        {
+            return -1;
+        }
+
+        event->tick = midi->currentTick;
+        event->sample = (uint32_t)(midi->elapsed * midi->sampleRate / ((uint64_t)midi->ticksPerQuarter * 1000000));
+        event->status = status;
+        event->data1 = track->position[0] & 0x7F;
+        event->data2 = (dataLength == 2) ? (track->position[1] & 0x7F) : 0;
+        track->position += dataLength;
+
+        ReadNextDelta(track);
+
+        return 1;
+    }
+}
@@ -0,0 +1,84 @@
+#ifndef __MIDIFILE_H
+#define __MIDIFILE_H
+
+#include <stdint.h>
+
+// Reads Standard MIDI Files (format 0 and 1) and returns the
+// events of all the tracks merged in time order. Event times are
+// converted straight to sample positions using the tempo map, so
+// nothing gets quantized to the 50 Hz player tick.
+
+#define MAX_MIDI_TRACKS (64)
+
+#define MIDI_NOTE_OFF        (0x80)
+#define MIDI_NOTE_ON         (0x90)
+#define MIDI_CONTROL_CHANGE  (0xB0)
+#define MIDI_PROGRAM_CHANGE  (0xC0)
+
+// Default tempo when the file doesn't specify one: 120 BPM
+#define MIDI_DEFAULT_TEMPO (500000)
+
+struct MidiTrack
+{
+    // Current read position and the end of the track data
+    const uint8_t *position;
+    const uint8_t *end;
+
+    // Absolute tick of the next event in this track
+    uint32_t nextTick;
+
+    uint8_t runningStatus;
+    uint8_t finished;
+};
+
+struct MidiFile
+{
+    uint16_t format;
+    uint16_t numTracks;
+
+    // Ticks per quarter note
+    uint16_t ticksPerQuarter;
+
+    uint32_t sampleRate;
+
+    // Microseconds per quarter note
+    uint32_t tempo;
+
+    // Tick of the last event returned
+    uint32_t currentTick;
+
+    // Time elapsed up to currentTick in units of
+    // microseconds * ticksPerQuarter, which keeps the conversion to
+    // samples exact across tempo changes
+    uint64_t elapsed;
+
+    // SMPTE timed files ignore tempo changes
+    uint8_t smpte;
+
+    struct MidiTrack tracks[MAX_MIDI_TRACKS];
+};
+
+struct MidiEvent
+{
+    uint32_t tick;
+    uint32_t sample;
+
+    // Status byte including the MIDI channel in the low nibble
+    uint8_t status;
+    uint8_t data1;
+    uint8_t data2;
+};
+
+// Parses the header and locates the tracks in the given data, which
+// must stay valid while events are read.
+// Returns 1 on success, 0 if the data isn't a usable MIDI file.
+int OpenMidiFile(struct MidiFile *midi, const uint8_t *data, uint32_t size, uint32_t sampleRate);
+
+// Gets the next channel event (0x80 - 0xEF) from any track.
+// Meta events and system exclusive messages are handled or skipped
+// internally.
+// Returns 1 if an event was returned, 0 at the end of the file and
+// -1 if the track data is corrupt.
+int NextMidiEvent(struct MidiFile *midi, struct MidiEvent *event);
+
+#endif // __MIDIFILE_H
@@ -0,0 +1,188 @@
+// Drives the synthesizer from MIDI note events instead of the
+// GoatTracker pattern data. The instruments, wavetable and pulsetable
+// still come from the song that was initialized, but notes are
+// assigned to channels by a voice allocator as they arrive.
+// Include after goatplayer.c.
+
+#include "midifile.h"
+
+// MIDI note number of piano key 0 in the frequency tables.
+// Key 49 is A4 (440 Hz), which is MIDI note 69.
+#define MIDI_NOTE_OFFSET (20)
+
+struct MidiVoice
+{
+    uint8_t midiChannel;
+    uint8_t midiNote;
+
+    // Set while the note is held down
+    uint8_t held;
+
+    // When the voice was last started, used to find the oldest voice
+    uint32_t startOrder;
+} gMidiVoices[NUM_CHANNELS];
+
+// Instrument (1 based, as in the pattern data) played by each MIDI channel
+uint8_t gMidiInstruments[16];
+
+uint32_t gMidiNotesPlayed = 0;
+uint32_t gMidiVoicesStolen = 0;
+
+void InitializeMidiPlayer()
+{
+    for (uint8_t midiChannel = 0 ; midiChannel < 16 ; midiChannel++)
+    {
+        gMidiInstruments[midiChannel] = (midiChannel % gNumInstruments) + 1;
+    }
+
+    for (uint8_t channel = 0 ; channel < NUM_CHANNELS ; channel++)
+    {
+        gMidiVoices[channel].held = 0;
+        gMidiVoices[channel].startOrder = 0;
+        gTrackData[channel].instrumentNumber = -1;
+        gTrackData[channel].wavetablePosition = 0xFF;
+        gTrackData[channel].pulsetablePosition = 0xFF;
+        channels[channel].envelopePhase = Off;
+    }
+
+    // Only the instrument tables get processed every tick
+    gTickFunction = TableTick;
+}
+
+// Picks the channel to play a new note on
+uint8_t AllocateVoice(uint8_t midiChannel, uint8_t midiNote)
+{
+    uint8_t channel;
+    uint8_t best = 0xFF;
+
+    // Retrigger a channel that's already playing the same note
+    for (channel = 0 ; channel < NUM_CHANNELS ; channel++)
+    {
+        if (gMidiVoices[channel].held &&
+            gMidiVoices[channel].midiChannel == midiChannel &&
+            gMidiVoices[channel].midiNote == midiNote)
+        {
+            return channel;
+        }
+    }
+
+    // Prefer a channel that has gone completely silent
+    for (channel = 0 ; channel < NUM_CHANNELS ; channel++)
+    {
+        if (!gMidiVoices[channel].held && channels[channel].envelopePhase == Off)
+        {
+            return channel;
+        }
+    }
+
+    // Then the channel that was released the longest ago
+    for (channel = 0 ; channel < NUM_CHANNELS ; channel++)
+    {
+        if (!gMidiVoices[channel].held &&
+            (best == 0xFF || gMidiVoices[channel].startOrder < gMidiVoices[best].startOrder))
+        {
+            best = channel;
+        }
+    }
+
+    if (best != 0xFF)
+    {
+        return best;
+    }
+
+    // Everything is held down, so steal the oldest note
+    best = 0;
+    for (channel = 1 ; channel < NUM_CHANNELS ; channel++)
+    {
+        if (gMidiVoices[channel].startOrder < gMidiVoices[best].startOrder)
+        {
+            best = channel;
+        }
+    }
+
+    gMidiVoicesStolen++;
+    return best;
+}
+
+void MidiNoteOff(uint8_t midiChannel, uint8_t midiNote)
+{
+    for (uint8_t channel = 0 ; channel < NUM_CHANNELS ; channel++)
+    {
+        if (gMidiVoices[channel].held &&
+            gMidiVoices[channel].midiChannel == midiChannel &&
+            gMidiVoices[channel].midiNote == midiNote)
+        {
+            gMidiVoices[channel].held = 0;
+            KeyOff(channel);
+        }
+    }
+}
+
+void MidiNoteOn(uint8_t midiChannel, uint8_t midiNote)
+{
+    // Fold notes outside the tables into the available octaves
+    int key = midiNote - MIDI_NOTE_OFFSET;
+    while (key < 0)
+    {
+        key += 12;
+    }
+    while (key >= NUM_PIANO_KEYS)
+    {
+        key -= 12;
+    }
+
+    uint8_t channel = AllocateVoice(midiChannel, midiNote);
+
+    gMidiVoices[channel].midiChannel = midiChannel;
+    gMidiVoices[channel].midiNote = midiNote;
+    gMidiVoices[channel].held = 1;
+    gMidiVoices[channel].startOrder = ++gMidiNotesPlayed;
+
+    KeyOn(channel, (uint8_t)key, gMidiInstruments[midiChannel]);
+
+    // Start the instrument right away rather than waiting for the
+    // next tick so the note starts on the exact sample
+    WavetableStep(channel);
+    PulsetableStep(channel);
+}
+
+void HandleMidiEvent(const struct MidiEvent *event)
+{
+    uint8_t midiChannel = event->status & 0x0F;
+
+    switch (event->status & 0xF0)
+    {
+        case MIDI_NOTE_ON:
+            if (event->data2 != 0)
+            {
+                MidiNoteOn(midiChannel, event->data1);
+                break;
+            }
+            // Note on with a velocity of 0 is a note off
+            MidiNoteOff(midiChannel, event->data1);
+            break;
+
+        case MIDI_NOTE_OFF:
+            MidiNoteOff(midiChannel, event->data1);
+            break;
+
+        case MIDI_PROGRAM_CHANGE:
+            gMidiInstruments[midiChannel] = (event->data1 % gNumInstruments) + 1;
+            break;
+
+        case MIDI_CONTROL_CHANGE:
+            if (event->data1 == 120 || event->data1 == 123)
+            {
+                // All sound off / all notes off
+                for (uint8_t channel = 0 ; channel < NUM_CHANNELS ; channel++)
+                {
+                    if (gMidiVoices[channel].held && gMidiVoices[channel].midiChannel == midiChannel)
+                    {
+                        gMidiVoices[channel].held = 0;
+                        KeyOff(channel);
+                    }
+                }
+            }
+            break;
+    }
+}
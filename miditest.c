@@ -0,0 +1,157 @@
+// Renders a MIDI file through the SIDish synthesizer using the
+// instruments from a GoatTracker song
+//
+// Usage: miditest [-o output.wav] [-t tail seconds] [-i channel:instrument] song.sng file.mid
+
+#include <unistd.h>
+
+#include "hostplayer.c"
+#include "midiplayer.c"
+
+FILE *outputfp;
+unsigned int gTotalBytesWritten = 0;
+
+void OutputByte(uint8_t value)
+{
+    fwrite(&value, 1, 1, outputfp);
+    gTotalBytesWritten++;
+}
+
+void Usage()
+{
+    printf("Usage: miditest [-o output.wav] [-t tail seconds] [-i channel:instrument] song.sng file.mid\n");
+    printf("  -o  Output file (default tonetest.wav)\n");
+    printf("  -t  Seconds to keep rendering after the last event (default 2)\n");
+    printf("  -i  Play MIDI channel (1-16) with the given song instrument.\n");
+    printf("      May be repeated. Program changes in the file override this.\n");
+}
+
+int main(int argc, char *argv[])
+{
+    const char *outputFilename = "tonetest.wav";
+    int tailSeconds = 2;
+    uint8_t instrumentOverride[16] = { 0 };
+    int opt;
+
+    while ((opt = getopt(argc, argv, "o:t:i:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'o':
+                outputFilename = optarg;
+                break;
+
+            case 't':
+                tailSeconds = atoi(optarg);
+                break;
+
+            case 'i':
+            {
+                int midiChannel, instrument;
+                if (sscanf(optarg, "%d:%d", &midiChannel, &instrument) != 2 ||
+                    midiChannel < 1 || midiChannel > 16 || instrument < 1)
+                {
+                    Usage();
+                    return -1;
+                }
+                instrumentOverride[midiChannel - 1] = instrument;
+                break;
+            }
+
+            default:
+                Usage();
+                return -1;
+        }
+    }
+
+    if (argc - optind != 2)
+    {
+        Usage();
+        return -1;
+    }
+
+    InitializeTables();
+
+    char *songdata = LoadFile(argv[optind], NULL);
+    if (songdata == NULL || !InitializeSong(songdata))
+    {
+        printf("Failed to load the song data.\n");
+        return -1;
+    }
+
+    // The MIDI programs are spread over the song's instruments
+    if (gNumInstruments == 0)
+    {
+        printf("The song has no instruments to play the MIDI file with.\n");
+        return -1;
+    }
+
+    uint32_t midiSize;
+    uint8_t *mididata = (uint8_t *)LoadFile(argv[optind + 1], &midiSize);
+    struct MidiFile midi;
+    if (mididata == NULL || !OpenMidiFile(&midi, mididata, midiSize, BITRATE))
+    {
+        printf("Failed to load the MIDI file.\n");
+        return -1;
+    }
+
+    InitializeMidiPlayer();
+    for (uint8_t midiChannel = 0 ; midiChannel < 16 ; midiChannel++)
+    {
+        if (instrumentOverride[midiChannel] > gNumInstruments)
+        {
+            printf("Song only has %u instruments.\n", gNumInstruments);
+            return -1;
+        }
+        if (instrumentOverride[midiChannel] != 0)
+        {
+            gMidiInstruments[midiChannel] = instrumentOverride[midiChannel];
+        }
+    }
+
+    outputfp = fopen(outputFilename, "wb");
+    if (outputfp == NULL)
+    {
+        printf("Failed to open output file.\n");
+        return -1;
+    }
+
+    // 1 byte per sample, mono
+    WriteWavHeader(outputfp, BITRATE, 1, 8, 0);
+
+    struct MidiEvent event;
+    uint32_t sample = 0;
+    uint32_t numEvents = 0;
+    int result;
+    while ((result = NextMidiEvent(&midi, &event)) > 0)
+    {
+        // Synthesize right up to the sample the event happens on
+        while (sample < event.sample)
+        {
+            OutputAudioAndCalculateNextByte();
+            sample++;
+        }
+
+        HandleMidiEvent(&event);
+        numEvents++;
+    }
+
+    if (result < 0)
+    {
+        printf("MIDI data is corrupt. Stopping early.\n");
+    }
+
+    // Let the last notes ring out
+    for (uint32_t i = 0 ; i < (uint32_t)tailSeconds * BITRATE ; i++)
+    {
+        OutputAudioAndCalculateNextByte();
+    }
+
+    FinishWavFile(outputfp, gTotalBytesWritten);
+    fclose(outputfp);
+
+    printf("Rendered %u MIDI events (%u notes, %u voices stolen) into %u samples.\n",
+        numEvents, gMidiNotesPlayed, gMidiVoicesStolen, gTotalBytesWritten);
+
+    return 0;
+}
@@ -0,0 +1,103 @@
+// Stereo mixing bus for the host tools
+
+#include <math.h>
+#include <string.h>
+
+#include "mixer.h"
+
+// Works out the left and right gains for a voice.
+// Uses a constant power pan so a voice keeps the same loudness as it
+// moves across.
+static void UpdateVoice(struct Mixer *mixer, uint8_t voice)
+{
+    float angle = (mixer->pan[voice] + 1.0f) * (float)M_PI / 4.0f;
+    float gain = mixer->gain[voice] * MIXER_UNITY_GAIN;
+
+    mixer->leftGain[voice] = (int32_t)lrintf(gain * cosf(angle));
+    mixer->rightGain[voice] = (int32_t)lrintf(gain * sinf(angle));
+}
+
+void InitializeMixer(struct Mixer *mixer, uint8_t numVoices)
+{
+    if (numVoices > MIXER_MAX_VOICES)
+    {
+        numVoices = MIXER_MAX_VOICES;
+    }
+    mixer->numVoices = numVoices;
+
+    for (uint8_t voice = 0 ; voice < MIXER_MAX_VOICES ; voice++)
+    {
+        mixer->gain[voice] = 1.0f;
+        mixer->pan[voice] = 0.0f;
+        UpdateVoice(mixer, voice);
+    }
+}
+
+void SetVoiceGain(struct Mixer *mixer, uint8_t voice, float gain)
+{
+    if (voice < MIXER_MAX_VOICES)
+    {
+        mixer->gain[voice] = gain;
+        UpdateVoice(mixer, voice);
+    }
+}
+
+void SetVoicePan(struct Mixer *mixer, uint8_t voice, float pan)
+{
+    if (voice < MIXER_MAX_VOICES)
+    {
+        if (pan < -1.0f)
+        {
+            pan = -1.0f;
+        }
+        else if (pan > 1.0f)
+        {
+            pan = 1.0f;
+        }
+        mixer->pan[voice] = pan;
+        UpdateVoice(mixer, voice);
+    }
+}
+
+void MixBlock(const struct Mixer *mixer, const int8_t voices[][MIXER_BLOCK_SIZE], int length, int16_t *stereo)
+{
+    int32_t left[MIXER_BLOCK_SIZE];
+    int32_t right[MIXER_BLOCK_SIZE];
+    int16_t mixed[2 * MIXER_BLOCK_SIZE];
+
+    // The whole block is always mixed so that the loops have a fixed
+    // length, which lets the compiler vectorize them without any
+    // special optimization flags. Only length samples are kept.
+    for (int i = 0 ; i < MIXER_BLOCK_SIZE ; i++)
+    {
+        left[i] = 0;
+        right[i] = 0;
+    }
+
+    for (uint8_t voice = 0 ; voice < mixer->numVoices ; voice++)
+    {
+        const int8_t *input = voices[voice];
+        int32_t leftGain = mixer->leftGain[voice];
+        int32_t rightGain = mixer->rightGain[voice];
+
+        for (int i = 0 ; i < MIXER_BLOCK_SIZE ; i++)
+        {
+            left[i] += input[i] * leftGain;
+            right[i] += input[i] * rightGain;
+        }
+    }
+
+    for (int i = 0 ; i < MIXER_BLOCK_SIZE ; i++)
+    {
+        int32_t l = left[i] < INT16_MIN ? INT16_MIN : (left[i] > INT16_MAX ? INT16_MAX : left[i]);
+        int32_t r = right[i] < INT16_MIN ? INT16_MIN : (right[i] > INT16_MAX ? INT16_MAX : right[i]);
+        mixed[2 * i] = (int16_t)l;
+        mixed[2 * i + 1] = (int16_t)r;
+    }
+
+    if (length > MIXER_BLOCK_SIZE)
+    {
+        length = MIXER_BLOCK_SIZE;
+    }
+    memcpy(stereo, mixed, length * 2 * sizeof(int16_t));
+}
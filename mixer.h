@@ -0,0 +1,52 @@
+#ifndef __MIXER_H
+#define __MIXER_H
+
+#include <stdint.h>
+
+// Mixes the output of each voice into interleaved 16 bit stereo with
+// a gain and pan for every voice. Voices are summed in 32 bits and
+// only clipped once at the end, so more voices can be mixed than fit
+// in the player's 8 bit output.
+//
+// Samples are handled a block at a time: the voices are collected into
+// one buffer per voice, then the whole block is mixed with loops the
+// compiler can vectorize.
+
+#define MIXER_MAX_VOICES (16)
+#define MIXER_BLOCK_SIZE (256)
+
+// Gains are fixed point with this as 1.0. At 1.0 a voice panned hard
+// to one side has its -32 to 31 range become -8192 to 7936 on that
+// side, so 4 such voices fill the 16 bit output the same way 4 voices
+// fill the 8 bit output. The pan is constant power, so in the center
+// each side gets about 0.707 of that, -5792 to 5611.
+#define MIXER_UNITY_GAIN (256)
+
+struct Mixer
+{
+    uint8_t numVoices;
+
+    // Gain and pan set for each voice
+    float gain[MIXER_MAX_VOICES];
+    float pan[MIXER_MAX_VOICES];
+
+    // Left and right gains worked out from them
+    int32_t leftGain[MIXER_MAX_VOICES];
+    int32_t rightGain[MIXER_MAX_VOICES];
+};
+
+// Starts with every voice at full volume in the center
+void InitializeMixer(struct Mixer *mixer, uint8_t numVoices);
+
+// Gain is 1.0 for the voice as it is
+void SetVoiceGain(struct Mixer *mixer, uint8_t voice, float gain);
+
+// Pan goes from -1.0 (left) to 1.0 (right)
+void SetVoicePan(struct Mixer *mixer, uint8_t voice, float pan);
+
+// Mixes length samples (up to MIXER_BLOCK_SIZE) of voices, which has
+// MIXER_BLOCK_SIZE samples for each voice one after the other, into
+// length interleaved left and right samples.
+void MixBlock(const struct Mixer *mixer, const int8_t voices[][MIXER_BLOCK_SIZE], int length, int16_t *stereo);
+
+#endif // __MIXER_H
@@ -0,0 +1,863 @@
+// Cache of the notes and patterns a song plays over and over
+//
+// Drums and other short instruments are usually played exactly the
+// same way every time: the same wavetable, pulsetable and envelope,
+// from the same starting point. When a voice starts a note, the
+// instrument, the note and the voice's state are looked up, and if the
+// same note has started from the same state before, the voice's
+// samples are copied from the first time instead of being synthesized
+// again.
+//
+// What a voice plays from one tick to the next only depends on its own
+// state at the first one, so each note is kept a tick at a time: the
+// state the tick started from, the samples, and the state they left
+// the voice in. The player's ticks still run as usual, and a later hit
+// only keeps using the cache while the voice comes out of every tick
+// in the same state the recorded note did. A note that's keyed off
+// earlier, cut short by the next one or changed by the pattern in any
+// other way goes back to being synthesized from the tick it changed.
+// A hit that outlasts the recording carries on recording where it
+// left off.
+//
+// Songs also play whole patterns again, from the orderlist's repeat
+// codes or by listing a pattern more than once, so each voice is
+// cached a second way at the same time: from the tick its track reads
+// the first row of a pattern to the tick it reads the first row of the
+// next one, keyed on the whole track and voice at that first row. A
+// pattern that starts again from the same state is taken from the
+// cache however its notes run into each other, and the tick by tick
+// check keeps it exact the same way as for a note. Patterns are only
+// followed while gTickFunction is playing the song.
+//
+// Noise comes from the generator all the voices share, so ticks that
+// play noise are always synthesized, but the rest of the note around
+// them still comes from the cache. A pulse also goes high where the
+// voices before it wrap, which is put back in once all the voices'
+// samples have been worked out (see ApplyEarlierWraps).
+//
+// The cache is held to gNoteCacheBudget bytes by throwing out the
+// notes and patterns that were used least recently.
+//
+// Cached or not, the voices are worked out a tick at a time rather
+// than a sample at a time, so a voice coming from the cache is only a
+// pointer to its samples, and the voices are added up a tick at a
+// time too before the ones that are routed to it go through the
+// filter. The player is a tick ahead of the output until the tick's
+// samples have all been output.
+//
+// Include after hostplayer.c and segmentrender.c, which has the noise
+// generator's jump tables. Render with OutputAudioFromNoteCache in
+// place of OutputAudioAndCalculateNextByte once StartNoteCache has been
+// called.
+
+// Longest part of a note that's kept, 10 seconds, and of a pattern,
+// a minute
+#define NOTE_CACHE_MAX_TICKS (50 * 10)
+#define NOTE_CACHE_MAX_PATTERN_TICKS (50 * 60)
+
+// Ticks added to a note's recording at a time
+#define NOTE_CACHE_TICK_CHUNK (16)
+
+#define NOTE_CACHE_BUCKETS (4096)
+
+// 16 MB unless the tool chooses another size
+#define NOTE_CACHE_DEFAULT_BUDGET (16 * 1024 * 1024)
+
+struct NoteCacheTick
+{
+    // The voice when the tick started and when its samples were done
+    struct Voice start;
+    struct Voice end;
+
+    // Set for a tick that played noise, which has no samples
+    uint8_t noise;
+    int8_t samples[VBI_COUNT];
+
+    // A bit for each sample the voice came back round to the start of
+    // its waveform on (see ApplyEarlierWraps)
+    uint8_t wraps[VBI_COUNT / 8];
+};
+
+// What a note or pattern is looked up by, along with the voice at its
+// first tick. Anything not used is 0.
+struct NoteCacheKey
+{
+    uint8_t isPattern;
+
+    // For a note
+    int8_t instrument;
+    uint8_t note;
+
+    // For a pattern, the track after reading the pattern's first row,
+    // without where it is in the orderlist
+    struct Track track;
+};
+
+struct NoteCacheEntry
+{
+    struct NoteCacheKey key;
+    uint64_t hash;
+
+    struct NoteCacheTick *ticks;
+    uint32_t numTicks;
+    uint32_t ticksSize;
+
+    // Voices playing or recording the note. It isn't thrown out while
+    // any are.
+    uint8_t users;
+
+    // Set while a voice is adding ticks to the end
+    uint8_t recording;
+
+    struct NoteCacheEntry *nextInBucket;
+
+    // Most recently used first
+    struct NoteCacheEntry *newer;
+    struct NoteCacheEntry *older;
+};
+
+enum NoteCacheMode
+{
+    NoteCacheIdle,
+    NoteCachePlaying,
+    NoteCacheRecording,
+};
+
+struct NoteCacheVoice
+{
+    enum NoteCacheMode mode;
+    struct NoteCacheEntry *entry;
+
+    // Tick of the note being played or recorded
+    uint32_t tick;
+
+    // The samples of this tick and where they wrapped, when they come
+    // from the cache
+    const int8_t *samples;
+    const uint8_t *wraps;
+
+    // The voice at the start of the tick being recorded
+    struct Voice recordStart;
+
+    // The voice was off at the last tick, so the next sound it makes
+    // is a new note
+    uint8_t wasOff;
+
+    // The player's next tick reads the first row of a pattern, and
+    // the track hasn't read a row yet since the subtune started
+    uint8_t startsPattern;
+    uint8_t beforeFirstRow;
+};
+
+// What each voice is doing with its note, and with its pattern
+struct NoteCacheVoice gNoteCacheVoices[NUM_CHANNELS];
+struct NoteCacheVoice gPatternCacheVoices[NUM_CHANNELS];
+
+struct NoteCacheStatistics
+{
+    uint64_t notes;
+    uint64_t hits;
+    uint64_t patterns;
+    uint64_t patternHits;
+
+    // Ticks the voices were playing for, and how many of them came
+    // from the cache
+    uint64_t ticks;
+    uint64_t ticksFromCache;
+
+    uint64_t evictions;
+    uint32_t entries;
+
+    // Memory used by all the notes
+    uint64_t size;
+} gNoteCacheStatistics;
+
+uint64_t gNoteCacheBudget = NOTE_CACHE_DEFAULT_BUDGET;
+
+// The tick being output
+struct NoteCacheBlock
+{
+    // The voices that were synthesized
+    int8_t synthesized[NUM_CHANNELS][VBI_COUNT];
+    uint8_t synthesizedWraps[NUM_CHANNELS][VBI_COUNT / 8];
+
+    // Pulses that went high on the wraps of the voices before them
+    int8_t pulses[NUM_CHANNELS][VBI_COUNT];
+
+    // Where each voice's samples are, in the cache or above
+    const int8_t *voices[NUM_CHANNELS];
+    const uint8_t *wraps[NUM_CHANNELS];
+    uint8_t routing;
+
+    // What each voice adds to the mix without the filter, which is
+    // silence for the ones that go through it
+    const int8_t *unfilteredVoices[NUM_CHANNELS];
+
+    uint8_t output[VBI_COUNT];
+    int8_t filterOutput[VBI_COUNT];
+
+    uint16_t position;
+    uint16_t length;
+} gNoteCacheBlock;
+
+const int8_t gSilentBlock[VBI_COUNT];
+const uint8_t gNoWraps[VBI_COUNT / 8];
+
+struct NoteCacheEntry *gNoteCacheBuckets[NOTE_CACHE_BUCKETS];
+struct NoteCacheEntry *gNoteCacheNewest;
+struct NoteCacheEntry *gNoteCacheOldest;
+
+// Whether the voice's output depends on the noise generator
+static inline int VoicePlaysNoise(const struct Voice *voice)
+{
+    return (voice->control & (CONTROL_SAWTOOTH | CONTROL_TRIANGLE | CONTROL_PULSE | CONTROL_NOISE)) == CONTROL_NOISE;
+}
+
+static uint64_t NoteCacheHash(const struct NoteCacheKey *key, const struct Voice *start)
+{
+    uint64_t hash = HashBytes(key, sizeof(*key), FNV_OFFSET_BASIS);
+    return HashBytes(start, sizeof(*start), hash);
+}
+
+static void UnlinkNoteCacheEntry(struct NoteCacheEntry *entry)
+{
+    if (entry->newer != NULL)
+    {
+        entry->newer->older = entry->older;
+    }
+    else
+    {
+        gNoteCacheNewest = entry->older;
+    }
+
+    if (entry->older != NULL)
+    {
+        entry->older->newer = entry->newer;
+    }
+    else
+    {
+        gNoteCacheOldest = entry->newer;
+    }
+}
+
+// Moves the note to the front of the least recently used list
+static void TouchNoteCacheEntry(struct NoteCacheEntry *entry)
+{
+    if (gNoteCacheNewest == entry)
+    {
+        return;
+    }
+
+    if (entry->newer != NULL || entry->older != NULL || gNoteCacheOldest == entry)
+    {
+        UnlinkNoteCacheEntry(entry);
+    }
+
+    entry->newer = NULL;
+    entry->older = gNoteCacheNewest;
+    if (gNoteCacheNewest != NULL)
+    {
+        gNoteCacheNewest->newer = entry;
+    }
+    gNoteCacheNewest = entry;
+    if (gNoteCacheOldest == NULL)
+    {
+        gNoteCacheOldest = entry;
+    }
+}
+
+static void RemoveNoteCacheEntry(struct NoteCacheEntry *entry)
+{
+    struct NoteCacheEntry **link = &gNoteCacheBuckets[entry->hash % NOTE_CACHE_BUCKETS];
+    while (*link != entry)
+    {
+        link = &(*link)->nextInBucket;
+    }
+    *link = entry->nextInBucket;
+
+    UnlinkNoteCacheEntry(entry);
+    gNoteCacheStatistics.size -= sizeof(*entry) + (uint64_t)entry->ticksSize * sizeof(struct NoteCacheTick);
+    gNoteCacheStatistics.entries--;
+    free(entry->ticks);
+    free(entry);
+}
+
+// Throws out notes that aren't being played, oldest first, until
+// another size bytes fit in the budget. Returns 0 if they don't.
+static int MakeRoomInNoteCache(uint64_t size)
+{
+    struct NoteCacheEntry *entry = gNoteCacheOldest;
+    while (gNoteCacheStatistics.size + size > gNoteCacheBudget && entry != NULL)
+    {
+        struct NoteCacheEntry *newer = entry->newer;
+        if (entry->users == 0)
+        {
+            RemoveNoteCacheEntry(entry);
+            gNoteCacheStatistics.evictions++;
+        }
+        entry = newer;
+    }
+
+    return gNoteCacheStatistics.size + size <= gNoteCacheBudget;
+}
+
+static struct NoteCacheEntry *FindNoteCacheEntry(const struct NoteCacheKey *key, const struct Voice *start, uint64_t hash)
+{
+    for (struct NoteCacheEntry *entry = gNoteCacheBuckets[hash % NOTE_CACHE_BUCKETS] ; entry != NULL ; entry = entry->nextInBucket)
+    {
+        if (entry->hash == hash && memcmp(&entry->key, key, sizeof(*key)) == 0 &&
+            entry->numTicks > 0 && memcmp(&entry->ticks[0].start, start, sizeof(*start)) == 0)
+        {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// Returns a new note with room for its first ticks, or NULL if the
+// budget is used up by notes that are playing
+static struct NoteCacheEntry *AddNoteCacheEntry(const struct NoteCacheKey *key, uint64_t hash)
+{
+    uint64_t size = sizeof(struct NoteCacheEntry) + NOTE_CACHE_TICK_CHUNK * sizeof(struct NoteCacheTick);
+    if (!MakeRoomInNoteCache(size))
+    {
+        return NULL;
+    }
+
+    struct NoteCacheEntry *entry = calloc(1, sizeof(*entry));
+    entry->key = *key;
+    entry->hash = hash;
+    entry->ticksSize = NOTE_CACHE_TICK_CHUNK;
+    entry->ticks = malloc(entry->ticksSize * sizeof(struct NoteCacheTick));
+
+    entry->nextInBucket = gNoteCacheBuckets[hash % NOTE_CACHE_BUCKETS];
+    gNoteCacheBuckets[hash % NOTE_CACHE_BUCKETS] = entry;
+    TouchNoteCacheEntry(entry);
+
+    gNoteCacheStatistics.size += size;
+    gNoteCacheStatistics.entries++;
+    return entry;
+}
+
+// Adds the tick the voice just recorded to its note or pattern.
+// Returns 0 if there's no more room for it.
+static int AppendNoteCacheTick(struct NoteCacheVoice *cached, uint8_t channel, const struct Voice *voice)
+{
+    struct NoteCacheEntry *entry = cached->entry;
+    if (entry->numTicks == entry->ticksSize)
+    {
+        uint64_t size = NOTE_CACHE_TICK_CHUNK * sizeof(struct NoteCacheTick);
+        if (!MakeRoomInNoteCache(size))
+        {
+            return 0;
+        }
+
+        entry->ticksSize += NOTE_CACHE_TICK_CHUNK;
+        entry->ticks = realloc(entry->ticks, entry->ticksSize * sizeof(struct NoteCacheTick));
+        gNoteCacheStatistics.size += size;
+    }
+
+    struct NoteCacheTick *tick = &entry->ticks[entry->numTicks++];
+    tick->start = cached->recordStart;
+    tick->end = *voice;
+    tick->noise = VoicePlaysNoise(&cached->recordStart);
+    if (!tick->noise)
+    {
+        memcpy(tick->samples, gNoteCacheBlock.synthesized[channel], sizeof(tick->samples));
+    }
+    memcpy(tick->wraps, gNoteCacheBlock.synthesizedWraps[channel], sizeof(tick->wraps));
+    return 1;
+}
+
+static void StopNoteCacheVoice(struct NoteCacheVoice *cached)
+{
+    if (cached->mode == NoteCacheRecording)
+    {
+        cached->entry->recording = 0;
+    }
+
+    if (cached->mode != NoteCacheIdle)
+    {
+        cached->entry->users--;
+        if (cached->entry->numTicks == 0 && cached->entry->users == 0)
+        {
+            RemoveNoteCacheEntry(cached->entry);
+        }
+    }
+
+    cached->mode = NoteCacheIdle;
+    cached->entry = NULL;
+    cached->samples = NULL;
+}
+
+// Stops playing or recording once the note or pattern is over or goes
+// differently from the recording, and starts recording again where a
+// recording that was played to the end left off
+static void ContinueNoteCacheVoice(struct NoteCacheVoice *cached, const struct Voice *voice, int over, uint32_t maxTicks)
+{
+    if (cached->mode == NoteCacheIdle)
+    {
+        return;
+    }
+
+    if (over || cached->tick >= maxTicks)
+    {
+        StopNoteCacheVoice(cached);
+        return;
+    }
+
+    if (cached->mode == NoteCachePlaying)
+    {
+        struct NoteCacheEntry *entry = cached->entry;
+        if (cached->tick < entry->numTicks)
+        {
+            if (memcmp(&entry->ticks[cached->tick].start, voice, sizeof(*voice)) != 0)
+            {
+                // It's gone differently from here on
+                StopNoteCacheVoice(cached);
+            }
+        }
+        else if (entry->recording)
+        {
+            StopNoteCacheVoice(cached);
+        }
+        else
+        {
+            // Played as far as it was recorded, so record the rest
+            cached->mode = NoteCacheRecording;
+            entry->recording = 1;
+        }
+    }
+}
+
+// Plays the note or pattern that's starting from the cache if it's
+// been played from the same state before, or else records it.
+// Returns 1 if it's in the cache.
+static int StartNoteCacheVoice(struct NoteCacheVoice *cached, const struct NoteCacheKey *key, const struct Voice *voice)
+{
+    uint64_t hash = NoteCacheHash(key, voice);
+    struct NoteCacheEntry *entry = FindNoteCacheEntry(key, voice, hash);
+    int found = (entry != NULL);
+    if (found)
+    {
+        cached->mode = NoteCachePlaying;
+    }
+    else
+    {
+        entry = AddNoteCacheEntry(key, hash);
+        if (entry == NULL)
+        {
+            return 0;
+        }
+        cached->mode = NoteCacheRecording;
+        entry->recording = 1;
+    }
+
+    TouchNoteCacheEntry(entry);
+    entry->users++;
+    cached->entry = entry;
+    cached->tick = 0;
+    return found;
+}
+
+// Points the voice at this tick's samples if they come from the cache,
+// or keeps where it started if it's recording
+static void PrepareNoteCacheVoice(struct NoteCacheVoice *cached, const struct Voice *voice)
+{
+    cached->samples = NULL;
+    if (cached->mode == NoteCachePlaying)
+    {
+        const struct NoteCacheTick *tick = &cached->entry->ticks[cached->tick];
+        if (!tick->noise)
+        {
+            cached->samples = tick->samples;
+            cached->wraps = tick->wraps;
+        }
+    }
+    else if (cached->mode == NoteCacheRecording)
+    {
+        cached->recordStart = *voice;
+    }
+}
+
+// Works out where each voice's next tick comes from, once the player
+// has had its tick
+static void StartNoteCacheTick()
+{
+    for (uint8_t channel = 0 ; channel < NUM_CHANNELS ; channel++)
+    {
+        struct NoteCacheVoice *note = &gNoteCacheVoices[channel];
+        struct NoteCacheVoice *pattern = &gPatternCacheVoices[channel];
+        struct Voice *voice = &channels[channel];
+        int off = (voice->envelopePhase == Off);
+
+        ContinueNoteCacheVoice(pattern, voice, pattern->startsPattern, NOTE_CACHE_MAX_PATTERN_TICKS);
+        ContinueNoteCacheVoice(note, voice, off, NOTE_CACHE_MAX_TICKS);
+
+        struct NoteCacheKey key;
+        if (pattern->startsPattern)
+        {
+            memset(&key, 0, sizeof(key));
+            key.isPattern = 1;
+            memcpy(&key.track, &gTrackData[channel], sizeof(key.track));
+            key.track.orderlistPosition = 0;
+            key.track.patternRepeatCountdown = 0;
+
+            gNoteCacheStatistics.patterns++;
+            gNoteCacheStatistics.patternHits += StartNoteCacheVoice(pattern, &key, voice);
+        }
+
+        if (note->mode == NoteCacheIdle && note->wasOff && !off)
+        {
+            // A new note, so see if it's been played before
+            memset(&key, 0, sizeof(key));
+            key.instrument = gTrackData[channel].instrumentNumber;
+            key.note = gTrackData[channel].originalNote;
+
+            gNoteCacheStatistics.notes++;
+            gNoteCacheStatistics.hits += StartNoteCacheVoice(note, &key, voice);
+        }
+        note->wasOff = off;
+
+        PrepareNoteCacheVoice(pattern, voice);
+        PrepareNoteCacheVoice(note, voice);
+
+        if (!off)
+        {
+            gNoteCacheStatistics.ticks++;
+            if (pattern->samples != NULL || note->samples != NULL)
+            {
+                gNoteCacheStatistics.ticksFromCache++;
+            }
+        }
+    }
+}
+
+// Whether the player's next tick reads a row from the start of a
+// pattern: the row the track is at ends the last one, or it's the
+// first row of the subtune
+static int TrackStartsPattern(uint8_t channel)
+{
+    const struct Track *track = &gTrackData[channel];
+    if (gTickFunction != GoatPlayerTick || track->trackStepCountdown != 1)
+    {
+        return 0;
+    }
+
+    if (gPatternCacheVoices[channel].beforeFirstRow)
+    {
+        return 1;
+    }
+
+    struct PatternRow buffer;
+    return ReadPatternRow(track->songPosition, &buffer)->action == RowPatternEnd;
+}
+
+// Puts the voices playing from the cache where their samples left
+// them, and keeps the ticks that were recorded, before the player has
+// its tick
+static void FinishNoteCacheTick()
+{
+    for (uint8_t channel = 0 ; channel < NUM_CHANNELS ; channel++)
+    {
+        struct NoteCacheVoice *cached[2] = { &gNoteCacheVoices[channel], &gPatternCacheVoices[channel] };
+
+        // Both can be playing, from the same state to the same state
+        for (int i = 0 ; i < 2 ; i++)
+        {
+            if (cached[i]->mode == NoteCachePlaying)
+            {
+                channels[channel] = cached[i]->entry->ticks[cached[i]->tick].end;
+                cached[i]->tick++;
+            }
+        }
+
+        for (int i = 0 ; i < 2 ; i++)
+        {
+            if (cached[i]->mode == NoteCacheRecording)
+            {
+                if (AppendNoteCacheTick(cached[i], channel, &channels[channel]))
+                {
+                    cached[i]->tick++;
+                }
+                else
+                {
+                    StopNoteCacheVoice(cached[i]);
+                }
+            }
+        }
+
+        struct NoteCacheVoice *pattern = &gPatternCacheVoices[channel];
+        pattern->startsPattern = TrackStartsPattern(channel);
+        if (gTrackData[channel].trackStepCountdown == 1)
+        {
+            pattern->beforeFirstRow = 0;
+        }
+    }
+}
+
+// Starts using the cache for the subtune that's just been started.
+// Notes and patterns cached from before are kept.
+void StartNoteCache()
+{
+    for (uint8_t channel = 0 ; channel < NUM_CHANNELS ; channel++)
+    {
+        StopNoteCacheVoice(&gNoteCacheVoices[channel]);
+        StopNoteCacheVoice(&gPatternCacheVoices[channel]);
+        gNoteCacheVoices[channel].wasOff = (channels[channel].envelopePhase == Off);
+        gPatternCacheVoices[channel].startsPattern = 0;
+        gPatternCacheVoices[channel].beforeFirstRow = 1;
+    }
+
+    // The next sample starts a new block
+    gNoteCacheBlock.position = 0;
+    gNoteCacheBlock.length = 0;
+}
+
+// Steps the noise generator up to 10 times at once. The bits it
+// shifts in don't reach the taps for 10 steps, so they all come from
+// the value it started at.
+static inline uint16_t AdvanceNoise(uint16_t noise, uint8_t steps)
+{
+    uint16_t feedback = noise ^ (noise >> 2) ^ (noise >> 3) ^ (noise >> 5);
+    return (noise >> steps) | ((feedback & ((1 << steps) - 1)) << (16 - steps));
+}
+
+// Synthesizes the given number of samples of a voice that's playing,
+// and marks where it wrapped
+static void SynthesizeNoteCacheVoice(uint8_t channel, int8_t *samples, uint8_t *wraps, uint16_t length)
+{
+    struct Voice *voice = &channels[channel];
+
+    // The noise generator steps once for each voice in every sample,
+    // so a voice playing noise hears it after its own step. Nothing
+    // else changes the waveform until the next tick.
+    int playsNoise = VoicePlaysNoise(voice);
+    uint16_t startNoise = gNoise;
+    uint16_t noise = AdvanceNoise(gNoise, channel + 1);
+
+    // Worked on in copies, which the compiler can keep in registers
+    // while the samples are written
+    struct Voice playing = *voice;
+    memset(wraps, 0, VBI_COUNT / 8);
+    for (uint16_t sample = 0 ; sample < length ; sample++)
+    {
+        if (playing.envelopePhase == Off)
+        {
+            // Finished releasing partway through the tick
+            memset(&samples[sample], 0, length - sample);
+            break;
+        }
+
+        int8_t wrap = 0;
+        uint16_t offset = WrapTableOffset(&playing, &wrap);
+        gNoise = noise;
+        samples[sample] = VoiceWaveform(&playing, offset, wrap);
+        wraps[sample >> 3] |= wrap << (sample & 7);
+        StepEnvelope(&playing);
+        playing.tableOffset += playing.steps;
+
+        if (playsNoise)
+        {
+            noise = AdvanceNoise(noise, NUM_CHANNELS);
+        }
+    }
+    *voice = playing;
+
+    gNoise = startNoise;
+}
+
+// OutputAudioAndCalculateNextByte shares the wrap between the voices
+// in each sample, so a pulse is also high on the samples where a voice
+// before it came back round to the start of its waveform. Each voice
+// is cached with only its own wraps, and this makes the pulses high
+// where the voices before them wrapped too. A pulse that was low is
+// the envelope's level below 0, so it can be worked out from that.
+static void ApplyEarlierWraps(struct NoteCacheBlock *block)
+{
+    uint8_t earlierWraps[VBI_COUNT / 8];
+    memcpy(earlierWraps, block->wraps[0], sizeof(earlierWraps));
+    for (uint8_t channel = 1 ; channel < NUM_CHANNELS ; channel++)
+    {
+        uint8_t control = channels[channel].control;
+        if (!(control & (CONTROL_SAWTOOTH | CONTROL_TRIANGLE)) && (control & CONTROL_PULSE))
+        {
+            // Only a few samples in a tick wrap, so they're found a bit
+            // at a time and the samples are only copied if one changes
+            int8_t *pulse = block->pulses[channel];
+            const int8_t *samples = block->voices[channel];
+            for (uint8_t i = 0 ; i < sizeof(earlierWraps) ; i++)
+            {
+                for (uint8_t bits = earlierWraps[i] ; bits != 0 ; bits &= bits - 1)
+                {
+                    uint16_t sample = i * 8 + __builtin_ctz(bits);
+                    if (sample < block->length && samples[sample] < 0)
+                    {
+                        if (block->voices[channel] != pulse)
+                        {
+                            memcpy(pulse, samples, block->length);
+                            block->voices[channel] = pulse;
+                        }
+
+                        // The same as VoiceWaveform's faded 31
+                        pulse[sample] = (int8_t)(31 * -samples[sample] / 32);
+                    }
+                }
+            }
+        }
+
+        for (uint8_t i = 0 ; i < sizeof(earlierWraps) ; i++)
+        {
+            earlierWraps[i] |= block->wraps[channel][i];
+        }
+    }
+}
+
+// Works out the samples up to the next tick, the same as calling
+// OutputAudioAndCalculateNextByte for each of them would
+static void RenderNoteCacheBlock()
+{
+    struct NoteCacheBlock *block = &gNoteCacheBlock;
+    block->length = vbiCount;
+    block->position = 0;
+    block->routing = gFilter.routing;
+
+    for (uint8_t channel = 0 ; channel < NUM_CHANNELS ; channel++)
+    {
+        const struct NoteCacheVoice *note = &gNoteCacheVoices[channel];
+        const struct NoteCacheVoice *pattern = &gPatternCacheVoices[channel];
+        const struct NoteCacheVoice *cached = (pattern->samples != NULL) ? pattern : note;
+        const int8_t *samples = cached->samples;
+        const uint8_t *wraps = cached->wraps;
+        if (samples == NULL && channels[channel].envelopePhase != Off)
+        {
+            SynthesizeNoteCacheVoice(channel, block->synthesized[channel], block->synthesizedWraps[channel], block->length);
+            samples = block->synthesized[channel];
+            wraps = block->synthesizedWraps[channel];
+        }
+        else if (note->mode == NoteCacheRecording || pattern->mode == NoteCacheRecording)
+        {
+            // Recorded from here once the tick's over, by which time
+            // the cache could have moved what's played from it
+            memcpy(block->synthesized[channel], samples != NULL ? samples : gSilentBlock, block->length);
+            memcpy(block->synthesizedWraps[channel], samples != NULL ? wraps : gNoWraps, VBI_COUNT / 8);
+            samples = block->synthesized[channel];
+            wraps = block->synthesizedWraps[channel];
+        }
+        else if (samples == NULL)
+        {
+            samples = gSilentBlock;
+            wraps = gNoWraps;
+        }
+        block->voices[channel] = samples;
+        block->wraps[channel] = wraps;
+    }
+    SkipNoise((uint32_t)block->length * NUM_CHANNELS);
+
+    ApplyEarlierWraps(block);
+    for (uint8_t channel = 0 ; channel < NUM_CHANNELS ; channel++)
+    {
+        block->unfilteredVoices[channel] = (block->routing & (1 << channel)) ? gSilentBlock : block->voices[channel];
+    }
+
+    // The routing only changes on a tick, so most blocks don't go
+    // through the filter at all. The sums wrap around the same as they
+    // do a sample at a time.
+    const int8_t *voice0 = block->voices[0];
+    const int8_t *voice1 = block->voices[1];
+    const int8_t *voice2 = block->voices[2];
+    if (block->routing == 0)
+    {
+        for (uint16_t sample = 0 ; sample < block->length ; sample++)
+        {
+            int8_t outputValue = voice0[sample] + voice1[sample] + voice2[sample];
+            block->output[sample] = (uint8_t)((int16_t)outputValue + 128);
+        }
+        memset(block->filterOutput, 0, block->length);
+        return;
+    }
+
+    // Added up a voice at a time, then filtered into buffers of its
+    // own so the filter's state can stay in registers
+    int8_t filterInput[VBI_COUNT];
+    int8_t unfiltered[VBI_COUNT];
+    memset(filterInput, 0, block->length);
+    memset(unfiltered, 0, block->length);
+    for (uint8_t channel = 0 ; channel < NUM_CHANNELS ; channel++)
+    {
+        int8_t *sum = (block->routing & (1 << channel)) ? filterInput : unfiltered;
+        const int8_t *voice = block->voices[channel];
+        for (uint16_t sample = 0 ; sample < block->length ; sample++)
+        {
+            sum[sample] += voice[sample];
+        }
+    }
+
+    uint8_t output[VBI_COUNT];
+    int8_t filterOutput[VBI_COUNT];
+    for (uint16_t sample = 0 ; sample < block->length ; sample++)
+    {
+        int8_t filtered = FilterSample(filterInput[sample]);
+        int16_t mixed = (int16_t)unfiltered[sample] + filtered;
+        if (mixed > 127)
+        {
+            mixed = 127;
+        }
+        else if (mixed < -128)
+        {
+            mixed = -128;
+        }
+        filterOutput[sample] = filtered;
+        output[sample] = (uint8_t)((int16_t)mixed + 128);
+    }
+    memcpy(block->filterOutput, filterOutput, block->length);
+    memcpy(block->output, output, block->length);
+}
+
+// Does the same as OutputAudioAndCalculateNextByte, but takes the
+// voices playing a cached note from the cache
+int OutputAudioFromNoteCache(void)
+{
+    struct NoteCacheBlock *block = &gNoteCacheBlock;
+
+    OutputByte(gNextOutputValue);
+    if (block->position == block->length)
+    {
+        RenderNoteCacheBlock();
+    }
+
+    // What each voice added, for the tools writing them out separately
+    uint16_t sample = block->position++;
+    gVoiceOutput[0] = block->unfilteredVoices[0][sample];
+    gVoiceOutput[1] = block->unfilteredVoices[1][sample];
+    gVoiceOutput[2] = block->unfilteredVoices[2][sample];
+    gFilterOutput = block->filterOutput[sample];
+    gNextOutputValue = block->output[sample];
+
+    vbiCount--;
+    if (vbiCount == 0)
+    {
+        vbiCount = VBI_COUNT;
+        FinishNoteCacheTick();
+        int finished = gTickFunction();
+        StartNoteCacheTick();
+        return finished;
+    }
+
+    return 0;
+}
+
+void PrintNoteCacheStatistics()
+{
+    const struct NoteCacheStatistics *statistics = &gNoteCacheStatistics;
+    printf("Note cache: %llu of %llu notes (%.0f%%) and %llu of %llu voice ticks (%.0f%%) came from the cache,\n",
+        (unsigned long long)statistics->hits, (unsigned long long)statistics->notes,
+        statistics->notes ? 100.0 * statistics->hits / statistics->notes : 0.0,
+        (unsigned long long)statistics->ticksFromCache, (unsigned long long)statistics->ticks,
+        statistics->ticks ? 100.0 * statistics->ticksFromCache / statistics->ticks : 0.0);
+    printf("            and %llu of %llu patterns (%.0f%%) had been played the same way before,\n",
+        (unsigned long long)statistics->patternHits, (unsigned long long)statistics->patterns,
+        statistics->patterns ? 100.0 * statistics->patternHits / statistics->patterns : 0.0);
+    printf("            %u notes and patterns kept in %.1f KB, %llu thrown out\n",
+        statistics->entries, statistics->size / 1024.0, (unsigned long long)statistics->evictions);
+}
@@ -0,0 +1,481 @@
+// Content addressed cache of rendered audio
+//
+// Renders are keyed by a hash of the song data, the render parameters
+// and SIDISH_VERSION, and are stored in fixed size chunks:
+//
+//   <cache directory>/<key>/<chunk number>.chunk
+//
+// Each chunk holds the player state at the end of the chunk along with
+// the audio, so a chunk that isn't cached yet can be rendered starting
+// from the end of the chunk in front of it instead of rendering the
+// whole song up to that point. Chunks are evicted least recently used
+// first (using the file modification time, which is updated on every
+// hit) once the cache goes over its size budget.
+//
+// Include after hostplayer.c. The tool including this needs to send
+// the output to CaptureByte while gCaptureBuffer is set.
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+
+// 4 seconds of audio per chunk
+#define CACHE_CHUNK_SAMPLES (BITRATE * 4)
+
+#define CACHE_CHUNK_MAGIC (0x32434453) // "SDC2"
+
+// Room for the cache directory plus the key and chunk names
+#define CACHE_PATH_SIZE (PATH_MAX + 300)
+
+struct CacheChunkHeader
+{
+    uint32_t magic;
+
+    // Number of samples in the chunk. Only the last chunk of a song
+    // has less than CACHE_CHUNK_SAMPLES.
+    uint32_t samples;
+
+    // Set if the song finished in this chunk
+    uint32_t finished;
+
+    // State to continue rendering the next chunk from
+    struct PlayerState endState;
+};
+
+// Shared between the daemon and all the renderers it forks
+struct CacheStatistics
+{
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t bytesFromCache;
+    uint64_t bytesRendered;
+    uint64_t evictions;
+
+    // Current size of all the chunks in the cache
+    uint64_t size;
+};
+
+struct RenderCache
+{
+    char directory[PATH_MAX];
+    uint64_t budget;
+    struct CacheStatistics *statistics;
+};
+
+struct RenderCache gRenderCache;
+
+// While set, the output is collected here instead of being sent
+uint8_t *gCaptureBuffer = NULL;
+uint32_t gCaptureLength;
+
+void CaptureByte(uint8_t value)
+{
+    gCaptureBuffer[gCaptureLength++] = value;
+}
+
+struct CacheFile
+{
+    char *path;
+    time_t modifiedTime;
+    off_t size;
+} *gCacheFiles;
+int gNumCacheFiles;
+int gCacheFilesAllocated;
+
+// Finds every chunk in the cache and adds it to gCacheFiles.
+// Returns the total size of the chunks.
+uint64_t ScanRenderCache()
+{
+    uint64_t size = 0;
+    gNumCacheFiles = 0;
+
+    DIR *cacheDirectory = opendir(gRenderCache.directory);
+    if (cacheDirectory == NULL)
+    {
+        return 0;
+    }
+
+    struct dirent *keyEntry;
+    while ((keyEntry = readdir(cacheDirectory)) != NULL)
+    {
+        if (keyEntry->d_name[0] == '.')
+        {
+            continue;
+        }
+
+        char keyPath[CACHE_PATH_SIZE];
+        snprintf(keyPath, sizeof(keyPath), "%s/%s", gRenderCache.directory, keyEntry->d_name);
+        DIR *keyDirectory = opendir(keyPath);
+        if (keyDirectory == NULL)
+        {
+            continue;
+        }
+
+        struct dirent *chunkEntry;
+        while ((chunkEntry = readdir(keyDirectory)) != NULL)
+        {
+            char path[CACHE_PATH_SIZE * 2];
+            struct stat chunkstat;
+            const char *extension = strrchr(chunkEntry->d_name, '.');
+            if (extension == NULL || strcmp(extension, ".chunk") != 0)
+            {
+                continue;
+            }
+
+            snprintf(path, sizeof(path), "%s/%s", keyPath, chunkEntry->d_name);
+            if (stat(path, &chunkstat) != 0)
+            {
+                continue;
+            }
+
+            if (gNumCacheFiles == gCacheFilesAllocated)
+            {
+                gCacheFilesAllocated = gCacheFilesAllocated ? gCacheFilesAllocated * 2 : 256;
+                gCacheFiles = realloc(gCacheFiles, gCacheFilesAllocated * sizeof(struct CacheFile));
+            }
+
+            gCacheFiles[gNumCacheFiles].path = strdup(path);
+            gCacheFiles[gNumCacheFiles].modifiedTime = chunkstat.st_mtime;
+            gCacheFiles[gNumCacheFiles].size = chunkstat.st_size;
+            gNumCacheFiles++;
+            size += chunkstat.st_size;
+        }
+        closedir(keyDirectory);
+    }
+    closedir(cacheDirectory);
+
+    return size;
+}
+
+int CompareCacheFileAge(const void *a, const void *b)
+{
+    const struct CacheFile *fileA = (const struct CacheFile *)a;
+    const struct CacheFile *fileB = (const struct CacheFile *)b;
+
+    if (fileA->modifiedTime != fileB->modifiedTime)
+    {
+        return fileA->modifiedTime < fileB->modifiedTime ? -1 : 1;
+    }
+    return 0;
+}
+
+// Opens the cache directory, creating it if needed.
+// Must be called before forking the renderers so they all share
+// the statistics.
+// Returns 1 on success
+int OpenRenderCache(const char *directory, uint64_t budget)
+{
+    if (mkdir(directory, 0755) != 0 && errno != EEXIST)
+    {
+        perror(directory);
+        return 0;
+    }
+
+    if (realpath(directory, gRenderCache.directory) == NULL)
+    {
+        perror(directory);
+        return 0;
+    }
+
+    gRenderCache.budget = budget;
+    gRenderCache.statistics = mmap(NULL, sizeof(struct CacheStatistics), PROT_READ | PROT_WRITE,
+                                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (gRenderCache.statistics == MAP_FAILED)
+    {
+        perror("mmap");
+        return 0;
+    }
+    memset(gRenderCache.statistics, 0, sizeof(struct CacheStatistics));
+
+    gRenderCache.statistics->size = ScanRenderCache();
+    for (int i = 0 ; i < gNumCacheFiles ; i++)
+    {
+        free(gCacheFiles[i].path);
+    }
+
+    return 1;
+}
+
+// Removes the least recently used chunks until the cache is back
+// under 90% of the budget
+void EvictFromRenderCache()
+{
+    char lockPath[CACHE_PATH_SIZE];
+    snprintf(lockPath, sizeof(lockPath), "%s/.lock", gRenderCache.directory);
+    int lock = open(lockPath, O_RDWR | O_CREAT, 0644);
+    if (lock < 0)
+    {
+        return;
+    }
+
+    // Only one renderer needs to do this at a time
+    if (flock(lock, LOCK_EX | LOCK_NB) != 0)
+    {
+        close(lock);
+        return;
+    }
+
+    uint64_t size = ScanRenderCache();
+    qsort(gCacheFiles, gNumCacheFiles, sizeof(struct CacheFile), CompareCacheFileAge);
+
+    uint64_t target = gRenderCache.budget / 10 * 9;
+    for (int i = 0 ; i < gNumCacheFiles ; i++)
+    {
+        if (size > target && unlink(gCacheFiles[i].path) == 0)
+        {
+            size -= gCacheFiles[i].size;
+            __atomic_add_fetch(&gRenderCache.statistics->evictions, 1, __ATOMIC_RELAXED);
+
+            // Clean up the key's directory once it's empty
+            *strrchr(gCacheFiles[i].path, '/') = 0;
+            rmdir(gCacheFiles[i].path);
+        }
+        free(gCacheFiles[i].path);
+    }
+
+    __atomic_store_n(&gRenderCache.statistics->size, size, __ATOMIC_RELAXED);
+
+    flock(lock, LOCK_UN);
+    close(lock);
+}
+
+// Builds the key for a render of the given song data
+uint64_t RenderCacheKey(const char *songdata, uint32_t songSize, int subtune)
+{
+    char parameters[128];
+    snprintf(parameters, sizeof(parameters), "rate=%u format=u8 channels=1 subtune=%d version=%d",
+             BITRATE, subtune, SIDISH_VERSION);
+
+    uint64_t key = HashBytes(songdata, songSize, FNV_OFFSET_BASIS);
+    return HashBytes(parameters, strlen(parameters), key);
+}
+
+void ChunkPath(char *path, uint64_t key, uint32_t chunk)
+{
+    snprintf(path, CACHE_PATH_SIZE, "%s/%016llx/%u.chunk", gRenderCache.directory, (unsigned long long)key, chunk);
+}
+
+// Opens a cached chunk and reads its header.
+// Returns the open file or -1 if the chunk isn't in the cache.
+int OpenChunk(uint64_t key, uint32_t chunk, struct CacheChunkHeader *header)
+{
+    char path[CACHE_PATH_SIZE];
+    ChunkPath(path, key, chunk);
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    if (read(fd, header, sizeof(*header)) != sizeof(*header) || header->magic != CACHE_CHUNK_MAGIC)
+    {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+// Renders one chunk starting from the given state and stores it in
+// the cache. The audio is left in buffer.
+void RenderChunk(uint64_t key, uint32_t chunk, const struct PlayerState *startState,
+                 uint8_t *buffer, struct CacheChunkHeader *header)
+{
+    RestorePlayerState(startState);
+
+    gCaptureBuffer = buffer;
+    gCaptureLength = 0;
+    header->finished = 0;
+    while (gCaptureLength < CACHE_CHUNK_SAMPLES)
+    {
+        if (OutputAudioAndCalculateNextByte())
+        {
+            header->finished = 1;
+            break;
+        }
+    }
+    gCaptureBuffer = NULL;
+
+    header->magic = CACHE_CHUNK_MAGIC;
+    header->samples = gCaptureLength;
+    SavePlayerState(&header->endState);
+
+    __atomic_add_fetch(&gRenderCache.statistics->misses, 1, __ATOMIC_RELAXED);
+
+    // Write to a temporary file and rename it so other renderers never
+    // see a partial chunk
+    char path[CACHE_PATH_SIZE];
+    char temporaryPath[CACHE_PATH_SIZE + 16];
+    snprintf(path, CACHE_PATH_SIZE, "%s/%016llx", gRenderCache.directory, (unsigned long long)key);
+    mkdir(path, 0755);
+    ChunkPath(path, key, chunk);
+    snprintf(temporaryPath, sizeof(temporaryPath), "%s.%d", path, (int)getpid());
+
+    FILE *fp = fopen(temporaryPath, "wb");
+    if (fp == NULL)
+    {
+        return;
+    }
+
+    int written = fwrite(header, sizeof(*header), 1, fp) == 1 &&
+                  fwrite(buffer, 1, header->samples, fp) == header->samples;
+    if (fclose(fp) != 0 || !written || rename(temporaryPath, path) != 0)
+    {
+        unlink(temporaryPath);
+        return;
+    }
+
+    uint64_t size = __atomic_add_fetch(&gRenderCache.statistics->size, sizeof(*header) + header->samples, __ATOMIC_RELAXED);
+    if (size > gRenderCache.budget)
+    {
+        EvictFromRenderCache();
+    }
+}
+
+// Sends all of the data, retrying partial writes.
+// Returns 1 on success
+int SendAll(int connection, const uint8_t *data, uint32_t length)
+{
+    while (length > 0)
+    {
+        ssize_t sent = write(connection, data, length);
+        if (sent <= 0)
+        {
+            return 0;
+        }
+        data += sent;
+        length -= sent;
+    }
+    return 1;
+}
+
+// Sends samples [startSample, endSample) of the song that's currently
+// initialized in the player (and hasn't started playing yet) to the
+// connection, using cached chunks where possible and rendering and
+// caching the rest.
+void ServeFromRenderCache(int connection, uint64_t key, uint32_t startSample, uint32_t endSample)
+{
+    static uint8_t buffer[CACHE_CHUNK_SAMPLES];
+    struct CacheChunkHeader header;
+    struct PlayerState initialState;
+
+    // State to render the next chunk from, if it's known
+    struct PlayerState state;
+    int haveState = 0;
+
+    SavePlayerState(&initialState);
+
+    uint32_t sample = startSample;
+    uint32_t chunk = sample / CACHE_CHUNK_SAMPLES;
+    if (chunk == 0)
+    {
+        state = initialState;
+        haveState = 1;
+    }
+
+    while (sample < endSample)
+    {
+        uint32_t offset = sample - chunk * CACHE_CHUNK_SAMPLES;
+        int fd = OpenChunk(key, chunk, &header);
+        if (fd >= 0)
+        {
+            // Mark it as recently used
+            futimens(fd, NULL);
+
+            if (offset >= header.samples)
+            {
+                close(fd);
+                break;
+            }
+
+            uint32_t length = header.samples - offset;
+            if (length > endSample - sample)
+            {
+                length = endSample - sample;
+            }
+
+            off_t fileOffset = sizeof(header) + offset;
+            uint32_t remaining = length;
+            while (remaining > 0)
+            {
+                ssize_t sent = sendfile(connection, fd, &fileOffset, remaining);
+                if (sent <= 0)
+                {
+                    close(fd);
+                    return;
+                }
+                remaining -= sent;
+            }
+            close(fd);
+
+            __atomic_add_fetch(&gRenderCache.statistics->hits, 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&gRenderCache.statistics->bytesFromCache, length, __ATOMIC_RELAXED);
+
+            state = header.endState;
+            haveState = 1;
+        }
+        else
+        {
+            if (!haveState)
+            {
+                // Find the closest cached chunk in front of this one to
+                // start from. The ones in between get cached on the way.
+                uint32_t startChunk = chunk;
+                while (startChunk > 0)
+                {
+                    startChunk--;
+                    fd = OpenChunk(key, startChunk, &header);
+                    if (fd >= 0)
+                    {
+                        close(fd);
+                        startChunk++;
+                        break;
+                    }
+                }
+
+                state = (startChunk == 0) ? initialState : header.endState;
+                for ( ; startChunk < chunk ; startChunk++)
+                {
+                    RenderChunk(key, startChunk, &state, buffer, &header);
+                    state = header.endState;
+                    if (header.finished)
+                    {
+                        return;
+                    }
+                }
+            }
+
+            RenderChunk(key, chunk, &state, buffer, &header);
+            if (offset >= header.samples)
+            {
+                break;
+            }
+
+            uint32_t length = header.samples - offset;
+            if (length > endSample - sample)
+            {
+                length = endSample - sample;
+            }
+
+            if (!SendAll(connection, buffer + offset, length))
+            {
+                return;
+            }
+            __atomic_add_fetch(&gRenderCache.statistics->bytesRendered, length, __ATOMIC_RELAXED);
+
+            state = header.endState;
+            haveState = 1;
+        }
+
+        if (header.finished)
+        {
+            break;
+        }
+
+        sample = ++chunk * CACHE_CHUNK_SAMPLES;
+    }
+}
@@ -0,0 +1,611 @@
+// Incremental re-rendering after a song is edited
+//
+// Alongside the render, the player state at the start of every tick is
+// saved to a checkpoint file with a copy of the song. The next time the
+// song is rendered, the old and new song are compared to find what
+// changed (patterns, instruments, the orderlists and the tables), and
+// the old checkpoints show which ticks read any of it. Those are the
+// only ticks whose output can be different, so the render starts from
+// the checkpoint of the first one. Once the player state matches the
+// old checkpoint at some tick again, everything up to the next tick
+// that reads something that changed comes out the same as before, so
+// it's copied from the old render instead and rendering carries on
+// from there.
+//
+// Include after hostplayer.c. The tool including this needs to send
+// the output to RerenderByte while gRerender.active is set.
+
+#include <stddef.h>
+
+// "SDCK"
+#define CHECKPOINT_MAGIC (0x4B434453)
+
+struct CheckpointHeader
+{
+    uint32_t magic;
+
+    // Checkpoints from another version of the player or another build
+    // can't be restored
+    uint32_t version;
+    uint32_t stateSize;
+
+    uint32_t subtune;
+    uint32_t songSize;
+    uint32_t samples;
+
+    // Of the audio in the .wav file the checkpoints go with
+    uint64_t outputHash;
+
+    // Followed by the song data and then the player state at the
+    // start of each tick
+};
+
+// The render in progress
+struct Rerender
+{
+    int active;
+
+    uint8_t *output;
+    uint32_t length;
+    uint32_t size;
+
+    struct PlayerState *states;
+    uint32_t numStates;
+    uint32_t statesSize;
+} gRerender;
+
+// The render from last time
+struct PreviousRender
+{
+    struct CheckpointHeader header;
+    char *songdata;
+    uint8_t *output;
+    struct PlayerState *states;
+    uint32_t numStates;
+};
+
+void RerenderByte(uint8_t value)
+{
+    if (gRerender.length == gRerender.size)
+    {
+        gRerender.size = gRerender.size ? gRerender.size * 2 : BITRATE * 60;
+        gRerender.output = realloc(gRerender.output, gRerender.size);
+    }
+    gRerender.output[gRerender.length++] = value;
+}
+
+static void AddCheckpoints(const struct PlayerState *states, uint32_t count)
+{
+    if (gRerender.numStates + count > gRerender.statesSize)
+    {
+        while (gRerender.numStates + count > gRerender.statesSize)
+        {
+            gRerender.statesSize = gRerender.statesSize ? gRerender.statesSize * 2 : 50 * 60;
+        }
+        gRerender.states = realloc(gRerender.states, gRerender.statesSize * sizeof(struct PlayerState));
+    }
+    memcpy(&gRerender.states[gRerender.numStates], states, count * sizeof(struct PlayerState));
+    gRerender.numStates += count;
+}
+
+// Everything in a song that the player reads while it plays a subtune,
+// laid out so that two versions of the song can be compared
+struct SongView
+{
+    uint8_t orderlist[NUM_CHANNELS][258];
+    uint16_t orderlistLength[NUM_CHANNELS];
+
+    uint16_t numPatterns;
+    struct PatternRow *rows[256];
+    uint16_t numRows[256];
+
+    uint16_t numInstruments;
+    uint8_t instruments[256][offsetof(struct Instrument, name)];
+
+    // Both sides of every table entry, with the entries past the end
+    // of the table read as 0 the way the player does
+    uint8_t wavetable[256][2];
+    uint8_t pulsetable[256][2];
+    uint8_t filtertable[256][2];
+};
+
+static void ReadTable(uint8_t table[256][2], const uint8_t *data, uint8_t size)
+{
+    memset(table, 0, 256 * 2);
+    for (int position = 0 ; position < size ; position++)
+    {
+        table[position][0] = data[position];
+        table[position][1] = data[position + size];
+    }
+}
+
+// Fills in the view from the song that's currently initialized
+static void ReadSongView(struct SongView *view, uint8_t subtune)
+{
+    memset(view, 0, sizeof(*view));
+
+    for (uint8_t channel = 0 ; channel < NUM_CHANNELS ; channel++)
+    {
+        // Up to the end marker and the position it loops back to
+        const uint8_t *orderlistData = (const uint8_t *)ORDERLIST(subtune, channel);
+        uint16_t length = 0;
+        while (length < 256 && orderlistData[length] != 0xFF)
+        {
+            length++;
+        }
+        length = (length < 256) ? length + 2 : 256;
+        memcpy(view->orderlist[channel], orderlistData, length);
+        view->orderlistLength[channel] = length;
+    }
+
+    view->numPatterns = gNumPatterns;
+    for (int number = 0 ; number < gNumPatterns ; number++)
+    {
+        struct Track reader;
+        SetTrackRow(&reader, number, 0);
+        struct PatternRow rows[256];
+        uint16_t numRows = 0;
+        const struct PatternRow *row;
+        do
+        {
+            struct PatternRow buffer;
+            row = ReadPatternRow(reader.songPosition, &buffer);
+            rows[numRows++] = *row;
+            NextPatternRow(&reader);
+        } while (row->action != RowPatternEnd && numRows < 256);
+
+        view->rows[number] = malloc(numRows * sizeof(struct PatternRow));
+        memcpy(view->rows[number], rows, numRows * sizeof(struct PatternRow));
+        view->numRows[number] = numRows;
+    }
+
+    view->numInstruments = gNumInstruments;
+    for (int instrument = 0 ; instrument < gNumInstruments && instrument < 256 ; instrument++)
+    {
+        memcpy(view->instruments[instrument], &gInstruments[instrument], offsetof(struct Instrument, name));
+    }
+
+    ReadTable(view->wavetable, gWavetable, gWavetableSize);
+    ReadTable(view->pulsetable, gPulsetable, gPulsetableSize);
+    ReadTable(view->filtertable, gFiltertable, gFiltertableSize);
+}
+
+static void FreeSongView(struct SongView *view)
+{
+    for (int number = 0 ; number < view->numPatterns ; number++)
+    {
+        free(view->rows[number]);
+    }
+}
+
+// What's different between two versions of a song, marked by
+// channel, pattern number, instrument number or table position
+struct SongChanges
+{
+    uint8_t orderlist[NUM_CHANNELS];
+    uint8_t pattern[256];
+    uint8_t instrument[256];
+    uint8_t wavetable[256];
+    uint8_t pulsetable[256];
+    uint8_t filtertable[256];
+};
+
+static int PatternRowsDiffer(const struct PatternRow *a, const struct PatternRow *b)
+{
+    return a->action != b->action || a->command != b->command || a->note != b->note ||
+        a->instrument != b->instrument || a->parameter != b->parameter;
+}
+
+// Returns how many things changed
+static int CompareSongViews(const struct SongView *old, const struct SongView *new, struct SongChanges *changes)
+{
+    int count = 0;
+    memset(changes, 0, sizeof(*changes));
+
+    for (uint8_t channel = 0 ; channel < NUM_CHANNELS ; channel++)
+    {
+        changes->orderlist[channel] = old->orderlistLength[channel] != new->orderlistLength[channel] ||
+            memcmp(old->orderlist[channel], new->orderlist[channel], old->orderlistLength[channel]) != 0;
+        count += changes->orderlist[channel];
+    }
+
+    // Patterns and instruments that only exist in one of them count
+    // as changed
+    for (int number = 0 ; number < 256 ; number++)
+    {
+        if (number >= old->numPatterns || number >= new->numPatterns)
+        {
+            changes->pattern[number] = (number < old->numPatterns || number < new->numPatterns);
+        }
+        else if (old->numRows[number] != new->numRows[number])
+        {
+            changes->pattern[number] = 1;
+        }
+        else
+        {
+            for (int row = 0 ; row < old->numRows[number] ; row++)
+            {
+                if (PatternRowsDiffer(&old->rows[number][row], &new->rows[number][row]))
+                {
+                    changes->pattern[number] = 1;
+                    break;
+                }
+            }
+        }
+        count += changes->pattern[number];
+
+        if (number >= old->numInstruments || number >= new->numInstruments)
+        {
+            changes->instrument[number] = (number < old->numInstruments || number < new->numInstruments);
+        }
+        else
+        {
+            changes->instrument[number] = memcmp(old->instruments[number], new->instruments[number],
+                                                 sizeof(old->instruments[number])) != 0;
+        }
+        count += changes->instrument[number];
+
+        changes->wavetable[number] = memcmp(old->wavetable[number], new->wavetable[number], 2) != 0;
+        changes->pulsetable[number] = memcmp(old->pulsetable[number], new->pulsetable[number], 2) != 0;
+        changes->filtertable[number] = memcmp(old->filtertable[number], new->filtertable[number], 2) != 0;
+        count += changes->wavetable[number] + changes->pulsetable[number] + changes->filtertable[number];
+    }
+
+    return count;
+}
+
+// Whether the tick that starts in state and ends in next might read
+// anything that changed. It doesn't have to be exact as long as it
+// never misses a tick that does.
+static int TickReadsChanges(const struct PlayerState *state, const struct PlayerState *next, const struct SongChanges *changes)
+{
+    for (uint8_t channel = 0 ; channel < NUM_CHANNELS ; channel++)
+    {
+        const struct Track *track = &state->tracks[channel];
+        const struct Track *nextTrack = &next->tracks[channel];
+
+        // The tables are read at the position the tick starts at, once
+        // there's an instrument and unless they're waiting
+        if (track->instrumentNumber >= 0)
+        {
+            if (track->wavetablePosition != 0xFF && track->wavetableDelay == 0 &&
+                changes->wavetable[track->wavetablePosition])
+            {
+                return 1;
+            }
+
+            if (track->pulsetablePosition != 0xFF && track->pulseRepeatCountdown == 0 &&
+                changes->pulsetable[track->pulsetablePosition])
+            {
+                return 1;
+            }
+        }
+
+        // Only the ticks that read a row read the pattern, the
+        // instrument for a key on or, at the end of a pattern, the
+        // orderlist. The pattern and row after the end are always
+        // row 1 of whichever pattern comes next.
+        if (track->trackStepCountdown != 1)
+        {
+            continue;
+        }
+
+        if (changes->pattern[state->patternNumber[channel]] || changes->pattern[next->patternNumber[channel]])
+        {
+            return 1;
+        }
+
+        if (nextTrack->instrumentNumber >= 0 && changes->instrument[nextTrack->instrumentNumber])
+        {
+            return 1;
+        }
+
+        if (changes->orderlist[channel] &&
+            (next->patternRow[channel] <= 1 || nextTrack->orderlistPosition != track->orderlistPosition ||
+             next->patternNumber[channel] != state->patternNumber[channel] ||
+             nextTrack->patternRepeatCountdown != track->patternRepeatCountdown))
+        {
+            return 1;
+        }
+    }
+
+    // The filtertable reads where it starts, and can read up to two
+    // entries in front of where it ends up after a jump
+    if (state->filter.tablePosition != 0xFF && changes->filtertable[state->filter.tablePosition])
+    {
+        return 1;
+    }
+
+    for (int position = next->filter.tablePosition - 2 ; position <= next->filter.tablePosition ; position++)
+    {
+        if (position >= 0 && position < 0xFF && changes->filtertable[position])
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static void FreePreviousRender(struct PreviousRender *previous)
+{
+    free(previous->songdata);
+    free(previous->output);
+    free(previous->states);
+    memset(previous, 0, sizeof(*previous));
+}
+
+// Loads the checkpoints and the audio they go with.
+// Returns 0 if there aren't any or they can't be used.
+static int LoadPreviousRender(struct PreviousRender *previous, const char *checkpointFilename,
+                              const char *outputFilename, uint8_t subtune)
+{
+    memset(previous, 0, sizeof(*previous));
+
+    FILE *fp = fopen(checkpointFilename, "rb");
+    if (fp == NULL)
+    {
+        return 0;
+    }
+
+    struct CheckpointHeader *header = &previous->header;
+    if (fread(header, sizeof(*header), 1, fp) != 1 || header->magic != CHECKPOINT_MAGIC ||
+        header->version != SIDISH_VERSION || header->stateSize != sizeof(struct PlayerState) ||
+        header->subtune != subtune)
+    {
+        fclose(fp);
+        return 0;
+    }
+
+    previous->numStates = (header->samples + VBI_COUNT - 1) / VBI_COUNT;
+    previous->songdata = malloc(header->songSize + 1);
+    previous->states = malloc(previous->numStates * sizeof(struct PlayerState));
+    int loaded = fread(previous->songdata, 1, header->songSize, fp) == header->songSize &&
+                 fread(previous->states, sizeof(struct PlayerState), previous->numStates, fp) == previous->numStates;
+    fclose(fp);
+    if (!loaded)
+    {
+        FreePreviousRender(previous);
+        return 0;
+    }
+    previous->songdata[header->songSize] = 0;
+
+    // The audio is after the 44 byte header
+    uint32_t size;
+    char *wav = LoadFile(outputFilename, &size);
+    if (wav == NULL || size != 44 + header->samples ||
+        HashBytes(wav + 44, header->samples, FNV_OFFSET_BASIS) != header->outputHash)
+    {
+        free(wav);
+        FreePreviousRender(previous);
+        return 0;
+    }
+    previous->output = malloc(header->samples);
+    memcpy(previous->output, wav + 44, header->samples);
+    free(wav);
+
+    return 1;
+}
+
+static int SaveCheckpoints(const char *checkpointFilename, const char *songdata, uint32_t songSize, uint8_t subtune)
+{
+    FILE *fp = fopen(checkpointFilename, "wb");
+    if (fp == NULL)
+    {
+        perror(checkpointFilename);
+        return 0;
+    }
+
+    struct CheckpointHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = CHECKPOINT_MAGIC;
+    header.version = SIDISH_VERSION;
+    header.stateSize = sizeof(struct PlayerState);
+    header.subtune = subtune;
+    header.songSize = songSize;
+    header.samples = gRerender.length;
+    header.outputHash = HashBytes(gRerender.output, gRerender.length, FNV_OFFSET_BASIS);
+
+    int written = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+                  fwrite(songdata, 1, songSize, fp) == songSize &&
+                  fwrite(gRerender.states, sizeof(struct PlayerState), gRerender.numStates, fp) == gRerender.numStates;
+    if (fclose(fp) != 0 || !written)
+    {
+        printf("Failed to write %s.\n", checkpointFilename);
+        return 0;
+    }
+    return 1;
+}
+
+// Copies the audio and checkpoints of ticks [first, last) from the
+// previous render
+static void ReusePreviousRender(const struct PreviousRender *previous, uint32_t first, uint32_t last)
+{
+    uint32_t start = first * VBI_COUNT;
+    uint32_t end = (last * VBI_COUNT < previous->header.samples) ? last * VBI_COUNT : previous->header.samples;
+    for (uint32_t sample = start ; sample < end ; sample++)
+    {
+        RerenderByte(previous->output[sample]);
+    }
+    AddCheckpoints(&previous->states[first], last - first);
+}
+
+// Renders a subtune of the song, which has to be initialized already,
+// to outputFilename as 8 bit mono. Reuses as much as it can of the last
+// render if checkpointFilename has the checkpoints from it, and saves
+// the checkpoints of this one. Returns 1 on success.
+int RenderWithCheckpoints(const char *songdata, uint32_t songSize, uint8_t subtune,
+                          const char *outputFilename, const char *checkpointFilename)
+{
+    struct PreviousRender previous;
+    uint8_t *affected = NULL;
+
+    int havePrevious = LoadPreviousRender(&previous, checkpointFilename, outputFilename, subtune);
+    if (havePrevious)
+    {
+        struct SongView *oldView = malloc(sizeof(struct SongView));
+        struct SongView *newView = malloc(sizeof(struct SongView));
+
+        // Both songs were already printed when they were loaded
+        int printEnabled = gPrintEnabled;
+        gPrintEnabled = 0;
+        int oldParsed = InitializeSong(previous.songdata) && subtune < gNumSubtunes;
+        if (oldParsed)
+        {
+            ReadSongView(oldView, subtune);
+        }
+        int newParsed = InitializeSong(songdata) && subtune < gNumSubtunes;
+        if (newParsed)
+        {
+            ReadSongView(newView, subtune);
+        }
+        gPrintEnabled = printEnabled;
+
+        if (oldParsed && newParsed)
+        {
+            struct SongChanges changes;
+            printf("%d changes since the last render\n", CompareSongViews(oldView, newView, &changes));
+
+            // The last tick is always rendered, since that's where the
+            // song ends
+            affected = malloc(previous.numStates);
+            for (uint32_t tick = 0 ; tick < previous.numStates ; tick++)
+            {
+                affected[tick] = (tick + 1 == previous.numStates) ||
+                    TickReadsChanges(&previous.states[tick], &previous.states[tick + 1], &changes);
+            }
+        }
+        else
+        {
+            FreePreviousRender(&previous);
+            havePrevious = 0;
+        }
+
+        if (oldParsed)
+        {
+            FreeSongView(oldView);
+        }
+        if (newParsed)
+        {
+            FreeSongView(newView);
+        }
+
+        free(oldView);
+        free(newView);
+    }
+
+    if (!StartSubtune(subtune))
+    {
+        if (havePrevious)
+        {
+            FreePreviousRender(&previous);
+            free(affected);
+        }
+        return 0;
+    }
+
+    gRerender.length = 0;
+    gRerender.numStates = 0;
+    gRerender.output = NULL;
+    gRerender.size = 0;
+    uint32_t renderedTicks = 0;
+
+    // Skips straight to the first tick that's affected, as long as the
+    // subtune starts out the same way (the orderlists and the first
+    // patterns are read before the first tick). A converged render is
+    // only checked against the old checkpoints after that.
+    uint32_t tick = 0;
+    if (havePrevious)
+    {
+        struct PlayerState state;
+        SavePlayerState(&state);
+        if (memcmp(&state, &previous.states[0], sizeof(state)) == 0)
+        {
+            while (tick < previous.numStates && !affected[tick])
+            {
+                tick++;
+            }
+            ReusePreviousRender(&previous, 0, tick);
+            if (tick > 0 && tick < previous.numStates)
+            {
+                RestorePlayerState(&previous.states[tick]);
+            }
+        }
+    }
+
+    gRerender.active = 1;
+    uint32_t resumedTick = tick;
+    int finished = (havePrevious && tick == previous.numStates);
+    while (!finished)
+    {
+        struct PlayerState state;
+        SavePlayerState(&state);
+
+        if (havePrevious && tick > resumedTick && tick < previous.numStates &&
+            memcmp(&state, &previous.states[tick], sizeof(state)) == 0)
+        {
+            // Caught up with the old render, so it can be copied up to
+            // the next tick that reads something that changed
+            uint32_t next = tick;
+            while (next < previous.numStates && !affected[next])
+            {
+                next++;
+            }
+
+            if (next > tick)
+            {
+                ReusePreviousRender(&previous, tick, next);
+                if (next == previous.numStates)
+                {
+                    break;
+                }
+
+                tick = next;
+                resumedTick = tick;
+                RestorePlayerState(&previous.states[tick]);
+                SavePlayerState(&state);
+            }
+        }
+
+        AddCheckpoints(&state, 1);
+        renderedTicks++;
+
+        for (int sample = 0 ; sample < VBI_COUNT ; sample++)
+        {
+            if (OutputAudioAndCalculateNextByte())
+            {
+                finished = 1;
+                break;
+            }
+        }
+        tick++;
+    }
+
+    gRerender.active = 0;
+    printf("Rendered %u of %u ticks\n", renderedTicks, gRerender.numStates);
+
+    if (havePrevious)
+    {
+        FreePreviousRender(&previous);
+        free(affected);
+    }
+
+    int result = 0;
+    FILE *fp = fopen(outputFilename, "wb");
+    if (fp == NULL)
+    {
+        printf("Failed to open output file %s.\n", outputFilename);
+    }
+    else
+    {
+        WriteWavHeader(fp, BITRATE, 1, 8, gRerender.length);
+        result = fwrite(gRerender.output, 1, gRerender.length, fp) == gRerender.length;
+        result &= fclose(fp) == 0;
+        result = result && SaveCheckpoints(checkpointFilename, songdata, songSize, subtune);
+    }
+
+    free(gRerender.output);
+    free(gRerender.states);
+    memset(&gRerender, 0, sizeof(gRerender));
+    return result;
+}
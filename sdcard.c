@@ -0,0 +1,210 @@
+// SD card reads over SPI for the Adafruit Wave Shield
+// Provides BlockRead for songsource.c. The card is on the ATmega's
+// hardware SPI with its chip select on pin 10 (PB2). The DAC has its
+// own pins on PORTD (see DacSend), so the two never share a bus.
+//
+// Only what the song source needs is here: starting the card up, and
+// reading part of a 512 byte block.
+
+#define SD_CS   (PB2)
+#define SD_MOSI (PB3)
+#define SD_SCK  (PB5)
+
+#define SD_SELECT()   { PORTB &= ~_BV(SD_CS); }
+#define SD_DESELECT() { PORTB |= _BV(SD_CS); }
+
+// Commands
+#define SD_GO_IDLE_STATE     (0)
+#define SD_SEND_IF_COND      (8)
+#define SD_SET_BLOCKLEN      (16)
+#define SD_READ_SINGLE_BLOCK (17)
+#define SD_APP_CMD           (55)
+#define SD_READ_OCR          (58)
+#define SD_APP_SEND_OP_COND  (41)
+
+#define SD_R1_IDLE      (0x01)
+#define SD_DATA_START   (0xFE)
+
+// How many times to poll the card before giving up on it
+#define SD_TRIES (0xFFFF)
+
+// SDHC and SDXC cards are addressed by block rather than by byte
+uint8_t gCardBlockAddressing = 0;
+
+static uint8_t SpiTransfer(uint8_t value)
+{
+    SPDR = value;
+    while (!(SPSR & _BV(SPIF)));
+    return SPDR;
+}
+
+// Sends a command and returns the card's first response byte
+static uint8_t SdCommand(uint8_t command, uint32_t argument)
+{
+    // Wait until the card isn't busy any more
+    for (uint16_t tries = SD_TRIES ; tries > 0 && SpiTransfer(0xFF) != 0xFF ; tries--);
+
+    SpiTransfer(0x40 | command);
+    SpiTransfer(argument >> 24);
+    SpiTransfer(argument >> 16);
+    SpiTransfer(argument >> 8);
+    SpiTransfer(argument);
+
+    // The CRC only counts until the card is in SPI mode, which these
+    // are the only 2 commands sent before
+    uint8_t crc = 0x01;
+    if (command == SD_GO_IDLE_STATE)
+    {
+        crc = 0x95;
+    }
+    else if (command == SD_SEND_IF_COND)
+    {
+        crc = 0x87;
+    }
+    SpiTransfer(crc);
+
+    uint8_t response;
+    for (uint8_t tries = 0 ; tries < 10 ; tries++)
+    {
+        response = SpiTransfer(0xFF);
+        if (!(response & 0x80))
+        {
+            break;
+        }
+    }
+    return response;
+}
+
+static uint8_t SdAppCommand(uint8_t command, uint32_t argument)
+{
+    SdCommand(SD_APP_CMD, 0);
+    return SdCommand(command, argument);
+}
+
+static void SdEndCommand()
+{
+    SD_DESELECT();
+    SpiTransfer(0xFF);
+}
+
+// Starts the card up. Has to be called with the interrupts off, before
+// anything is read. Returns 0 if there's no card that works.
+uint8_t SdCardInitialize()
+{
+    DDRB |= _BV(SD_CS) | _BV(SD_MOSI) | _BV(SD_SCK);
+    SD_DESELECT();
+
+    // Below 400 kHz to start with: 16 MHz / 128 = 125 kHz
+    SPCR = _BV(SPE) | _BV(MSTR) | _BV(SPR1) | _BV(SPR0);
+    SPSR = 0;
+
+    // At least 74 clocks with the card deselected puts it in SPI mode
+    for (uint8_t i = 0 ; i < 10 ; i++)
+    {
+        SpiTransfer(0xFF);
+    }
+
+    SD_SELECT();
+    uint16_t tries = SD_TRIES;
+    while (SdCommand(SD_GO_IDLE_STATE, 0) != SD_R1_IDLE)
+    {
+        if (--tries == 0)
+        {
+            SdEndCommand();
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
+            print("No SD card\n");
+#endif
+            return 0;
+        }
+    }
+
+    // Only version 2 cards answer this, and only they can be SDHC
+    uint8_t version2 = 0;
+    if (SdCommand(SD_SEND_IF_COND, 0x1AA) == SD_R1_IDLE)
+    {
+        uint8_t echo[4];
+        for (uint8_t i = 0 ; i < 4 ; i++)
+        {
+            echo[i] = SpiTransfer(0xFF);
+        }
+        version2 = (echo[3] == 0xAA);
+    }
+
+    tries = SD_TRIES;
+    while (SdAppCommand(SD_APP_SEND_OP_COND, version2 ? 0x40000000 : 0) != 0)
+    {
+        if (--tries == 0)
+        {
+            SdEndCommand();
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
+            print("The SD card didn't start\n");
+#endif
+            return 0;
+        }
+    }
+
+    gCardBlockAddressing = 0;
+    if (version2 && SdCommand(SD_READ_OCR, 0) == 0)
+    {
+        // Card capacity status bit
+        gCardBlockAddressing = (SpiTransfer(0xFF) & 0x40) != 0;
+        for (uint8_t i = 0 ; i < 3 ; i++)
+        {
+            SpiTransfer(0xFF);
+        }
+    }
+
+    if (!gCardBlockAddressing)
+    {
+        SdCommand(SD_SET_BLOCKLEN, 512);
+    }
+    SdEndCommand();
+
+    // As fast as it goes from here on: 16 MHz / 2 = 8 MHz
+    SPCR = _BV(SPE) | _BV(MSTR);
+    SPSR = _BV(SPI2X);
+
+    return 1;
+}
+
+// The whole block has to be clocked out, but only the part that's
+// wanted is kept. That's over 8000 bits for any read, so even at 8 MHz
+// it takes more than a millisecond once the player's interrupt has had
+// its share, which is why the interrupt never waits for one.
+int BlockRead(uint32_t sector, uint16_t offset, uint8_t *buffer, uint16_t length)
+{
+    SD_SELECT();
+    if (SdCommand(SD_READ_SINGLE_BLOCK, gCardBlockAddressing ? sector : sector << 9) != 0)
+    {
+        SdEndCommand();
+        return 0;
+    }
+
+    uint16_t tries = SD_TRIES;
+    uint8_t token;
+    while ((token = SpiTransfer(0xFF)) == 0xFF)
+    {
+        if (--tries == 0)
+        {
+            break;
+        }
+    }
+    if (token != SD_DATA_START)
+    {
+        SdEndCommand();
+        return 0;
+    }
+
+    // The data and then its 2 byte CRC
+    for (uint16_t position = 0 ; position < 512 + 2 ; position++)
+    {
+        uint8_t value = SpiTransfer(0xFF);
+        if (position >= offset && position < offset + length)
+        {
+            *buffer++ = value;
+        }
+    }
+
+    SdEndCommand();
+    return 1;
+}
@@ -0,0 +1,145 @@
+// SD card song source test
+// Plays SONG.BIN from an image of an SD card the way the firmware does
+// when it's built with SONG_SOURCE = sd, with a file standing in for
+// the card. The main loop's prefetch is called once every interval
+// samples, which is about how often the ATmega can finish reading a
+// line while it plays. It reports how well the cache kept up, and a
+// hash of the audio to check against the same song played from flash.
+//
+// Usage: sdtest [-i interval] [-o output.raw] card.img
+
+#include <unistd.h>
+
+#define COMPILED_SONG (1)
+#define SONG_SOURCE_SD (1)
+
+#include "hostplayer.c"
+#include "songsource.c"
+
+// Samples between calls to SongSourcePrefetch. A read takes over a
+// millisecond on the ATmega (see BlockRead in sdcard.c).
+#define DEFAULT_PREFETCH_INTERVAL (24)
+
+FILE *gCard;
+uint32_t gCardReads = 0;
+
+FILE *gOutput = NULL;
+uint64_t gOutputHash = FNV_OFFSET_BASIS;
+
+int BlockRead(uint32_t sector, uint16_t offset, uint8_t *buffer, uint16_t length)
+{
+    gCardReads++;
+
+    if (offset + length > SECTOR_SIZE ||
+        fseek(gCard, (long)sector * SECTOR_SIZE + offset, SEEK_SET) != 0 ||
+        fread(buffer, 1, length, gCard) != length)
+    {
+        return 0;
+    }
+    return 1;
+}
+
+void OutputByte(uint8_t value)
+{
+    gOutputHash = HashBytes(&value, 1, gOutputHash);
+    if (gOutput != NULL)
+    {
+        fputc(value, gOutput);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int interval = DEFAULT_PREFETCH_INTERVAL;
+    const char *outputFilename = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "i:o:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'i':
+                interval = atoi(optarg);
+                break;
+
+            case 'o':
+                outputFilename = optarg;
+                break;
+
+            default:
+                optind = argc;
+                break;
+        }
+    }
+
+    if (optind != argc - 1 || interval < 1)
+    {
+        fprintf(stderr, "Usage: sdtest [-i interval] [-o output.raw] card.img\n");
+        return -1;
+    }
+
+    gCard = fopen(argv[optind], "rb");
+    if (gCard == NULL)
+    {
+        perror(argv[optind]);
+        return -1;
+    }
+
+    if (outputFilename != NULL)
+    {
+        gOutput = fopen(outputFilename, "wb");
+        if (gOutput == NULL)
+        {
+            perror(outputFilename);
+            return -1;
+        }
+    }
+
+    InitializeTables();
+    const char *songdata = SongSourceOpen(SONG_SOURCE_FILE_NAME);
+    if (songdata == NULL || !InitializeSong(songdata))
+    {
+        fprintf(stderr, "Can't play the song on %s\n", argv[optind]);
+        return -1;
+    }
+    printf("SONG.BIN is %u bytes in %u clusters, %u bytes of it loaded into RAM\n",
+           gSongFile.size, gSongFile.numClusters, gSongHeadSize);
+
+    while (SongSourcePrefetch());
+    uint32_t startReads = gCardReads;
+
+    // Every row would be printed otherwise
+    gPrintEnabled = 0;
+
+    uint32_t samples = 0;
+    int finished = 0;
+    while (!finished)
+    {
+        finished = OutputAudioAndCalculateNextByte();
+        samples++;
+
+        if (samples % interval == 0)
+        {
+            SongSourcePrefetch();
+        }
+    }
+    gPrintEnabled = 1;
+
+    if (gOutput != NULL)
+    {
+        fclose(gOutput);
+    }
+
+    const struct SongSourceStatistics *statistics = &gSongSourceStatistics;
+    uint32_t reads = statistics->hits + statistics->misses + statistics->dropped;
+    printf("Played %u samples, prefetching every %d, hash %016llX\n",
+           samples, interval, (unsigned long long)gOutputHash);
+    printf("Pattern lines read: %u, %u in the cache (%.2f%%), %u missed, %u dropped\n",
+           reads, statistics->hits, reads ? 100.0 * statistics->hits / reads : 100.0,
+           statistics->misses, statistics->dropped);
+    printf("Rows played late: %u\n", statistics->lateRows);
+    printf("Lines read from the card: %u, %u of them while playing\n",
+           statistics->lineFills, gCardReads - startReads);
+
+    return (statistics->lateRows == 0 && statistics->misses == 0 && statistics->dropped == 0) ? 0 : 1;
+}
@@ -0,0 +1,333 @@
+// Renders one song on several cores at once
+//
+// The song is cut into segments of SEGMENT_TICKS ticks. The parent
+// runs through the song without making any sound, which only needs the
+// ticks and what changes from sample to sample between them: where each
+// voice is in its waveform, its envelope, the noise generator and the
+// filter. At the start of every segment it forks a worker, which starts
+// with an exact copy of the player at that point and renders the
+// segment into a shared buffer while the parent moves on to the next.
+// Since every worker starts from the same state a serial render would
+// be in, the segments join up into exactly the same output.
+//
+// The filter depends on every sample of the voices going through it,
+// so those voices still have to be synthesized in the parent. Songs
+// that filter a voice the whole way through don't speed up as much.
+//
+// Include after hostplayer.c. The tool including this needs to send
+// the output to SegmentByte while gSegmentOutput is set.
+
+#include <unistd.h>
+#include <sys/wait.h>
+
+// 5 seconds of audio per segment
+#define SEGMENT_TICKS (250)
+
+// While set, the output is written here instead, at gSegmentPosition.
+// Only the samples before gSegmentEnd are kept.
+uint8_t *gSegmentOutput = NULL;
+uint32_t gSegmentPosition;
+uint32_t gSegmentEnd;
+
+void SegmentByte(uint8_t value)
+{
+    if (gSegmentPosition < gSegmentEnd)
+    {
+        gSegmentOutput[gSegmentPosition] = value;
+    }
+    gSegmentPosition++;
+}
+
+// The noise generator is linear, so stepping it 2^n times is the same
+// as XORing together where 2^n steps takes each bit that's set
+uint16_t gNoiseJump[16][16];
+int gNoiseJumpReady = 0;
+
+// Where the last number of steps takes each possible low and high
+// byte, since the same number comes up over and over
+struct NoiseSkip
+{
+    uint32_t steps;
+    uint16_t low[256];
+    uint16_t high[256];
+} gNoiseSkip;
+
+static uint16_t JumpNoise(const uint16_t jump[16], uint16_t noise)
+{
+    uint16_t result = 0;
+    for (uint8_t bit = 0 ; bit < 16 ; bit++)
+    {
+        if (noise & (1 << bit))
+        {
+            result ^= jump[bit];
+        }
+    }
+    return result;
+}
+
+static void InitializeNoiseJump()
+{
+    for (uint8_t bit = 0 ; bit < 16 ; bit++)
+    {
+        uint16_t noise = 1 << bit;
+        uint16_t feedback = ((noise >> 0) ^ (noise >> 2) ^ (noise >> 3) ^ (noise >> 5)) & 1;
+        gNoiseJump[0][bit] = (noise >> 1) | (feedback << 15);
+    }
+
+    for (uint8_t power = 1 ; power < 16 ; power++)
+    {
+        for (uint8_t bit = 0 ; bit < 16 ; bit++)
+        {
+            gNoiseJump[power][bit] = JumpNoise(gNoiseJump[power - 1], gNoiseJump[power - 1][bit]);
+        }
+    }
+    gNoiseJumpReady = 1;
+}
+
+// Where stepping the noise generator the given number of times takes it
+static uint16_t StepNoise(uint16_t noise, uint32_t steps)
+{
+    for (uint8_t power = 0 ; steps != 0 ; power++, steps >>= 1)
+    {
+        if (steps & 1)
+        {
+            noise = JumpNoise(gNoiseJump[power], noise);
+        }
+    }
+    return noise;
+}
+
+// Steps the noise generator the given number of times
+static void SkipNoise(uint32_t steps)
+{
+    if (steps == 0)
+    {
+        return;
+    }
+
+    if (!gNoiseJumpReady)
+    {
+        InitializeNoiseJump();
+    }
+
+    if (gNoiseSkip.steps != steps)
+    {
+        for (int value = 0 ; value < 256 ; value++)
+        {
+            gNoiseSkip.low[value] = StepNoise(value, steps);
+            gNoiseSkip.high[value] = StepNoise(value << 8, steps);
+        }
+        gNoiseSkip.steps = steps;
+    }
+
+    gNoise = gNoiseSkip.low[gNoise & 0xFF] ^ gNoiseSkip.high[gNoise >> 8];
+}
+
+// Moves a voice that isn't going through the filter on by the given
+// number of samples. Only stops at the steps of its envelope.
+static void SkipVoice(struct Voice *voice, uint32_t samples)
+{
+    while (samples > 0 && voice->envelopePhase != Off)
+    {
+        // A countdown of 0 goes all the way around before the next step
+        uint32_t untilStep = voice->phaseStepCountdown ? voice->phaseStepCountdown : 0x10000;
+        uint32_t count = (samples < untilStep) ? samples : untilStep;
+
+        // The position goes back 64 whole steps whenever it's past the
+        // end at the start of a sample, and steps is always less than
+        // that, so it's the position modulo 64 whole steps plus the
+        // one step after the last time it was brought back
+        voice->tableOffset = (((voice->tableOffset & 0x3FFF) + (count - 1) * voice->steps) & 0x3FFF) + voice->steps;
+
+        // Leaves the last count to StepEnvelope so it takes the step
+        voice->phaseStepCountdown -= count - 1;
+        StepEnvelope(voice);
+
+        samples -= count;
+    }
+}
+
+// Moves the player on by the given number of samples without working
+// out any output. Has to stop short of the next tick.
+void SkipSamples(uint16_t samples)
+{
+    // Voices going through the filter have to be played sample by
+    // sample, and so do the voices in front of one of them playing a
+    // pulse, since it shares their wrap
+    uint8_t filtered = 0;
+    uint8_t exact = 0;
+    uint8_t exactNoise = 0;
+    for (uint8_t channel = 0 ; channel < NUM_CHANNELS ; channel++)
+    {
+        struct Voice *voice = &channels[channel];
+        if (voice->envelopePhase == Off || !(gFilter.routing & (1 << channel)))
+        {
+            continue;
+        }
+
+        filtered |= 1 << channel;
+        if (!(voice->control & (CONTROL_SAWTOOTH | CONTROL_TRIANGLE)) && (voice->control & CONTROL_PULSE))
+        {
+            exact |= (1 << (channel + 1)) - 1;
+        }
+        else if (!(voice->control & (CONTROL_SAWTOOTH | CONTROL_TRIANGLE | CONTROL_PULSE)) && (voice->control & CONTROL_NOISE))
+        {
+            exactNoise = 1;
+        }
+    }
+    exact |= filtered;
+
+    for (uint8_t channel = 0 ; channel < NUM_CHANNELS ; channel++)
+    {
+        if (!(exact & (1 << channel)))
+        {
+            SkipVoice(&channels[channel], samples);
+        }
+    }
+
+    // The filter keeps running as long as anything is routed to it,
+    // even once the voices going through it have stopped
+    if (exact != 0 || gFilter.routing != 0)
+    {
+        for (uint16_t sample = 0 ; sample < samples ; sample++)
+        {
+            int8_t filterInput = 0;
+            int8_t wrap = 0;
+
+            for (uint8_t channel = 0 ; channel < NUM_CHANNELS ; channel++)
+            {
+                if (exactNoise)
+                {
+                    uint16_t bit = ((gNoise >> 0) ^ (gNoise >> 2) ^ (gNoise >> 3) ^ (gNoise >> 5)) & 1;
+                    gNoise = (gNoise >> 1) | (bit << 15);
+                }
+
+                struct Voice *voice = &channels[channel];
+                if (!(exact & (1 << channel)) || voice->envelopePhase == Off)
+                {
+                    continue;
+                }
+
+                uint16_t offset = WrapTableOffset(voice, &wrap);
+                if (filtered & (1 << channel))
+                {
+                    filterInput += VoiceWaveform(voice, offset, wrap);
+                }
+                StepEnvelope(voice);
+                voice->tableOffset += voice->steps;
+            }
+
+            if (gFilter.routing != 0)
+            {
+                FilterSample(filterInput);
+            }
+        }
+    }
+
+    if (!exactNoise)
+    {
+        SkipNoise((uint32_t)samples * NUM_CHANNELS);
+    }
+
+    vbiCount -= samples;
+}
+
+// Renders the subtune that's been started into output, which has to be
+// shared (MAP_SHARED) since the workers write to it, using up to the
+// given number of workers at a time. Stops at limit samples.
+// Returns the number of samples, the same as a serial render would
+// have written, or -1 if a worker failed.
+int64_t RenderSegments(uint8_t *output, uint32_t limit, int workers)
+{
+    int running = 0;
+    int failures = 0;
+    int finished = 0;
+
+    gSegmentOutput = output;
+    gSegmentPosition = 0;
+    gSegmentEnd = 0;
+
+    while (!finished && gSegmentPosition < limit)
+    {
+        if (running == workers)
+        {
+            int status;
+            if (wait(&status) > 0)
+            {
+                running--;
+                failures += !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+            }
+        }
+
+        // The first tick of the segment might be closer than the others
+        uint32_t start = gSegmentPosition;
+        uint32_t end = start + vbiCount + (SEGMENT_TICKS - 1) * VBI_COUNT;
+        if (end > limit)
+        {
+            end = limit;
+        }
+
+        fflush(stdout);
+        if (gLogFile != NULL)
+        {
+            fflush(gLogFile);
+        }
+
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            // The messages already came from the parent
+            gPrintEnabled = 0;
+            gSegmentEnd = end;
+            while (gSegmentPosition < end && !OutputAudioAndCalculateNextByte());
+            _exit(0);
+        }
+        else if (pid < 0)
+        {
+            perror("fork");
+            failures++;
+            break;
+        }
+        running++;
+
+        // Skip ahead to the next segment, working out only the last
+        // sample before each tick in full since the next sample is
+        // already waiting in gNextOutputValue when a segment starts
+        for (int tick = 0 ; tick < SEGMENT_TICKS && gSegmentPosition < limit ; tick++)
+        {
+            uint16_t samples = vbiCount - 1;
+            if (gSegmentPosition + samples >= limit)
+            {
+                samples = limit - gSegmentPosition;
+                SkipSamples(samples);
+                gSegmentPosition += samples;
+                break;
+            }
+
+            SkipSamples(samples);
+            gSegmentPosition += samples;
+            if (OutputAudioAndCalculateNextByte())
+            {
+                finished = 1;
+                break;
+            }
+        }
+    }
+
+    while (running > 0)
+    {
+        int status;
+        if (wait(&status) <= 0)
+        {
+            failures++;
+            break;
+        }
+        running--;
+        failures += !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+    }
+
+    uint32_t samples = (gSegmentPosition < limit) ? gSegmentPosition : limit;
+    gSegmentOutput = NULL;
+
+    return failures ? -1 : (int64_t)samples;
+}
@@ -0,0 +1,250 @@
+// Drives the synthesizer from a log of SID register writes instead of
+// the GoatTracker pattern data, the kind VICE writes with
+// -sounddev dump: a line for every write to $D400-$D418 with the number
+// of cycles since the last write, the register and the value. Each
+// number can be decimal, or hex with a $ or 0x in front, and the
+// register can be given as its address.
+//
+// The writes are grouped into frames by the cycle they happen on, and
+// each tick applies a whole frame of them at once. The frequency goes
+// through lookup tables and everything else is copied or shifted into
+// the voices, so nothing needs more than an add per write.
+// Include after goatplayer.c.
+
+#define SID_NUM_REGISTERS (25)
+
+// Cycles in a frame of a PAL C64, 312 lines of 63 cycles
+#define SID_PAL_CYCLES_PER_FRAME (19656)
+
+// The registers of each voice, from the first one of the voice
+#define SID_VOICE_REGISTERS (7)
+#define SID_FREQUENCY_LOW   (0)
+#define SID_FREQUENCY_HIGH  (1)
+#define SID_PULSE_LOW       (2)
+#define SID_PULSE_HIGH      (3)
+#define SID_CONTROL         (4)
+#define SID_ATTACK_DECAY    (5)
+#define SID_SUSTAIN_RELEASE (6)
+
+#define SID_FILTER_CUTOFF_LOW   (0x15)
+#define SID_FILTER_CUTOFF_HIGH  (0x16)
+#define SID_FILTER_RESONANCE    (0x17) // Resonance in the high nibble, routing in the low
+#define SID_FILTER_MODE_VOLUME  (0x18) // Filter types in bits 4-6, volume in the low nibble
+
+// The voices' waveforms are 64 positions of 256 steps, and the SID's
+// 12 bit pulse width covers the whole cycle
+#define SID_PULSE_WIDTH_SHIFT (2)
+
+struct SidWrite
+{
+    uint32_t frame;
+    uint8_t reg;
+    uint8_t value;
+};
+
+struct SidWrite *gSidWrites;
+uint32_t gNumSidWrites;
+uint32_t gNumSidFrames;
+
+// The next write to apply, and the frame the next tick applies
+uint32_t gSidWritePosition;
+uint32_t gSidFrame;
+
+// What was last written to each register
+uint8_t gSidRegisters[SID_NUM_REGISTERS];
+
+// Reads a number that's decimal or hex with a $ or 0x in front.
+// Returns 0 if there isn't one.
+int ParseDumpNumber(char **text, uint32_t *value)
+{
+    char *start = *text;
+    while (*start == ' ' || *start == '\t' || *start == ',')
+    {
+        start++;
+    }
+
+    char *end;
+    if (*start == '$')
+    {
+        *value = strtoul(start + 1, &end, 16);
+        if (end == start + 1)
+        {
+            return 0;
+        }
+    }
+    else if (start[0] == '0' && (start[1] == 'x' || start[1] == 'X'))
+    {
+        *value = strtoul(start + 2, &end, 16);
+        if (end == start + 2)
+        {
+            return 0;
+        }
+    }
+    else
+    {
+        *value = strtoul(start, &end, 10);
+        if (end == start)
+        {
+            return 0;
+        }
+    }
+
+    *text = end;
+    return 1;
+}
+
+// Reads a register write log into gSidWrites. Lines that don't start
+// with 3 numbers, like comments, are skipped. Returns 0 if the file
+// can't be read or has no writes.
+int LoadSidDump(const char *filename, uint32_t cyclesPerFrame)
+{
+    FILE *fp = fopen(filename, "r");
+    if (fp == NULL)
+    {
+        printf("Failed to open %s.\n", filename);
+        return 0;
+    }
+
+    uint32_t capacity = 4096;
+    gSidWrites = realloc(gSidWrites, capacity * sizeof(struct SidWrite));
+    gNumSidWrites = 0;
+
+    uint64_t cycle = 0;
+    char line[256];
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        char *text = line;
+        uint32_t cycles, reg, value;
+        if (!ParseDumpNumber(&text, &cycles) || !ParseDumpNumber(&text, &reg) || !ParseDumpNumber(&text, &value))
+        {
+            continue;
+        }
+
+        // Only the first SID, wherever it's mapped, and its write
+        // only registers
+        cycle += cycles;
+        reg &= 0x1F;
+        if (reg >= SID_NUM_REGISTERS)
+        {
+            continue;
+        }
+
+        if (gNumSidWrites == capacity)
+        {
+            capacity *= 2;
+            gSidWrites = realloc(gSidWrites, capacity * sizeof(struct SidWrite));
+        }
+
+        struct SidWrite *write = &gSidWrites[gNumSidWrites++];
+        write->frame = cycle / cyclesPerFrame;
+        write->reg = reg;
+        write->value = value;
+    }
+    fclose(fp);
+
+    if (gNumSidWrites == 0)
+    {
+        printf("%s has no SID register writes.\n", filename);
+        return 0;
+    }
+
+    gNumSidFrames = gSidWrites[gNumSidWrites - 1].frame + 1;
+    return 1;
+}
+
+// Updates the voices and the filter for a write to a SID register
+void WriteSidRegister(uint8_t reg, uint8_t value)
+{
+    uint8_t previous = gSidRegisters[reg];
+    gSidRegisters[reg] = value;
+
+    if (reg < NUM_CHANNELS * SID_VOICE_REGISTERS)
+    {
+        uint8_t channel = reg / SID_VOICE_REGISTERS;
+        const uint8_t *registers = &gSidRegisters[channel * SID_VOICE_REGISTERS];
+        struct Voice *voice = &channels[channel];
+
+        switch (reg - channel * SID_VOICE_REGISTERS)
+        {
+            case SID_FREQUENCY_LOW:
+            case SID_FREQUENCY_HIGH:
+                voice->steps = pgm_read_word(&SID_FREQUENCY_HIGH_TABLE[registers[SID_FREQUENCY_HIGH]]) +
+                               pgm_read_byte(&SID_FREQUENCY_LOW_TABLE[registers[SID_FREQUENCY_LOW]]);
+                break;
+
+            case SID_PULSE_LOW:
+            case SID_PULSE_HIGH:
+                voice->pulseWidth = (((registers[SID_PULSE_HIGH] & 0x0F) << 8) | registers[SID_PULSE_LOW]) << SID_PULSE_WIDTH_SHIFT;
+                break;
+
+            case SID_CONTROL:
+                voice->control = value;
+                if (value & CONTROL_TESTBIT)
+                {
+                    // Holds the oscillator at the start of the waveform
+                    voice->tableOffset = 0;
+                }
+
+                if ((value & CONTROL_GATE) && !(previous & CONTROL_GATE))
+                {
+                    // The SID's attack starts from wherever the envelope
+                    // is, which is silence once it's finished releasing
+                    if (voice->envelopePhase == Off)
+                    {
+                        voice->fadeAmount = 32;
+                    }
+                    voice->envelopePhase = Attack;
+                    voice->phaseStepCountdown = AttackCycles[(voice->attackDecay & 0xF0) >> 4];
+                }
+                else if (!(value & CONTROL_GATE) && (previous & CONTROL_GATE) && voice->envelopePhase != Off)
+                {
+                    KeyOff(channel);
+                }
+                break;
+
+            case SID_ATTACK_DECAY:
+                voice->attackDecay = value;
+                break;
+
+            case SID_SUSTAIN_RELEASE:
+                voice->sustainRelease = value;
+                break;
+        }
+    }
+    else
+    {
+        // Only the top 8 bits of the cutoff are used, the same as the
+        // filtertable. There's no master volume, so it's left out.
+        gFilter.cutoff = gSidRegisters[SID_FILTER_CUTOFF_HIGH];
+        gFilter.resonance = gSidRegisters[SID_FILTER_RESONANCE] >> 4;
+        gFilter.routing = gSidRegisters[SID_FILTER_RESONANCE] & ((1 << NUM_CHANNELS) - 1);
+        gFilter.type = gSidRegisters[SID_FILTER_MODE_VOLUME] & (FILTER_LOWPASS | FILTER_BANDPASS | FILTER_HIGHPASS);
+        UpdateFilterCoefficients();
+    }
+}
+
+// Takes the place of GoatPlayerTick. Applies the writes of the next
+// frame in the order they were made, so a voice that's gated off and
+// on again in the same frame still restarts. Returns TRUE once the
+// last frame has been applied.
+int SidDumpTick()
+{
+    while (gSidWritePosition < gNumSidWrites && gSidWrites[gSidWritePosition].frame == gSidFrame)
+    {
+        WriteSidRegister(gSidWrites[gSidWritePosition].reg, gSidWrites[gSidWritePosition].value);
+        gSidWritePosition++;
+    }
+
+    gSidFrame++;
+    return gSidFrame >= gNumSidFrames;
+}
+
+// Starts playing the log that's been loaded from the beginning
+void StartSidDump()
+{
+    ResetSynthesizer();
+    memset(gSidRegisters, 0, sizeof(gSidRegisters));
+    gSidWritePosition = 0;
+    gSidFrame = 0;
+    gTickFunction = SidDumpTick;
+}
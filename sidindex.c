@@ -0,0 +1,591 @@
+// Song library indexer
+// Scans directories for .sng files and writes an index of them (see
+// sidindex.h) with the name, author and copyright, the number of
+// subtunes, instruments and patterns, and how long each subtune plays
+// before it loops. The index can then be searched without opening any
+// of the songs.
+//
+// The details only need the fields at the start of the song and the
+// sizes of its orderlists and tables, which are read straight from the
+// file. Working out the lengths means running the subtunes, but only
+// the ticks, without synthesizing any audio. Songs that have the same
+// size and modification time as in the last index are copied from it
+// without being read again. Songs that are no longer in the scanned
+// directories are dropped. Paths are stored in their canonical form,
+// so a song that's reached through more than one of the directories
+// is only indexed once.
+//
+// Usage: sidindex [-i index] directory...
+//        sidindex [-i index] -q text
+
+#define _GNU_SOURCE
+
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "hostplayer.c"
+#include "sidindex.h"
+
+void OutputByte(uint8_t value)
+{
+    // Only the ticks are run, so nothing is ever output
+    (void)value;
+}
+
+// An index that's mmapped for reading
+struct SongIndex
+{
+    void *data;
+    size_t size;
+    const struct SongIndexHeader *header;
+    const struct SongIndexEntry *entries;
+    const uint32_t *durations;
+    const char *paths;
+};
+
+// The index being built
+struct SongIndexEntry *gEntries = NULL;
+uint32_t gNumEntries = 0;
+uint32_t gEntriesSize = 0;
+uint32_t *gDurations = NULL;
+uint32_t gNumDurations = 0;
+uint32_t gDurationsSize = 0;
+char *gPaths = NULL;
+uint32_t gPathsLength = 0;
+uint32_t gPathsSize = 0;
+
+// The entries by the hash of their path, to find the songs that have
+// already been added. Each bucket holds the entry number + 1 of its
+// first entry, or 0 if it's empty, and the rest of its entries are
+// chained through gNextInBucket.
+#define PATH_BUCKETS (4096)
+uint32_t gPathBuckets[PATH_BUCKETS];
+uint32_t *gNextInBucket = NULL;
+
+// The last index, for the songs that haven't changed
+struct SongIndex gPreviousIndex;
+int gHavePreviousIndex = 0;
+
+uint32_t gSongsRead = 0;
+uint32_t gSongsSkipped = 0;
+
+// Maps an index file and checks that it all fits.
+// Returns 0 if there isn't one or it can't be used.
+int OpenSongIndex(const char *filename, struct SongIndex *index)
+{
+    memset(index, 0, sizeof(*index));
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+    {
+        return 0;
+    }
+
+    struct stat filestat;
+    if (fstat(fd, &filestat) != 0 || filestat.st_size < (off_t)sizeof(struct SongIndexHeader))
+    {
+        close(fd);
+        return 0;
+    }
+
+    index->size = filestat.st_size;
+    index->data = mmap(NULL, index->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (index->data == MAP_FAILED)
+    {
+        return 0;
+    }
+
+    const struct SongIndexHeader *header = index->data;
+    if (header->magic != SONG_INDEX_MAGIC || header->version != SONG_INDEX_VERSION ||
+        sizeof(*header) + (uint64_t)header->numEntries * sizeof(struct SongIndexEntry) > header->durationsOffset ||
+        header->durationsOffset + (uint64_t)header->numDurations * sizeof(uint32_t) > header->pathsOffset ||
+        header->pathsOffset + (uint64_t)header->pathsSize > index->size ||
+        (header->pathsSize > 0 && ((const char *)index->data)[header->pathsOffset + header->pathsSize - 1] != 0))
+    {
+        printf("%s isn't a song index from this version of sidindex.\n", filename);
+        munmap(index->data, index->size);
+        return 0;
+    }
+
+    index->header = header;
+    index->entries = (const struct SongIndexEntry *)(header + 1);
+    index->durations = (const uint32_t *)((const char *)index->data + header->durationsOffset);
+    index->paths = (const char *)index->data + header->pathsOffset;
+
+    for (uint32_t entry = 0 ; entry < header->numEntries ; entry++)
+    {
+        if (index->entries[entry].pathOffset >= header->pathsSize ||
+            index->entries[entry].firstDuration + (uint64_t)index->entries[entry].numSubtunes > header->numDurations)
+        {
+            printf("%s is damaged.\n", filename);
+            munmap(index->data, index->size);
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+void CloseSongIndex(struct SongIndex *index)
+{
+    munmap(index->data, index->size);
+}
+
+// Finds a song by its path, since the entries are sorted by path.
+// Returns NULL if it isn't in the index.
+const struct SongIndexEntry *FindSongIndexEntry(const struct SongIndex *index, const char *path)
+{
+    int low = 0;
+    int high = (int)index->header->numEntries - 1;
+    while (low <= high)
+    {
+        int middle = (low + high) / 2;
+        int order = strcmp(path, index->paths + index->entries[middle].pathOffset);
+        if (order == 0)
+        {
+            return &index->entries[middle];
+        }
+        else if (order < 0)
+        {
+            high = middle - 1;
+        }
+        else
+        {
+            low = middle + 1;
+        }
+    }
+    return NULL;
+}
+
+// In nanoseconds, so a song saved twice in the same second is still
+// noticed
+int64_t ModifiedTime(const struct stat *songstat)
+{
+    return songstat->st_mtim.tv_sec * 1000000000LL + songstat->st_mtim.tv_nsec;
+}
+
+uint32_t PathBucket(const char *path)
+{
+    return HashBytes(path, strlen(path), FNV_OFFSET_BASIS) % PATH_BUCKETS;
+}
+
+// Returns whether a song with the path has already been added
+int HaveEntry(const char *path)
+{
+    for (uint32_t number = gPathBuckets[PathBucket(path)] ; number != 0 ; number = gNextInBucket[number - 1])
+    {
+        if (strcmp(path, gPaths + gEntries[number - 1].pathOffset) == 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Makes room for one more entry, the given number of durations and a
+// path. Returns the new entry, or NULL if there isn't enough memory.
+struct SongIndexEntry *AddEntry(const char *path, uint32_t numDurations)
+{
+    if (gNumEntries == gEntriesSize)
+    {
+        uint32_t size = gEntriesSize ? gEntriesSize * 2 : 1024;
+        struct SongIndexEntry *entries = realloc(gEntries, size * sizeof(*entries));
+        if (entries == NULL)
+        {
+            return NULL;
+        }
+        gEntries = entries;
+        uint32_t *nextInBucket = realloc(gNextInBucket, size * sizeof(*nextInBucket));
+        if (nextInBucket == NULL)
+        {
+            return NULL;
+        }
+        gNextInBucket = nextInBucket;
+        gEntriesSize = size;
+    }
+
+    while (gNumDurations + numDurations > gDurationsSize)
+    {
+        uint32_t size = gDurationsSize ? gDurationsSize * 2 : 1024;
+        uint32_t *durations = realloc(gDurations, size * sizeof(*durations));
+        if (durations == NULL)
+        {
+            return NULL;
+        }
+        gDurations = durations;
+        gDurationsSize = size;
+    }
+
+    uint32_t pathLength = strlen(path) + 1;
+    while (gPathsLength + pathLength > gPathsSize)
+    {
+        uint32_t size = gPathsSize ? gPathsSize * 2 : 64 * 1024;
+        char *paths = realloc(gPaths, size);
+        if (paths == NULL)
+        {
+            return NULL;
+        }
+        gPaths = paths;
+        gPathsSize = size;
+    }
+
+    uint32_t bucket = PathBucket(path);
+    gNextInBucket[gNumEntries] = gPathBuckets[bucket];
+    gPathBuckets[bucket] = gNumEntries + 1;
+
+    struct SongIndexEntry *entry = &gEntries[gNumEntries++];
+    memset(entry, 0, sizeof(*entry));
+    entry->pathOffset = gPathsLength;
+    memcpy(gPaths + gPathsLength, path, pathLength);
+    gPathsLength += pathLength;
+    entry->firstDuration = gNumDurations;
+    gNumDurations += numDurations;
+
+    return entry;
+}
+
+// Runs each subtune of the initialized song until it loops, counting
+// the ticks
+void MeasureSubtunes(uint32_t *durations, uint8_t numSubtunes)
+{
+    for (uint8_t subtune = 0 ; subtune < numSubtunes ; subtune++)
+    {
+        durations[subtune] = 0;
+        if (!StartSubtune(subtune))
+        {
+            continue;
+        }
+
+        for (uint32_t tick = 1 ; tick <= SONG_INDEX_MAX_TICKS ; tick++)
+        {
+            if (GoatPlayerTick())
+            {
+                durations[subtune] = tick;
+                break;
+            }
+        }
+    }
+}
+
+// Reads the details of a song that's new or changed.
+// Returns 0 if it isn't a song that can be played.
+int ReadSong(const char *path, const struct stat *songstat)
+{
+    uint32_t size;
+    char *songdata = LoadFile(path, &size);
+    if (songdata == NULL)
+    {
+        return 0;
+    }
+
+    const uint8_t *data = (const uint8_t *)songdata;
+    if (!SongIsComplete(data, size))
+    {
+        printf("Skipping %s, it isn't a complete GoatTracker song.\n", path);
+        free(songdata);
+        return 0;
+    }
+
+    // Straight after the names come the orderlists, each with its
+    // size in front of it, then the instruments and the tables
+    uint32_t position = 4 + 3 * 32;
+    uint8_t numSubtunes = data[position++];
+    for (int orderlist = 0 ; orderlist < numSubtunes * NUM_CHANNELS ; orderlist++)
+    {
+        position += 1 + data[position] + 1;
+    }
+    uint8_t numInstruments = data[position];
+    position += 1 + numInstruments * 25;
+    for (int table = 0 ; table < 4 ; table++)
+    {
+        position += 1 + data[position] * 2;
+    }
+    uint8_t numPatterns = data[position];
+
+    struct SongIndexEntry *entry = AddEntry(path, numSubtunes);
+    if (entry == NULL)
+    {
+        printf("Failed to malloc for the index.\n");
+        free(songdata);
+        exit(-1);
+    }
+
+    memcpy(entry->name, data + 4, 32);
+    memcpy(entry->author, data + 4 + 32, 32);
+    memcpy(entry->copyright, data + 4 + 64, 32);
+    entry->hash = HashBytes(songdata, size, FNV_OFFSET_BASIS);
+    entry->modifiedTime = ModifiedTime(songstat);
+    entry->size = size;
+    entry->numSubtunes = numSubtunes;
+    entry->numInstruments = numInstruments;
+    entry->numPatterns = numPatterns;
+
+    uint32_t *durations = gDurations + entry->firstDuration;
+    memset(durations, 0, numSubtunes * sizeof(*durations));
+    if (InitializeSong(songdata))
+    {
+        MeasureSubtunes(durations, numSubtunes);
+    }
+
+    free(songdata);
+    gSongsRead++;
+    return 1;
+}
+
+int IndexFile(const char *filename, const struct stat *songstat, int type, struct FTW *position)
+{
+    (void)position;
+
+    const char *extension = strrchr(filename, '.');
+    if (type != FTW_F || extension == NULL || strcasecmp(extension, ".sng") != 0)
+    {
+        return 0;
+    }
+
+    // The same song can be reached through different spellings of its
+    // directory, like both . and testsongs
+    char path[PATH_MAX];
+    if (realpath(filename, path) == NULL)
+    {
+        perror(filename);
+        return 0;
+    }
+    if (HaveEntry(path))
+    {
+        return 0;
+    }
+
+    const struct SongIndexEntry *previous = NULL;
+    if (gHavePreviousIndex)
+    {
+        previous = FindSongIndexEntry(&gPreviousIndex, path);
+    }
+
+    if (previous != NULL && previous->size == songstat->st_size && previous->modifiedTime == ModifiedTime(songstat))
+    {
+        struct SongIndexEntry *entry = AddEntry(path, previous->numSubtunes);
+        if (entry == NULL)
+        {
+            printf("Failed to malloc for the index.\n");
+            exit(-1);
+        }
+
+        uint32_t pathOffset = entry->pathOffset;
+        uint32_t firstDuration = entry->firstDuration;
+        *entry = *previous;
+        entry->pathOffset = pathOffset;
+        entry->firstDuration = firstDuration;
+        memcpy(gDurations + firstDuration, gPreviousIndex.durations + previous->firstDuration,
+               previous->numSubtunes * sizeof(uint32_t));
+        return 0;
+    }
+
+    if (!ReadSong(path, songstat))
+    {
+        gSongsSkipped++;
+    }
+    return 0;
+}
+
+int CompareEntries(const void *a, const void *b)
+{
+    return strcmp(gPaths + ((const struct SongIndexEntry *)a)->pathOffset,
+                  gPaths + ((const struct SongIndexEntry *)b)->pathOffset);
+}
+
+// Writes the index to a new file and moves it over the old one, so
+// anything that has the old one mapped can carry on using it
+int WriteSongIndex(const char *filename)
+{
+    qsort(gEntries, gNumEntries, sizeof(*gEntries), CompareEntries);
+
+    struct SongIndexHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = SONG_INDEX_MAGIC;
+    header.version = SONG_INDEX_VERSION;
+    header.playerVersion = SIDISH_VERSION;
+    header.numEntries = gNumEntries;
+    header.durationsOffset = sizeof(header) + gNumEntries * sizeof(*gEntries);
+    header.numDurations = gNumDurations;
+    header.pathsOffset = header.durationsOffset + gNumDurations * sizeof(*gDurations);
+    header.pathsSize = gPathsLength;
+
+    char temporary[PATH_MAX];
+    snprintf(temporary, sizeof(temporary), "%s.tmp", filename);
+    FILE *fp = fopen(temporary, "wb");
+    if (fp == NULL)
+    {
+        printf("Failed to open %s.\n", temporary);
+        return 0;
+    }
+
+    fwrite(&header, sizeof(header), 1, fp);
+    fwrite(gEntries, sizeof(*gEntries), gNumEntries, fp);
+    fwrite(gDurations, sizeof(*gDurations), gNumDurations, fp);
+    fwrite(gPaths, 1, gPathsLength, fp);
+    if (ferror(fp) | fclose(fp))
+    {
+        printf("Failed to write %s.\n", temporary);
+        unlink(temporary);
+        return 0;
+    }
+
+    if (rename(temporary, filename) != 0)
+    {
+        printf("Failed to replace %s.\n", filename);
+        unlink(temporary);
+        return 0;
+    }
+
+    return 1;
+}
+
+// Copies one of the 32 byte names so it ends in 0
+void CopyName(char name[33], const char field[32])
+{
+    memcpy(name, field, 32);
+    name[32] = 0;
+}
+
+// Prints the songs with the text anywhere in their path or names
+int QuerySongIndex(const char *filename, const char *text)
+{
+    struct SongIndex index;
+    if (!OpenSongIndex(filename, &index))
+    {
+        printf("Can't read %s.\n", filename);
+        return -1;
+    }
+
+    uint32_t found = 0;
+    for (uint32_t number = 0 ; number < index.header->numEntries ; number++)
+    {
+        const struct SongIndexEntry *entry = &index.entries[number];
+        const char *path = index.paths + entry->pathOffset;
+        char name[33], author[33], copyright[33];
+        CopyName(name, entry->name);
+        CopyName(author, entry->author);
+        CopyName(copyright, entry->copyright);
+
+        if (strcasestr(path, text) == NULL && strcasestr(name, text) == NULL &&
+            strcasestr(author, text) == NULL && strcasestr(copyright, text) == NULL)
+        {
+            continue;
+        }
+
+        printf("%s: %s by %s (%s), %d instruments, %d subtunes:", path, name, author, copyright,
+               entry->numInstruments, entry->numSubtunes);
+        for (uint8_t subtune = 0 ; subtune < entry->numSubtunes ; subtune++)
+        {
+            uint32_t ticks = index.durations[entry->firstDuration + subtune];
+            if (ticks == 0)
+            {
+                printf(" forever");
+            }
+            else
+            {
+                uint32_t seconds = (ticks + 25) / 50;
+                printf(" %u:%02u", seconds / 60, seconds % 60);
+            }
+        }
+        printf("\n");
+        found++;
+    }
+
+    printf("%u of %u songs\n", found, index.header->numEntries);
+    CloseSongIndex(&index);
+    return 0;
+}
+
+void Usage()
+{
+    printf("Usage: sidindex [-i index] directory...\n");
+    printf("       sidindex [-i index] -q text\n");
+    printf("  -i  Index file (default %s)\n", SONG_INDEX_DEFAULT_FILE);
+    printf("  -q  List the songs with the text in their path, name, author or copyright\n");
+}
+
+int main(int argc, char *argv[])
+{
+    const char *indexFilename = SONG_INDEX_DEFAULT_FILE;
+    const char *query = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "i:q:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'i':
+                indexFilename = optarg;
+                break;
+
+            case 'q':
+                query = optarg;
+                break;
+
+            default:
+                Usage();
+                return -1;
+        }
+    }
+
+    if (query != NULL)
+    {
+        return QuerySongIndex(indexFilename, query);
+    }
+
+    if (optind == argc)
+    {
+        Usage();
+        return -1;
+    }
+
+    // Messages from the player would just be noise here
+    gPrintEnabled = 0;
+    InitializeTables();
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    gHavePreviousIndex = OpenSongIndex(indexFilename, &gPreviousIndex);
+    if (gHavePreviousIndex && gPreviousIndex.header->playerVersion != SIDISH_VERSION)
+    {
+        // The lengths might have changed with the player
+        printf("%s is from SIDISH_VERSION %u, reading every song again.\n", indexFilename,
+               gPreviousIndex.header->playerVersion);
+        CloseSongIndex(&gPreviousIndex);
+        gHavePreviousIndex = 0;
+    }
+
+    for (int argument = optind ; argument < argc ; argument++)
+    {
+        if (nftw(argv[argument], IndexFile, 16, FTW_PHYS) != 0)
+        {
+            perror(argv[argument]);
+            return -1;
+        }
+    }
+
+    if (gHavePreviousIndex)
+    {
+        CloseSongIndex(&gPreviousIndex);
+    }
+
+    if (!WriteSongIndex(indexFilename))
+    {
+        return -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double milliseconds = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+    printf("Indexed %u songs in %.1f ms: %u read, %u unchanged, %u skipped\n", gNumEntries, milliseconds,
+           gSongsRead, gNumEntries - gSongsRead, gSongsSkipped);
+
+    return 0;
+}
@@ -0,0 +1,62 @@
+#ifndef __SIDINDEX_H
+#define __SIDINDEX_H
+
+// Song library index
+//
+// Written by sidindex. Laid out so it can be mmapped and read as it
+// is: a header, one entry per song sorted by path, the length of every
+// subtune, then the paths the entries point into, each ending in 0.
+// The names are the 32 byte fields from the song, which don't have to
+// end in 0 if they fill the field.
+
+#include <stdint.h>
+
+#define SONG_INDEX_MAGIC (0x58444953) // "SIDX"
+#define SONG_INDEX_VERSION (1)
+
+#define SONG_INDEX_DEFAULT_FILE "songs.idx"
+
+struct SongIndexHeader
+{
+    uint32_t magic;
+    uint32_t version;
+
+    // The SIDISH_VERSION the lengths were worked out with
+    uint32_t playerVersion;
+
+    uint32_t numEntries;
+    uint32_t durationsOffset;   // uint32_t [], length of each subtune in ticks
+    uint32_t numDurations;
+    uint32_t pathsOffset;
+    uint32_t pathsSize;
+};
+
+struct SongIndexEntry
+{
+    char name[32];
+    char author[32];
+    char copyright[32];
+
+    // Used to notice when the file changes. The modification time is
+    // in nanoseconds.
+    uint64_t hash;
+    int64_t modifiedTime;
+    uint32_t size;
+
+    uint32_t pathOffset;
+
+    // Index of the length of the first subtune. The subtunes follow
+    // it in order. A length of 0 means it didn't end within
+    // SONG_INDEX_MAX_TICKS.
+    uint32_t firstDuration;
+
+    uint8_t numSubtunes;
+    uint8_t numInstruments;
+    uint8_t numPatterns;
+    uint8_t reserved;
+};
+
+// Subtunes that are still going after 30 minutes are taken not to end
+#define SONG_INDEX_MAX_TICKS (50 * 60 * 30)
+
+#endif
@@ -44,18 +44,35 @@
 // For hooking up the hardware, see this article:
 //   https://developer.mbed.org/users/4180_1/notebook/using-a-speaker-for-audio-output/
 
+#include <string.h>
 #include <avr/pgmspace.h>
 #include <avr/interrupt.h>
 
 #include "sidish.h"
 
+#if !SONG_SOURCE_SD
 #include "songdata.h"
+#endif
 #include "tables.h"
 
+#if !COMPILED_SONG
+// Orderlist and pattern offsets generated from the raw song by songc
+#include "songindex.h"
+#endif
+
 // Ugly to include this like this, but it works for now.
 // TODO: Find a better way to compile the same .c file into 2 different object files soon.
 #include "goatplayer.c"
 
+#if SONG_SOURCE_SD
+#include "songsource.c"
+#include "sdcard.c"
+#endif
+
+#if FRAME_REPLAY
+#include "framereplay.c"
+#endif
+
 void print(char *message)
 {
     while (*message != 0)
@@ -231,7 +248,26 @@ void setup()
     UCSR0C = 6; 
 
 #if !TEST_MODE
+#if FRAME_REPLAY
+    InitializeFrameReplay(song_start);
+#elif SONG_SOURCE_SD
+    const char *songdata = NULL;
+    if (SdCardInitialize())
+    {
+        songdata = SongSourceOpen(SONG_SOURCE_FILE_NAME);
+    }
+    if (songdata == NULL || !InitializeSong(songdata))
+    {
+        // Nothing to play. The reason has already been printed.
+        while (1);
+    }
+
+    // Fill the cache before the song starts so the first rows aren't
+    // late
+    while (SongSourcePrefetch());
+#else
     InitializeSong(song_start);
+#endif
 #endif
     
     sei();
@@ -325,10 +361,51 @@ void StartNote(uint8_t key)
 }
 #endif
 
+#if FILTER_BENCHMARK
+#define BENCHMARK_SAMPLES (64)
+
+// Times the filter with Timer1 counting every CPU cycle.
+// There are 1000 cycles per sample at 16 MHz and 16 kHz.
+void BenchmarkFilter()
+{
+    volatile int8_t output;
+
+    gFilter.routing = 1;
+    gFilter.type = FILTER_LOWPASS | FILTER_BANDPASS | FILTER_HIGHPASS;
+    gFilter.cutoff = 0x60;
+    gFilter.resonance = 8;
+    UpdateFilterCoefficients();
+
+    cli();
+    TCCR1A = 0;
+    TCCR1B = _BV(CS10);
+    TCNT1 = 0;
+    for (uint8_t sample = 0 ; sample < BENCHMARK_SAMPLES ; sample++)
+    {
+        output = FilterSample((int8_t)((sample & 0x3F) - 32));
+    }
+    uint16_t cycles = TCNT1;
+    TCCR1B = 0;
+    sei();
+
+    (void)output;
+    print("Filter: ");
+    printint(cycles / BENCHMARK_SAMPLES);
+    print(" cycles per sample\n");
+
+    // Start the song again from the beginning
+    StartSubtune(0);
+}
+#endif
+
 int main (void)
 {
     setup();
 
+#if FILTER_BENCHMARK
+    BenchmarkFilter();
+#endif
+
 #if TEST_MODE
     EnableFakeInstruments();
     
@@ -386,6 +463,15 @@ int main (void)
             print("\n");
         }
     }
+#elif SONG_SOURCE_SD
+
+    // Keeps the patterns coming from the SD card in the time the
+    // interrupt leaves
+    while (1)
+    {
+        SongSourcePrefetch();
+    }
+
 #else
     
     while(1);
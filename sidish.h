@@ -5,6 +5,10 @@
 // control of the synthesizer
 #define TEST_MODE (0)
 
+// If set, times the filter when it starts and prints the number of
+// cycles it takes per sample before playing the song
+#define FILTER_BENCHMARK (0)
+
 // If set, uses the Adafruit Waveshield for audio output.
 // If not set, uses a PWM pin as the DAC
 #define USE_WAVESHIELD (1)
@@ -18,6 +22,26 @@
 // Number of predefined keys in the frequency table
 #define NUM_PIANO_KEYS (87)
 
+// How much the player prints while it loads and plays the song.
+// Messages above the level aren't compiled in at all, strings
+// included. On the ATmega every message busy-waits on the serial
+// port, so the firmware only reports errors unless asked for more.
+#define LOG_LEVEL_NONE  (0)
+#define LOG_LEVEL_ERROR (1) // The song can't be played
+#define LOG_LEVEL_INFO  (2) // A summary of the song as it loads
+#define LOG_LEVEL_DEBUG (3) // Every instrument, pattern and orderlist step
+#ifndef LOG_LEVEL
+#ifdef __AVR_ARCH__
+#define LOG_LEVEL (LOG_LEVEL_ERROR)
+#else
+#define LOG_LEVEL (LOG_LEVEL_DEBUG)
+#endif
+#endif
+
+// Version of the synthesizer and player output. Bump this whenever a
+// change alters the rendered audio so that cached renders are thrown out.
+#define SIDISH_VERSION (3)
+
 // Outputs the next byte of audio data
 #if __cplusplus 
 extern "C" 
@@ -0,0 +1,193 @@
+// Client for the render daemon (sidishd)
+// Sends a render request and writes the audio it gets back to a file
+// or stdout.
+//
+// Usage: sidishc [-s socket path] [-o output] [-u subtune] [-b start ms]
+//                [-d duration ms] [-f raw|wav] song.sng
+//        sidishc [-s socket path] -S
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "sidishd.h"
+
+double Now()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+void Usage()
+{
+    fprintf(stderr, "Usage: sidishc [-s socket path] [-o output] [-u subtune] [-b start ms]\n");
+    fprintf(stderr, "               [-d duration ms] [-f raw|wav] song.sng\n");
+    fprintf(stderr, "       sidishc [-s socket path] -S\n");
+    fprintf(stderr, "  -o  Output file (default stdout)\n");
+    fprintf(stderr, "  -d  Duration to render, or 0 to render the whole song (default)\n");
+    fprintf(stderr, "  -f  Output format (default wav)\n");
+    fprintf(stderr, "  -S  Print the daemon's cache statistics\n");
+}
+
+int main(int argc, char *argv[])
+{
+    const char *socketPath = SIDISHD_DEFAULT_SOCKET;
+    const char *outputFilename = NULL;
+    const char *format = "wav";
+    int subtune = 0;
+    unsigned int startMs = 0;
+    unsigned int durationMs = 0;
+    int statistics = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:o:u:b:d:f:S")) != -1)
+    {
+        switch (opt)
+        {
+            case 's':
+                socketPath = optarg;
+                break;
+
+            case 'o':
+                outputFilename = optarg;
+                break;
+
+            case 'u':
+                subtune = atoi(optarg);
+                break;
+
+            case 'b':
+                startMs = strtoul(optarg, NULL, 10);
+                break;
+
+            case 'd':
+                durationMs = strtoul(optarg, NULL, 10);
+                break;
+
+            case 'f':
+                format = optarg;
+                break;
+
+            case 'S':
+                statistics = 1;
+                break;
+
+            default:
+                Usage();
+                return -1;
+        }
+    }
+
+    if (argc - optind != (statistics ? 0 : 1))
+    {
+        Usage();
+        return -1;
+    }
+
+    // Relative paths need to work from wherever the daemon was started
+    char songPath[SIDISHD_MAX_REQUEST];
+    if (!statistics && realpath(argv[optind], songPath) == NULL)
+    {
+        perror(argv[optind]);
+        return -1;
+    }
+
+    FILE *outputfp = stdout;
+    if (outputFilename != NULL)
+    {
+        outputfp = fopen(outputFilename, "wb");
+        if (outputfp == NULL)
+        {
+            perror(outputFilename);
+            return -1;
+        }
+    }
+
+    double startTime = Now();
+
+    int connection = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, socketPath, sizeof(address.sun_path) - 1);
+
+    if (connection < 0 || connect(connection, (struct sockaddr *)&address, sizeof(address)) != 0)
+    {
+        perror(socketPath);
+        return -1;
+    }
+
+    if (statistics)
+    {
+        dprintf(connection, "STATS\n");
+    }
+    else
+    {
+        dprintf(connection, "RENDER %d %u %u %s %s\n", subtune, startMs, durationMs, format, songPath);
+    }
+
+    // Read the response line one byte at a time so none of the
+    // audio gets consumed with it
+    char response[256];
+    int length = 0;
+    while (length < (int)sizeof(response) - 1)
+    {
+        if (read(connection, &response[length], 1) != 1)
+        {
+            fprintf(stderr, "Connection closed without a response\n");
+            return -1;
+        }
+        if (response[length] == '\n')
+        {
+            break;
+        }
+        length++;
+    }
+    response[length] = 0;
+
+    if (strncmp(response, "OK ", 3) != 0)
+    {
+        fprintf(stderr, "%s\n", response);
+        return -1;
+    }
+
+    if (statistics)
+    {
+        printf("%s\n", response + 3);
+        close(connection);
+        return 0;
+    }
+
+    char buffer[65536];
+    uint64_t totalBytes = 0;
+    double firstByteTime = 0;
+    ssize_t bytesRead;
+    while ((bytesRead = read(connection, buffer, sizeof(buffer))) > 0)
+    {
+        if (totalBytes == 0)
+        {
+            firstByteTime = Now();
+        }
+        fwrite(buffer, 1, bytesRead, outputfp);
+        totalBytes += bytesRead;
+    }
+
+    double endTime = Now();
+    close(connection);
+    if (outputfp != stdout)
+    {
+        fclose(outputfp);
+    }
+
+    fprintf(stderr, "%s: %llu bytes, first byte after %.2f ms, done after %.2f ms\n",
+        response, (unsigned long long)totalBytes,
+        (firstByteTime - startTime) * 1000.0, (endTime - startTime) * 1000.0);
+
+    return 0;
+}
@@ -0,0 +1,437 @@
+// Render daemon
+// Listens on a Unix domain socket for render requests (see sidishd.h
+// for the protocol) and streams the audio back as it's rendered.
+// Songs stay loaded in memory between requests, and the song that was
+// used last stays initialized in the player, so each request only
+// has to fork a copy of the player and start rendering.
+// With -c, rendered audio is also cached on disk (see rendercache.c).
+//
+// Usage: sidishd [-s socket path] [-c cache directory] [-m cache size in MB]
+
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "hostplayer.c"
+#include "rendercache.c"
+#include "sidishd.h"
+
+#define MAX_CACHED_SONGS (64)
+
+// Size of the blocks the audio is sent in. Small enough that the
+// first block goes out right away.
+#define STREAM_BLOCK_SIZE (4096)
+
+struct CachedSong
+{
+    char *path;
+    char *data;
+    uint32_t size;
+
+    // Used to notice when the file changes on disk
+    time_t modifiedTime;
+    ino_t inode;
+
+    // Used to pick the least recently used song to drop
+    uint32_t lastUsed;
+} gSongCache[MAX_CACHED_SONGS];
+
+// Cache slot of the song that's currently initialized in the player
+int gInstalledSong = -1;
+
+uint32_t gUseCounter = 0;
+
+// Set when renders are being cached
+int gCacheEnabled = 0;
+
+// Where the rendered audio goes and the range of samples to send
+FILE *gConnection;
+uint32_t gSampleNumber;
+uint32_t gStartSample;
+
+void OutputByte(uint8_t value)
+{
+    if (gCaptureBuffer != NULL)
+    {
+        CaptureByte(value);
+    }
+    else if (gSampleNumber++ >= gStartSample)
+    {
+        putc(value, gConnection);
+    }
+}
+
+void DropSong(int slot)
+{
+    free(gSongCache[slot].path);
+    free(gSongCache[slot].data);
+    gSongCache[slot].path = NULL;
+    gSongCache[slot].data = NULL;
+
+    if (gInstalledSong == slot)
+    {
+        gInstalledSong = -1;
+    }
+}
+
+// Finds the song in the cache, loading it if it isn't there yet or
+// if it changed on disk.
+// Returns the cache slot or -1 if the song can't be loaded.
+int FindSong(const char *path)
+{
+    struct stat songstat;
+    if (stat(path, &songstat) != 0)
+    {
+        return -1;
+    }
+
+    int slot;
+    int freeSlot = -1;
+    int oldestSlot = 0;
+    for (slot = 0 ; slot < MAX_CACHED_SONGS ; slot++)
+    {
+        if (gSongCache[slot].path == NULL)
+        {
+            freeSlot = slot;
+            continue;
+        }
+
+        if (strcmp(gSongCache[slot].path, path) == 0)
+        {
+            if (gSongCache[slot].modifiedTime == songstat.st_mtime &&
+                gSongCache[slot].inode == songstat.st_ino &&
+                gSongCache[slot].size == songstat.st_size)
+            {
+                gSongCache[slot].lastUsed = ++gUseCounter;
+                return slot;
+            }
+
+            // Changed on disk, so load it again
+            printf("Reloading %s\n", path);
+            DropSong(slot);
+            freeSlot = slot;
+            break;
+        }
+
+        if (gSongCache[slot].lastUsed < gSongCache[oldestSlot].lastUsed)
+        {
+            oldestSlot = slot;
+        }
+    }
+
+    if (freeSlot < 0)
+    {
+        printf("Dropping %s from the cache\n", gSongCache[oldestSlot].path);
+        DropSong(oldestSlot);
+        freeSlot = oldestSlot;
+    }
+
+    uint32_t size;
+    char *data = LoadFile(path, &size);
+    if (data == NULL)
+    {
+        return -1;
+    }
+
+    gSongCache[freeSlot].path = strdup(path);
+    gSongCache[freeSlot].data = data;
+    gSongCache[freeSlot].size = size;
+    gSongCache[freeSlot].modifiedTime = songstat.st_mtime;
+    gSongCache[freeSlot].inode = songstat.st_ino;
+    gSongCache[freeSlot].lastUsed = ++gUseCounter;
+
+    printf("Loaded %s (%u bytes)\n", path, size);
+
+    return freeSlot;
+}
+
+// Reads the request line from the client.
+// Returns 1 if a complete line was read.
+int ReadRequest(int connection, char *request)
+{
+    int length = 0;
+
+    while (length < SIDISHD_MAX_REQUEST - 1)
+    {
+        ssize_t result = recv(connection, request + length, 1, 0);
+        if (result <= 0)
+        {
+            return 0;
+        }
+
+        if (request[length] == '\n')
+        {
+            request[length] = 0;
+            return 1;
+        }
+        length++;
+    }
+
+    return 0;
+}
+
+void SendError(int connection, const char *message)
+{
+    printf("Error: %s\n", message);
+    dprintf(connection, "ERROR %s\n", message);
+}
+
+// Renders the requested range of a subtune of the currently
+// initialized song to the connection. Runs in the forked child.
+void Render(int connection, int subtune, uint32_t startMs, uint32_t durationMs, int wavFormat, uint64_t cacheKey)
+{
+    signal(SIGPIPE, SIG_IGN);
+
+    // The song stays initialized in the daemon, so only the player
+    // state for the subtune needs to be set up here
+    StartSubtune(subtune);
+
+    gConnection = fdopen(connection, "w");
+    if (gConnection == NULL)
+    {
+        exit(1);
+    }
+    setvbuf(gConnection, NULL, _IOFBF, STREAM_BLOCK_SIZE);
+
+    gStartSample = (uint32_t)((uint64_t)startMs * BITRATE / 1000);
+    uint32_t endSample = UINT32_MAX;
+    uint32_t dataLength = WAV_UNKNOWN_LENGTH;
+    if (durationMs != 0)
+    {
+        dataLength = (uint32_t)((uint64_t)durationMs * BITRATE / 1000);
+        endSample = gStartSample + dataLength;
+    }
+
+    fprintf(gConnection, "OK %u 1 8\n", BITRATE);
+    if (wavFormat)
+    {
+        // The song might end before the duration is up, so the
+        // length can't be trusted until the end
+        WriteWavHeader(gConnection, BITRATE, 1, 8, WAV_UNKNOWN_LENGTH);
+    }
+
+    // Get the header out right away
+    fflush(gConnection);
+
+    if (gCacheEnabled)
+    {
+        ServeFromRenderCache(connection, cacheKey, gStartSample, endSample);
+        fclose(gConnection);
+        exit(0);
+    }
+
+    gSampleNumber = 0;
+    while (gSampleNumber < endSample && !ferror(gConnection))
+    {
+        if (OutputAudioAndCalculateNextByte())
+        {
+            break;
+        }
+    }
+
+    fclose(gConnection);
+    exit(0);
+}
+
+void HandleConnection(int connection)
+{
+    char request[SIDISHD_MAX_REQUEST];
+    int subtune;
+    unsigned int startMs, durationMs;
+    char format[8];
+    int pathOffset = 0;
+
+    if (!ReadRequest(connection, request))
+    {
+        SendError(connection, "Incomplete request");
+        return;
+    }
+
+    if (strcmp(request, "STATS") == 0)
+    {
+        if (!gCacheEnabled)
+        {
+            SendError(connection, "Not caching");
+            return;
+        }
+
+        struct CacheStatistics statistics = *gRenderCache.statistics;
+        uint64_t requests = statistics.hits + statistics.misses;
+        dprintf(connection, "OK hits=%llu misses=%llu hitrate=%.1f fromcache=%llu rendered=%llu evictions=%llu size=%llu budget=%llu\n",
+                (unsigned long long)statistics.hits, (unsigned long long)statistics.misses,
+                requests ? 100.0 * statistics.hits / requests : 0.0,
+                (unsigned long long)statistics.bytesFromCache, (unsigned long long)statistics.bytesRendered,
+                (unsigned long long)statistics.evictions, (unsigned long long)statistics.size,
+                (unsigned long long)gRenderCache.budget);
+        return;
+    }
+
+    if (sscanf(request, "RENDER %d %u %u %7s %n", &subtune, &startMs, &durationMs, format, &pathOffset) != 4 ||
+        pathOffset == 0 || request[pathOffset] == 0)
+    {
+        SendError(connection, "Invalid request");
+        return;
+    }
+
+    const char *path = request + pathOffset;
+    int wavFormat;
+    if (strcmp(format, "wav") == 0)
+    {
+        wavFormat = 1;
+    }
+    else if (strcmp(format, "raw") == 0)
+    {
+        wavFormat = 0;
+    }
+    else
+    {
+        SendError(connection, "Unknown format");
+        return;
+    }
+
+    int slot = FindSong(path);
+    if (slot < 0)
+    {
+        SendError(connection, "Can't load the song");
+        return;
+    }
+
+    if (gInstalledSong != slot)
+    {
+        if (!InitializeSong(gSongCache[slot].data))
+        {
+            DropSong(slot);
+            SendError(connection, "Not a GoatTracker song");
+            return;
+        }
+        gInstalledSong = slot;
+    }
+
+    if (subtune < 0 || subtune >= gNumSubtunes)
+    {
+        SendError(connection, "No such subtune");
+        return;
+    }
+
+    uint64_t cacheKey = 0;
+    if (gCacheEnabled)
+    {
+        cacheKey = RenderCacheKey(gSongCache[slot].data, gSongCache[slot].size, subtune);
+    }
+
+    printf("Rendering %s subtune %d from %u ms for %u ms as %s\n", path, subtune, startMs, durationMs, format);
+    fflush(stdout);
+
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        Render(connection, subtune, startMs, durationMs, wavFormat, cacheKey);
+    }
+    else if (pid < 0)
+    {
+        SendError(connection, "Can't start the renderer");
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    const char *socketPath = SIDISHD_DEFAULT_SOCKET;
+    const char *cacheDirectory = NULL;
+    uint64_t cacheBudget = 256;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:c:m:")) != -1)
+    {
+        switch (opt)
+        {
+            case 's':
+                socketPath = optarg;
+                break;
+
+            case 'c':
+                cacheDirectory = optarg;
+                break;
+
+            case 'm':
+                cacheBudget = strtoull(optarg, NULL, 10);
+                break;
+
+            default:
+                printf("Usage: sidishd [-s socket path] [-c cache directory] [-m cache size in MB]\n");
+                return -1;
+        }
+    }
+
+    if (cacheDirectory != NULL)
+    {
+        if (!OpenRenderCache(cacheDirectory, cacheBudget * 1024 * 1024))
+        {
+            return -1;
+        }
+        gCacheEnabled = 1;
+        printf("Caching renders in %s (%llu MB)\n", gRenderCache.directory, (unsigned long long)cacheBudget);
+    }
+
+    // Messages from the player would just be noise here
+    gPrintEnabled = 0;
+
+    InitializeTables();
+
+    // Finished renderers don't need to be waited for
+    signal(SIGCHLD, SIG_IGN);
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0)
+    {
+        perror("socket");
+        return -1;
+    }
+
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(socketPath) >= sizeof(address.sun_path))
+    {
+        printf("Socket path is too long.\n");
+        return -1;
+    }
+    strcpy(address.sun_path, socketPath);
+
+    unlink(socketPath);
+    if (bind(listener, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(listener, 16) != 0)
+    {
+        perror(socketPath);
+        return -1;
+    }
+
+    printf("Listening on %s\n", socketPath);
+    fflush(stdout);
+
+    while (1)
+    {
+        int connection = accept(listener, NULL, NULL);
+        if (connection < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("accept");
+            return -1;
+        }
+
+        // Don't let a client that never finishes its request hold
+        // up everyone else
+        struct timeval timeout = { 1, 0 };
+        setsockopt(connection, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+        HandleConnection(connection);
+        close(connection);
+        fflush(stdout);
+    }
+}
@@ -0,0 +1,40 @@
+#ifndef __SIDISHD_H
+#define __SIDISHD_H
+
+// Protocol shared by the render daemon (sidishd) and its client (sidishc)
+//
+// The client connects to the Unix domain socket and sends a single line:
+//
+//   RENDER <subtune> <start ms> <duration ms> <format> <song path>\n
+//
+// A duration of 0 renders until the song ends. The format is either
+// "raw" (unsigned 8 bit mono PCM) or "wav" (the same data with a
+// streaming .wav header in front of it). The song path is everything
+// after the format, so it may contain spaces.
+//
+// The daemon answers with one line, either
+//
+//   OK <sample rate> <channels> <bits per sample>\n
+//
+// followed by the audio data as it's rendered until the connection is
+// closed, or
+//
+//   ERROR <message>\n
+//
+// When the daemon is caching renders, sending
+//
+//   STATS\n
+//
+// instead gets back a single line with the cache statistics:
+//
+//   OK hits=<n> misses=<n> hitrate=<percent> fromcache=<bytes> rendered=<bytes>
+//      evictions=<n> size=<bytes> budget=<bytes>\n
+//
+// where hits and misses count 4 second chunks.
+
+#define SIDISHD_DEFAULT_SOCKET "/tmp/sidishd.sock"
+
+// Longest request line accepted
+#define SIDISHD_MAX_REQUEST (1024)
+
+#endif // __SIDISHD_H
@@ -0,0 +1,328 @@
+// Realtime player that follows a song as it's edited
+// Plays a song forever, writing 8 bit unsigned mono at BITRATE to
+// standard output for aplay or a similar tool to play as it arrives:
+//
+//   ./sidplay [-u subtune] song.sng | aplay -q -f U8 -r 16000
+//
+// The song is watched with inotify. When it's saved, a background
+// thread loads it, checks that it's complete, and swaps it in between
+// two ticks. Each channel carries on from the same orderlist position
+// and row if the new song still has the same pattern there, and
+// starts its orderlist again otherwise. The voices keep sounding
+// through the swap, so there's no gap or click.
+//
+// The player keeps the song in globals, so the new song can't be set
+// up next to the one that's playing. Instead the audio thread renders
+// a tick at a time with gSongLock held, and the watcher takes the lock
+// between two ticks to parse the new song. That's all done on the
+// watcher thread, so the audio thread never allocates anything, and it
+// takes a small fraction of a tick, which the audio already waiting in
+// the pipe covers.
+
+#define _GNU_SOURCE
+
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/inotify.h>
+
+#include "hostplayer.c"
+
+// Samples written to the output at a time, 32 ms
+#define OUTPUT_BLOCK_SIZE (512)
+
+// Keeps the audio waiting in the pipe (and so the time until an edit
+// is heard) down to about a quarter of a second
+#define OUTPUT_PIPE_SIZE (4096)
+
+uint8_t gOutputBlock[OUTPUT_BLOCK_SIZE + VBI_COUNT];
+int gOutputLength = 0;
+
+// Held by the audio thread while it renders up to the next tick, so
+// the song can only be changed at a tick boundary
+pthread_mutex_t gSongLock = PTHREAD_MUTEX_INITIALIZER;
+
+// The song that's playing
+const char *gSongPath;
+char *gPlayingSong;
+
+void OutputByte(uint8_t value)
+{
+    gOutputBlock[gOutputLength++] = value;
+}
+
+// Returns 1 if the song that's initialized has the given pattern at
+// the given orderlist position, and the pattern reaches the given row
+int SongHasPosition(uint8_t subtune, uint8_t channel, uint8_t orderlistPosition, uint8_t patternNumber, uint8_t patternRow)
+{
+    for (uint8_t position = 0 ; position < orderlistPosition ; position++)
+    {
+        if (pgm_read_byte(ORDERLIST(subtune, channel) + position) == 0xFF)
+        {
+            return 0;
+        }
+    }
+
+    if (pgm_read_byte(ORDERLIST(subtune, channel) + orderlistPosition) != patternNumber ||
+        patternNumber >= gNumPatterns)
+    {
+        return 0;
+    }
+
+    // The row after the last one is the end marker, which is where a
+    // channel that's just read its last row is
+    struct Track reader;
+    SetTrackRow(&reader, patternNumber, 0);
+    for (uint8_t row = 0 ; row < patternRow ; row++)
+    {
+        struct PatternRow buffer;
+        if (ReadPatternRow(reader.songPosition, &buffer)->action == RowPatternEnd)
+        {
+            return 0;
+        }
+        NextPatternRow(&reader);
+    }
+
+    return 1;
+}
+
+// Swaps in a new song, keeping the positions that it still has.
+// Has to be called with gSongLock held, which puts it between ticks.
+// Returns the number of channels that kept their position, or -1 if
+// the song couldn't be initialized, in which case the old song is
+// left playing.
+int SwapSong(char *songdata)
+{
+    struct PlayerState playing;
+    SavePlayerState(&playing);
+
+    if (!InitializeSong(songdata))
+    {
+        InitializeSong(gPlayingSong);
+        RestorePlayerState(&playing);
+        return -1;
+    }
+
+    // Where each channel would be starting the subtune from the top
+    uint8_t subtune = (playing.subtune < gNumSubtunes) ? playing.subtune : 0;
+    StartSubtune(subtune);
+    struct PlayerState restarted;
+    SavePlayerState(&restarted);
+
+    int kept = 0;
+    for (uint8_t channel = 0 ; channel < NUM_CHANNELS ; channel++)
+    {
+        if (subtune == playing.subtune &&
+            SongHasPosition(subtune, channel, playing.tracks[channel].orderlistPosition,
+                            playing.patternNumber[channel], playing.patternRow[channel]))
+        {
+            kept++;
+        }
+        else
+        {
+            // Starts its orderlist again on the next tick, but lets
+            // the note and its tables carry on until the next row
+            // changes them
+            struct Track *track = &playing.tracks[channel];
+            track->orderlistPosition = restarted.tracks[channel].orderlistPosition;
+            track->patternRepeatCountdown = restarted.tracks[channel].patternRepeatCountdown;
+            track->semitoneOffset = restarted.tracks[channel].semitoneOffset;
+            track->trackStepCountdown = 1;
+            playing.patternNumber[channel] = restarted.patternNumber[channel];
+            playing.patternRow[channel] = restarted.patternRow[channel];
+        }
+    }
+    playing.subtune = subtune;
+
+    RestorePlayerState(&playing);
+    gPlayingSong = songdata;
+    return kept;
+}
+
+// Loads the song again and swaps it in
+void ReloadSong()
+{
+    uint32_t size;
+    char *songdata = LoadFile(gSongPath, &size);
+    if (songdata == NULL)
+    {
+        return;
+    }
+
+    if (!SongIsComplete((const uint8_t *)songdata, size))
+    {
+        fprintf(stderr, "%s isn't a complete GoatTracker song, still playing the last one\n", gSongPath);
+        free(songdata);
+        return;
+    }
+
+    struct timespec start, end;
+    pthread_mutex_lock(&gSongLock);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    char *oldSongdata = gPlayingSong;
+    int kept = SwapSong(songdata);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    pthread_mutex_unlock(&gSongLock);
+
+    long microseconds = (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000;
+    if (kept < 0)
+    {
+        fprintf(stderr, "Failed to initialize %s, still playing the last one\n", gSongPath);
+        free(songdata);
+        return;
+    }
+
+    fprintf(stderr, "Reloaded %s in %ld us, %d of %d channels kept their position\n",
+            gSongPath, microseconds, kept, NUM_CHANNELS);
+    free(oldSongdata);
+}
+
+// Waits for the song to be saved. Editors either write the file in
+// place or write a new file and rename it over the old one, so this
+// watches the directory for both.
+void *WatchSong(void *unused)
+{
+    char *pathCopy = strdup(gSongPath);
+    char *nameCopy = strdup(gSongPath);
+    const char *directory = dirname(pathCopy);
+    const char *name = basename(nameCopy);
+
+    int watcher = inotify_init1(IN_CLOEXEC);
+    if (watcher < 0 || inotify_add_watch(watcher, directory, IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+    {
+        perror("inotify");
+        fprintf(stderr, "Not watching %s for changes\n", gSongPath);
+        return NULL;
+    }
+
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (1)
+    {
+        ssize_t length = read(watcher, events, sizeof(events));
+        if (length <= 0)
+        {
+            if (length < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            perror("inotify");
+            return NULL;
+        }
+
+        int changed = 0;
+        for (char *next = events ; next < events + length ; )
+        {
+            const struct inotify_event *event = (const struct inotify_event *)next;
+            if (event->len > 0 && strcmp(event->name, name) == 0)
+            {
+                changed = 1;
+            }
+            next += sizeof(struct inotify_event) + event->len;
+        }
+
+        if (changed)
+        {
+            ReloadSong();
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int subtune = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "u:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'u':
+                subtune = atoi(optarg);
+                break;
+
+            default:
+                optind = argc;
+                break;
+        }
+    }
+
+    if (optind != argc - 1)
+    {
+        fprintf(stderr, "Usage: sidplay [-u subtune] song.sng | aplay -q -f U8 -r %d\n", BITRATE);
+        return -1;
+    }
+    gSongPath = argv[optind];
+
+    if (isatty(STDOUT_FILENO))
+    {
+        fprintf(stderr, "The audio goes to standard output, so pipe it to a player such as aplay.\n");
+        return -1;
+    }
+    fcntl(STDOUT_FILENO, F_SETPIPE_SZ, OUTPUT_PIPE_SIZE);
+
+    // Standard output is for the audio
+    gLogFile = stderr;
+
+    uint32_t size;
+    gPlayingSong = LoadFile(gSongPath, &size);
+    if (gPlayingSong == NULL)
+    {
+        return -1;
+    }
+
+    InitializeTables();
+    if (!SongIsComplete((const uint8_t *)gPlayingSong, size) || !InitializeSong(gPlayingSong) || !StartSubtune(subtune))
+    {
+        fprintf(stderr, "Can't play %s\n", gSongPath);
+        return -1;
+    }
+
+    // Only the messages from loading the song are wanted. Printing
+    // every row would hold up the audio.
+    gPrintEnabled = 0;
+
+    pthread_t watcher;
+    if (pthread_create(&watcher, NULL, WatchSong, NULL) != 0)
+    {
+        fprintf(stderr, "Failed to start watching %s\n", gSongPath);
+    }
+
+    while (1)
+    {
+        // Up to and including the next tick, so the lock is only free
+        // between ticks. The song loops forever, so the end of it
+        // doesn't matter.
+        pthread_mutex_lock(&gSongLock);
+        for (uint16_t samples = vbiCount ; samples > 0 ; samples--)
+        {
+            OutputAudioAndCalculateNextByte();
+        }
+        pthread_mutex_unlock(&gSongLock);
+
+        if (gOutputLength >= OUTPUT_BLOCK_SIZE)
+        {
+            for (int written = 0 ; written < gOutputLength ; )
+            {
+                ssize_t result = write(STDOUT_FILENO, gOutputBlock + written, gOutputLength - written);
+                if (result < 0)
+                {
+                    if (errno == EINTR)
+                    {
+                        continue;
+                    }
+
+                    // The player went away
+                    return 0;
+                }
+                written += result;
+            }
+            gOutputLength = 0;
+        }
+    }
+}
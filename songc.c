@@ -0,0 +1,163 @@
+// Song compiler
+// Works out ahead of time what the player would otherwise have to work
+// out on the ATmega when the song is loaded.
+//
+// With -b, it compiles the song into the layout described by
+// struct CompiledSong: every offset resolved, the pattern rows already
+// decoded and the names left out. The firmware plays it straight from
+// flash without parsing anything.
+//
+// With -i, it writes a header with the offsets of every orderlist and
+// pattern from the start of the raw song data instead, for firmware
+// that embeds the .sng file as it is. The firmware keeps those tables
+// in flash instead of filling in pointer tables in SRAM.
+//
+// Usage: songc [-b song.bin] [-i songindex.h] song.sng
+
+// The offsets are into the raw song data, not the decoded rows
+#define PREDECODE_PATTERNS (0)
+
+#include <unistd.h>
+#include <stddef.h>
+
+#include "hostplayer.c"
+#include "songcompiler.c"
+
+void OutputByte(uint8_t value)
+{
+}
+
+int WriteSongIndex(const char *filename, const char *songFilename, const char *songdata)
+{
+    FILE *fp = fopen(filename, "w");
+    if (fp == NULL)
+    {
+        perror(filename);
+        return 0;
+    }
+
+    fprintf(fp, "// Generated by songc from %s. Do not edit.\n", songFilename);
+    fprintf(fp, "// Offsets from song_start of each orderlist and pattern\n\n");
+    fprintf(fp, "#define SONG_INDEX_IN_PROGMEM (1)\n");
+    fprintf(fp, "#define SONG_NUM_SUBTUNES (%u)\n", gNumSubtunes);
+    fprintf(fp, "#define SONG_NUM_PATTERNS (%u)\n\n", gNumPatterns);
+
+    fprintf(fp, "const uint16_t SONG_ORDERLIST_OFFSETS[SONG_NUM_SUBTUNES][%u] PROGMEM = {\n", NUM_CHANNELS);
+    for (int subtune = 0 ; subtune < gNumSubtunes ; subtune++)
+    {
+        fprintf(fp, "    {");
+        for (int channel = 0 ; channel < NUM_CHANNELS ; channel++)
+        {
+            fprintf(fp, "%s0x%04X", channel ? ", " : "", (unsigned int)(orderlist[subtune][channel] - songdata));
+        }
+        fprintf(fp, "},\n");
+    }
+    fprintf(fp, "};\n\n");
+
+    fprintf(fp, "const uint16_t SONG_PATTERN_OFFSETS[SONG_NUM_PATTERNS] PROGMEM = {");
+    for (int i = 0 ; i < gNumPatterns ; i++)
+    {
+        fprintf(fp, "%s%s0x%04X", i ? "," : "", (i % 8) ? " " : "\n    ", (unsigned int)(pattern[i] - songdata));
+    }
+    fprintf(fp, "\n};\n");
+
+    fclose(fp);
+    return 1;
+}
+
+int WriteCompiledSong(const char *filename)
+{
+    uint32_t size = CompileSong();
+    if (size == 0)
+    {
+        return 0;
+    }
+
+    FILE *fp = fopen(filename, "wb");
+    if (fp == NULL)
+    {
+        perror(filename);
+        return 0;
+    }
+
+    fwrite(gCompiled, 1, size, fp);
+    fclose(fp);
+
+    printf("Compiled song is %u bytes, with %u bytes of pattern rows in %u\n",
+           size, gPatternRowsSize, gCompiledPatternsSize);
+    return 1;
+}
+
+void Usage()
+{
+    fprintf(stderr, "Usage: songc [-b song.bin] [-i songindex.h] song.sng\n");
+    fprintf(stderr, "  -b  Write the compiled song\n");
+    fprintf(stderr, "  -i  Write the orderlist and pattern offsets of the raw song as a header\n");
+}
+
+int main(int argc, char *argv[])
+{
+    const char *indexFilename = NULL;
+    const char *compiledFilename = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "b:i:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'b':
+                compiledFilename = optarg;
+                break;
+
+            case 'i':
+                indexFilename = optarg;
+                break;
+
+            default:
+                Usage();
+                return -1;
+        }
+    }
+
+    if (argc - optind != 1 || (indexFilename == NULL && compiledFilename == NULL))
+    {
+        Usage();
+        return -1;
+    }
+
+    const char *songFilename = argv[optind];
+    uint32_t size;
+    char *songdata = LoadFile(songFilename, &size);
+    if (songdata == NULL)
+    {
+        return -1;
+    }
+
+    gPrintEnabled = 0;
+    if (!InitializeSong(songdata))
+    {
+        fprintf(stderr, "%s is not a GoatTracker song\n", songFilename);
+        return -1;
+    }
+
+    if (compiledFilename != NULL && !WriteCompiledSong(compiledFilename))
+    {
+        return -1;
+    }
+
+    if (indexFilename != NULL)
+    {
+        if (size > UINT16_MAX)
+        {
+            fprintf(stderr, "%s is too big to index with 16 bit offsets\n", songFilename);
+            return -1;
+        }
+
+        if (!WriteSongIndex(indexFilename, songFilename, songdata))
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
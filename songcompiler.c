@@ -0,0 +1,171 @@
+// Compiles the song that's loaded in the player into the layout
+// described by struct CompiledSong.
+// Shared by songc, which writes it out for the firmware, and the tools
+// that check it plays the same as the original.
+
+#include <stddef.h>
+
+// The compiled song is built up in memory, then written all at once
+uint8_t gCompiled[65536];
+uint32_t gCompiledSize;
+int gCompiledTooBig;
+
+// Size of the pattern rows with and without the empty rows shortened
+uint32_t gPatternRowsSize;
+uint32_t gCompiledPatternsSize;
+
+// Makes room for data at the end of the compiled song, starting on an
+// even offset. Returns the offset or 0 if it doesn't fit.
+uint16_t ReserveCompiled(uint32_t size)
+{
+    gCompiledSize = (gCompiledSize + 1) & ~1;
+    if (gCompiledSize + size > sizeof(gCompiled))
+    {
+        gCompiledTooBig = 1;
+        return 0;
+    }
+
+    uint16_t offset = gCompiledSize;
+    gCompiledSize += size;
+    return offset;
+}
+
+uint16_t AppendCompiled(const void *data, uint32_t size)
+{
+    uint16_t offset = ReserveCompiled(size);
+    if (offset != 0)
+    {
+        memcpy(&gCompiled[offset], data, size);
+    }
+    return offset;
+}
+
+// The ATmega is little endian like the host, but don't depend on it
+void PutCompiledWord(uint32_t offset, uint16_t value)
+{
+    gCompiled[offset] = value & 0xFF;
+    gCompiled[offset + 1] = value >> 8;
+}
+
+// Compiles the song that was last passed to InitializeSong into
+// gCompiled. Returns the size of the compiled song or 0 if it's too big.
+uint32_t CompileSong()
+{
+    memset(gCompiled, 0, sizeof(gCompiled));
+    gCompiledSize = sizeof(struct CompiledSong);
+    gCompiledTooBig = 0;
+
+    uint16_t orderlistOffsets = ReserveCompiled(gNumSubtunes * NUM_CHANNELS * 2);
+    uint16_t patternOffsets = ReserveCompiled(gNumPatterns * 2);
+
+    // Instruments are copied without the names
+    uint16_t instruments = ReserveCompiled(gNumInstruments * offsetof(struct Instrument, name));
+    for (int i = 0 ; i < gNumInstruments ; i++)
+    {
+        memcpy(&gCompiled[instruments + i * offsetof(struct Instrument, name)],
+            &gInstruments[i], offsetof(struct Instrument, name));
+    }
+
+    // The tables are copied as one block, sizes and all, since they
+    // follow each other in the .sng. Each table then keeps its offset
+    // from the start of the block.
+    const uint8_t *tablesStart = gWavetable - 1;
+    const uint8_t *tablesEnd = gSpeedtable + gSpeedtableSize * 2;
+    uint16_t tables = AppendCompiled(tablesStart, tablesEnd - tablesStart);
+    uint16_t wavetable = tables + (gWavetable - tablesStart);
+    uint16_t pulsetable = tables + (gPulsetable - tablesStart);
+    uint16_t filtertable = tables + (gFiltertable - tablesStart);
+    uint16_t speedtable = tables + (gSpeedtable - tablesStart);
+
+    // Each orderlist is followed by its restart position
+    for (int subtune = 0 ; subtune < gNumSubtunes ; subtune++)
+    {
+        for (int channel = 0 ; channel < NUM_CHANNELS ; channel++)
+        {
+            uint8_t size = pgm_read_byte(orderlist[subtune][channel] - 1);
+            uint16_t offset = AppendCompiled(orderlist[subtune][channel], size + 1);
+            PutCompiledWord(orderlistOffsets + (subtune * NUM_CHANNELS + channel) * 2, offset);
+        }
+    }
+
+    // The rows are stored decoded, the same way the host player
+    // decodes them when it loads a song, except that each run of empty
+    // rows takes 2 bytes (see EMPTY_ROWS_MARKER). Most patterns are
+    // largely empty rows. The patterns follow the number of patterns
+    // after the tables, and are read from there since pattern[] may
+    // already point at decoded rows.
+    const char *patternData = (const char *)tablesEnd + 1;
+    gPatternRowsSize = 0;
+    gCompiledPatternsSize = 0;
+    for (int i = 0 ; i < gNumPatterns ; i++)
+    {
+        uint8_t length = pgm_read_byte(patternData++);
+        struct PatternRow rows[256];
+        for (int row = 0 ; row < length ; row++)
+        {
+            DecodePatternRow(patternData + row * 4, &rows[row]);
+        }
+        patternData += 4 * length;
+
+        uint8_t compressed[256 * sizeof(struct PatternRow)];
+        uint32_t size = 0;
+        for (int row = 0 ; row < length ; )
+        {
+            int empty = 0;
+            while (row + empty < length && empty < 255 &&
+                   rows[row + empty].action == RowNone && rows[row + empty].command == CommandNone &&
+                   rows[row + empty].note == 0 && rows[row + empty].instrument == 0 && rows[row + empty].parameter == 0)
+            {
+                empty++;
+            }
+
+            if (empty > 0)
+            {
+                compressed[size++] = EMPTY_ROWS_MARKER;
+                compressed[size++] = empty;
+                row += empty;
+            }
+            else
+            {
+                memcpy(&compressed[size], &rows[row], sizeof(struct PatternRow));
+                size += sizeof(struct PatternRow);
+                row++;
+            }
+        }
+
+        uint16_t offset = AppendCompiled(compressed, size);
+        if (offset != 0)
+        {
+            PutCompiledWord(patternOffsets + i * 2, offset);
+        }
+        gPatternRowsSize += length * sizeof(struct PatternRow);
+        gCompiledPatternsSize += size;
+    }
+
+    if (gCompiledTooBig)
+    {
+        fprintf(stderr, "The compiled song is too big for 16 bit offsets\n");
+        return 0;
+    }
+
+    gCompiled[0] = COMPILED_SONG_MAGIC & 0xFF;
+    gCompiled[1] = (COMPILED_SONG_MAGIC >> 8) & 0xFF;
+    gCompiled[2] = (COMPILED_SONG_MAGIC >> 16) & 0xFF;
+    gCompiled[3] = COMPILED_SONG_MAGIC >> 24;
+    gCompiled[offsetof(struct CompiledSong, numSubtunes)] = gNumSubtunes;
+    gCompiled[offsetof(struct CompiledSong, numInstruments)] = gNumInstruments;
+    gCompiled[offsetof(struct CompiledSong, numPatterns)] = gNumPatterns;
+    gCompiled[offsetof(struct CompiledSong, wavetableSize)] = gWavetableSize;
+    gCompiled[offsetof(struct CompiledSong, pulsetableSize)] = gPulsetableSize;
+    gCompiled[offsetof(struct CompiledSong, filtertableSize)] = gFiltertableSize;
+    gCompiled[offsetof(struct CompiledSong, speedtableSize)] = gSpeedtableSize;
+    PutCompiledWord(offsetof(struct CompiledSong, orderlistOffsets), orderlistOffsets);
+    PutCompiledWord(offsetof(struct CompiledSong, patternOffsets), patternOffsets);
+    PutCompiledWord(offsetof(struct CompiledSong, instruments), instruments);
+    PutCompiledWord(offsetof(struct CompiledSong, wavetable), wavetable);
+    PutCompiledWord(offsetof(struct CompiledSong, pulsetable), pulsetable);
+    PutCompiledWord(offsetof(struct CompiledSong, filtertable), filtertable);
+    PutCompiledWord(offsetof(struct CompiledSong, speedtable), speedtable);
+
+    return gCompiledSize;
+}
@@ -0,0 +1,633 @@
+// Streams the patterns of a compiled song from a FAT16 or FAT32
+// formatted SD card. Include it after goatplayer.c, which reads the
+// song through the SONG_ and PATTERN_ macros when SONG_SOURCE_SD is set.
+//
+// The ATmega328 only has 2K of RAM, so just the part of the song in
+// front of the patterns is loaded: the header, instruments, tables and
+// orderlists. That's read every tick, and is only a few hundred bytes.
+// The patterns are read through a pool of small cache lines instead.
+// The main loop works out from where each channel is which lines it
+// reads next, including the first row of the pattern it moves on to,
+// and reads them from the card between samples. The interrupt only
+// reads from the cache, and a channel whose row isn't there yet plays
+// it a tick late rather than wait for the card (see PatternStep).
+
+#ifdef __AVR_ARCH__
+#include <util/atomic.h>
+#else
+// The host tools call SongSourcePrefetch between samples themselves,
+// so nothing can break into it there
+#define ATOMIC_BLOCK(type)
+#endif
+
+#define SECTOR_SIZE (512)
+#define NO_LINE (0xFFFF)
+#define CACHE_LINES (NUM_CHANNELS * SONG_SOURCE_LINES)
+
+struct SongSourceStatistics gSongSourceStatistics;
+
+struct CacheLine
+{
+    // Offset of the line in the song divided by SONG_SOURCE_LINE_SIZE,
+    // or NO_LINE
+    uint16_t line;
+    uint8_t data[SONG_SOURCE_LINE_SIZE];
+};
+
+// The lines aren't tied to a channel, since channels often play the
+// same pattern. The extra line at the end holds whatever the player
+// last had to read from the card itself, so that doesn't push out a
+// line the main loop is counting on.
+struct CacheLine gCacheLines[CACHE_LINES + 1];
+#define MISS_LINE (CACHE_LINES)
+
+// Set while the main loop is in the middle of talking to the card, so
+// the interrupt knows it can't read anything itself
+volatile uint8_t gCardBusy = 0;
+
+// Where the song is on the card. The song has to fit in 16 bit
+// offsets, so its clusters are all looked up when it's opened.
+struct SongFile
+{
+    uint8_t fat32;
+    uint8_t sectorsPerCluster;
+    uint32_t fatStart;
+    uint32_t rootStart;     // Sector of the root directory on FAT16
+    uint16_t rootSectors;
+    uint32_t rootCluster;   // First cluster of the root directory on FAT32
+    uint32_t dataStart;     // Sector of cluster 2
+
+    uint16_t size;
+    uint8_t numClusters;
+    uint32_t clusters[SONG_SOURCE_MAX_CLUSTERS];
+} gSongFile;
+
+// Everything in front of the patterns
+uint8_t gSongHead[SONG_SOURCE_HEAD_SIZE];
+uint16_t gSongHeadSize;
+
+static uint16_t Little16(const uint8_t *bytes)
+{
+    return bytes[0] | ((uint16_t)bytes[1] << 8);
+}
+
+static uint32_t Little32(const uint8_t *bytes)
+{
+    return Little16(bytes) | ((uint32_t)Little16(bytes + 2) << 16);
+}
+
+static uint32_t ClusterSector(uint32_t cluster)
+{
+    return gSongFile.dataStart + (cluster - 2) * gSongFile.sectorsPerCluster;
+}
+
+// Returns the cluster after the given one in the FAT, or 0 if the FAT
+// couldn't be read
+static uint32_t NextCluster(uint32_t cluster)
+{
+    uint8_t entry[4];
+
+    if (gSongFile.fat32)
+    {
+        uint32_t offset = cluster * 4;
+        if (!BlockRead(gSongFile.fatStart + offset / SECTOR_SIZE, offset % SECTOR_SIZE, entry, 4))
+        {
+            return 0;
+        }
+        return Little32(entry) & 0x0FFFFFFF;
+    }
+
+    uint32_t offset = cluster * 2;
+    if (!BlockRead(gSongFile.fatStart + offset / SECTOR_SIZE, offset % SECTOR_SIZE, entry, 2))
+    {
+        return 0;
+    }
+    return Little16(entry);
+}
+
+// Returns 1 if the cluster ends its chain, which is also taken to be
+// the case for the clusters that can't be in one
+static uint8_t IsLastCluster(uint32_t cluster)
+{
+    return cluster < 2 || cluster >= (gSongFile.fat32 ? 0x0FFFFFF8 : 0xFFF8);
+}
+
+// Reads part of the song. Returns 0 if the card couldn't be read.
+static uint8_t ReadSongFile(uint16_t offset, uint8_t *buffer, uint16_t length)
+{
+    while (length > 0)
+    {
+        uint16_t sectorInFile = offset / SECTOR_SIZE;
+        uint16_t withinSector = offset % SECTOR_SIZE;
+        uint16_t size = SECTOR_SIZE - withinSector;
+        if (size > length)
+        {
+            size = length;
+        }
+
+        uint32_t sector = ClusterSector(gSongFile.clusters[sectorInFile / gSongFile.sectorsPerCluster]) +
+                          sectorInFile % gSongFile.sectorsPerCluster;
+        if (!BlockRead(sector, withinSector, buffer, size))
+        {
+            return 0;
+        }
+
+        offset += size;
+        buffer += size;
+        length -= size;
+    }
+
+    return 1;
+}
+
+// Looks for the song in a sector of the root directory.
+// Returns 1 if it was found, 0 if it wasn't, or -1 at the end of the
+// directory or if the card couldn't be read.
+static int8_t FindInDirectorySector(uint32_t sector, const char *name, uint8_t *entry)
+{
+    for (uint16_t offset = 0 ; offset < SECTOR_SIZE ; offset += 32)
+    {
+        if (!BlockRead(sector, offset, entry, 32))
+        {
+            return -1;
+        }
+
+        if (entry[0] == 0)
+        {
+            return -1;
+        }
+
+        // Skip deleted files, long file names, directories and the
+        // volume label
+        if (entry[0] == 0xE5 || (entry[11] & 0x18) != 0)
+        {
+            continue;
+        }
+
+        if (memcmp(entry, name, 11) == 0)
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// Finds the song's directory entry. Returns 0 if it isn't there.
+static uint8_t FindSongEntry(const char *name, uint8_t *entry)
+{
+    int8_t found = 0;
+
+    if (!gSongFile.fat32)
+    {
+        for (uint16_t sector = 0 ; sector < gSongFile.rootSectors && found == 0 ; sector++)
+        {
+            found = FindInDirectorySector(gSongFile.rootStart + sector, name, entry);
+        }
+        return found == 1;
+    }
+
+    for (uint32_t cluster = gSongFile.rootCluster ; !IsLastCluster(cluster) && found == 0 ; cluster = NextCluster(cluster))
+    {
+        for (uint8_t sector = 0 ; sector < gSongFile.sectorsPerCluster && found == 0 ; sector++)
+        {
+            found = FindInDirectorySector(ClusterSector(cluster) + sector, name, entry);
+        }
+    }
+    return found == 1;
+}
+
+// Reads the boot sector of the FAT volume, which is either the first
+// sector of the card or the start of the first partition
+static uint8_t OpenVolume()
+{
+    uint8_t boot[48];
+    uint32_t volumeStart = 0;
+
+    if (!BlockRead(0, 0, boot, sizeof(boot)))
+    {
+        return 0;
+    }
+
+    // A boot sector starts with a jump instruction, which a partition
+    // table doesn't
+    if (boot[0] != 0xEB && boot[0] != 0xE9)
+    {
+        uint8_t partitionStart[4];
+        if (!BlockRead(0, 446 + 8, partitionStart, 4))
+        {
+            return 0;
+        }
+        volumeStart = Little32(partitionStart);
+        if (!BlockRead(volumeStart, 0, boot, sizeof(boot)))
+        {
+            return 0;
+        }
+    }
+
+    uint8_t sectorsPerCluster = boot[13];
+    if (Little16(boot + 11) != SECTOR_SIZE || sectorsPerCluster == 0)
+    {
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
+        print("The SD card doesn't have a FAT volume on it\n");
+#endif
+        return 0;
+    }
+
+    uint32_t fatSize = Little16(boot + 22);
+    if (fatSize == 0)
+    {
+        fatSize = Little32(boot + 36);
+    }
+    uint32_t totalSectors = Little16(boot + 19);
+    if (totalSectors == 0)
+    {
+        totalSectors = Little32(boot + 32);
+    }
+
+    gSongFile.sectorsPerCluster = sectorsPerCluster;
+    gSongFile.fatStart = volumeStart + Little16(boot + 14);
+    gSongFile.rootStart = gSongFile.fatStart + boot[16] * fatSize;
+    gSongFile.rootSectors = ((uint32_t)Little16(boot + 17) * 32 + SECTOR_SIZE - 1) / SECTOR_SIZE;
+    gSongFile.rootCluster = Little32(boot + 44);
+    gSongFile.dataStart = gSongFile.rootStart + gSongFile.rootSectors;
+
+    // The number of clusters is the only thing that says which FAT it is
+    uint32_t numClusters = (totalSectors - (gSongFile.dataStart - volumeStart)) / sectorsPerCluster;
+    if (numClusters < 4085)
+    {
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
+        print("The SD card is FAT12, format it as FAT16 or FAT32\n");
+#endif
+        return 0;
+    }
+    gSongFile.fat32 = (numClusters >= 65525);
+
+    return 1;
+}
+
+const char *SongSourceOpen(const char *name)
+{
+    if (!OpenVolume())
+    {
+        return NULL;
+    }
+
+    uint8_t entry[32];
+    if (!FindSongEntry(name, entry))
+    {
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
+        print("The song isn't on the SD card\n");
+#endif
+        return NULL;
+    }
+
+    uint32_t size = Little32(entry + 28);
+    if (size < sizeof(struct CompiledSong) || size > 0xFFFF)
+    {
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
+        print("The song on the SD card is the wrong size\n");
+#endif
+        return NULL;
+    }
+    gSongFile.size = size;
+
+    uint32_t clusterSize = (uint32_t)gSongFile.sectorsPerCluster * SECTOR_SIZE;
+    uint32_t cluster = ((uint32_t)Little16(entry + 20) << 16) | Little16(entry + 26);
+    gSongFile.numClusters = 0;
+    while (gSongFile.numClusters * clusterSize < size)
+    {
+        if (IsLastCluster(cluster) || gSongFile.numClusters == SONG_SOURCE_MAX_CLUSTERS)
+        {
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
+            print("The song on the SD card is spread over too many clusters\n");
+#endif
+            return NULL;
+        }
+        gSongFile.clusters[gSongFile.numClusters++] = cluster;
+        cluster = NextCluster(cluster);
+    }
+
+    // The patterns are the last thing in a compiled song, in order, so
+    // the head ends where the first one starts
+    const struct CompiledSong *song = (const struct CompiledSong *)gSongHead;
+    if (!ReadSongFile(0, gSongHead, sizeof(struct CompiledSong)))
+    {
+        return NULL;
+    }
+
+    uint16_t headSize = size;
+    if (song->numPatterns > 0)
+    {
+        uint8_t firstPattern[2];
+        if (!ReadSongFile(Little16((const uint8_t *)&song->patternOffsets), firstPattern, 2))
+        {
+            return NULL;
+        }
+        headSize = Little16(firstPattern);
+    }
+
+    if (headSize > SONG_SOURCE_HEAD_SIZE || headSize > size)
+    {
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
+        print("The song on the SD card has too much in front of its patterns\n");
+#endif
+        return NULL;
+    }
+
+    if (!ReadSongFile(0, gSongHead, headSize))
+    {
+        return NULL;
+    }
+    gSongHeadSize = headSize;
+
+    for (uint8_t line = 0 ; line <= CACHE_LINES ; line++)
+    {
+        gCacheLines[line].line = NO_LINE;
+    }
+    memset(&gSongSourceStatistics, 0, sizeof(gSongSourceStatistics));
+
+    return (const char *)gSongHead;
+}
+
+// Reads a line of the song into a cache line that nothing is using
+static uint8_t FillLine(struct CacheLine *cacheLine, uint16_t line)
+{
+    uint16_t offset = line * SONG_SOURCE_LINE_SIZE;
+    uint16_t length = SONG_SOURCE_LINE_SIZE;
+    if ((uint32_t)offset + length > gSongFile.size)
+    {
+        length = gSongFile.size - offset;
+    }
+
+    memset(cacheLine->data, 0, SONG_SOURCE_LINE_SIZE);
+    gSongSourceStatistics.lineFills++;
+    return ReadSongFile(offset, cacheLine->data, length);
+}
+
+// Returns the cache line holding the given line, or NULL
+static struct CacheLine *FindLine(uint16_t line, uint8_t includeMissLine)
+{
+    for (uint8_t index = 0 ; index < CACHE_LINES + includeMissLine ; index++)
+    {
+        if (gCacheLines[index].line == line)
+        {
+            return &gCacheLines[index];
+        }
+    }
+
+    return NULL;
+}
+
+// Returns the data of a line for the player, reading it from the card
+// if it has to
+static const uint8_t *ReadLine(uint16_t line)
+{
+    static const uint8_t emptyLine[SONG_SOURCE_LINE_SIZE];
+
+    struct CacheLine *cacheLine = FindLine(line, 1);
+    if (cacheLine != NULL)
+    {
+        gSongSourceStatistics.hits++;
+        return cacheLine->data;
+    }
+
+    // The interrupt came in while the main loop was reading from the
+    // card, so the line can't be read now. SongSourceRowReady makes
+    // sure this doesn't happen to anything the player reads.
+    if (gCardBusy)
+    {
+        gSongSourceStatistics.dropped++;
+        return emptyLine;
+    }
+
+    gSongSourceStatistics.misses++;
+    cacheLine = &gCacheLines[MISS_LINE];
+    cacheLine->line = NO_LINE;
+    if (FillLine(cacheLine, line))
+    {
+        cacheLine->line = line;
+    }
+    return cacheLine->data;
+}
+
+uint8_t SongSourceByte(uint16_t offset)
+{
+    return ReadLine(offset / SONG_SOURCE_LINE_SIZE)[offset % SONG_SOURCE_LINE_SIZE];
+}
+
+void SongSourceCopy(void *buffer, uint16_t offset, uint8_t size)
+{
+    uint8_t *bytes = (uint8_t *)buffer;
+
+    while (size > 0)
+    {
+        uint8_t withinLine = offset % SONG_SOURCE_LINE_SIZE;
+        uint8_t length = SONG_SOURCE_LINE_SIZE - withinLine;
+        if (length > size)
+        {
+            length = size;
+        }
+
+        memcpy(bytes, ReadLine(offset / SONG_SOURCE_LINE_SIZE) + withinLine, length);
+        bytes += length;
+        offset += length;
+        size -= length;
+    }
+}
+
+// Works out which pattern the channel plays after the one it's in, the
+// same way PatternStep does when it reaches the end of the pattern.
+// Updates the orderlist position and repeat count to match.
+static uint16_t NextPatternOffset(uint8_t channel, uint8_t *orderlistPosition, uint8_t *repeatCountdown)
+{
+    const char *orderlist = ORDERLIST(gSubtune, channel);
+    uint8_t patternNumber;
+
+    if (*repeatCountdown > 0)
+    {
+        (*repeatCountdown)--;
+        patternNumber = SONG_BYTE(orderlist + *orderlistPosition);
+        return PATTERN(patternNumber) - gSongData;
+    }
+
+    (*orderlistPosition)++;
+    do
+    {
+        patternNumber = SONG_BYTE(orderlist + *orderlistPosition);
+
+        if (patternNumber >= 0xD0 && patternNumber <= 0xDF)
+        {
+            (*orderlistPosition)++;
+            *repeatCountdown = (patternNumber & 0x0F) ? (patternNumber & 0x0F) : 16;
+        }
+        else if (patternNumber >= 0xE0 && patternNumber <= 0xFE)
+        {
+            (*orderlistPosition)++;
+        }
+        else if (patternNumber == 0xFF)
+        {
+            (*orderlistPosition)++;
+            patternNumber = SONG_BYTE(orderlist + *orderlistPosition);
+            *orderlistPosition = patternNumber;
+        }
+    } while (patternNumber >= 0xD0);
+
+    return PATTERN(patternNumber) - gSongData;
+}
+
+// Returns the byte at the offset if it's in the cache, or NULL
+static const uint8_t *CachedByte(uint16_t offset)
+{
+    struct CacheLine *cacheLine = FindLine(offset / SONG_SOURCE_LINE_SIZE, 1);
+    return (cacheLine != NULL) ? &cacheLine->data[offset % SONG_SOURCE_LINE_SIZE] : NULL;
+}
+
+static uint8_t RowIsLate()
+{
+    gSongSourceStatistics.lateRows++;
+    return 0;
+}
+
+uint8_t SongSourceRowReady(uint8_t channel)
+{
+    uint16_t position = gTrackData[channel].songPosition - gSongData;
+    uint8_t orderlistPosition = gTrackData[channel].orderlistPosition;
+    uint8_t repeatCountdown = gTrackData[channel].patternRepeatCountdown;
+
+    // Follows PatternStep through the end of the pattern to the first
+    // row of the next one. Only a pattern with no rows would take it
+    // further than that.
+    for (uint8_t rows = 0 ; rows < 4 ; rows++)
+    {
+        const uint8_t *first = CachedByte(position);
+        if (first == NULL)
+        {
+            return RowIsLate();
+        }
+
+        if (*first == EMPTY_ROWS_MARKER)
+        {
+            return (CachedByte(position + 1) != NULL) ? 1 : RowIsLate();
+        }
+
+        struct PatternRow row;
+        for (uint8_t index = 0 ; index < sizeof(struct PatternRow) ; index++)
+        {
+            const uint8_t *byte = CachedByte(position + index);
+            if (byte == NULL)
+            {
+                return RowIsLate();
+            }
+            ((uint8_t *)&row)[index] = *byte;
+        }
+
+        if (row.action != RowPatternEnd)
+        {
+            return 1;
+        }
+
+        position = NextPatternOffset(channel, &orderlistPosition, &repeatCountdown);
+    }
+
+    return 1;
+}
+
+// Adds a line to the list of the ones that are wanted, unless it's
+// already there or past the end of the song
+static void WantLine(uint16_t *wanted, uint8_t *numWanted, uint16_t line)
+{
+    if ((uint32_t)line * SONG_SOURCE_LINE_SIZE >= gSongFile.size)
+    {
+        return;
+    }
+
+    for (uint8_t index = 0 ; index < *numWanted ; index++)
+    {
+        if (wanted[index] == line)
+        {
+            return;
+        }
+    }
+
+    wanted[(*numWanted)++] = line;
+}
+
+uint8_t SongSourcePrefetch()
+{
+    // Nothing to do until the song from the card is playing
+    if (gSongData != (const char *)gSongHead)
+    {
+        return 0;
+    }
+
+    uint16_t position[NUM_CHANNELS];
+    uint8_t orderlistPosition[NUM_CHANNELS];
+    uint8_t repeatCountdown[NUM_CHANNELS];
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        for (uint8_t channel = 0 ; channel < NUM_CHANNELS ; channel++)
+        {
+            position[channel] = gTrackData[channel].songPosition - gSongData;
+            orderlistPosition[channel] = gTrackData[channel].orderlistPosition;
+            repeatCountdown[channel] = gTrackData[channel].patternRepeatCountdown;
+        }
+    }
+
+    // For each channel, the line it's in and the one after that, and
+    // the lines the first row of its next pattern is in
+    uint16_t wanted[CACHE_LINES];
+    uint8_t numWanted = 0;
+    for (uint8_t channel = 0 ; channel < NUM_CHANNELS ; channel++)
+    {
+        uint16_t line = position[channel] / SONG_SOURCE_LINE_SIZE;
+        WantLine(wanted, &numWanted, line);
+        WantLine(wanted, &numWanted, line + 1);
+
+        uint16_t nextPattern = NextPatternOffset(channel, &orderlistPosition[channel], &repeatCountdown[channel]);
+        WantLine(wanted, &numWanted, nextPattern / SONG_SOURCE_LINE_SIZE);
+        WantLine(wanted, &numWanted, (nextPattern + sizeof(struct PatternRow) - 1) / SONG_SOURCE_LINE_SIZE);
+    }
+
+    for (uint8_t index = 0 ; index < numWanted ; index++)
+    {
+        if (FindLine(wanted[index], 0) != NULL)
+        {
+            continue;
+        }
+
+        // There are as many cache lines as lines that can be wanted,
+        // so there's always one holding a line that isn't
+        struct CacheLine *cacheLine = NULL;
+        for (uint8_t candidate = 0 ; candidate < CACHE_LINES && cacheLine == NULL ; candidate++)
+        {
+            cacheLine = &gCacheLines[candidate];
+            for (uint8_t other = 0 ; other < numWanted ; other++)
+            {
+                if (cacheLine->line == wanted[other])
+                {
+                    cacheLine = NULL;
+                    break;
+                }
+            }
+        }
+
+        gCardBusy = 1;
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+        {
+            cacheLine->line = NO_LINE;
+        }
+        uint8_t filled = FillLine(cacheLine, wanted[index]);
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+        {
+            cacheLine->line = filled ? wanted[index] : NO_LINE;
+        }
+        gCardBusy = 0;
+
+        // One line at a time, so the caller can get on with anything
+        // else it has to do
+        return filled;
+    }
+
+    return 0;
+}
@@ -0,0 +1,62 @@
+#ifndef __SONGSOURCE_H
+#define __SONGSOURCE_H
+
+// Streaming a compiled song from a FAT formatted SD card (see
+// songsource.c). The platform provides BlockRead: the SPI driver in
+// sdcard.c on the ATmega, or a disk image on the host.
+
+#include <stdint.h>
+
+// The song the firmware plays, as the 11 characters of its 8.3 name
+// in the card's root directory: SONG.BIN. Copying another song over it
+// changes the song without flashing the ATmega again.
+#define SONG_SOURCE_FILE_NAME "SONG    BIN"
+
+// Everything in front of the first pattern is kept in RAM. Songs with
+// more than this in front of their patterns can't be streamed.
+#ifndef SONG_SOURCE_HEAD_SIZE
+#define SONG_SOURCE_HEAD_SIZE (768)
+#endif
+
+// The patterns are read through cache lines of this many bytes, which
+// has to divide the 512 byte sector. Each channel has 4 of them: where
+// it is, the line after that, and the first row of the pattern it
+// plays next, which can take 2 lines.
+#define SONG_SOURCE_LINE_SIZE (16)
+#define SONG_SOURCE_LINES (4)
+
+// Most clusters the song can be spread over
+#define SONG_SOURCE_MAX_CLUSTERS (16)
+
+// Kept by songsource.c in gSongSourceStatistics
+struct SongSourceStatistics
+{
+    uint32_t hits;       // Lines the player found in the cache
+    uint32_t misses;     // Lines the player had to read from the card itself
+    uint32_t dropped;    // Lines the player couldn't read since the card was busy
+    uint32_t lateRows;   // Rows put off to the next tick
+    uint32_t lineFills;  // Lines read from the card, including the misses
+};
+
+// Reads length bytes starting at offset in a 512 byte sector.
+// Returns 0 if the card couldn't be read.
+int BlockRead(uint32_t sector, uint16_t offset, uint8_t *buffer, uint16_t length);
+
+// Finds the song in the root directory of the card and loads
+// everything in front of the patterns. Returns the song data to pass
+// to InitializeSong, or NULL if the song can't be streamed.
+const char *SongSourceOpen(const char *name);
+
+// Reads one of the cache lines the player needs next, if any are
+// missing. Called from the main loop, between samples, so the
+// interrupt can break into it. Returns 0 once the cache has caught up.
+uint8_t SongSourcePrefetch();
+
+uint8_t SongSourceByte(uint16_t offset);
+void SongSourceCopy(void *buffer, uint16_t offset, uint8_t size);
+
+// Returns 1 if everything the channel reads for its next row is in
+// the cache
+uint8_t SongSourceRowReady(uint8_t channel);
+
+#endif
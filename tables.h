@@ -25,4 +25,23 @@ const uint32_t SAWTOOTH_TABLE[] PROGMEM = {
     0x00A8,0x00B2,0x00BD,0x00C8,0x00D4,0x00E1,0x00EE,0x00FC,0x010B,0x011B,0x012C,0x013E,0x0151,0x0165,0x017A,0x0191,
     0x01A9,0x01C2,0x01DD,0x01F9,0x0217,0x0237,0x0259,0x027D,0x02A3,0x02CB,0x02F5,0x0322,0x0352,0x0385,0x03BA,0x03F3,
     0x042F,0x046F,0x04B2,0x04FA,0x0546,0x0596,0x05EB,0x0645,0x06A5,0x070A,0x0775,0x07E6,0x085F,0x08DE,0x0965,0x09F4,
-    0x0A8C,0x0B2C,0x0BD6,0x0C8B,0x0D4A,0x0E14,0x0EEA};
\ No newline at end of file
+    0x0A8C,0x0B2C,0x0BD6,0x0C8B,0x0D4A,0x0E14,0x0EEA};
+
+// Filter frequency coefficient for each filtertable cutoff value
+const uint8_t FILTER_CUTOFF_TABLE[] PROGMEM = {
+    0x14,0x14,0x14,0x15,0x15,0x16,0x16,0x17,0x17,0x18,0x18,0x19,0x1A,0x1A,0x1B,0x1B,
+    0x1C,0x1D,0x1D,0x1E,0x1E,0x1F,0x20,0x21,0x21,0x22,0x23,0x24,0x24,0x25,0x26,0x27,
+    0x28,0x29,0x29,0x2A,0x2B,0x2C,0x2D,0x2E,0x2F,0x30,0x31,0x32,0x34,0x35,0x36,0x37,
+    0x38,0x39,0x3B,0x3C,0x3D,0x3F,0x40,0x41,0x43,0x44,0x46,0x47,0x49,0x4B,0x4C,0x4E,
+    0x50,0x51,0x53,0x55,0x57,0x59,0x5B,0x5D,0x5F,0x61,0x63,0x65,0x67,0x69,0x6C,0x6E,
+    0x70,0x73,0x75,0x78,0x7A,0x7D,0x80,0x82,0x85,0x88,0x8B,0x8E,0x91,0x94,0x97,0x9A,
+    0x9E,0xA1,0xA4,0xA8,0xAB,0xAF,0xB3,0xB7,0xBA,0xBE,0xC2,0xC6,0xCA,0xCF,0xD3,0xD7,
+    0xDC,0xE0,0xE5,0xE9,0xEE,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,
+    0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,
+    0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,
+    0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,
+    0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,
+    0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,
+    0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,
+    0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,
+    0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0,0xF0};
\ No newline at end of file
@@ -0,0 +1,258 @@
+// Tick timeline trace for the host tools (see trace.h)
+
+#include <stdio.h>
+#include <time.h>
+
+#include "trace.h"
+
+// Most channels the player could have, for naming the tracks
+#define TRACE_MAX_CHANNELS (4)
+
+// Thread ids of the tracks in the trace
+#define TRACE_PLAYER_TRACK (0)
+#define TRACE_CHANNEL_TRACK(channel) ((channel) == TRACE_NO_CHANNEL ? TRACE_PLAYER_TRACK : (channel) + 1)
+
+static FILE *gTraceFile = NULL;
+
+// When the trace was opened. All the times are from here.
+static uint64_t gTraceStart;
+
+static uint32_t gTraceTick;
+static uint64_t gTickStart;
+static uint64_t gRowStart[TRACE_MAX_CHANNELS];
+
+// Synthesis time since the last tick started
+static uint64_t gSampleStart;
+static uint64_t gSynthesisTime;
+static uint64_t gSlowestSample;
+static uint32_t gSynthesisSamples;
+
+// Start of the tick the synthesis time is counted against, or 0 before
+// the first tick
+static uint64_t gSynthesisTickStart;
+
+static uint64_t Now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Trace events are in microseconds
+static double Microseconds(uint64_t time)
+{
+    return (time - gTraceStart) / 1000.0;
+}
+
+// Writes text for inside a JSON string, with quotes, backslashes and
+// control characters escaped
+static void WriteJsonText(const char *text)
+{
+    for ( ; *text != 0 ; text++)
+    {
+        unsigned char c = *text;
+        if (c == '"' || c == '\\')
+        {
+            fprintf(gTraceFile, "\\%c", c);
+        }
+        else if (c < 0x20)
+        {
+            fprintf(gTraceFile, "\\u%04x", c);
+        }
+        else
+        {
+            fputc(c, gTraceFile);
+        }
+    }
+}
+
+static void NameTrack(int track, const char *name)
+{
+    fprintf(gTraceFile, "{\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"name\":\"thread_name\",\"args\":{\"name\":\"%s\"}},\n",
+            track, name);
+    fprintf(gTraceFile, "{\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"name\":\"thread_sort_index\",\"args\":{\"sort_index\":%d}},\n",
+            track, track);
+}
+
+int TraceOpen(const char *filename, const char *songName)
+{
+    gTraceFile = fopen(filename, "w");
+    if (gTraceFile == NULL)
+    {
+        perror(filename);
+        return 0;
+    }
+
+    gTraceStart = Now();
+    gTraceTick = 0;
+    gSynthesisTickStart = 0;
+    gSynthesisTime = 0;
+    gSlowestSample = 0;
+    gSynthesisSamples = 0;
+
+    fprintf(gTraceFile, "[\n");
+    fprintf(gTraceFile, "{\"ph\":\"M\",\"pid\":1,\"name\":\"process_name\",\"args\":{\"name\":\"SIDish ");
+    WriteJsonText(songName);
+    fprintf(gTraceFile, "\"}},\n");
+    NameTrack(TRACE_PLAYER_TRACK, "Player");
+    for (int channel = 0 ; channel < TRACE_MAX_CHANNELS ; channel++)
+    {
+        char name[16];
+        snprintf(name, sizeof(name), "Channel %d", channel);
+        NameTrack(TRACE_CHANNEL_TRACK(channel), name);
+    }
+
+    return 1;
+}
+
+// Writes the synthesis time for the samples since the last tick
+static void FlushSynthesis(void)
+{
+    if (gSynthesisTickStart == 0)
+    {
+        return;
+    }
+
+    fprintf(gTraceFile, "{\"ph\":\"C\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"name\":\"Synthesis\","
+            "\"args\":{\"total us\":%.3f,\"slowest sample ns\":%llu}},\n",
+            TRACE_PLAYER_TRACK, Microseconds(gSynthesisTickStart), gSynthesisTime / 1000.0,
+            (unsigned long long)gSlowestSample);
+    fprintf(gTraceFile, "{\"ph\":\"C\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"name\":\"Samples\",\"args\":{\"samples\":%u}},\n",
+            TRACE_PLAYER_TRACK, Microseconds(gSynthesisTickStart), gSynthesisSamples);
+
+    gSynthesisTime = 0;
+    gSlowestSample = 0;
+    gSynthesisSamples = 0;
+}
+
+void TraceClose(void)
+{
+    if (gTraceFile == NULL)
+    {
+        return;
+    }
+
+    FlushSynthesis();
+
+    // The last event doesn't get a comma after it
+    fprintf(gTraceFile, "{\"ph\":\"M\",\"pid\":1,\"name\":\"process_sort_index\",\"args\":{\"sort_index\":0}}\n]\n");
+    fclose(gTraceFile);
+    gTraceFile = NULL;
+}
+
+void TraceTickBegin(void)
+{
+    if (gTraceFile == NULL)
+    {
+        return;
+    }
+
+    gTickStart = Now();
+    FlushSynthesis();
+    gSynthesisTickStart = gTickStart;
+}
+
+void TraceTickEnd(void)
+{
+    if (gTraceFile == NULL)
+    {
+        return;
+    }
+
+    uint64_t end = Now();
+
+    // Ticks are 50 Hz, so the tick number gives the time in the song
+    fprintf(gTraceFile, "{\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"name\":\"Tick\","
+            "\"args\":{\"tick\":%u,\"song time\":\"%u:%02u.%02u\"}},\n",
+            TRACE_PLAYER_TRACK, Microseconds(gTickStart), (end - gTickStart) / 1000.0, gTraceTick,
+            gTraceTick / 3000, (gTraceTick / 50) % 60, (gTraceTick % 50) * 2);
+    gTraceTick++;
+}
+
+void TraceRowBegin(uint8_t channel)
+{
+    if (gTraceFile == NULL || channel >= TRACE_MAX_CHANNELS)
+    {
+        return;
+    }
+
+    gRowStart[channel] = Now();
+}
+
+void TraceRowEnd(uint8_t channel, uint8_t action, uint8_t note, uint8_t instrument, uint8_t command)
+{
+    static const char *const ACTION_NAMES[] = { "none", "key on", "key off", "pattern end" };
+
+    if (gTraceFile == NULL || channel >= TRACE_MAX_CHANNELS)
+    {
+        return;
+    }
+
+    uint64_t end = Now();
+    fprintf(gTraceFile, "{\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"name\":\"Row\","
+            "\"args\":{\"tick\":%u,\"action\":\"%s\",\"note\":%u,\"instrument\":%u,\"command\":%u}},\n",
+            TRACE_CHANNEL_TRACK(channel), Microseconds(gRowStart[channel]), (end - gRowStart[channel]) / 1000.0,
+            gTraceTick, ACTION_NAMES[action & 3], note, instrument, command);
+}
+
+void TraceTableStep(const char *table, uint8_t channel, uint8_t position, uint8_t leftSide, uint8_t rightSide)
+{
+    if (gTraceFile == NULL)
+    {
+        return;
+    }
+
+    fprintf(gTraceFile, "{\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"name\":\"%s\","
+            "\"args\":{\"tick\":%u,\"position\":%u,\"entry\":\"%02X %02X\"}},\n",
+            TRACE_CHANNEL_TRACK(channel), Microseconds(Now()), table, gTraceTick, position, leftSide, rightSide);
+}
+
+void TraceKeyOn(uint8_t channel, uint8_t key, uint8_t instrument)
+{
+    if (gTraceFile == NULL)
+    {
+        return;
+    }
+
+    fprintf(gTraceFile, "{\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"name\":\"Key on\","
+            "\"args\":{\"tick\":%u,\"key\":%u,\"instrument\":%u}},\n",
+            TRACE_CHANNEL_TRACK(channel), Microseconds(Now()), gTraceTick, key, instrument);
+}
+
+void TraceKeyOff(uint8_t channel)
+{
+    if (gTraceFile == NULL)
+    {
+        return;
+    }
+
+    fprintf(gTraceFile, "{\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"name\":\"Key off\","
+            "\"args\":{\"tick\":%u}},\n",
+            TRACE_CHANNEL_TRACK(channel), Microseconds(Now()), gTraceTick);
+}
+
+void TraceSampleBegin(void)
+{
+    if (gTraceFile == NULL)
+    {
+        return;
+    }
+
+    gSampleStart = Now();
+}
+
+void TraceSampleEnd(void)
+{
+    if (gTraceFile == NULL)
+    {
+        return;
+    }
+
+    uint64_t sampleTime = Now() - gSampleStart;
+    gSynthesisTime += sampleTime;
+    gSynthesisSamples++;
+    if (sampleTime > gSlowestSample)
+    {
+        gSlowestSample = sampleTime;
+    }
+}
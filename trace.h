@@ -0,0 +1,42 @@
+#ifndef __TRACE_H
+#define __TRACE_H
+
+#include <stdint.h>
+
+// Records a timeline of what the player does on every tick as Chrome
+// trace event JSON, which can be opened in Perfetto (ui.perfetto.dev)
+// or chrome://tracing.
+//
+// Each tick is a slice on the "Player" track, with the time spent
+// synthesizing the samples until the next tick as a counter. Rows
+// read from the patterns are slices on each channel's track, and
+// table steps and key on and off are instant events on the channel
+// they happened on.
+//
+// The player only calls these when it's built with TRACE set (see
+// goatplayer.c), and they do nothing until a trace is opened.
+
+// Starts writing a trace. Returns 0 if the file can't be opened.
+int TraceOpen(const char *filename, const char *songName);
+
+// Finishes the trace and closes the file
+void TraceClose(void);
+
+void TraceTickBegin(void);
+void TraceTickEnd(void);
+
+void TraceRowBegin(uint8_t channel);
+void TraceRowEnd(uint8_t channel, uint8_t action, uint8_t note, uint8_t instrument, uint8_t command);
+
+// channel is TRACE_NO_CHANNEL for the filtertable, which is shared
+#define TRACE_NO_CHANNEL (0xFF)
+void TraceTableStep(const char *table, uint8_t channel, uint8_t position, uint8_t leftSide, uint8_t rightSide);
+
+void TraceKeyOn(uint8_t channel, uint8_t key, uint8_t instrument);
+void TraceKeyOff(uint8_t channel);
+
+// Around the synthesis of each sample
+void TraceSampleBegin(void);
+void TraceSampleEnd(void);
+
+#endif // __TRACE_H